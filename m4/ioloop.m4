@@ -2,6 +2,32 @@ dnl * I/O loop function
 AC_DEFUN([DOVECOT_IOLOOP], [
   have_ioloop=no
   
+  if test "$ioloop" = "uring"; then
+    AC_CACHE_CHECK([whether we can use io_uring],i_cv_io_uring_works,[
+      AC_TRY_COMPILE([
+        #include <unistd.h>
+        #include <sys/syscall.h>
+        #include <sys/epoll.h>
+        #include <linux/io_uring.h>
+      ], [
+        struct io_uring_getevents_arg arg;
+        (void)arg;
+        return syscall(__NR_io_uring_setup, 0, (void *)0) +
+          IORING_FEAT_EXT_ARG + IORING_FEAT_NODROP + IORING_ENTER_EXT_ARG;
+      ], [
+        i_cv_io_uring_works=yes
+      ], [
+        i_cv_io_uring_works=no
+      ])
+    ])
+    if test $i_cv_io_uring_works = yes; then
+      AC_DEFINE(IOLOOP_URING,, [Implement I/O loop with Linux io_uring, falling back to epoll() at runtime])
+      have_ioloop=yes
+    else
+      AC_MSG_ERROR([uring ioloop requested but <linux/io_uring.h> is missing or too old])
+    fi
+  fi
+
   if test "$ioloop" = "best" || test "$ioloop" = "epoll"; then
     AC_CACHE_CHECK([whether we can use epoll],i_cv_epoll_works,[
       AC_TRY_RUN([
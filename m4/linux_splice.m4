@@ -0,0 +1,18 @@
+dnl * Linux splice()
+AC_DEFUN([DOVECOT_LINUX_SPLICE], [
+  AC_CACHE_CHECK([Linux splice()],i_cv_have_linux_splice,[
+    AC_TRY_LINK([
+      #define _GNU_SOURCE
+      #include <fcntl.h>
+    ], [
+      splice(0, (void *)0, 1, (void *)0, 0, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    ], [
+      i_cv_have_linux_splice=yes
+    ], [
+      i_cv_have_linux_splice=no
+    ])
+  ])
+  if test $i_cv_have_linux_splice = yes; then
+    AC_DEFINE(HAVE_LINUX_SPLICE,, [Define if you have Linux splice()])
+  fi
+])
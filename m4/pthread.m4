@@ -0,0 +1,13 @@
+dnl * POSIX threads, used for CPU bound work that doesn't touch lib
+AC_DEFUN([DOVECOT_PTHREAD], [
+  PTHREAD_LIBS=
+  old_LIBS=$LIBS
+  AC_SEARCH_LIBS(pthread_create, pthread, [
+    AC_DEFINE(HAVE_PTHREAD,, [Define if you have POSIX threads])
+    if test "$ac_cv_search_pthread_create" != "none required"; then
+      PTHREAD_LIBS=$ac_cv_search_pthread_create
+    fi
+  ])
+  LIBS=$old_LIBS
+  AC_SUBST(PTHREAD_LIBS)
+])
@@ -31,6 +31,11 @@ static void auth_client_connection_unref(struct auth_client_connection **_conn);
 static void auth_client_input(struct auth_client_connection *conn);
 
 static struct auth_client_connection *auth_client_connections;
+/* Freed connections are recycled for new connections. Each connection holds
+   a reference to the pool, so it stays alive until the last connection is
+   freed. The slabs aren't returned to the system until then, so the memory
+   used by a burst of connections stays allocated. */
+static pool_t auth_client_connection_pool;
 
 static const char *reply_line_hide_pass(const char *line)
 {
@@ -308,7 +313,14 @@ void auth_client_connection_create(struct auth *auth, int fd,
 	const char *mechanisms;
 	string_t *str;
 
-	conn = i_new(struct auth_client_connection, 1);
+	if (auth_client_connection_pool == NULL) {
+		auth_client_connection_pool =
+			pool_slab_create("auth client connections");
+	}
+	conn = p_new(auth_client_connection_pool,
+		     struct auth_client_connection, 1);
+	conn->pool = auth_client_connection_pool;
+	pool_ref(conn->pool);
 	conn->auth = auth;
 	conn->refcount = 1;
 	conn->connect_uid = ++connect_uid_counter;
@@ -400,6 +412,7 @@ static void auth_client_disconnected(struct auth_client_connection **_conn)
 static void auth_client_connection_unref(struct auth_client_connection **_conn)
 {
         struct auth_client_connection *conn = *_conn;
+	pool_t pool;
 
 	*_conn = NULL;
 	if (--conn->refcount > 0)
@@ -407,7 +420,9 @@ static void auth_client_connection_unref(struct auth_client_connection **_conn)
 
 	i_stream_unref(&conn->input);
 	o_stream_unref(&conn->output);
-	i_free(conn);
+	pool = conn->pool;
+	p_free(pool, conn);
+	pool_unref(&pool);
 }
 
 struct auth_client_connection *
@@ -430,4 +445,6 @@ void auth_client_connections_destroy_all(void)
 		conn = auth_client_connections;
 		auth_client_connection_destroy(&conn);
 	}
+	if (auth_client_connection_pool != NULL)
+		pool_unref(&auth_client_connection_pool);
 }
@@ -5,6 +5,7 @@
 
 struct auth_client_connection {
 	struct auth_client_connection *prev, *next;
+	pool_t pool;
 	struct auth *auth;
 	int refcount;
 
@@ -1940,7 +1940,7 @@ director_connection_init_common(struct director *dir, int fd)
 {
 	struct director_connection *conn;
 
-	conn = i_new(struct director_connection, 1);
+	conn = p_new(dir->connection_pool, struct director_connection, 1);
 	conn->created = ioloop_time;
 	conn->fd = fd;
 	conn->dir = dir;
@@ -2104,7 +2104,7 @@ void director_connection_deinit(struct director_connection **_conn,
 	if (conn->in)
 		master_service_client_connection_destroyed(master_service);
 	i_free(conn->name);
-	i_free(conn);
+	p_free(dir->connection_pool, conn);
 
 	if (dir->left == NULL || dir->right == NULL) {
 		/* we aren't synced until we're again connected to a ring */
@@ -1349,6 +1349,7 @@ director_init(const struct director_settings *set,
 	i_array_init(&dir->dir_hosts, 16);
 	i_array_init(&dir->pending_requests, 16);
 	i_array_init(&dir->connections, 8);
+	dir->connection_pool = pool_slab_create("director connections");
 	dir->mail_hosts = mail_hosts_init(set->director_user_expire,
 					  set->director_consistent_hashing,
 					  director_user_freed);
@@ -1396,6 +1397,7 @@ void director_deinit(struct director **_dir)
 	array_free(&dir->pending_requests);
 	array_free(&dir->dir_hosts);
 	array_free(&dir->connections);
+	pool_unref(&dir->connection_pool);
 	i_free(dir);
 }
 
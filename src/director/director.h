@@ -108,6 +108,8 @@ struct director {
 	struct director_connection *left, *right;
 	/* all director connections */
 	ARRAY(struct director_connection *) connections;
+	/* director_connection structs are allocated from here */
+	pool_t connection_pool;
 	struct timeout *to_reconnect;
 	struct timeout *to_sync;
 	struct timeout *to_callback;
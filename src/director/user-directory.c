@@ -288,7 +288,7 @@ user_directory_init(unsigned int timeout_secs,
 	i_assert(dir->timeout_secs/2 > dir->user_near_expiring_secs);
 
 	dir->user_free_hook = user_free_hook;
-	hash_table_create_direct(&dir->hash, default_pool, 0);
+	hash_table_create_direct_open(&dir->hash, default_pool, 0);
 	i_array_init(&dir->iters, 8);
 	return dir;
 }
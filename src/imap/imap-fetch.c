@@ -452,8 +452,10 @@ static int imap_fetch_more_int(struct imap_fetch_context *ctx, bool cancel)
 
 	if (state->cont_handler != NULL) {
 		ret = state->cont_handler(ctx);
-		if (ret == 0)
+		if (ret == 0) {
+			mailbox_search_pause(state->search_ctx);
 			return 0;
+		}
 
 		if (ret < 0) {
 			if (client->output->closed)
@@ -481,6 +483,8 @@ static int imap_fetch_more_int(struct imap_fetch_context *ctx, bool cancel)
 		if (o_stream_get_buffer_used_size(client->output) >=
 		    CLIENT_OUTPUT_OPTIMAL_SIZE) {
 			ret = o_stream_flush(client->output);
+			if (ret == 0)
+				mailbox_search_pause(state->search_ctx);
 			if (ret <= 0)
 				return ret;
 		}
@@ -519,8 +523,11 @@ static int imap_fetch_more_int(struct imap_fetch_context *ctx, bool cancel)
 						 h->context);
 			} T_END;
 
-			if (ret == 0)
+			if (ret == 0) {
+				/* waiting for the client to read the output */
+				mailbox_search_pause(state->search_ctx);
 				return 0;
+			}
 
 			if (ret < 0) {
 				if (state->cur_mail->expunged) {
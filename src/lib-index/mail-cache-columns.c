@@ -0,0 +1,281 @@
+/* Copyright (c) 2017 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "bsearch-insert-pos.h"
+#include "mail-cache-private.h"
+
+void mail_cache_set_column_fields(struct mail_cache *cache,
+				  const char *const *field_names)
+{
+	char **namep, *name;
+
+	array_foreach_modifiable(&cache->column_field_names, namep)
+		i_free(*namep);
+	array_clear(&cache->column_field_names);
+
+	for (; *field_names != NULL; field_names++) {
+		name = i_strdup(*field_names);
+		array_append(&cache->column_field_names, &name, 1);
+	}
+}
+
+void mail_cache_columns_free(struct mail_cache *cache)
+{
+	unsigned int i;
+
+	if (cache->column_metas != NULL) {
+		for (i = 0; i < cache->columns_hdr.columns_count; i++) {
+			i_free(cache->column_metas[i].exists);
+			i_free(cache->column_metas[i].ends);
+		}
+		i_free_and_null(cache->column_metas);
+	}
+	cache->columns_read = FALSE;
+	i_zero(&cache->columns_hdr);
+	i_free_and_null(cache->columns);
+	i_free_and_null(cache->column_uids);
+}
+
+static int mail_cache_columns_read_real(struct mail_cache *cache)
+{
+	const struct mail_cache_column_header *hdr;
+	const struct mail_cache_column *column;
+	const void *data;
+	unsigned int i, field_idx;
+	size_t size;
+	int ret;
+
+	ret = mail_cache_map(cache, sizeof(struct mail_cache_header),
+			     sizeof(*hdr), &data);
+	if (ret <= 0) {
+		if (ret == 0)
+			mail_cache_set_corrupted(cache, "Column header missing");
+		return -1;
+	}
+	hdr = data;
+	if (hdr->columns_count > cache->file_fields_count) {
+		mail_cache_set_corrupted(cache,
+			"Too many columns (%u > %u)", hdr->columns_count,
+			cache->file_fields_count);
+		return -1;
+	}
+	cache->columns_hdr = *hdr;
+
+	size = sizeof(*hdr) + hdr->columns_count * sizeof(*column);
+	ret = mail_cache_map(cache, sizeof(struct mail_cache_header),
+			     size, &data);
+	if (ret <= 0) {
+		if (ret == 0) {
+			mail_cache_set_corrupted(cache,
+				"Column header points outside file");
+		}
+		return -1;
+	}
+	column = CONST_PTR_OFFSET(data, sizeof(*hdr));
+	cache->columns = i_new(struct mail_cache_column,
+			       hdr->columns_count + 1);
+	memcpy(cache->columns, column, hdr->columns_count * sizeof(*column));
+	cache->column_metas = i_new(struct mail_cache_column_meta,
+				    hdr->columns_count + 1);
+
+	for (i = 0; i < cache->columns_hdr.columns_count; i++) {
+		column = &cache->columns[i];
+		if (column->file_field >= cache->file_fields_count) {
+			mail_cache_set_corrupted(cache,
+				"Column field index too large (%u >= %u)",
+				column->file_field, cache->file_fields_count);
+			return -1;
+		}
+		field_idx = cache->file_field_map[column->file_field];
+		if (column->field_size !=
+		    (uint32_t)cache->fields[field_idx].field.field_size) {
+			mail_cache_set_corrupted(cache,
+				"Column field %s size changed",
+				cache->fields[field_idx].field.name);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int mail_cache_columns_read(struct mail_cache *cache)
+{
+	if (cache->columns_read)
+		return 0;
+
+	mail_cache_columns_free(cache);
+	if ((cache->hdr->flags & MAIL_CACHE_HEADER_FLAG_COLUMNS) != 0) {
+		if (mail_cache_columns_read_real(cache) < 0) {
+			mail_cache_columns_free(cache);
+			return -1;
+		}
+	}
+	cache->columns_read = TRUE;
+	return 0;
+}
+
+static bool
+mail_cache_columns_uid_search(const uint32_t *uids, unsigned int count,
+			      uint32_t uid, unsigned int *idx_r)
+{
+	BINARY_NUMBER_SEARCH(uids, count, uid, idx_r);
+}
+
+static int mail_cache_columns_read_uids(struct mail_cache *cache)
+{
+	unsigned int count = cache->columns_hdr.messages_count;
+	const void *data;
+	int ret;
+
+	/* the UIDs don't change until the file is compressed again, so
+	   keep a copy of them instead of mapping them for every lookup.
+	   this matters especially with mmap_disable=yes. */
+	ret = mail_cache_map(cache, cache->columns_hdr.uids_offset,
+			     count * sizeof(uint32_t), &data);
+	if (ret <= 0) {
+		if (ret == 0) {
+			mail_cache_set_corrupted(cache,
+				"Column UIDs point outside file");
+		}
+		return -1;
+	}
+	cache->column_uids = i_new(uint32_t, count);
+	memcpy(cache->column_uids, data, count * sizeof(uint32_t));
+	return 0;
+}
+
+int mail_cache_columns_lookup_row(struct mail_cache_view *view, uint32_t seq,
+				  unsigned int *row_r)
+{
+	struct mail_cache *cache = view->cache;
+	const uint32_t *uids;
+	unsigned int count;
+	uint32_t uid;
+
+	if (mail_cache_columns_read(cache) < 0)
+		return -1;
+	count = cache->columns_hdr.messages_count;
+	if (cache->columns_hdr.columns_count == 0 || count == 0)
+		return 0;
+
+	if (cache->column_uids == NULL) {
+		if (mail_cache_columns_read_uids(cache) < 0)
+			return -1;
+	}
+	uids = cache->column_uids;
+
+	/* messages are only expunged or appended after compression, so with
+	   an up-to-date view the row is usually at the same sequence. */
+	mail_index_lookup_uid(view->view, seq, &uid);
+	if (seq <= count && uids[seq-1] == uid) {
+		*row_r = seq-1;
+		return 1;
+	}
+	return mail_cache_columns_uid_search(uids, count, uid, row_r) ? 1 : 0;
+}
+
+static int
+mail_cache_column_map(struct mail_cache *cache, uoff_t offset, size_t size,
+		      const void **data_r)
+{
+	int ret;
+
+	if (offset + size > (uint32_t)-1) {
+		mail_cache_set_corrupted(cache, "Column points outside file");
+		return -1;
+	}
+	if ((ret = mail_cache_map(cache, offset, size, data_r)) <= 0) {
+		if (ret == 0) {
+			mail_cache_set_corrupted(cache,
+				"Column points outside file");
+		}
+		return -1;
+	}
+	return 0;
+}
+
+static int
+mail_cache_column_read_meta(struct mail_cache *cache,
+			    const struct mail_cache_column *column,
+			    struct mail_cache_column_meta *meta)
+{
+	unsigned int i, count = cache->columns_hdr.messages_count;
+	size_t exists_size = (count + 7) / 8;
+	const void *data;
+
+	/* like the UIDs, the bitmap and the ends don't change until the file
+	   is compressed again. keep copies of them, so that each lookup only
+	   needs to access the value. */
+	if (mail_cache_column_map(cache, column->exists_offset, exists_size,
+				  &data) < 0)
+		return -1;
+	meta->exists = i_malloc(exists_size);
+	memcpy(meta->exists, data, exists_size);
+
+	if (column->field_size != (uint32_t)-1)
+		return 0;
+	if (mail_cache_column_map(cache, column->data_offset,
+				  count * sizeof(uint32_t), &data) < 0)
+		return -1;
+	meta->ends = i_new(uint32_t, count);
+	memcpy(meta->ends, data, count * sizeof(uint32_t));
+	for (i = 1; i < count; i++) {
+		if (meta->ends[i-1] > meta->ends[i]) {
+			mail_cache_set_corrupted(cache,
+				"Column has invalid value size");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int mail_cache_column_get(struct mail_cache *cache, unsigned int column_idx,
+			  unsigned int row,
+			  struct mail_cache_iterate_field *field_r)
+{
+	const struct mail_cache_column *column;
+	struct mail_cache_column_meta *meta;
+	const void *data;
+	uint32_t start, end;
+	uoff_t offset;
+
+	i_assert(column_idx < cache->columns_hdr.columns_count);
+	i_assert(row < cache->columns_hdr.messages_count);
+
+	column = &cache->columns[column_idx];
+	meta = &cache->column_metas[column_idx];
+	if (meta->exists == NULL) {
+		if (mail_cache_column_read_meta(cache, column, meta) < 0) {
+			i_free_and_null(meta->exists);
+			i_free_and_null(meta->ends);
+			return -1;
+		}
+	}
+	if ((meta->exists[row / 8] & (1 << (row % 8))) == 0)
+		return 0;
+
+	if (column->field_size != (uint32_t)-1) {
+		start = 0;
+		end = column->field_size;
+		offset = column->data_offset + (uoff_t)row * column->field_size;
+	} else {
+		/* ends[row-1]..ends[row] in the data following the ends */
+		start = row == 0 ? 0 : meta->ends[row-1];
+		end = meta->ends[row];
+		offset = column->data_offset +
+			(uoff_t)cache->columns_hdr.messages_count *
+			sizeof(uint32_t);
+	}
+	if (start == end)
+		data = "";
+	else if (mail_cache_column_map(cache, offset + start, end - start,
+				       &data) < 0)
+		return -1;
+
+	field_r->field_idx = cache->file_field_map[column->file_field];
+	field_r->data = data;
+	field_r->size = end - start;
+	field_r->offset = offset + start;
+	return 1;
+}
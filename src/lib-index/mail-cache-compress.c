@@ -2,32 +2,179 @@
 
 #include "lib.h"
 #include "array.h"
+#include "ioloop.h"
+#include "time-util.h"
 #include "ostream.h"
 #include "nfs-workarounds.h"
 #include "read-full.h"
+#include "write-full.h"
 #include "file-dotlock.h"
 #include "file-cache.h"
 #include "file-set-size.h"
 #include "mail-cache-private.h"
 
 #include <stdio.h>
+#include <utime.h>
 #include <sys/stat.h>
 
+struct mail_cache_copy_column {
+	unsigned int field_idx;
+	uint32_t field_size;
+	buffer_t *exists, *data, *ends;
+};
+
+struct mail_cache_copy_record {
+	uint32_t uid;
+	/* The message's cache offset in the old file when it was copied.
+	   If it has changed, the message is copied again. */
+	uint32_t old_offset;
+	/* offset in the new file, 0 if nothing was copied */
+	uint32_t offset;
+};
+
 struct mail_cache_copy_context {
 	struct mail_cache *cache;
+	struct ostream *output;
+	struct mail_cache_header hdr;
+	time_t max_drop_time;
 
 	buffer_t *buffer, *field_seen;
 	ARRAY(unsigned int) bitmask_pos;
+	/* field_idx -> file field index, or (uint32_t)-1 if it's dropped */
 	uint32_t *field_file_map;
+	unsigned int field_map_count, used_fields_count;
+
+	/* messages copied by incremental compression steps, sorted by UID */
+	ARRAY(struct mail_cache_copy_record) records;
+	unsigned int written_record_count;
+	uint32_t max_uid;
+
+	ARRAY(struct mail_cache_copy_column) columns;
+	/* field_idx -> columns index + 1, or 0 if field isn't in columns */
+	unsigned int *field_column_map;
+	buffer_t *column_uids;
+	unsigned int column_row;
+	struct mail_cache_column_header column_hdr;
+	struct mail_cache_column *file_columns;
 
 	uint8_t field_seen_value;
+	bool all_fields;
 	bool new_msg;
+	bool have_column_data;
+};
+
+struct mail_cache_compress_incr {
+	struct mail_cache_copy_context *ctx;
+	int fd;
+	char *temp_path;
+	ino_t temp_ino;
+
+	/* file_seq of the cache file that is being compressed */
+	uint32_t old_file_seq;
+	/* the next UID to copy */
+	uint32_t next_uid;
+};
+
+/* Saved to the .incr.state file when the cache is closed in the middle of
+   an incremental compression. It's followed by fields_count NUL-terminated
+   field names in the new file's order, padded to 32bit alignment, and
+   records_count struct mail_cache_copy_records. */
+struct mail_cache_compress_incr_state {
+	uint32_t indexid;
+	uint32_t old_file_seq;
+	uint32_t new_file_seq;
+	uint32_t next_uid;
+	uint32_t max_uid;
+	uint32_t written_record_count;
+	uint32_t fields_count;
+	uint32_t records_count;
+	uint64_t temp_ino;
+	uint64_t temp_size;
 };
 
 struct mail_cache_compress_lock {
 	struct dotlock *dotlock;
 };
 
+static enum mail_cache_decision_type
+mail_cache_copy_get_decision(struct mail_cache_copy_context *ctx,
+			     const struct mail_cache_field_private *priv)
+{
+	enum mail_cache_decision_type dec = priv->field.decision;
+
+	/* if the decision isn't forced and this field hasn't been accessed
+	   for a while, drop it */
+	if ((dec & MAIL_CACHE_DECISION_FORCED) == 0 &&
+	    priv->field.last_used < ctx->max_drop_time && !priv->adding)
+		dec = MAIL_CACHE_DECISION_NO;
+	return dec;
+}
+
+static bool
+mail_cache_copy_want_field(struct mail_cache_copy_context *ctx,
+			   const struct mail_cache_field_private *priv)
+{
+	enum mail_cache_decision_type dec;
+
+	if (ctx->all_fields) {
+		/* creating the initial cache file. add all fields. */
+		return TRUE;
+	}
+	/* drop all fields we don't want */
+	dec = mail_cache_copy_get_decision(ctx, priv);
+	if ((dec & ~MAIL_CACHE_DECISION_FORCED) == MAIL_CACHE_DECISION_NO &&
+	    !priv->adding)
+		return FALSE;
+	return priv->used;
+}
+
+static void mail_cache_copy_fields_update(struct mail_cache_copy_context *ctx)
+{
+	struct mail_cache *cache = ctx->cache;
+	unsigned int i;
+
+	/* @UNSAFE: create a field mapping for used fields. Fields that
+	   become used while an incremental compression is in progress are
+	   mapped after the existing ones. */
+	if (ctx->field_map_count < cache->fields_count) {
+		ctx->field_file_map = i_realloc(ctx->field_file_map,
+			sizeof(uint32_t) * ctx->field_map_count,
+			sizeof(uint32_t) * cache->fields_count);
+		ctx->field_column_map = i_realloc(ctx->field_column_map,
+			sizeof(unsigned int) * ctx->field_map_count,
+			sizeof(unsigned int) * cache->fields_count);
+		for (i = ctx->field_map_count; i < cache->fields_count; i++)
+			ctx->field_file_map[i] = (uint32_t)-1;
+		ctx->field_map_count = cache->fields_count;
+	}
+	for (i = 0; i < cache->fields_count; i++) {
+		if (ctx->field_file_map[i] == (uint32_t)-1 &&
+		    mail_cache_copy_want_field(ctx, &cache->fields[i]))
+			ctx->field_file_map[i] = ctx->used_fields_count++;
+	}
+}
+
+static void mail_cache_copy_drop_fields(struct mail_cache_copy_context *ctx)
+{
+	struct mail_cache *cache = ctx->cache;
+	struct mail_cache_field_private *priv;
+	unsigned int i;
+
+	/* forget about the fields that weren't copied */
+	for (i = 0; i < cache->fields_count; i++) {
+		if (ctx->field_file_map[i] != (uint32_t)-1)
+			continue;
+
+		priv = &cache->fields[i];
+		priv->field.decision = mail_cache_copy_get_decision(ctx, priv);
+		if ((priv->field.decision & ~MAIL_CACHE_DECISION_FORCED) ==
+		    MAIL_CACHE_DECISION_NO && !priv->adding) {
+			priv->used = FALSE;
+			priv->field.last_used = 0;
+		}
+	}
+}
+
 static void
 mail_cache_merge_bitmask(struct mail_cache_copy_context *ctx,
 			 const struct mail_cache_iterate_field *field)
@@ -46,6 +193,42 @@ mail_cache_merge_bitmask(struct mail_cache_copy_context *ctx,
 		dest[i] |= ((const unsigned char*)field->data)[i];
 }
 
+static void
+mail_cache_compress_column(struct mail_cache_copy_context *ctx,
+			   struct mail_cache_copy_column *column,
+			   const struct mail_cache_iterate_field *field,
+			   bool duplicate)
+{
+	const struct mail_cache_field *cache_field =
+		&ctx->cache->fields[field->field_idx].field;
+	unsigned int i, row = ctx->column_row;
+	uint8_t *exists;
+	unsigned char *dest;
+
+	exists = buffer_get_space_unsafe(column->exists, row / 8, 1);
+	if (duplicate) {
+		if (cache_field->type != MAIL_CACHE_FIELD_BITMASK ||
+		    (*exists & (1 << (row % 8))) == 0)
+			return;
+		dest = buffer_get_space_unsafe(column->data,
+					       row * column->field_size,
+					       field->size);
+		for (i = 0; i < field->size; i++)
+			dest[i] |= ((const unsigned char*)field->data)[i];
+		return;
+	}
+
+	*exists |= 1 << (row % 8);
+	if (column->field_size == (uint32_t)-1)
+		buffer_append(column->data, field->data, field->size);
+	else {
+		i_assert(field->size == column->field_size);
+		buffer_write(column->data, row * column->field_size,
+			     field->data, field->size);
+	}
+	ctx->have_column_data = TRUE;
+}
+
 static void
 mail_cache_compress_field(struct mail_cache_copy_context *ctx,
 			  const struct mail_cache_iterate_field *field)
@@ -53,19 +236,30 @@ mail_cache_compress_field(struct mail_cache_copy_context *ctx,
         struct mail_cache_field *cache_field;
 	enum mail_cache_decision_type dec;
 	uint32_t file_field_idx, size32;
+	struct mail_cache_copy_column *column = NULL;
+	unsigned int column_idx;
 	uint8_t *field_seen;
 
+	if (field->field_idx >= ctx->field_map_count) {
+		/* field was just added to the old file */
+		mail_cache_copy_fields_update(ctx);
+	}
 	file_field_idx = ctx->field_file_map[field->field_idx];
 	if (file_field_idx == (uint32_t)-1)
 		return;
 
 	cache_field = &ctx->cache->fields[field->field_idx].field;
+	column_idx = ctx->field_column_map[field->field_idx];
+	if (column_idx != 0)
+		column = array_idx_modifiable(&ctx->columns, column_idx - 1);
 
 	field_seen = buffer_get_space_unsafe(ctx->field_seen,
 					     field->field_idx, 1);
 	if (*field_seen == ctx->field_seen_value) {
 		/* duplicate */
-		if (cache_field->type == MAIL_CACHE_FIELD_BITMASK)
+		if (column != NULL)
+			mail_cache_compress_column(ctx, column, field, TRUE);
+		else if (cache_field->type == MAIL_CACHE_FIELD_BITMASK)
 			mail_cache_merge_bitmask(ctx, field);
 		return;
 	}
@@ -80,6 +274,11 @@ mail_cache_compress_field(struct mail_cache_copy_context *ctx,
 			return;
 	}
 
+	if (column != NULL) {
+		mail_cache_compress_column(ctx, column, field, FALSE);
+		return;
+	}
+
 	buffer_append(ctx->buffer, &file_field_idx, sizeof(file_field_idx));
 
 	if (cache_field->field_size == UINT_MAX) {
@@ -98,6 +297,110 @@ mail_cache_compress_field(struct mail_cache_copy_context *ctx,
 		buffer_append_zero(ctx->buffer, 4 - (field->size & 3));
 }
 
+static void
+mail_cache_compress_columns_init(struct mail_cache_copy_context *ctx)
+{
+	struct mail_cache *cache = ctx->cache;
+	struct mail_cache_copy_column *column;
+	char *const *namep;
+	unsigned int field_idx, field_size;
+
+	i_array_init(&ctx->columns, 8);
+	array_foreach(&cache->column_field_names, namep) {
+		field_idx = mail_cache_register_lookup(cache, *namep);
+		if (field_idx == UINT_MAX ||
+		    ctx->field_file_map[field_idx] == (uint32_t)-1 ||
+		    ctx->field_column_map[field_idx] != 0)
+			continue;
+
+		field_size = cache->fields[field_idx].field.field_size;
+		column = array_append_space(&ctx->columns);
+		column->field_idx = field_idx;
+		column->field_size = field_size == UINT_MAX ?
+			(uint32_t)-1 : field_size;
+		column->exists = buffer_create_dynamic(default_pool, 1024);
+		column->data = buffer_create_dynamic(default_pool, 1024*8);
+		if (column->field_size == (uint32_t)-1) {
+			column->ends = buffer_create_dynamic(default_pool,
+							     1024*4);
+		}
+		ctx->field_column_map[field_idx] = array_count(&ctx->columns);
+	}
+	if (array_count(&ctx->columns) > 0)
+		ctx->column_uids = buffer_create_dynamic(default_pool, 1024*4);
+}
+
+static void
+mail_cache_compress_columns_finish_row(struct mail_cache_copy_context *ctx,
+				       uint32_t uid)
+{
+	struct mail_cache_copy_column *column;
+	uint32_t end;
+
+	buffer_append(ctx->column_uids, &uid, sizeof(uid));
+	array_foreach_modifiable(&ctx->columns, column) {
+		if (column->field_size == (uint32_t)-1) {
+			end = column->data->used;
+			buffer_append(column->ends, &end, sizeof(end));
+		}
+	}
+	ctx->column_row++;
+}
+
+static void
+mail_cache_compress_columns_append(struct ostream *output, buffer_t *buf,
+				   size_t size)
+{
+	/* pad missing values with zeros and keep everything 32bit aligned */
+	if (buf->used < size)
+		buffer_append_zero(buf, size - buf->used);
+	if ((buf->used & 3) != 0)
+		buffer_append_zero(buf, 4 - (buf->used & 3));
+	o_stream_nsend(output, buf->data, buf->used);
+}
+
+static void
+mail_cache_compress_columns_write(struct mail_cache_copy_context *ctx,
+				  struct ostream *output)
+{
+	struct mail_cache_copy_column *column;
+	struct mail_cache_column *file_columns;
+	unsigned int i, count, rows = ctx->column_row;
+
+	column = array_get_modifiable(&ctx->columns, &count);
+	file_columns = ctx->file_columns = t_new(struct mail_cache_column, count);
+
+	ctx->column_hdr.messages_count = rows;
+	ctx->column_hdr.columns_count = count;
+	ctx->column_hdr.uids_offset = output->offset;
+	o_stream_nsend(output, ctx->column_uids->data, ctx->column_uids->used);
+	buffer_free(&ctx->column_uids);
+
+	for (i = 0; i < count; i++) {
+		file_columns[i].file_field =
+			ctx->field_file_map[column[i].field_idx];
+		file_columns[i].field_size = column[i].field_size;
+
+		file_columns[i].exists_offset = output->offset;
+		mail_cache_compress_columns_append(output, column[i].exists,
+						   (rows + 7) / 8);
+		buffer_free(&column[i].exists);
+
+		file_columns[i].data_offset = output->offset;
+		if (column[i].field_size != (uint32_t)-1) {
+			mail_cache_compress_columns_append(output,
+				column[i].data, rows * column[i].field_size);
+		} else {
+			o_stream_nsend(output, column[i].ends->data,
+				       column[i].ends->used);
+			mail_cache_compress_columns_append(output,
+							   column[i].data, 0);
+			buffer_free(&column[i].ends);
+		}
+		buffer_free(&column[i].data);
+	}
+}
+
 static uint32_t get_next_file_seq(struct mail_cache *cache)
 {
 	const struct mail_index_ext *ext;
@@ -120,12 +423,11 @@ static uint32_t get_next_file_seq(struct mail_cache *cache)
 }
 
 static void
-mail_cache_compress_get_fields(struct mail_cache_copy_context *ctx,
-			       unsigned int used_fields_count)
+mail_cache_compress_get_fields(struct mail_cache_copy_context *ctx)
 {
 	struct mail_cache *cache = ctx->cache;
 	struct mail_cache_field *field;
-	unsigned int i, j, idx;
+	unsigned int i, j, idx, used_fields_count = ctx->used_fields_count;
 
 	/* Make mail_cache_header_fields_get() return the fields in
 	   the same order as we saved them. */
@@ -159,25 +461,160 @@ mail_cache_compress_get_fields(struct mail_cache_copy_context *ctx,
 	mail_cache_header_fields_get(cache, ctx->buffer);
 }
 
+static struct mail_cache_copy_context *
+mail_cache_copy_alloc(struct mail_cache *cache, struct mail_index_view *view,
+		      int fd)
+{
+	struct mail_cache_copy_context *ctx;
+	const struct mail_index_header *idx_hdr;
+
+	ctx = i_new(struct mail_cache_copy_context, 1);
+	ctx->cache = cache;
+	ctx->output = o_stream_create_fd_file(fd, 0, FALSE);
+	ctx->buffer = buffer_create_dynamic(default_pool, 4096);
+	ctx->field_seen = buffer_create_dynamic(default_pool, 64);
+	i_array_init(&ctx->bitmask_pos, 32);
+	i_array_init(&ctx->records, 256);
+
+	ctx->hdr.major_version = MAIL_CACHE_MAJOR_VERSION;
+	ctx->hdr.minor_version = MAIL_CACHE_MINOR_VERSION;
+	ctx->hdr.compat_sizeof_uoff_t = sizeof(uoff_t);
+	ctx->hdr.indexid = cache->index->indexid;
+
+	idx_hdr = mail_index_get_header(view);
+	ctx->max_drop_time = idx_hdr->day_stamp == 0 ? 0 :
+		idx_hdr->day_stamp - MAIL_CACHE_FIELD_DROP_SECS;
+	ctx->all_fields = cache->file_fields_count == 0;
+	return ctx;
+}
+
+static struct mail_cache_copy_context *
+mail_cache_copy_init(struct mail_cache *cache, struct mail_index_view *view,
+		     int fd)
+{
+	struct mail_cache_copy_context *ctx;
+
+	ctx = mail_cache_copy_alloc(cache, view, fd);
+	ctx->hdr.file_seq = get_next_file_seq(cache);
+	o_stream_nsend(ctx->output, &ctx->hdr, sizeof(ctx->hdr));
+	mail_cache_copy_fields_update(ctx);
+
+	mail_cache_compress_columns_init(ctx);
+	if (array_count(&ctx->columns) > 0) {
+		/* leave space for the column header. it's written at the
+		   end after the file header. */
+		size_t size = sizeof(struct mail_cache_column_header) +
+			sizeof(struct mail_cache_column) *
+			array_count(&ctx->columns);
+
+		ctx->hdr.flags |= MAIL_CACHE_HEADER_FLAG_COLUMNS;
+		o_stream_nsend(ctx->output, t_malloc0(size), size);
+	}
+	return ctx;
+}
+
+static void mail_cache_copy_deinit(struct mail_cache_copy_context **_ctx)
+{
+	struct mail_cache_copy_context *ctx = *_ctx;
+	struct mail_cache_copy_column *column;
+
+	*_ctx = NULL;
+
+	o_stream_ignore_last_errors(ctx->output);
+	o_stream_destroy(&ctx->output);
+	array_foreach_modifiable(&ctx->columns, column) {
+		if (column->exists != NULL)
+			buffer_free(&column->exists);
+		if (column->data != NULL)
+			buffer_free(&column->data);
+		if (column->ends != NULL)
+			buffer_free(&column->ends);
+	}
+	if (ctx->column_uids != NULL)
+		buffer_free(&ctx->column_uids);
+	array_free(&ctx->columns);
+	array_free(&ctx->records);
+	array_free(&ctx->bitmask_pos);
+	buffer_free(&ctx->buffer);
+	buffer_free(&ctx->field_seen);
+	i_free(ctx->field_file_map);
+	i_free(ctx->field_column_map);
+	i_free(ctx);
+}
+
+static uint32_t
+mail_cache_copy_message(struct mail_cache_copy_context *ctx,
+			struct mail_cache_view *cache_view,
+			uint32_t seq, uint32_t uid, bool new_msg)
+{
+	struct mail_cache_lookup_iterate_ctx iter;
+	struct mail_cache_iterate_field field;
+	struct mail_cache_record cache_rec;
+	uint32_t offset;
+
+	ctx->new_msg = new_msg;
+	ctx->have_column_data = FALSE;
+	buffer_set_used_size(ctx->buffer, 0);
+
+	if (++ctx->field_seen_value == 0) {
+		memset(buffer_get_modifiable_data(ctx->field_seen, NULL),
+		       0, buffer_get_size(ctx->field_seen));
+		ctx->field_seen_value++;
+	}
+
+	i_zero(&cache_rec);
+	buffer_append(ctx->buffer, &cache_rec, sizeof(cache_rec));
+
+	mail_cache_lookup_iter_init(cache_view, seq, &iter);
+	while (mail_cache_lookup_iter_next(&iter, &field) > 0)
+		mail_cache_compress_field(ctx, &field);
+
+	if (ctx->have_column_data) {
+		mail_cache_compress_columns_finish_row(ctx, uid);
+		if (ctx->max_uid < uid)
+			ctx->max_uid = uid;
+	}
+
+	if (ctx->buffer->used == sizeof(cache_rec) ||
+	    ctx->buffer->used > MAIL_CACHE_RECORD_MAX_SIZE) {
+		/* nothing cached */
+		return 0;
+	}
+
+	if (ctx->max_uid < uid)
+		ctx->max_uid = uid;
+	cache_rec.size = ctx->buffer->used;
+	offset = ctx->output->offset;
+	buffer_write(ctx->buffer, 0, &cache_rec, sizeof(cache_rec));
+	o_stream_nsend(ctx->output, ctx->buffer->data, cache_rec.size);
+	ctx->written_record_count++;
+	return offset;
+}
+
+static uint32_t
+mail_cache_copy_get_old_offset(struct mail_index_view *view, uint32_t seq,
+			       uint32_t old_file_seq)
+{
+	uint32_t offset, reset_id;
+
+	offset = mail_cache_lookup_cur_offset(view, seq, &reset_id);
+	return offset != 0 && reset_id == old_file_seq ? offset : 0;
+}
+
 static int
 mail_cache_copy(struct mail_cache *cache, struct mail_index_transaction *trans,
-		int fd, uint32_t *file_seq_r, uoff_t *file_size_r, uint32_t *max_uid_r,
+		struct mail_cache_compress_incr *incr, int fd,
+		uint32_t *file_seq_r, uoff_t *file_size_r, uint32_t *max_uid_r,
 		ARRAY_TYPE(uint32_t) *ext_offsets)
 {
-        struct mail_cache_copy_context ctx;
-	struct mail_cache_lookup_iterate_ctx iter;
-	struct mail_cache_iterate_field field;
+	struct mail_cache_copy_context *ctx;
 	struct mail_index_view *view;
 	struct mail_cache_view *cache_view;
-	const struct mail_index_header *idx_hdr;
-	struct mail_cache_header hdr;
-	struct mail_cache_record cache_rec;
+	const struct mail_cache_copy_record *records;
 	struct ostream *output;
-	uint32_t message_count, seq, first_new_seq, ext_offset;
-	unsigned int i, used_fields_count, orig_fields_count, record_count;
-	time_t max_drop_time;
-
-	*max_uid_r = 0;
+	uint32_t message_count, seq, first_new_seq, ext_offset, uid;
+	uint32_t next_uid = 0, old_file_seq = 0, old_offset;
+	unsigned int i, records_count, orig_fields_count, record_count = 0;
 
 	/* get the latest info on fields */
 	if (mail_cache_header_fields_read(cache) < 0)
@@ -185,132 +622,99 @@ mail_cache_copy(struct mail_cache *cache, struct mail_index_transaction *trans,
 
 	view = mail_index_transaction_get_view(trans);
 	cache_view = mail_cache_view_open(cache, view);
-	output = o_stream_create_fd_file(fd, 0, FALSE);
-
-	i_zero(&hdr);
-	hdr.major_version = MAIL_CACHE_MAJOR_VERSION;
-	hdr.minor_version = MAIL_CACHE_MINOR_VERSION;
-	hdr.compat_sizeof_uoff_t = sizeof(uoff_t);
-	hdr.indexid = cache->index->indexid;
-	hdr.file_seq = get_next_file_seq(cache);
-	o_stream_nsend(output, &hdr, sizeof(hdr));
-
-	i_zero(&ctx);
-	ctx.cache = cache;
-	ctx.buffer = buffer_create_dynamic(default_pool, 4096);
-	ctx.field_seen = buffer_create_dynamic(default_pool, 64);
-	ctx.field_seen_value = 0;
-	ctx.field_file_map = t_new(uint32_t, cache->fields_count + 1);
-	t_array_init(&ctx.bitmask_pos, 32);
-
-	/* @UNSAFE: drop unused fields and create a field mapping for
-	   used fields */
-	idx_hdr = mail_index_get_header(view);
-	max_drop_time = idx_hdr->day_stamp == 0 ? 0 :
-		idx_hdr->day_stamp - MAIL_CACHE_FIELD_DROP_SECS;
-
-	orig_fields_count = cache->fields_count;
-	if (cache->file_fields_count == 0) {
-		/* creating the initial cache file. add all fields. */
-		for (i = 0; i < orig_fields_count; i++)
-			ctx.field_file_map[i] = i;
-		used_fields_count = i;
-	} else {
-		for (i = used_fields_count = 0; i < orig_fields_count; i++) {
-			struct mail_cache_field_private *priv =
-				&cache->fields[i];
-			enum mail_cache_decision_type dec =
-				priv->field.decision;
-
-			/* if the decision isn't forced and this field hasn't
-			   been accessed for a while, drop it */
-			if ((dec & MAIL_CACHE_DECISION_FORCED) == 0 &&
-			    priv->field.last_used < max_drop_time &&
-			    !priv->adding) {
-				dec = MAIL_CACHE_DECISION_NO;
-				priv->field.decision = dec;
-			}
-
-			/* drop all fields we don't want */
-			if ((dec & ~MAIL_CACHE_DECISION_FORCED) ==
-			    MAIL_CACHE_DECISION_NO && !priv->adding) {
-				priv->used = FALSE;
-				priv->field.last_used = 0;
-			}
-
-			ctx.field_file_map[i] = !priv->used ?
-				(uint32_t)-1 : used_fields_count++;
-		}
+	if (incr == NULL)
+		ctx = mail_cache_copy_init(cache, view, fd);
+	else {
+		/* finish the incremental compression. the earlier steps have
+		   already copied the messages before next_uid. */
+		ctx = incr->ctx;
+		incr->ctx = NULL;
+		next_uid = incr->next_uid;
+		old_file_seq = incr->old_file_seq;
+		mail_cache_copy_fields_update(ctx);
 	}
+	output = ctx->output;
+	orig_fields_count = cache->fields_count;
 
 	/* get sequence of first message which doesn't need its temp fields
 	   removed. */
 	first_new_seq = mail_cache_get_first_new_seq(view);
 	message_count = mail_index_view_get_messages_count(view);
+	records = array_get(&ctx->records, &records_count);
 
-	i_array_init(ext_offsets, message_count); record_count = 0;
+	i_array_init(ext_offsets, message_count); i = 0;
 	for (seq = 1; seq <= message_count; seq++) {
 		if (mail_index_transaction_is_expunged(trans, seq)) {
 			array_append_zero(ext_offsets);
 			continue;
 		}
 
-		ctx.new_msg = seq >= first_new_seq;
-		buffer_set_used_size(ctx.buffer, 0);
-
-		if (++ctx.field_seen_value == 0) {
-			memset(buffer_get_modifiable_data(ctx.field_seen, NULL),
-			       0, buffer_get_size(ctx.field_seen));
-			ctx.field_seen_value++;
-		}
-
-		i_zero(&cache_rec);
-		buffer_append(ctx.buffer, &cache_rec, sizeof(cache_rec));
-
-		mail_cache_lookup_iter_init(cache_view, seq, &iter);
-		while (mail_cache_lookup_iter_next(&iter, &field) > 0)
-			mail_cache_compress_field(&ctx, &field);
-
-		if (ctx.buffer->used == sizeof(cache_rec) ||
-		    ctx.buffer->used > MAIL_CACHE_RECORD_MAX_SIZE) {
-			/* nothing cached */
-			ext_offset = 0;
+		mail_index_lookup_uid(view, seq, &uid);
+		if (uid < next_uid) {
+			/* copy the message again only if its cache record
+			   was changed after it was copied */
+			old_offset = mail_cache_copy_get_old_offset(view,
+							seq, old_file_seq);
+			while (i < records_count && records[i].uid < uid)
+				i++;
+			if (i < records_count && records[i].uid == uid &&
+			    records[i].old_offset == old_offset)
+				ext_offset = records[i].offset;
+			else if (old_offset == 0)
+				ext_offset = 0;
+			else {
+				ext_offset = mail_cache_copy_message(ctx,
+					cache_view, seq, uid,
+					seq >= first_new_seq);
+			}
 		} else {
-			mail_index_lookup_uid(view, seq, max_uid_r);
-			cache_rec.size = ctx.buffer->used;
-			ext_offset = output->offset;
-			buffer_write(ctx.buffer, 0, &cache_rec,
-				     sizeof(cache_rec));
-			o_stream_nsend(output, ctx.buffer->data, cache_rec.size);
-			record_count++;
+			ext_offset = mail_cache_copy_message(ctx,
+				cache_view, seq, uid, seq >= first_new_seq);
 		}
-
+		if (ext_offset != 0)
+			record_count++;
 		array_append(ext_offsets, &ext_offset, 1);
 	}
 	i_assert(orig_fields_count == cache->fields_count);
 
-	hdr.record_count = record_count;
-	hdr.field_header_offset = mail_index_uint32_to_offset(output->offset);
-	mail_cache_compress_get_fields(&ctx, used_fields_count);
-	o_stream_nsend(output, ctx.buffer->data, ctx.buffer->used);
-
-	hdr.backwards_compat_used_file_size = output->offset;
-	buffer_free(&ctx.buffer);
-	buffer_free(&ctx.field_seen);
+	/* records written by the incremental steps for messages that were
+	   expunged or changed afterwards are unused */
+	ctx->hdr.record_count = record_count;
+	ctx->hdr.deleted_record_count =
+		ctx->written_record_count - record_count;
+	if (ctx->column_uids != NULL)
+		mail_cache_compress_columns_write(ctx, output);
+	ctx->hdr.field_header_offset =
+		mail_index_uint32_to_offset(output->offset);
+	mail_cache_copy_drop_fields(ctx);
+	mail_cache_compress_get_fields(ctx);
+	o_stream_nsend(output, ctx->buffer->data, ctx->buffer->used);
+
+	ctx->hdr.backwards_compat_used_file_size = output->offset;
+	*file_size_r = output->offset;
 
 	(void)o_stream_seek(output, 0);
-	o_stream_nsend(output, &hdr, sizeof(hdr));
+	o_stream_nsend(output, &ctx->hdr, sizeof(ctx->hdr));
+	if (ctx->file_columns != NULL) {
+		/* the column header follows the file header */
+		o_stream_nsend(output, &ctx->column_hdr,
+			       sizeof(ctx->column_hdr));
+		o_stream_nsend(output, ctx->file_columns,
+			       sizeof(*ctx->file_columns) *
+			       ctx->column_hdr.columns_count);
+	}
 
 	mail_cache_view_close(&cache_view);
 
 	if (o_stream_nfinish(output) < 0) {
 		mail_cache_set_syscall_error(cache, "write()");
-		o_stream_destroy(&output);
+		mail_cache_copy_deinit(&ctx);
 		array_free(ext_offsets);
 		return -1;
 	}
-	*file_size_r = output->offset;
-	o_stream_destroy(&output);
+	*file_seq_r = ctx->hdr.file_seq;
+	*max_uid_r = ctx->max_uid;
+	mail_cache_copy_deinit(&ctx);
 
 	if (cache->index->fsync_mode == FSYNC_MODE_ALWAYS) {
 		if (fdatasync(fd) < 0) {
@@ -319,14 +723,13 @@ mail_cache_copy(struct mail_cache *cache, struct mail_index_transaction *trans,
 			return -1;
 		}
 	}
-
-	*file_seq_r = hdr.file_seq;
 	return 0;
 }
 
 static int
 mail_cache_compress_write(struct mail_cache *cache,
 			  struct mail_index_transaction *trans,
+			  struct mail_cache_compress_incr *incr,
 			  int fd, const char *temp_path, bool *unlock)
 {
 	struct stat st;
@@ -336,7 +739,7 @@ mail_cache_compress_write(struct mail_cache *cache,
 	uoff_t file_size;
 	unsigned int i, count;
 
-	if (mail_cache_copy(cache, trans, fd, &file_seq, &file_size,
+	if (mail_cache_copy(cache, trans, incr, fd, &file_seq, &file_size,
 			    &max_uid, &ext_offsets) < 0)
 		return -1;
 
@@ -352,10 +755,11 @@ mail_cache_compress_write(struct mail_cache *cache,
 	}
 
 	if ((cache->index->flags & MAIL_INDEX_OPEN_FLAG_DEBUG) != 0) {
-		i_debug("%s: Compressed, file_seq changed %u -> %u, "
+		i_debug("%s: Compressed%s, file_seq changed %u -> %u, "
 			"size=%"PRIuUOFF_T", max_uid=%u", cache->filepath,
-			cache->need_compress_file_seq, file_seq,
-			file_size, max_uid);
+			incr == NULL ? "" : " incrementally",
+			incr == NULL ? cache->need_compress_file_seq :
+			incr->old_file_seq, file_seq, file_size, max_uid);
 	}
 
 	/* once we're sure that the compression was successful,
@@ -384,7 +788,9 @@ mail_cache_compress_write(struct mail_cache *cache,
 	return 0;
 }
 
-static int mail_cache_compress_has_file_changed(struct mail_cache *cache)
+static int
+mail_cache_compress_has_file_changed(struct mail_cache *cache,
+				     uint32_t file_seq)
 {
 	struct mail_cache_header hdr;
 	unsigned int i;
@@ -406,12 +812,12 @@ static int mail_cache_compress_has_file_changed(struct mail_cache *cache)
 		if (ret >= 0) {
 			if (ret == 0)
 				return 0;
-			if (cache->need_compress_file_seq == 0) {
+			if (file_seq == 0) {
 				/* previously it didn't exist or it
 				   was unusable and was just unlinked */
 				return 1;
 			}
-			return hdr.file_seq != cache->need_compress_file_seq ? 1 : 0;
+			return hdr.file_seq != file_seq ? 1 : 0;
 		} else if (errno != ESTALE || i >= NFS_ESTALE_RETRY_COUNT) {
 			mail_cache_set_syscall_error(cache, "read()");
 			return -1;
@@ -431,12 +837,238 @@ static int mail_cache_compress_dotlock(struct mail_cache *cache,
 	return 0;
 }
 
+static void
+mail_cache_compress_incr_free(struct mail_cache_compress_incr **_incr)
+{
+	struct mail_cache_compress_incr *incr = *_incr;
+
+	*_incr = NULL;
+	if (incr->ctx != NULL)
+		mail_cache_copy_deinit(&incr->ctx);
+	i_free(incr->temp_path);
+	i_free(incr);
+}
+
+static const char *
+mail_cache_compress_incr_temp_path(struct mail_cache *cache)
+{
+	return t_strconcat(cache->filepath, ".incr.tmp", NULL);
+}
+
+static const char *
+mail_cache_compress_incr_state_path(struct mail_cache *cache)
+{
+	return t_strconcat(cache->filepath, ".incr.state", NULL);
+}
+
+static int
+mail_cache_compress_incr_read_state(struct mail_cache *cache, buffer_t *buf)
+{
+	const char *path = mail_cache_compress_incr_state_path(cache);
+	struct stat st;
+	ssize_t ret;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return 0;
+		mail_index_file_set_syscall_error(cache->index, path, "open()");
+		return -1;
+	}
+	if (fstat(fd, &st) < 0) {
+		mail_index_file_set_syscall_error(cache->index, path, "fstat()");
+		i_close_fd(&fd);
+		return -1;
+	}
+	ret = read_full(fd, buffer_append_space_unsafe(buf, st.st_size),
+			st.st_size);
+	if (ret < 0) {
+		mail_index_file_set_syscall_error(cache->index, path, "read()");
+		i_close_fd(&fd);
+		return -1;
+	}
+	i_close_fd(&fd);
+	if (ret == 0) {
+		/* replaced with a shorter file. treat it as invalid. */
+		buffer_set_used_size(buf, 0);
+	}
+
+	/* whoever manages to unlink the state file continues the
+	   compression */
+	if (unlink(path) < 0) {
+		if (errno == ENOENT)
+			return 0;
+		mail_index_file_set_syscall_error(cache->index, path,
+						  "unlink()");
+		return -1;
+	}
+	return 1;
+}
+
+static void mail_cache_compress_incr_unlink_saved(struct mail_cache *cache)
+{
+	struct mail_cache_compress_incr_state state;
+	const char *temp_path;
+	buffer_t *buf;
+	struct stat st;
+
+	/* the saved incremental compression can't be continued after the
+	   cache was compressed some other way */
+	buf = buffer_create_dynamic(pool_datastack_create(), 1024);
+	if (mail_cache_compress_incr_read_state(cache, buf) <= 0 ||
+	    buf->used < sizeof(state))
+		return;
+	memcpy(&state, buf->data, sizeof(state));
+	temp_path = mail_cache_compress_incr_temp_path(cache);
+	if (stat(temp_path, &st) == 0 && st.st_ino == state.temp_ino)
+		(void)i_unlink_if_exists(temp_path);
+}
+
+void mail_cache_compress_incr_abort(struct mail_cache *cache)
+{
+	struct mail_cache_compress_incr *incr = cache->compress_incr;
+	struct stat st;
+
+	cache->compress_incr = NULL;
+
+	/* don't delete the temp file if another process already replaced
+	   it, because it thought ours was abandoned */
+	if (stat(incr->temp_path, &st) == 0 && st.st_ino == incr->temp_ino)
+		(void)i_unlink_if_exists(incr->temp_path);
+	if (incr->ctx != NULL)
+		mail_cache_copy_deinit(&incr->ctx);
+	i_close_fd(&incr->fd);
+	mail_cache_compress_incr_free(&incr);
+}
+
+static bool mail_cache_compress_incr_is_valid(struct mail_cache *cache)
+{
+	struct mail_cache_compress_incr *incr = cache->compress_incr;
+	struct stat st;
+
+	if (MAIL_CACHE_IS_UNUSABLE(cache) ||
+	    cache->hdr->file_seq != incr->old_file_seq)
+		return FALSE;
+
+	if (stat(incr->temp_path, &st) < 0) {
+		if (errno != ENOENT) {
+			mail_index_file_set_syscall_error(cache->index,
+				incr->temp_path, "stat()");
+		}
+		return FALSE;
+	}
+	return st.st_ino == incr->temp_ino;
+}
+
+static void
+mail_cache_compress_incr_append_fields(struct mail_cache_copy_context *ctx,
+				       buffer_t *buf)
+{
+	struct mail_cache *cache = ctx->cache;
+	unsigned int i, file_idx;
+
+	for (file_idx = 0; file_idx < ctx->used_fields_count; file_idx++) {
+		for (i = 0; i < ctx->field_map_count; i++) {
+			if (ctx->field_file_map[i] == file_idx)
+				break;
+		}
+		i_assert(i < ctx->field_map_count);
+		buffer_append(buf, cache->fields[i].field.name,
+			      strlen(cache->fields[i].field.name) + 1);
+	}
+	if ((buf->used & 3) != 0)
+		buffer_append_zero(buf, 4 - (buf->used & 3));
+}
+
+static int
+mail_cache_compress_incr_write_state(struct mail_cache *cache,
+				     const buffer_t *buf)
+{
+	const char *path, *temp_path;
+	int fd;
+
+	path = mail_cache_compress_incr_state_path(cache);
+	fd = mail_index_create_tmp_file(cache->index, path, &temp_path);
+	if (fd == -1)
+		return -1;
+	if (write_full(fd, buf->data, buf->used) < 0) {
+		mail_index_file_set_syscall_error(cache->index, temp_path,
+						  "write()");
+		i_close_fd(&fd);
+		i_unlink(temp_path);
+		return -1;
+	}
+	i_close_fd(&fd);
+	if (rename(temp_path, path) < 0) {
+		mail_index_file_set_syscall_error(cache->index, path,
+						  "rename()");
+		i_unlink(temp_path);
+		return -1;
+	}
+	return 0;
+}
+
+void mail_cache_compress_incr_save(struct mail_cache *cache)
+{
+	struct mail_cache_compress_incr *incr = cache->compress_incr;
+	struct mail_cache_copy_context *ctx = incr->ctx;
+	struct mail_cache_compress_incr_state state;
+	const struct mail_cache_copy_record *records;
+	unsigned int count;
+	buffer_t *buf;
+	int ret;
+
+	if (!mail_cache_compress_incr_is_valid(cache))
+		ret = -1;
+	else if ((ret = o_stream_flush(ctx->output)) < 0) {
+		mail_index_file_set_syscall_error(cache->index,
+						  incr->temp_path, "write()");
+	} else T_BEGIN {
+		i_zero(&state);
+		state.indexid = cache->index->indexid;
+		state.old_file_seq = incr->old_file_seq;
+		state.new_file_seq = ctx->hdr.file_seq;
+		state.next_uid = incr->next_uid;
+		state.max_uid = ctx->max_uid;
+		state.written_record_count = ctx->written_record_count;
+		state.fields_count = ctx->used_fields_count;
+		state.records_count = array_count(&ctx->records);
+		state.temp_ino = incr->temp_ino;
+		state.temp_size = ctx->output->offset;
+
+		buf = buffer_create_dynamic(pool_datastack_create(), 1024);
+		buffer_append(buf, &state, sizeof(state));
+		mail_cache_compress_incr_append_fields(ctx, buf);
+		records = array_get(&ctx->records, &count);
+		buffer_append(buf, records, sizeof(*records) * count);
+		ret = mail_cache_compress_incr_write_state(cache, buf);
+	} T_END;
+
+	if (ret < 0) {
+		mail_cache_compress_incr_abort(cache);
+		return;
+	}
+	/* keep the temporary file for the next process */
+	cache->compress_incr = NULL;
+	i_close_fd(&incr->fd);
+	mail_cache_compress_incr_free(&incr);
+
+	if ((cache->index->flags & MAIL_INDEX_OPEN_FLAG_DEBUG) != 0) {
+		i_debug("%s: Saved incremental compression of file_seq %u "
+			"at size %"PRIuUOFF_T, cache->filepath,
+			state.old_file_seq, (uoff_t)state.temp_size);
+	}
+}
+
 static int mail_cache_compress_locked(struct mail_cache *cache,
 				      struct mail_index_transaction *trans,
 				      bool *unlock, struct dotlock **dotlock_r)
 {
+	struct mail_cache_compress_incr *incr;
 	const char *temp_path;
 	const void *data;
+	uint32_t file_seq;
 	int fd, ret;
 
 	/* There are two possible locking situations here:
@@ -448,13 +1080,23 @@ static int mail_cache_compress_locked(struct mail_cache *cache,
 
 	if (mail_cache_compress_dotlock(cache, dotlock_r) < 0)
 		return -1;
+	if (cache->compress_incr != NULL &&
+	    !mail_cache_compress_incr_is_valid(cache))
+		mail_cache_compress_incr_abort(cache);
+	file_seq = cache->compress_incr != NULL ?
+		cache->compress_incr->old_file_seq :
+		cache->need_compress_file_seq;
+
 	/* we've locked the cache compression now. if somebody else had just
 	   recreated the cache, reopen the cache and return success. */
-	if ((ret = mail_cache_compress_has_file_changed(cache)) != 0) {
+	ret = mail_cache_compress_has_file_changed(cache, file_seq);
+	if (ret != 0) {
 		if (ret < 0)
 			return -1;
 
 		/* was just compressed, forget this */
+		if (cache->compress_incr != NULL)
+			mail_cache_compress_incr_abort(cache);
 		cache->need_compress_file_seq = 0;
 		file_dotlock_delete(dotlock_r);
 
@@ -471,11 +1113,28 @@ static int mail_cache_compress_locked(struct mail_cache *cache,
 			return -1;
 	}
 
-	/* we want to recreate the cache. write it first to a temporary file */
-	fd = mail_index_create_tmp_file(cache->index, cache->filepath, &temp_path);
-	if (fd == -1)
-		return -1;
-	if (mail_cache_compress_write(cache, trans, fd, temp_path, unlock) < 0) {
+	incr = cache->compress_incr;
+	if (incr != NULL) {
+		/* copy the rest of the messages to the incrementally
+		   written file */
+		cache->compress_incr = NULL;
+		fd = incr->fd;
+		temp_path = t_strdup(incr->temp_path);
+	} else {
+		/* we want to recreate the cache. write it first to a
+		   temporary file */
+		fd = mail_index_create_tmp_file(cache->index, cache->filepath,
+						&temp_path);
+		if (fd == -1)
+			return -1;
+	}
+	ret = mail_cache_compress_write(cache, trans, incr, fd,
+					temp_path, unlock);
+	if (incr != NULL)
+		mail_cache_compress_incr_free(&incr);
+	else if (ret == 0)
+		mail_cache_compress_incr_unlink_saved(cache);
+	if (ret < 0) {
 		i_close_fd(&fd);
 		i_unlink(temp_path);
 		return -1;
@@ -492,11 +1151,52 @@ static int mail_cache_compress_locked(struct mail_cache *cache,
 	return 0;
 }
 
+static void
+mail_cache_compress_disable_map_with_read(struct mail_cache *cache)
+{
+	/* compression isn't very efficient with small read()s */
+	if (cache->map_with_read) {
+		cache->map_with_read = FALSE;
+		if (cache->read_buf != NULL)
+			buffer_set_used_size(cache->read_buf, 0);
+		cache->hdr = NULL;
+		cache->mmap_length = 0;
+	}
+}
+
+static void
+mail_cache_compress_update_stats(struct mail_cache *cache,
+				 const struct timeval *start_time,
+				 bool step)
+{
+	struct mail_cache_compress_stats *stats = &cache->compress_stats;
+	struct timeval now;
+	long long usecs;
+
+	if (gettimeofday(&now, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	usecs = timeval_diff_usecs(&now, start_time);
+	if (usecs < 0)
+		usecs = 0;
+
+	if (step) {
+		stats->step_count++;
+		stats->total_step_usecs += usecs;
+	} else {
+		stats->compress_count++;
+		stats->last_lock_usecs = usecs;
+		if (stats->max_lock_usecs < stats->last_lock_usecs)
+			stats->max_lock_usecs = stats->last_lock_usecs;
+		stats->total_lock_usecs += usecs;
+	}
+}
+
 int mail_cache_compress(struct mail_cache *cache,
 			struct mail_index_transaction *trans,
 			struct mail_cache_compress_lock **lock_r)
 {
 	struct dotlock *dotlock = NULL;
+	struct timeval start_time;
 	bool unlock = FALSE;
 	int ret;
 
@@ -509,14 +1209,9 @@ int mail_cache_compress(struct mail_cache *cache,
 		return 0;
 	}
 
-	/* compression isn't very efficient with small read()s */
-	if (cache->map_with_read) {
-		cache->map_with_read = FALSE;
-		if (cache->read_buf != NULL)
-			buffer_set_used_size(cache->read_buf, 0);
-		cache->hdr = NULL;
-		cache->mmap_length = 0;
-	}
+	if (gettimeofday(&start_time, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	mail_cache_compress_disable_map_with_read(cache);
 
 	if (cache->index->lock_method == FILE_LOCK_METHOD_DOTLOCK) {
 		/* we're using dotlocking, cache file creation itself creates
@@ -547,6 +1242,7 @@ int mail_cache_compress(struct mail_cache *cache,
 		if (mail_cache_unlock(cache) < 0)
 			ret = -1;
 	}
+	mail_cache_compress_update_stats(cache, &start_time, FALSE);
 	if (ret < 0) {
 		if (dotlock != NULL)
 			file_dotlock_delete(&dotlock);
@@ -560,6 +1256,339 @@ int mail_cache_compress(struct mail_cache *cache,
 	return ret;
 }
 
+static int
+mail_cache_compress_incr_create(struct mail_cache *cache,
+				const char **path_r, int *fd_r)
+{
+	struct mail_index *index = cache->index;
+	const char *path;
+	struct stat st;
+	mode_t old_mask;
+	int fd;
+
+	path = *path_r = mail_cache_compress_incr_temp_path(cache);
+	old_mask = umask(0);
+	fd = open(path, O_RDWR|O_CREAT|O_EXCL, index->mode);
+	umask(old_mask);
+	if (fd == -1 && errno == EEXIST) {
+		if (stat(path, &st) == 0 && st.st_mtime >
+		    ioloop_time - MAIL_CACHE_COMPRESS_INCR_STALE_SECS) {
+			/* another process is compressing the cache */
+			return 0;
+		}
+		/* the process compressing it had probably died */
+		if (i_unlink_if_exists(path) < 0)
+			return -1;
+		old_mask = umask(0);
+		fd = open(path, O_RDWR|O_CREAT|O_EXCL, index->mode);
+		umask(old_mask);
+	}
+	if (fd == -1) {
+		if (errno == EEXIST)
+			return 0;
+		mail_index_file_set_syscall_error(index, path, "creat()");
+		return -1;
+	}
+	mail_index_fchown(index, fd, path);
+	*fd_r = fd;
+	return 1;
+}
+
+static bool
+mail_cache_compress_incr_parse_state(struct mail_cache_copy_context *ctx,
+				     const buffer_t *buf,
+				     struct mail_cache_compress_incr_state *state_r)
+{
+	struct mail_cache *cache = ctx->cache;
+	const unsigned char *data = buf->data;
+	const unsigned char *end = data + buf->used, *p;
+	unsigned int i, field_idx;
+	size_t pos;
+
+	if (buf->used < sizeof(*state_r))
+		return FALSE;
+	memcpy(state_r, data, sizeof(*state_r));
+	data += sizeof(*state_r);
+	if (state_r->indexid != cache->index->indexid ||
+	    state_r->old_file_seq != cache->hdr->file_seq)
+		return FALSE;
+
+	/* the fields come from the old file, so they're all registered */
+	ctx->field_map_count = cache->fields_count;
+	ctx->field_file_map = i_new(uint32_t, ctx->field_map_count);
+	ctx->field_column_map = i_new(unsigned int, ctx->field_map_count);
+	for (i = 0; i < ctx->field_map_count; i++)
+		ctx->field_file_map[i] = (uint32_t)-1;
+	for (i = 0; i < state_r->fields_count; i++) {
+		p = memchr(data, '\0', end - data);
+		if (p == NULL)
+			return FALSE;
+		field_idx = mail_cache_register_lookup(cache,
+						       (const char *)data);
+		if (field_idx == UINT_MAX ||
+		    ctx->field_file_map[field_idx] != (uint32_t)-1)
+			return FALSE;
+		ctx->field_file_map[field_idx] = i;
+		data = p + 1;
+	}
+	ctx->used_fields_count = state_r->fields_count;
+
+	pos = data - (const unsigned char *)buf->data;
+	if ((pos & 3) != 0)
+		data += 4 - (pos & 3);
+	if (data > end || (size_t)(end - data) != state_r->records_count *
+	    sizeof(struct mail_cache_copy_record))
+		return FALSE;
+	array_append(&ctx->records,
+		     (const struct mail_cache_copy_record *)data,
+		     state_r->records_count);
+	return TRUE;
+}
+
+static int
+mail_cache_compress_incr_resume(struct mail_cache *cache,
+				struct mail_index_transaction *trans)
+{
+	struct mail_cache_compress_incr_state state;
+	struct mail_cache_compress_incr *incr;
+	struct mail_cache_copy_context *ctx;
+	const char *temp_path;
+	buffer_t *buf;
+	struct stat st;
+	bool valid;
+	int fd, ret;
+
+	buf = buffer_create_dynamic(pool_datastack_create(), 1024);
+	if ((ret = mail_cache_compress_incr_read_state(cache, buf)) <= 0)
+		return ret;
+
+	temp_path = mail_cache_compress_incr_temp_path(cache);
+	fd = open(temp_path, O_RDWR);
+	if (fd == -1) {
+		if (errno != ENOENT) {
+			mail_index_file_set_syscall_error(cache->index,
+							  temp_path, "open()");
+		}
+		return 0;
+	}
+	if (fstat(fd, &st) < 0) {
+		mail_index_file_set_syscall_error(cache->index, temp_path,
+						  "fstat()");
+		i_close_fd(&fd);
+		return -1;
+	}
+
+	i_zero(&state);
+	ctx = mail_cache_copy_alloc(cache,
+		mail_index_transaction_get_view(trans), fd);
+	i_array_init(&ctx->columns, 1);
+	valid = mail_cache_compress_incr_parse_state(ctx, buf, &state) &&
+		st.st_ino == state.temp_ino &&
+		(uoff_t)st.st_size == state.temp_size;
+	if (!valid) {
+		/* the cache was compressed meanwhile, or the state is
+		   otherwise unusable. start from the beginning. */
+		mail_cache_copy_deinit(&ctx);
+		i_close_fd(&fd);
+		if (st.st_ino == state.temp_ino)
+			(void)i_unlink_if_exists(temp_path);
+		return 0;
+	}
+	ctx->hdr.file_seq = state.new_file_seq;
+	ctx->max_uid = state.max_uid;
+	ctx->written_record_count = state.written_record_count;
+	mail_cache_copy_fields_update(ctx);
+	if (o_stream_seek(ctx->output, state.temp_size) < 0) {
+		mail_index_file_set_syscall_error(cache->index, temp_path,
+						  "lseek()");
+		mail_cache_copy_deinit(&ctx);
+		i_close_fd(&fd);
+		return -1;
+	}
+
+	/* the file may not have been modified for a while. make sure other
+	   processes don't think it's abandoned. */
+	if (utime(temp_path, NULL) < 0) {
+		mail_index_file_set_syscall_error(cache->index, temp_path,
+						  "utime()");
+	}
+
+	incr = i_new(struct mail_cache_compress_incr, 1);
+	incr->fd = fd;
+	incr->temp_path = i_strdup(temp_path);
+	incr->temp_ino = st.st_ino;
+	incr->old_file_seq = state.old_file_seq;
+	incr->next_uid = state.next_uid;
+	incr->ctx = ctx;
+	cache->compress_incr = incr;
+
+	if ((cache->index->flags & MAIL_INDEX_OPEN_FLAG_DEBUG) != 0) {
+		i_debug("%s: Continuing incremental compression of "
+			"file_seq %u from UID %u", cache->filepath,
+			incr->old_file_seq, incr->next_uid);
+	}
+	return 1;
+}
+
+static int
+mail_cache_compress_incr_start(struct mail_cache *cache,
+			       struct mail_index_transaction *trans)
+{
+	struct mail_cache_compress_incr *incr;
+	const char *temp_path;
+	const void *data;
+	struct stat st;
+	int fd, ret;
+
+	/* if somebody else had just recreated the cache, reopen it */
+	ret = mail_cache_compress_has_file_changed(cache,
+				cache->need_compress_file_seq);
+	if (ret != 0) {
+		if (ret < 0)
+			return -1;
+		cache->need_compress_file_seq = 0;
+		return mail_cache_reopen(cache) < 0 ? -1 : 0;
+	}
+	/* get the latest info on fields */
+	if (mail_cache_header_fields_read(cache) < 0)
+		return -1;
+	if (mail_cache_map(cache, 0, 0, &data) < 0)
+		return -1;
+	if (MAIL_CACHE_IS_UNUSABLE(cache))
+		return 0;
+	if ((ret = mail_cache_compress_incr_resume(cache, trans)) != 0)
+		return ret;
+
+	ret = mail_cache_compress_incr_create(cache, &temp_path, &fd);
+	if (ret <= 0)
+		return ret;
+	if (fstat(fd, &st) < 0) {
+		mail_index_file_set_syscall_error(cache->index, temp_path,
+						  "fstat()");
+		i_close_fd(&fd);
+		i_unlink(temp_path);
+		return -1;
+	}
+
+	incr = i_new(struct mail_cache_compress_incr, 1);
+	incr->fd = fd;
+	incr->temp_path = i_strdup(temp_path);
+	incr->temp_ino = st.st_ino;
+	incr->old_file_seq = cache->hdr->file_seq;
+	incr->next_uid = 1;
+	incr->ctx = mail_cache_copy_init(cache,
+		mail_index_transaction_get_view(trans), fd);
+	cache->compress_incr = incr;
+
+	if ((cache->index->flags & MAIL_INDEX_OPEN_FLAG_DEBUG) != 0) {
+		i_debug("%s: Started incremental compression of file_seq %u",
+			cache->filepath, incr->old_file_seq);
+	}
+	return 1;
+}
+
+static int
+mail_cache_compress_incr_copy(struct mail_cache *cache,
+			      struct mail_index_transaction *trans)
+{
+	struct mail_cache_compress_incr *incr = cache->compress_incr;
+	struct mail_cache_copy_context *ctx = incr->ctx;
+	struct mail_cache_copy_record *rec;
+	struct mail_index_view *view;
+	struct mail_cache_view *cache_view;
+	uint32_t seq, seq1, seq2, first_new_seq, uid, old_offset;
+	bool last_chunk = TRUE;
+
+	view = mail_index_transaction_get_view(trans);
+	if (!mail_index_lookup_seq_range(view, incr->next_uid, (uint32_t)-1,
+					 &seq1, &seq2))
+		return 1;
+	if (seq2 - seq1 >= cache->compress_chunk_mail_count) {
+		seq2 = seq1 + cache->compress_chunk_mail_count - 1;
+		last_chunk = FALSE;
+	}
+
+	mail_cache_copy_fields_update(ctx);
+	cache_view = mail_cache_view_open(cache, view);
+	first_new_seq = mail_cache_get_first_new_seq(view);
+	for (seq = seq1; seq <= seq2; seq++) {
+		mail_index_lookup_uid(view, seq, &uid);
+		incr->next_uid = uid + 1;
+		if (mail_index_transaction_is_expunged(trans, seq))
+			continue;
+
+		old_offset = mail_cache_copy_get_old_offset(view, seq,
+							    incr->old_file_seq);
+		if (old_offset == 0)
+			continue;
+
+		rec = array_append_space(&ctx->records);
+		rec->uid = uid;
+		rec->old_offset = old_offset;
+		rec->offset = mail_cache_copy_message(ctx, cache_view, seq, uid,
+						      seq >= first_new_seq);
+	}
+	mail_cache_view_close(&cache_view);
+
+	if (o_stream_flush(ctx->output) < 0) {
+		mail_index_file_set_syscall_error(cache->index,
+						  incr->temp_path, "write()");
+		return -1;
+	}
+	return last_chunk ? 1 : 0;
+}
+
+int mail_cache_compress_step(struct mail_cache *cache,
+			     struct mail_index_transaction *trans,
+			     struct mail_cache_compress_lock **lock_r)
+{
+	struct timeval start_time;
+	int ret;
+
+	if (cache->compress_chunk_mail_count == 0 ||
+	    MAIL_INDEX_IS_IN_MEMORY(cache->index) || cache->index->readonly ||
+	    array_count(&cache->column_field_names) > 0) {
+		/* the columns need all the messages at once */
+		return mail_cache_compress(cache, trans, lock_r);
+	}
+
+	*lock_r = NULL;
+	if (cache->compress_incr != NULL &&
+	    !mail_cache_compress_incr_is_valid(cache))
+		mail_cache_compress_incr_abort(cache);
+
+	if (gettimeofday(&start_time, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	mail_cache_compress_disable_map_with_read(cache);
+
+	cache->compressing = TRUE;
+	if (cache->compress_incr != NULL)
+		ret = 1;
+	else if ((ret = mail_cache_compress_incr_start(cache, trans)) == 0 &&
+		 MAIL_CACHE_IS_UNUSABLE(cache)) {
+		/* nothing to copy, just create the file */
+		cache->compressing = FALSE;
+		return mail_cache_compress(cache, trans, lock_r);
+	}
+	if (ret > 0)
+		ret = mail_cache_compress_incr_copy(cache, trans);
+	cache->compressing = FALSE;
+	mail_cache_compress_update_stats(cache, &start_time, TRUE);
+
+	if (ret < 0) {
+		if (cache->compress_incr != NULL)
+			mail_cache_compress_incr_abort(cache);
+		return -1;
+	}
+	if (ret > 0 && cache->compress_incr != NULL) {
+		/* everything is copied. lock the cache and copy the
+		   messages that were changed meanwhile. */
+		return mail_cache_compress(cache, trans, lock_r);
+	}
+	*lock_r = i_new(struct mail_cache_compress_lock, 1);
+	return 0;
+}
+
 void mail_cache_compress_unlock(struct mail_cache_compress_lock **_lock)
 {
 	struct mail_cache_compress_lock *lock = *_lock;
@@ -571,6 +1600,18 @@ void mail_cache_compress_unlock(struct mail_cache_compress_lock **_lock)
 	i_free(lock);
 }
 
+void mail_cache_set_compress_chunk(struct mail_cache *cache,
+				   unsigned int mail_count)
+{
+	cache->compress_chunk_mail_count = mail_count;
+}
+
+void mail_cache_get_compress_stats(struct mail_cache *cache,
+				   struct mail_cache_compress_stats *stats_r)
+{
+	*stats_r = cache->compress_stats;
+}
+
 bool mail_cache_need_compress(struct mail_cache *cache)
 {
 	return cache->need_compress_file_seq != 0 &&
@@ -4,10 +4,13 @@
 #include "array.h"
 #include "buffer.h"
 #include "str.h"
+#include "mmap-util.h"
 #include "mail-cache-private.h"
 
 
 #define CACHE_PREFETCH IO_BLOCK_SIZE
+/* Don't prefetch more than this much when looking up a sequence range */
+#define CACHE_RANGE_PREFETCH_MAX_SIZE (8*1024*1024)
 
 int mail_cache_get_record(struct mail_cache *cache, uint32_t offset,
 			  const struct mail_cache_record **rec_r)
@@ -156,6 +159,18 @@ void mail_cache_lookup_iter_init(struct mail_cache_view *view, uint32_t seq,
 			ctx->stop = TRUE;
 			ctx->failed = ret < 0;
 		}
+		if (ret >= 0) {
+			/* the message may have fields only in columns */
+			ret = mail_cache_columns_lookup_row(view, seq,
+							    &ctx->column_row);
+			if (ret > 0) {
+				ctx->columns_count =
+					view->cache->columns_hdr.columns_count;
+			} else if (ret < 0) {
+				ctx->stop = TRUE;
+				ctx->failed = TRUE;
+			}
+		}
 	}
 	ctx->remap_counter = view->cache->remap_counter;
 
@@ -243,6 +258,14 @@ int mail_cache_lookup_iter_next(struct mail_cache_lookup_iterate_ctx *ctx,
 
 	i_assert(ctx->remap_counter == cache->remap_counter);
 
+	while (ctx->column_idx < ctx->columns_count) {
+		ret = mail_cache_column_get(cache, ctx->column_idx++,
+					    ctx->column_row, field_r);
+		ctx->remap_counter = cache->remap_counter;
+		if (ret != 0)
+			return ret;
+	}
+
 	if (ctx->pos + sizeof(uint32_t) > ctx->rec_size) {
 		if (ctx->pos != ctx->rec_size) {
 			mail_cache_set_corrupted(cache,
@@ -360,8 +383,15 @@ int mail_cache_field_exists(struct mail_cache_view *view, uint32_t seq,
 bool mail_cache_field_exists_any(struct mail_cache_view *view, uint32_t seq)
 {
 	uint32_t reset_id;
+	unsigned int row;
 
-	return mail_cache_lookup_cur_offset(view->view, seq, &reset_id) != 0;
+	if (mail_cache_lookup_cur_offset(view->view, seq, &reset_id) != 0)
+		return TRUE;
+
+	if (!view->cache->opened)
+		(void)mail_cache_open_and_verify(view->cache);
+	return !MAIL_CACHE_IS_UNUSABLE(view->cache) &&
+		mail_cache_columns_lookup_row(view, seq, &row) > 0;
 }
 
 enum mail_cache_decision_type
@@ -434,6 +464,136 @@ int mail_cache_lookup_field(struct mail_cache_view *view, buffer_t *dest_buf,
 	return ret;
 }
 
+static void
+mail_cache_lookup_range_prefetch(struct mail_cache_view *view,
+				 uint32_t seq1, uint32_t seq2)
+{
+	struct mail_cache *cache = view->cache;
+	uint32_t seq, offset, reset_id;
+	uint32_t min_offset = (uint32_t)-1, max_offset = 0;
+	size_t page_size, start, size;
+	const void *data;
+
+	for (seq = seq1; seq <= seq2; seq++) {
+		offset = mail_cache_lookup_cur_offset(view->view, seq,
+						      &reset_id);
+		if (offset == 0 || reset_id != cache->hdr->file_seq)
+			continue;
+		if (min_offset > offset)
+			min_offset = offset;
+		if (max_offset < offset)
+			max_offset = offset;
+	}
+	if (max_offset == 0)
+		return;
+
+	/* The records are usually small and appended in the same order as
+	   the messages, so the range between the first and the last record
+	   contains nearly all of the wanted data. Get it into memory with a
+	   single read instead of one read per record. Any errors are noticed
+	   by the lookups themselves. */
+	size = (size_t)(max_offset - min_offset) + CACHE_PREFETCH;
+	if (size > CACHE_RANGE_PREFETCH_MAX_SIZE)
+		return;
+	if (mail_cache_map(cache, min_offset, size, &data) <= 0)
+		return;
+	if (cache->mmap_base != NULL && min_offset < cache->mmap_length) {
+		page_size = mmap_get_page_size();
+		start = min_offset - min_offset % page_size;
+		if (size > cache->mmap_length - min_offset)
+			size = cache->mmap_length - min_offset;
+		size += min_offset - start;
+		(void)madvise(PTR_OFFSET(cache->mmap_base, start), size,
+			      MADV_WILLNEED);
+	}
+}
+
+int mail_cache_lookup_field_range(struct mail_cache_view *view,
+				  buffer_t *dest_buf,
+				  uint32_t seq1, uint32_t seq2,
+				  const unsigned int field_idxs[],
+				  unsigned int fields_count,
+				  struct mail_cache_lookup_value *values_r)
+{
+	struct mail_cache *cache = view->cache;
+	struct mail_cache_lookup_iterate_ctx iter;
+	struct mail_cache_iterate_field field;
+	const unsigned char *src;
+	unsigned char *dest;
+	unsigned int *field_pos, i, j, max_field = 0, values_count;
+	size_t *offsets;
+	uint32_t seq;
+	int ret = 0;
+
+	i_assert(seq1 > 0 && seq1 <= seq2);
+
+	values_count = (seq2 - seq1 + 1) * fields_count;
+	memset(values_r, 0, sizeof(*values_r) * values_count);
+	if (fields_count == 0)
+		return 0;
+
+	if (!cache->opened)
+		(void)mail_cache_open_and_verify(cache);
+
+	/* field_idx -> 1 + its position in field_idxs[] */
+	for (i = 0; i < fields_count; i++) {
+		if (field_idxs[i] > max_field)
+			max_field = field_idxs[i];
+	}
+	field_pos = i_new(unsigned int, max_field + 1);
+	for (i = 0; i < fields_count; i++)
+		field_pos[field_idxs[i]] = i + 1;
+	/* dest_buf may get reallocated, so remember the values' offsets in
+	   it until everything is looked up. 0 = not found. */
+	offsets = i_new(size_t, values_count);
+
+	if (!MAIL_CACHE_IS_UNUSABLE(cache))
+		mail_cache_lookup_range_prefetch(view, seq1, seq2);
+
+	for (seq = seq1; seq <= seq2 && ret >= 0; seq++) {
+		for (i = 0; i < fields_count; i++)
+			mail_cache_decision_state_update(view, seq, field_idxs[i]);
+
+		mail_cache_lookup_iter_init(view, seq, &iter);
+		while ((ret = mail_cache_lookup_iter_next(&iter, &field)) > 0) {
+			if (field.field_idx > max_field ||
+			    field_pos[field.field_idx] == 0)
+				continue;
+
+			i = (seq - seq1) * fields_count +
+				field_pos[field.field_idx] - 1;
+			if (offsets[i] == 0) {
+				offsets[i] = dest_buf->used + 1;
+				values_r[i].size = field.size;
+				buffer_append(dest_buf, field.data, field.size);
+			} else if (cache->fields[field.field_idx].field.type ==
+				   MAIL_CACHE_FIELD_BITMASK &&
+				   field.size == values_r[i].size) {
+				/* merge all bits */
+				src = field.data;
+				dest = buffer_get_space_unsafe(dest_buf,
+						offsets[i] - 1, field.size);
+				for (j = 0; j < field.size; j++)
+					dest[j] |= src[j];
+			} else {
+				/* duplicates are all identical */
+			}
+		}
+	}
+
+	if (ret >= 0) {
+		for (i = 0; i < values_count; i++) {
+			if (offsets[i] == 0)
+				continue;
+			values_r[i].data = CONST_PTR_OFFSET(dest_buf->data,
+							    offsets[i] - 1);
+		}
+	}
+	i_free(field_pos);
+	i_free(offsets);
+	return ret < 0 ? -1 : 0;
+}
+
 struct header_lookup_data {
 	uint32_t data_size;
 	const unsigned char *data;
@@ -456,31 +616,64 @@ enum {
 	HDR_FIELD_STATE_SEEN
 };
 
+bool mail_cache_header_value_parse(const void *data, size_t size,
+				   unsigned int *lines_count_r,
+				   const unsigned char **headers_r,
+				   size_t *headers_size_r)
+{
+	const uint32_t *lines = data;
+	unsigned int i;
+
+	/* data = { line_nums[], 0, "headers" } */
+	for (i = 0; size >= sizeof(uint32_t); i++) {
+		size -= sizeof(uint32_t);
+		if (lines[i] == 0) {
+			*lines_count_r = i;
+			*headers_r = CONST_PTR_OFFSET(data,
+						      (i+1) * sizeof(uint32_t));
+			*headers_size_r = size;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+size_t mail_cache_header_line_size(const unsigned char *headers, size_t size)
+{
+	const unsigned char *p, *end = headers + size;
+
+	/* find the end of the (multiline) header */
+	for (p = headers; p != end; p++) {
+		if (*p == '\n' &&
+		    (p+1 == end || (p[1] != ' ' && p[1] != '\t'))) {
+			p++;
+			break;
+		}
+	}
+	return (size_t)(p - headers);
+}
+
 static void header_lines_save(struct header_lookup_context *ctx,
 			      const struct mail_cache_iterate_field *field)
 {
 	const uint32_t *lines = field->data;
-	uint32_t data_size = field->size;
 	struct header_lookup_line hdr_line;
         struct header_lookup_data *hdr_data;
+	const unsigned char *headers;
 	void *data_dup;
-	unsigned int i, lines_count, pos;
+	unsigned int i, lines_count;
+	size_t data_size;
 
-	/* data = { line_nums[], 0, "headers" } */
-	for (i = 0; data_size >= sizeof(uint32_t); i++) {
-		data_size -= sizeof(uint32_t);
-		if (lines[i] == 0)
-			break;
-	}
-	lines_count = i;
-	pos = (lines_count+1) * sizeof(uint32_t);
+	if (!mail_cache_header_value_parse(field->data, field->size,
+					   &lines_count, &headers, &data_size))
+		return;
 
 	hdr_data = p_new(ctx->pool, struct header_lookup_data, 1);
 	hdr_data->data_size = data_size;
 	if (data_size > 0) {
 		hdr_data->data = data_dup =
 			p_malloc(ctx->pool, data_size);
-		memcpy(data_dup, CONST_PTR_OFFSET(field->data, pos), data_size);
+		memcpy(data_dup, headers, data_size);
 	}
 
 	for (i = 0; i < lines_count; i++) {
@@ -506,7 +699,6 @@ mail_cache_lookup_headers_real(struct mail_cache_view *view, string_t *dest,
 	struct mail_cache_iterate_field field;
 	struct header_lookup_context ctx;
 	struct header_lookup_line *lines;
-	const unsigned char *p, *start, *end;
 	uint8_t *field_state;
 	unsigned int i, count, max_field = 0;
 	size_t hdr_size;
@@ -573,19 +765,9 @@ mail_cache_lookup_headers_real(struct mail_cache_view *view, string_t *dest,
 
 	/* then start filling dest buffer from the headers */
 	for (i = 0; i < count; i++) {
-		start = lines[i].data->data;
-		end = start + lines[i].data->data_size;
-
-		/* find the end of the (multiline) header */
-		for (p = start; p != end; p++) {
-			if (*p == '\n' &&
-			    (p+1 == end || (p[1] != ' ' && p[1] != '\t'))) {
-				p++;
-				break;
-			}
-		}
-		hdr_size = (size_t)(p - start);
-		buffer_append(dest, start, hdr_size);
+		hdr_size = mail_cache_header_line_size(lines[i].data->data,
+						       lines[i].data->data_size);
+		buffer_append(dest, lines[i].data->data, hdr_size);
 
 		/* if there are more lines for this header, the following lines
 		   continue after this one. so skip this line. */
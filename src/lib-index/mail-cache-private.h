@@ -25,6 +25,10 @@
    the latest cache header. */
 #define MAIL_CACHE_HEADER_FIELD_CONTINUE_COUNT 4
 
+/* Incremental compression's temporary file is treated as abandoned if it
+   hasn't been modified for this many seconds. */
+#define MAIL_CACHE_COMPRESS_INCR_STALE_SECS (60*10)
+
 /* If cache record becomes larger than this, don't add it. */
 #define MAIL_CACHE_RECORD_MAX_SIZE (64*1024)
 
@@ -34,13 +38,18 @@
 #define MAIL_CACHE_IS_UNUSABLE(cache) \
 	((cache)->hdr == NULL)
 
+enum mail_cache_header_flags {
+	/* struct mail_cache_column_header follows the file header */
+	MAIL_CACHE_HEADER_FLAG_COLUMNS	= 0x01
+};
+
 struct mail_cache_header {
 	/* version is increased only when you can't have backwards
 	   compatibility. */
 	uint8_t major_version;
 	uint8_t compat_sizeof_uoff_t;
 	uint8_t minor_version;
-	uint8_t unused;
+	uint8_t flags; /* enum mail_cache_header_flags */
 
 	uint32_t indexid;
 	uint32_t file_seq;
@@ -87,6 +96,31 @@ struct mail_cache_header_fields {
 #define MAIL_CACHE_FIELD_NAMES(count) \
 	(MAIL_CACHE_FIELD_DECISION(count) + sizeof(uint8_t) * (count))
 
+/* Column group written by compression for the fields configured with
+   mail_cache_set_column_fields(). Each column contains one field's values for
+   the messages that had any column data at compression time, ordered by UID.
+   The fields aren't duplicated in the message records. Columns are never
+   modified after compression, so newly added values go to the records as
+   usual. Old versions ignore the columns. */
+struct mail_cache_column_header {
+	uint32_t messages_count;
+	uint32_t columns_count;
+	/* uint32_t uids[messages_count] */
+	uint32_t uids_offset;
+	/* struct mail_cache_column columns[columns_count]; */
+};
+
+struct mail_cache_column {
+	uint32_t file_field;
+	/* (uint32_t)-1 for variable sized fields */
+	uint32_t field_size;
+	/* bitmap of messages having this field */
+	uint32_t exists_offset;
+	/* fixed size fields: values[messages_count]
+	   variable size fields: uint32_t ends[messages_count] + data */
+	uint32_t data_offset;
+};
+
 struct mail_cache_record {
 	uint32_t prev_offset;
 	uint32_t size; /* full record size, including this header */
@@ -104,6 +138,14 @@ struct mail_cache_field_private {
 	bool decision_dirty:1;
 };
 
+/* In-memory copy of a column's lookup metadata */
+struct mail_cache_column_meta {
+	/* bitmap of messages having this field */
+	uint8_t *exists;
+	/* ends[messages_count] for variable sized fields, NULL otherwise */
+	uint32_t *ends;
+};
+
 struct mail_cache {
 	struct mail_index *index;
 	uint32_t ext_id;
@@ -154,6 +196,26 @@ struct mail_cache {
 	unsigned int *file_field_map;
 	unsigned int file_fields_count;
 
+	/* max number of messages copied per incremental compression step,
+	   0 = compress the whole file at once */
+	unsigned int compress_chunk_mail_count;
+	/* incremental compression in progress */
+	struct mail_cache_compress_incr *compress_incr;
+	struct mail_cache_compress_stats compress_stats;
+
+	/* fields that compression writes into columns */
+	ARRAY(char *) column_field_names;
+	/* columns in the currently open file, read by
+	   mail_cache_columns_read() */
+	struct mail_cache_column_header columns_hdr;
+	struct mail_cache_column *columns;
+	/* copy of the columns' UIDs (columns_hdr.messages_count), read on
+	   the first row lookup */
+	uint32_t *column_uids;
+	/* copies of each column's exists bitmap and ends array, read on the
+	   column's first lookup */
+	struct mail_cache_column_meta *column_metas;
+
 	bool opened:1;
 	bool locked:1;
 	bool last_lock_failed:1;
@@ -161,6 +223,7 @@ struct mail_cache {
 	bool field_header_write_pending:1;
 	bool compressing:1;
 	bool map_with_read:1;
+	bool columns_read:1;
 };
 
 struct mail_cache_loop_track {
@@ -206,6 +269,9 @@ struct mail_cache_lookup_iterate_ctx {
 
 	unsigned int trans_next_idx;
 
+	/* column group row for this message */
+	unsigned int column_row, column_idx, columns_count;
+
 	bool stop:1;
 	bool failed:1;
 	bool memory_appends_checked:1;
@@ -253,6 +319,28 @@ mail_cache_transaction_lookup_rec(struct mail_cache_transaction_ctx *ctx,
 				  unsigned int seq,
 				  unsigned int *trans_next_idx);
 
+/* Read the column group descriptors if they haven't been read yet for the
+   currently open file. Returns 0 if ok, -1 if error/corrupted. */
+int mail_cache_columns_read(struct mail_cache *cache);
+void mail_cache_columns_free(struct mail_cache *cache);
+/* Find the message's row in the column group. Returns 1 if found, 0 if the
+   message doesn't exist in columns, -1 if error. */
+int mail_cache_columns_lookup_row(struct mail_cache_view *view, uint32_t seq,
+				  unsigned int *row_r);
+/* Get the column's value for the row. Returns 1 if found, 0 if the message
+   doesn't have a value in this column, -1 if error. */
+int mail_cache_column_get(struct mail_cache *cache, unsigned int column_idx,
+			  unsigned int row,
+			  struct mail_cache_iterate_field *field_r);
+
+/* Abort the incremental compression in progress and delete its temporary
+   file. */
+void mail_cache_compress_incr_abort(struct mail_cache *cache);
+/* Save the incremental compression's progress to a state file, so the next
+   process opening the cache can continue it. If saving fails, the
+   compression is aborted. */
+void mail_cache_compress_incr_save(struct mail_cache *cache);
+
 int mail_cache_map(struct mail_cache *cache, size_t offset, size_t size,
 		   const void **data_r);
 void mail_cache_file_close(struct mail_cache *cache);
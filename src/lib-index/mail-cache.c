@@ -68,6 +68,7 @@ void mail_cache_file_close(struct mail_cache *cache)
 	cache->hdr = NULL;
 	cache->mmap_length = 0;
 	cache->last_field_header_offset = 0;
+	mail_cache_columns_free(cache);
 
 	if (cache->file_lock != NULL)
 		file_lock_free(&cache->file_lock);
@@ -523,6 +524,7 @@ static struct mail_cache *mail_cache_alloc(struct mail_index *index)
 	cache->field_pool = pool_alloconly_create("Cache fields", 2048);
 	hash_table_create(&cache->field_name_hash, cache->field_pool, 0,
 			  strcase_hash, strcasecmp);
+	i_array_init(&cache->column_field_names, 8);
 
 	cache->dotlock_settings.use_excl_lock =
 		(index->flags & MAIL_INDEX_OPEN_FLAG_DOTLOCK_USE_EXCL) != 0;
@@ -557,18 +559,24 @@ struct mail_cache *mail_cache_open_or_create(struct mail_index *index)
 void mail_cache_free(struct mail_cache **_cache)
 {
 	struct mail_cache *cache = *_cache;
+	char **namep;
 
 	*_cache = NULL;
 	if (cache->file_cache != NULL)
 		file_cache_free(&cache->file_cache);
 
 	mail_index_unregister_expunge_handler(cache->index, cache->ext_id);
+	if (cache->compress_incr != NULL)
+		mail_cache_compress_incr_save(cache);
 	mail_cache_file_close(cache);
 
 	if (cache->read_buf != NULL)
 		buffer_free(&cache->read_buf);
 	hash_table_destroy(&cache->field_name_hash);
 	pool_unref(&cache->field_pool);
+	array_foreach_modifiable(&cache->column_field_names, namep)
+		i_free(*namep);
+	array_free(&cache->column_field_names);
 	i_free(cache->field_file_map);
 	i_free(cache->file_field_map);
 	i_free(cache->fields);
@@ -43,6 +43,24 @@ struct mail_cache_field {
 	time_t last_used;
 };
 
+struct mail_cache_lookup_value {
+	/* NULL if the field wasn't found */
+	const void *data;
+	unsigned int size;
+};
+
+struct mail_cache_compress_stats {
+	/* Number of cache file compressions */
+	unsigned int compress_count;
+	/* Number of incremental compression steps */
+	unsigned int step_count;
+	/* How long the cache was locked by the last compression, by the
+	   longest compression and by all of them in total */
+	unsigned long long last_lock_usecs, max_lock_usecs, total_lock_usecs;
+	/* Time spent in incremental compression steps without a lock */
+	unsigned long long total_step_usecs;
+};
+
 struct mail_cache *mail_cache_open_or_create(struct mail_index *index);
 void mail_cache_free(struct mail_cache **cache);
 
@@ -63,6 +81,19 @@ struct mail_cache_field *
 mail_cache_register_get_list(struct mail_cache *cache, pool_t pool,
 			     unsigned int *count_r);
 
+/* Set the fields that cache compression writes into per-field columns
+   instead of the message records. This makes it faster to look up the same
+   field for many messages. */
+void mail_cache_set_column_fields(struct mail_cache *cache,
+				  const char *const *field_names);
+
+/* Compress the cache incrementally by copying at most mail_count messages
+   per mail_cache_compress_step() call. The cache is locked only while the
+   messages changed since the previous step are copied at the end.
+   0 (default) compresses the whole file at once. */
+void mail_cache_set_compress_chunk(struct mail_cache *cache,
+				   unsigned int mail_count);
+
 /* Returns TRUE if cache should be compressed. */
 bool mail_cache_need_compress(struct mail_cache *cache);
 /* Compress cache file. Offsets are updated to given transaction. The cache
@@ -73,7 +104,17 @@ bool mail_cache_need_compress(struct mail_cache *cache);
 int mail_cache_compress(struct mail_cache *cache,
 			struct mail_index_transaction *trans,
 			struct mail_cache_compress_lock **lock_r);
+/* Like mail_cache_compress(), but if incremental compression is enabled only
+   copy the next chunk of messages to the new cache file without locking the
+   cache. The new file replaces the old one with mail_cache_compress() after
+   all the messages have been copied. */
+int mail_cache_compress_step(struct mail_cache *cache,
+			     struct mail_index_transaction *trans,
+			     struct mail_cache_compress_lock **lock_r);
 void mail_cache_compress_unlock(struct mail_cache_compress_lock **lock);
+/* Returns statistics of the compressions done by this process. */
+void mail_cache_get_compress_stats(struct mail_cache *cache,
+				   struct mail_cache_compress_stats *stats_r);
 /* Returns TRUE if there is at least something in the cache. */
 bool mail_cache_exists(struct mail_cache *cache);
 /* Open and read cache header. Returns 0 if ok, -1 if error/corrupted. */
@@ -130,11 +171,35 @@ mail_cache_field_get_decision(struct mail_cache *cache, unsigned int field_idx);
 int mail_cache_lookup_field(struct mail_cache_view *view, buffer_t *dest_buf,
 			    uint32_t seq, unsigned int field_idx);
 
+/* Look up the given fields for all the messages in seq1..seq2 with a single
+   pass through each message's cache records. The area of the cache file
+   containing the records is prefetched first. values_r must have space for
+   (seq2-seq1+1)*fields_count values. The value of field_idxs[i] for seq is
+   written to values_r[(seq-seq1)*fields_count + i], with data=NULL if it
+   wasn't found. The values point to data appended to dest_buf, so they're
+   valid until dest_buf is modified. Returns 0 if ok, -1 if error. */
+int mail_cache_lookup_field_range(struct mail_cache_view *view,
+				  buffer_t *dest_buf,
+				  uint32_t seq1, uint32_t seq2,
+				  const unsigned int field_idxs[],
+				  unsigned int fields_count,
+				  struct mail_cache_lookup_value *values_r);
+
 /* Return specified cached headers. Returns 1 if all fields were found,
    0 if not, -1 if error. dest is updated only if all fields were found. */
 int mail_cache_lookup_headers(struct mail_cache_view *view, string_t *dest,
 			      uint32_t seq, unsigned int field_idxs[],
 			      unsigned int fields_count);
+/* Parse a cached header field's value: the line numbers of the header's
+   instances followed by the "Name: value\n" lines. Returns FALSE if the
+   value is broken. */
+bool mail_cache_header_value_parse(const void *data, size_t size,
+				   unsigned int *lines_count_r,
+				   const unsigned char **headers_r,
+				   size_t *headers_size_r);
+/* Returns the size of the first (multiline) header in the headers returned
+   by mail_cache_header_value_parse(), including its trailing LF. */
+size_t mail_cache_header_line_size(const unsigned char *headers, size_t size);
 
 /* "Error in index cache file %s: ...". */
 void mail_cache_set_corrupted(struct mail_cache *cache, const char *fmt, ...)
@@ -5,6 +5,8 @@
 #include "module-context.h"
 #include "eacces-error.h"
 #include "mail-index-private.h"
+#include "mail-cache-private.h"
+#include "mail-transaction-log-private.h"
 #include "mail-index-alloc-cache.h"
 
 #define MAIL_INDEX_ALLOC_CACHE_CONTEXT(obj) \
@@ -21,6 +23,7 @@ struct mail_index_alloc_cache_list {
 
 	struct mail_index *index;
 	char *mailbox_path;
+	char *owner;
 	int refcount;
 	bool referenced;
 
@@ -32,12 +35,31 @@ struct mail_index_alloc_cache_list {
 
 static MODULE_CONTEXT_DEFINE_INIT(mail_index_alloc_cache_index_module,
 				  &mail_index_module_register);
+/* sorted by the last use, most recently used first */
 static struct mail_index_alloc_cache_list *indexes = NULL;
 static unsigned int indexes_cache_references_count = 0;
 static struct timeout *to_index = NULL;
 
+static struct mail_index_alloc_cache_settings cache_set = {
+	.max_count = INDEX_CACHE_MAX,
+	.timeout_secs = INDEX_CACHE_TIMEOUT,
+};
+static struct mail_index_alloc_cache_stats cache_stats;
+
+static void mail_index_alloc_cache_evict(struct mail_index_alloc_cache_list *keep);
+
+static void
+mail_index_alloc_cache_set_owner(struct mail_index_alloc_cache_list *list,
+				 const char *owner)
+{
+	if (null_strcmp(list->owner, owner) != 0) {
+		i_free(list->owner);
+		list->owner = i_strdup(owner);
+	}
+}
+
 static struct mail_index_alloc_cache_list *
-mail_index_alloc_cache_add(struct mail_index *index,
+mail_index_alloc_cache_add(struct mail_index *index, const char *owner,
 			   const char *mailbox_path, struct stat *st)
 {
 	struct mail_index_alloc_cache_list *list;
@@ -46,6 +68,7 @@ mail_index_alloc_cache_add(struct mail_index *index,
 	list->refcount = 1;
 	list->index = index;
 
+	list->owner = i_strdup(owner);
 	list->mailbox_path = i_strdup(mailbox_path);
 	list->index_dir_dev = st->st_dev;
 	list->index_dir_ino = st->st_ino;
@@ -76,26 +99,61 @@ mail_index_alloc_cache_list_free(struct mail_index_alloc_cache_list *list)
 	if (list->referenced)
 		mail_index_alloc_cache_list_unref(list);
 	mail_index_free(&list->index);
+	i_free(list->owner);
 	i_free(list->mailbox_path);
 	i_free(list);
 }
 
+static void
+mail_index_alloc_cache_move_to_head(struct mail_index_alloc_cache_list *list)
+{
+	struct mail_index_alloc_cache_list **listp;
+
+	for (listp = &indexes; *listp != list; listp = &(*listp)->next)
+		i_assert(*listp != NULL);
+	*listp = list->next;
+	list->next = indexes;
+	indexes = list;
+}
+
+static uoff_t mail_index_alloc_cache_get_size(struct mail_index *index)
+{
+	struct mail_index_map *map = index->map;
+	struct mail_cache *cache = index->cache;
+	struct mail_transaction_log_file *file;
+	uoff_t size = 0;
+
+	if (map != NULL) {
+		size += map->hdr_copy_buf->used;
+		if (map->rec_map->mmap_base != NULL)
+			size += map->rec_map->mmap_size;
+		else if (map->rec_map->buffer != NULL)
+			size += map->rec_map->buffer->used;
+	}
+	if (cache != NULL) {
+		if (cache->read_buf != NULL)
+			size += cache->read_buf->used;
+		else
+			size += cache->mmap_length;
+	}
+	if (index->log != NULL && (file = index->log->head) != NULL) {
+		if (file->mmap_base != NULL)
+			size += file->mmap_size;
+		else if (file->buffer != NULL)
+			size += file->buffer->used;
+	}
+	return size;
+}
+
 static struct mail_index_alloc_cache_list *
 mail_index_alloc_cache_find(const char *mailbox_path, const char *index_dir,
 			    const struct stat *index_st)
 {
-	struct mail_index_alloc_cache_list **indexp, *rec, *match;
-	unsigned int destroy_count;
+	struct mail_index_alloc_cache_list *rec;
 	struct stat st;
 
-	destroy_count = 0; match = NULL;
-	for (indexp = &indexes; *indexp != NULL;) {
-		rec = *indexp;
-
-		if (match != NULL) {
-			/* already found the index. we're just going through
-			   the rest of them to drop 0 refcounts */
-		} else if (rec->refcount == 0 && rec->index->open_count == 0) {
+	for (rec = indexes; rec != NULL; rec = rec->next) {
+		if (rec->refcount == 0 && rec->index->open_count == 0) {
 			/* index is already closed. don't even try to
 			   reuse it. */
 		} else if (index_dir != NULL && rec->index_dir_ino != 0) {
@@ -109,32 +167,19 @@ mail_index_alloc_cache_find(const char *mailbox_path, const char *index_dir,
 				    !CMP_DEV_T(st.st_dev, index_st->st_dev))
 					rec->destroy_time = 0;
 				else
-					match = rec;
+					return rec;
 			}
 		} else if (mailbox_path != NULL && rec->mailbox_path != NULL &&
 			   index_dir == NULL && rec->index_dir_ino == 0) {
 			if (strcmp(mailbox_path, rec->mailbox_path) == 0)
-				match = rec;
+				return rec;
 		}
-
-		if (rec->refcount == 0 && rec != match) {
-			if (rec->destroy_time <= ioloop_time ||
-			    destroy_count >= INDEX_CACHE_MAX) {
-				*indexp = rec->next;
-				mail_index_alloc_cache_list_free(rec);
-				continue;
-			} else {
-				destroy_count++;
-			}
-		}
-
-                indexp = &(*indexp)->next;
 	}
-	return match;
+	return NULL;
 }
 
 struct mail_index *
-mail_index_alloc_cache_get(const char *mailbox_path,
+mail_index_alloc_cache_get(const char *owner, const char *mailbox_path,
 			   const char *index_dir, const char *prefix)
 {
 	struct mail_index_alloc_cache_list *match;
@@ -159,14 +204,95 @@ mail_index_alloc_cache_get(const char *mailbox_path,
 	match = mail_index_alloc_cache_find(mailbox_path, index_dir, &st);
 	if (match == NULL) {
 		struct mail_index *index = mail_index_alloc(index_dir, prefix);
-		match = mail_index_alloc_cache_add(index, mailbox_path, &st);
+		match = mail_index_alloc_cache_add(index, owner, mailbox_path,
+						   &st);
+		cache_stats.misses++;
 	} else {
 		match->refcount++;
+		mail_index_alloc_cache_set_owner(match, owner);
+		mail_index_alloc_cache_move_to_head(match);
+		if (match->refcount == 1)
+			cache_stats.hits++;
 	}
+	/* drop the expired and closed indexes */
+	mail_index_alloc_cache_evict(match);
 	i_assert(match->index != NULL);
 	return match->index;
 }
 
+static unsigned int
+mail_index_alloc_cache_owner_count(struct mail_index_alloc_cache_list *list)
+{
+	struct mail_index_alloc_cache_list *rec;
+	unsigned int count = 0;
+
+	/* count the more recently used indexes kept for the same owner */
+	for (rec = indexes; rec != list; rec = rec->next) {
+		if (rec->referenced && rec->index->open_count == 1 &&
+		    null_strcmp(rec->owner, list->owner) == 0)
+			count++;
+	}
+	return count;
+}
+
+static bool
+mail_index_alloc_cache_want_keep(struct mail_index_alloc_cache_list *rec,
+				 unsigned int count, uoff_t size)
+{
+	if (rec->refcount == 0 && rec->destroy_time <= ioloop_time)
+		return FALSE;
+
+	if (count >= cache_set.max_count ||
+	    (cache_set.max_size != 0 && size > cache_set.max_size) ||
+	    (cache_set.max_owner_count != 0 &&
+	     mail_index_alloc_cache_owner_count(rec) >=
+	     cache_set.max_owner_count)) {
+		cache_stats.evictions++;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static void mail_index_alloc_cache_evict(struct mail_index_alloc_cache_list *keep)
+{
+	struct mail_index_alloc_cache_list **list, *rec;
+	unsigned int count = 0;
+	uoff_t size = 0;
+
+	for (list = &indexes; *list != NULL;) {
+		rec = *list;
+
+		if (rec == keep) {
+			/* being opened or closed right now */
+		} else if (rec->refcount == 0 && rec->index->open_count == 0) {
+			/* closed already, nothing to keep */
+			*list = rec->next;
+			mail_index_alloc_cache_list_free(rec);
+			continue;
+		} else if (rec->referenced && rec->index->open_count == 1) {
+			/* only we are keeping this index open */
+			size += mail_index_alloc_cache_get_size(rec->index);
+			if (!mail_index_alloc_cache_want_keep(rec, count, size)) {
+				size -= mail_index_alloc_cache_get_size(rec->index);
+				mail_index_alloc_cache_list_unref(rec);
+				if (rec->refcount == 0) {
+					*list = rec->next;
+					mail_index_alloc_cache_list_free(rec);
+					continue;
+				}
+			} else {
+				count++;
+			}
+		}
+		list = &(*list)->next;
+	}
+	cache_stats.cached_count = count;
+	cache_stats.cached_size = size;
+
+	if (count == 0 && to_index != NULL)
+		timeout_remove(&to_index);
+}
+
 static bool destroy_unrefed(unsigned int min_destroy_count)
 {
 	struct mail_index_alloc_cache_list **list, *rec;
@@ -208,7 +334,7 @@ static bool destroy_unrefed(unsigned int min_destroy_count)
 static void ATTR_NULL(1)
 index_removal_timeout(void *context ATTR_UNUSED)
 {
-	destroy_unrefed(0);
+	mail_index_alloc_cache_evict(NULL);
 }
 
 void mail_index_alloc_cache_unref(struct mail_index **_index)
@@ -229,14 +355,18 @@ void mail_index_alloc_cache_unref(struct mail_index **_index)
 	i_assert(list->refcount > 0);
 
 	list->refcount--;
-	list->destroy_time = ioloop_time + INDEX_CACHE_TIMEOUT;
+	list->destroy_time = ioloop_time + cache_set.timeout_secs;
 
 	if (list->refcount == 0 && index->open_count == 0) {
 		/* index was already closed. don't even try to cache it. */
 		*listp = list->next;
 		mail_index_alloc_cache_list_free(list);
-	} else if (to_index == NULL) {
-		to_index = timeout_add(INDEX_CACHE_TIMEOUT*1000/2,
+		return;
+	}
+	mail_index_alloc_cache_move_to_head(list);
+	mail_index_alloc_cache_evict(NULL);
+	if (to_index == NULL && cache_stats.cached_count > 0) {
+		to_index = timeout_add(I_MAX(cache_set.timeout_secs, 2)*1000/2,
 				       index_removal_timeout, (void *)NULL);
 	}
 }
@@ -244,6 +374,28 @@ void mail_index_alloc_cache_unref(struct mail_index **_index)
 void mail_index_alloc_cache_destroy_unrefed(void)
 {
 	destroy_unrefed(UINT_MAX);
+	/* nothing is kept cached anymore */
+	cache_stats.cached_count = 0;
+	cache_stats.cached_size = 0;
+}
+
+void mail_index_alloc_cache_evict_unused(void)
+{
+	mail_index_alloc_cache_evict(NULL);
+	if (to_index != NULL)
+		timeout_remove(&to_index);
+}
+
+void mail_index_alloc_cache_set_settings(
+	const struct mail_index_alloc_cache_settings *set)
+{
+	cache_set = *set;
+	mail_index_alloc_cache_evict(NULL);
+}
+
+void mail_index_alloc_cache_get_stats(struct mail_index_alloc_cache_stats *stats_r)
+{
+	*stats_r = cache_stats;
 }
 
 void mail_index_alloc_cache_index_opened(struct mail_index *index)
@@ -275,14 +427,15 @@ void mail_index_alloc_cache_index_closing(struct mail_index *index)
 		/* we're closing our referenced index */
 		return;
 	}
-	while (indexes_cache_references_count > INDEX_CACHE_MAX) {
-		if (!destroy_unrefed(1)) {
-			/* our cache is full already, don't keep more */
-			return;
-		}
+	if (cache_set.max_count == 0) {
+		/* caching is disabled */
+		return;
 	}
-	/* keep the index referenced for caching */
+	/* keep the index referenced for caching. the least recently used
+	   indexes are dropped if this goes over the limits. */
 	indexes_cache_references_count++;
 	list->referenced = TRUE;
 	index->open_count++;
+	mail_index_alloc_cache_move_to_head(list);
+	mail_index_alloc_cache_evict(list);
 }
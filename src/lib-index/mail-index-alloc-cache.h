@@ -1,13 +1,46 @@
 #ifndef MAIL_INDEX_ALLOC_CACHE_H
 #define MAIL_INDEX_ALLOC_CACHE_H
 
-/* If using in-memory indexes, give index_dir=NULL. */
-struct mail_index * ATTR_NULL(1, 2)
-mail_index_alloc_cache_get(const char *mailbox_path,
+struct mail_index_alloc_cache_settings {
+	/* Maximum number of closed indexes to keep open for reuse */
+	unsigned int max_count;
+	/* Maximum memory used by the kept indexes (0 = unlimited). The size
+	   includes the index maps, cache files and transaction logs. */
+	uoff_t max_size;
+	/* Maximum number of kept indexes for a single owner (0 = unlimited) */
+	unsigned int max_owner_count;
+	/* How many seconds to keep an unused index open */
+	unsigned int timeout_secs;
+};
+
+struct mail_index_alloc_cache_stats {
+	/* Number of times an unused index was found/not found from cache */
+	unsigned int hits, misses;
+	/* Number of indexes closed to stay within the limits */
+	unsigned int evictions;
+	/* Number and size of the currently kept indexes */
+	unsigned int cached_count;
+	uoff_t cached_size;
+};
+
+/* If using in-memory indexes, give index_dir=NULL. The owner is used for
+   the per-owner limits (usually the username). */
+struct mail_index * ATTR_NULL(1, 2, 3)
+mail_index_alloc_cache_get(const char *owner, const char *mailbox_path,
 			   const char *index_dir, const char *prefix);
 void mail_index_alloc_cache_unref(struct mail_index **index);
 
 void mail_index_alloc_cache_destroy_unrefed(void);
+/* Close the unused indexes that are expired or over the limits, but keep
+   the rest open without a timeout. This is useful when the current user's
+   session ends, but the process may be reused for another session. */
+void mail_index_alloc_cache_evict_unused(void);
+
+/* Change the limits for keeping closed indexes open. The least recently used
+   indexes are closed first when the limits are reached. */
+void mail_index_alloc_cache_set_settings(
+	const struct mail_index_alloc_cache_settings *set);
+void mail_index_alloc_cache_get_stats(struct mail_index_alloc_cache_stats *stats_r);
 
 /* internal: */
 void mail_index_alloc_cache_index_opened(struct mail_index *index);
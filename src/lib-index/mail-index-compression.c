@@ -0,0 +1,92 @@
+/* Copyright (c) 2017 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "buffer.h"
+#include "istream.h"
+#include "ostream.h"
+#include "mail-index-private.h"
+
+static const struct mail_index_compression *index_compression = NULL;
+
+void mail_index_register_compression(const struct mail_index_compression *compression)
+{
+	i_assert(index_compression == NULL);
+	index_compression = compression;
+}
+
+void mail_index_unregister_compression(const struct mail_index_compression *compression)
+{
+	i_assert(index_compression == compression);
+	index_compression = NULL;
+}
+
+void mail_index_set_compression(struct mail_index *index,
+				const char *handler, int level)
+{
+	i_free(index->compression_handler);
+	index->compression_handler = handler == NULL || handler[0] == '\0' ?
+		NULL : i_strdup(handler);
+	index->compression_level = level;
+}
+
+bool mail_index_want_compression(struct mail_index *index)
+{
+	return index->compression_handler != NULL &&
+		index_compression != NULL;
+}
+
+struct ostream *
+mail_index_compression_create_ostream(struct mail_index *index,
+				      struct ostream *output)
+{
+	i_assert(mail_index_want_compression(index));
+
+	return index_compression->create_ostream(output,
+						 index->compression_handler,
+						 index->compression_level);
+}
+
+int mail_index_read_compressed(struct mail_index *index, const char *path,
+			       int fd, uoff_t offset, buffer_t *dest)
+{
+	struct istream *file_input, *input;
+	const unsigned char *data;
+	size_t size;
+	int ret = 1;
+
+	if (index_compression == NULL) {
+		/* not corrupted - don't let the caller recreate the file */
+		mail_index_set_error(index, "%s is compressed, "
+			"but compression support isn't loaded", path);
+		return -1;
+	}
+
+	file_input = i_stream_create_fd(fd, IO_BLOCK_SIZE);
+	i_stream_set_name(file_input, path);
+	i_stream_seek(file_input, offset);
+	input = index_compression->create_istream(file_input);
+	i_stream_unref(&file_input);
+	if (input == NULL) {
+		mail_index_set_error(index, "Corrupted file %s: "
+				     "Unknown compression format", path);
+		return 0;
+	}
+
+	while (i_stream_read_more(input, &data, &size) > 0) {
+		buffer_append(dest, data, size);
+		i_stream_skip(input, size);
+	}
+	if (input->stream_errno != 0) {
+		if (input->stream_errno == EINVAL) {
+			mail_index_set_error(index, "Corrupted file %s: %s",
+				path, i_stream_get_error(input));
+			ret = 0;
+		} else {
+			errno = input->stream_errno;
+			mail_index_file_set_syscall_error(index, path, "read()");
+			ret = -1;
+		}
+	}
+	i_stream_unref(&input);
+	return ret;
+}
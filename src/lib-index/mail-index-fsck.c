@@ -101,7 +101,7 @@ mail_index_fsck_find_keyword_count(struct mail_index_map *map,
 	kw_pos = ext_hdr->record_offset;
 	kw_size = ext_hdr->record_size;
 
-	rec = map->rec_map->records;
+	rec = MAIL_INDEX_MAP_RECORDS(map);
 	for (r = 0; r < map->rec_map->records_count; r++) {
 		kw = CONST_PTR_OFFSET(rec, kw_pos);
 		for (i = cur = 0; i < kw_size; i++) {
@@ -339,7 +339,7 @@ mail_index_fsck_records(struct mail_index *index, struct mail_index_map *map,
 	hdr->first_unseen_uid_lowwater = 0;
 	hdr->first_deleted_uid_lowwater = 0;
 
-	rec = map->rec_map->records; last_uid = 0;
+	rec = MAIL_INDEX_MAP_RECORDS(map); last_uid = 0;
 	for (i = 0; i < map->rec_map->records_count; ) {
 		next_rec = PTR_OFFSET(rec, hdr->record_size);
 		if (rec->uid <= last_uid) {
@@ -363,6 +363,7 @@ mail_index_fsck_records(struct mail_index *index, struct mail_index_map *map,
 			memmove(rec, next_rec, hdr->record_size *
 				(map->rec_map->records_count - i - 1));
 			map->rec_map->records_count--;
+			mail_index_record_map_truncate_uid_lookup(map->rec_map, i);
 			records_dropped = TRUE;
 			continue;
 		}
@@ -445,6 +446,12 @@ int mail_index_fsck(struct mail_index *index)
 	uint32_t file_seq;
 	uoff_t file_offset;
 
+	if ((index->map->hdr.flags & MAIL_INDEX_HDR_FLAG_CORRUPTED) != 0) {
+		/* the records couldn't be read. fscking would write them
+		   back as zeros, reopening the index fixes this instead. */
+		return -1;
+	}
+
 	i_warning("fscking index file %s", index->filepath);
 
 	index->fscked = TRUE;
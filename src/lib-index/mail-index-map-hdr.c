@@ -187,7 +187,7 @@ bool mail_index_check_header_compat(struct mail_index *index,
 		return FALSE;
 	}
 
-	if (hdr->compat_flags != compat_flags) {
+	if ((hdr->compat_flags & ~MAIL_INDEX_COMPAT_COMPRESSED) != compat_flags) {
 		/* architecture change */
 		*error_r = "CPU architecture changed";
 		return FALSE;
@@ -321,17 +321,24 @@ int mail_index_map_check_header(struct mail_index_map *map,
 	if (hdr->messages_count > 0) {
 		/* last message's UID must be smaller than next_uid.
 		   also make sure it's not zero. */
-		const struct mail_index_record *rec;
-
-		rec = MAIL_INDEX_REC_AT_SEQ(map, hdr->messages_count);
-		if (rec->uid == 0) {
+		uint32_t last_uid;
+
+		if (map->rec_map->records_deferred &&
+		    hdr->messages_count == map->rec_map->records_count) {
+			/* don't read all the records just for this */
+			last_uid = map->rec_map->deferred_last_uid;
+		} else {
+			last_uid = MAIL_INDEX_REC_AT_SEQ(map,
+						hdr->messages_count)->uid;
+		}
+		if (last_uid == 0) {
 			*error_r = "last message has uid=0";
 			return -1;
 		}
-		if (rec->uid >= hdr->next_uid) {
+		if (last_uid >= hdr->next_uid) {
 			*error_r = t_strdup_printf(
 				"last message uid %u >= next_uid %u",
-				rec->uid, hdr->next_uid);
+				last_uid, hdr->next_uid);
 			return 0;
 		}
 	}
@@ -25,9 +25,14 @@ static void mail_index_map_copy_hdr(struct mail_index_map *map,
 	/* FIXME: backwards compatibility, remove later. In case this index is
 	   accessed with Dovecot v1.0, avoid recent message counter errors. */
 	map->hdr.unused_old_recent_messages_count = 0;
+	/* the map itself is never compressed */
+	map->hdr.compat_flags &= ~MAIL_INDEX_COMPAT_COMPRESSED;
 }
 
-static int mail_index_mmap(struct mail_index_map *map, uoff_t file_size)
+static int mail_index_read_map(struct mail_index_map *map, uoff_t file_size);
+
+static int mail_index_mmap(struct mail_index_map *map, int fd,
+			   const char *path, uoff_t file_size)
 {
 	struct mail_index *index = map->index;
 	struct mail_index_record_map *rec_map = map->rec_map;
@@ -39,19 +44,19 @@ static int mail_index_mmap(struct mail_index_map *map, uoff_t file_size)
 	buffer_free(&rec_map->buffer);
 	if (file_size > SSIZE_T_MAX) {
 		/* too large file to map into memory */
-		mail_index_set_error(index, "Index file too large: %s",
-				     index->filepath);
+		mail_index_set_error(index, "Index file too large: %s", path);
 		return -1;
 	}
 
 	rec_map->mmap_base = mmap(NULL, file_size, PROT_READ | PROT_WRITE,
-				  MAP_PRIVATE, index->fd, 0);
+				  MAP_PRIVATE, fd, 0);
 	if (rec_map->mmap_base == MAP_FAILED) {
 		rec_map->mmap_base = NULL;
 		if (ioloop_time != index->last_mmap_error_time) {
 			index->last_mmap_error_time = ioloop_time;
-			mail_index_set_syscall_error(index, t_strdup_printf(
-				"mmap(size=%"PRIuUOFF_T")", file_size));
+			mail_index_file_set_syscall_error(index, path,
+				t_strdup_printf("mmap(size=%"PRIuUOFF_T")",
+						file_size));
 		}
 		return -1;
 	}
@@ -68,17 +73,29 @@ static int mail_index_mmap(struct mail_index_map *map, uoff_t file_size)
 	if (rec_map->mmap_size < MAIL_INDEX_HEADER_MIN_SIZE) {
 		mail_index_set_error(index, "Corrupted index file %s: "
 				     "File too small (%"PRIuSIZE_T")",
-				     index->filepath, rec_map->mmap_size);
+				     path, rec_map->mmap_size);
 		return 0;
 	}
 
 	if (!mail_index_check_header_compat(index, hdr, rec_map->mmap_size, &error)) {
 		/* Can't use this file */
 		mail_index_set_error(index, "Corrupted index file %s: %s",
-				     index->filepath, error);
+				     path, error);
 		return 0;
 	}
 
+	if ((hdr->compat_flags & MAIL_INDEX_COMPAT_COMPRESSED) != 0) {
+		/* compressed files can't be used via mmap(). snapshots are
+		   never compressed. */
+		if (munmap(rec_map->mmap_base, rec_map->mmap_size) < 0)
+			mail_index_file_set_syscall_error(index, path, "munmap()");
+		rec_map->mmap_base = NULL;
+		rec_map->mmap_size = 0;
+		if (fd != index->fd)
+			return 0;
+		return mail_index_read_map(map, file_size);
+	}
+
 	rec_map->mmap_used_size = hdr->header_size +
 		hdr->messages_count * hdr->record_size;
 
@@ -92,7 +109,7 @@ static int mail_index_mmap(struct mail_index_map *map, uoff_t file_size)
 			rec_map->records_count * hdr->record_size;
 		mail_index_set_error(index, "Corrupted index file %s: "
 				     "messages_count too large (%u > %u)",
-				     index->filepath, hdr->messages_count,
+				     path, hdr->messages_count,
 				     rec_map->records_count);
 	}
 
@@ -127,6 +144,146 @@ static int mail_index_read_header(struct mail_index *index,
 	return ret;
 }
 
+static int
+mail_index_read_compressed_records(struct mail_index_map *map,
+				   const struct mail_index_header *hdr,
+				   unsigned int *records_count_r)
+{
+	struct mail_index *index = map->index;
+	size_t records_size;
+	int ret;
+
+	records_size = (size_t)hdr->messages_count * hdr->record_size;
+	if (hdr->record_size != 0 &&
+	    records_size / hdr->record_size != hdr->messages_count) {
+		mail_index_set_error(index, "Corrupted index file %s: "
+			"messages_count too large (%u)",
+			index->filepath, hdr->messages_count);
+		return 0;
+	}
+
+	if (map->rec_map->buffer == NULL) {
+		map->rec_map->buffer =
+			buffer_create_dynamic(default_pool, records_size);
+	}
+	buffer_set_used_size(map->rec_map->buffer, 0);
+	ret = mail_index_read_compressed(index, index->filepath, index->fd,
+					 hdr->header_size, map->rec_map->buffer);
+	if (ret <= 0)
+		return ret;
+
+	*records_count_r = hdr->messages_count;
+	if (map->rec_map->buffer->used < records_size) {
+		*records_count_r = map->rec_map->buffer->used /
+			hdr->record_size;
+		mail_index_set_error(index, "Corrupted index file %s: "
+			"messages_count too large (%u > %u)",
+			index->filepath, hdr->messages_count,
+			*records_count_r);
+	}
+	buffer_set_used_size(map->rec_map->buffer,
+			     (size_t)*records_count_r * hdr->record_size);
+	return 1;
+}
+
+static bool
+mail_index_try_defer_records(struct mail_index_map *map,
+			     const struct mail_index_header *hdr,
+			     unsigned int records_count, size_t offset,
+			     size_t size)
+{
+	struct mail_index *index = map->index;
+	struct mail_index_record_map *rec_map = map->rec_map;
+	struct mail_index_record rec;
+	uoff_t last_offset;
+	int fd;
+
+	/* With NFS the file may change under us unless we keep re-reading
+	   it, so read everything while the attribute cache is flushed. */
+	if ((index->flags & MAIL_INDEX_OPEN_FLAG_NFS_FLUSH) != 0 ||
+	    records_count == 0)
+		return FALSE;
+
+	/* the last record's UID is needed for checking the header */
+	last_offset = hdr->header_size +
+		(uoff_t)(records_count-1) * hdr->record_size;
+	if (pread_full(index->fd, &rec, sizeof(rec), last_offset) <= 0)
+		return FALSE;
+
+	/* index files are never modified after they're written, only
+	   replaced, so reading via our own fd later gives the same data. */
+	fd = dup(index->fd);
+	if (fd == -1) {
+		mail_index_set_syscall_error(index, "dup()");
+		return FALSE;
+	}
+	rec_map->deferred_fd = fd;
+	rec_map->deferred_offset = offset;
+	rec_map->deferred_size = size;
+	rec_map->deferred_path = i_strdup(index->filepath);
+	rec_map->deferred_last_uid = rec.uid;
+	rec_map->records_deferred = TRUE;
+	return TRUE;
+}
+
+static void
+mail_index_record_map_set_broken(struct mail_index_record_map *rec_map,
+				 struct mail_index *index, void *data)
+{
+	struct mail_index_map *const *mapp;
+	struct mail_index_header *hdr;
+
+	/* The callers already trust the records, so there's no way to return
+	   an error to them. Replace the records with zeros and mark the maps
+	   corrupted, so the existing views become inconsistent, the map is
+	   never synced or written back to disk and the index is reopened by
+	   the next mail_index_open(). */
+	memset(data, 0, rec_map->deferred_size);
+	array_foreach(&rec_map->maps, mapp) {
+		(*mapp)->hdr.flags |= MAIL_INDEX_HDR_FLAG_CORRUPTED;
+		hdr = buffer_get_modifiable_data((*mapp)->hdr_copy_buf, NULL);
+		hdr->flags |= MAIL_INDEX_HDR_FLAG_CORRUPTED;
+	}
+	index->inconsistency_id++;
+}
+
+void mail_index_record_map_read_deferred(struct mail_index_record_map *rec_map)
+{
+	struct mail_index_map *const *mapp;
+	struct mail_index *index;
+	void *data;
+	ssize_t ret;
+
+	i_assert(rec_map->records_deferred);
+
+	mapp = array_idx(&rec_map->maps, 0);
+	index = (*mapp)->index;
+
+	/* @UNSAFE */
+	data = buffer_append_space_unsafe(rec_map->buffer,
+					  rec_map->deferred_size);
+	ret = pread_full(rec_map->deferred_fd, data, rec_map->deferred_size,
+			 rec_map->deferred_offset);
+	if (ret < 0) {
+		mail_index_file_set_syscall_error(index,
+			rec_map->deferred_path, "pread_full()");
+	} else if (ret == 0) {
+		mail_index_set_error(index, "Corrupted index file %s: "
+			"File was truncated while reading records",
+			rec_map->deferred_path);
+	}
+	if (ret <= 0)
+		mail_index_record_map_set_broken(rec_map, index, data);
+	rec_map->records = buffer_get_modifiable_data(rec_map->buffer, NULL);
+	rec_map->records_deferred = FALSE;
+
+	if (close(rec_map->deferred_fd) < 0) {
+		mail_index_file_set_syscall_error(index,
+			rec_map->deferred_path, "close()");
+	}
+	i_free(rec_map->deferred_path);
+}
+
 static int
 mail_index_try_read_map(struct mail_index_map *map,
 			uoff_t file_size, bool *retry_r, bool try_retry)
@@ -140,6 +297,7 @@ mail_index_try_read_map(struct mail_index_map *map,
 	ssize_t ret;
 	size_t pos, records_size, initial_buf_pos = 0;
 	unsigned int records_count = 0, extra;
+	bool defer = FALSE;
 
 	i_assert(map->rec_map->mmap_base == NULL);
 
@@ -180,7 +338,12 @@ mail_index_try_read_map(struct mail_index_map *map,
 		}
 	}
 
-	if (ret > 0) {
+	if (ret > 0 && (hdr->compat_flags & MAIL_INDEX_COMPAT_COMPRESSED) != 0) {
+		/* the records are compressed */
+		if ((ret = mail_index_read_compressed_records(map, hdr,
+							&records_count)) <= 0)
+			return ret;
+	} else if (ret > 0) {
 		/* header read, read the records now. */
 		records_size = (size_t)hdr->messages_count * hdr->record_size;
 		records_count = hdr->messages_count;
@@ -197,23 +360,30 @@ mail_index_try_read_map(struct mail_index_map *map,
 				records_count);
 		}
 
+		if (initial_buf_pos <= hdr->header_size)
+			extra = 0;
+		else
+			extra = initial_buf_pos - hdr->header_size;
+		/* read the records only when they're needed. they aren't
+		   for example with STATUS. */
+		defer = records_size > extra &&
+			mail_index_try_defer_records(map, hdr, records_count,
+				hdr->header_size + extra, records_size - extra);
+
 		if (map->rec_map->buffer == NULL) {
 			map->rec_map->buffer =
 				buffer_create_dynamic(default_pool,
-						      records_size);
+					defer ? extra : records_size);
 		}
 
 		/* @UNSAFE */
 		buffer_set_used_size(map->rec_map->buffer, 0);
-		if (initial_buf_pos <= hdr->header_size)
-			extra = 0;
-		else {
-			extra = initial_buf_pos - hdr->header_size;
+		if (extra > 0) {
 			buffer_append(map->rec_map->buffer,
 				      CONST_PTR_OFFSET(buf, hdr->header_size),
 				      extra);
 		}
-		if (records_size > extra) {
+		if (records_size > extra && !defer) {
 			data = buffer_append_space_unsafe(map->rec_map->buffer,
 							  records_size - extra);
 			ret = pread_full(index->fd, data, records_size - extra,
@@ -237,11 +407,16 @@ mail_index_try_read_map(struct mail_index_map *map,
 		return 0;
 	}
 
-	map->rec_map->records =
+	map->rec_map->records = defer ? NULL :
 		buffer_get_modifiable_data(map->rec_map->buffer, NULL);
 	map->rec_map->records_count = records_count;
 
 	mail_index_map_copy_hdr(map, hdr);
+	if ((hdr->compat_flags & MAIL_INDEX_COMPAT_COMPRESSED) != 0) {
+		struct mail_index_header *copy_hdr =
+			buffer_get_modifiable_data(map->hdr_copy_buf, NULL);
+		copy_hdr->compat_flags &= ~MAIL_INDEX_COMPAT_COMPRESSED;
+	}
 	map->hdr_base = map->hdr_copy_buf->data;
 	i_assert(map->hdr_copy_buf->used == map->hdr.header_size);
 	return 1;
@@ -299,10 +474,96 @@ static int mail_index_read_map(struct mail_index_map *map, uoff_t file_size)
 	return ret;
 }
 
+static bool
+mail_index_snapshot_is_newer(struct mail_index *index,
+			     const struct mail_index_map *file_map,
+			     const struct mail_index_header *hdr)
+{
+	struct mail_transaction_log_file *head = index->log->head;
+
+	if (hdr->major_version != MAIL_INDEX_MAJOR_VERSION ||
+	    hdr->indexid != file_map->hdr.indexid)
+		return FALSE;
+	if (!LOG_IS_BEFORE(file_map->hdr.log_file_seq,
+			   file_map->hdr.log_file_head_offset,
+			   hdr->log_file_seq, hdr->log_file_head_offset))
+		return FALSE;
+	/* the snapshot must point to the current transaction log, or syncing
+	   it would fail with a lost log */
+	return head != NULL && hdr->log_file_seq == head->hdr.file_seq &&
+		hdr->log_file_head_offset <= head->last_size;
+}
+
+static bool
+mail_index_snapshot_is_trusted(const struct stat *st, const struct stat *file_st)
+{
+	/* the snapshot directory is shared between users. use the snapshot
+	   only if it was written by someone who could have written the
+	   index file as well: the index file's owner, us, or a member of the
+	   index file's group when the group can write to it. */
+	if (st->st_uid == file_st->st_uid || st->st_uid == geteuid())
+		return TRUE;
+	return (file_st->st_mode & 0020) != 0 &&
+		st->st_gid == file_st->st_gid;
+}
+
+static struct mail_index_map *
+mail_index_map_try_snapshot(struct mail_index *index,
+			    const struct mail_index_map *file_map,
+			    const struct stat *file_st)
+{
+	struct mail_index_map *map;
+	struct mail_index_header hdr;
+	struct stat st;
+	const char *path, *error;
+	int fd, ret;
+
+	path = mail_index_snapshot_get_path(index);
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		if (errno != ENOENT)
+			mail_index_file_set_syscall_error(index, path, "open()");
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0) {
+		mail_index_file_set_syscall_error(index, path, "fstat()");
+		i_close_fd(&fd);
+		return NULL;
+	}
+	/* look at the header before mapping anything. the snapshot is only
+	   useful if it's newer than the index file. */
+	if (!mail_index_snapshot_is_trusted(&st, file_st) ||
+	    st.st_mtime < ioloop_time - MAIL_INDEX_SNAPSHOT_DELETE_SECS ||
+	    pread_full(fd, &hdr, sizeof(hdr), 0) <= 0 ||
+	    !mail_index_snapshot_is_newer(index, file_map, &hdr)) {
+		i_close_fd(&fd);
+		return NULL;
+	}
+
+	map = mail_index_map_alloc(index);
+	ret = mail_index_mmap(map, fd, path, st.st_size);
+	i_close_fd(&fd);
+	if (ret > 0 && (map->rec_map->records_count != map->hdr.messages_count ||
+			mail_index_map_check_header(map, &error) <= 0))
+		ret = 0;
+	if (ret > 0) T_BEGIN {
+		if (mail_index_map_parse_extensions(map) < 0 ||
+		    mail_index_map_parse_keywords(map) < 0)
+			ret = 0;
+	} T_END;
+	if (ret <= 0) {
+		/* broken snapshot. just use the index file. */
+		mail_index_unmap(&map);
+		return NULL;
+	}
+	return map;
+}
+
 /* returns -1 = error, 0 = index files are unusable,
    1 = index files are usable or at least repairable */
 static int
-mail_index_map_latest_file(struct mail_index *index, const char **reason_r)
+mail_index_map_latest_file(struct mail_index *index, bool try_snapshot,
+			   const char **reason_r)
 {
 	struct mail_index_map *old_map, *new_map;
 	struct stat st;
@@ -344,7 +605,8 @@ mail_index_map_latest_file(struct mail_index *index, const char **reason_r)
 
 	new_map = mail_index_map_alloc(index);
 	if (use_mmap) {
-		ret = mail_index_mmap(new_map, file_size);
+		ret = mail_index_mmap(new_map, index->fd, index->filepath,
+				      file_size);
 	} else {
 		ret = mail_index_read_map(new_map, file_size);
 	}
@@ -392,18 +654,57 @@ mail_index_map_latest_file(struct mail_index *index, const char **reason_r)
 		mail_index_unmap(&new_map);
 		return ret < 0 ? -1 : (unusable ? 0 : 1);
 	}
-	i_assert(new_map->rec_map->records != NULL);
+	i_assert(new_map->rec_map->records != NULL ||
+		 new_map->rec_map->records_deferred);
 
 	index->last_read_log_file_seq = new_map->hdr.log_file_seq;
 	index->last_read_log_file_tail_offset =
 		new_map->hdr.log_file_tail_offset;
 
+	*reason_r = "Index mapped";
+	if (try_snapshot && use_mmap && index->snapshot_dir != NULL) {
+		/* another process may have already applied the transaction
+		   log on top of this file. share its map instead of
+		   syncing our own copy. */
+		struct mail_index_map *snapshot_map =
+			mail_index_map_try_snapshot(index, new_map, &st);
+
+		if (snapshot_map != NULL) {
+			mail_index_unmap(&new_map);
+			new_map = snapshot_map;
+			*reason_r = "Index snapshot mapped";
+		}
+	}
+
 	mail_index_unmap(&index->map);
 	index->map = new_map;
-	*reason_r = "Index mapped";
 	return 1;
 }
 
+static bool
+mail_index_want_snapshot(struct mail_index *index,
+			 enum mail_index_sync_handler_type type,
+			 uint32_t loaded_seq, uoff_t loaded_offset)
+{
+	const struct mail_index_header *hdr = &index->map->hdr;
+
+	if (index->snapshot_dir == NULL || MAIL_INDEX_IS_IN_MEMORY(index) ||
+	    (index->flags & MAIL_INDEX_OPEN_FLAG_MMAP_DISABLE) != 0)
+		return FALSE;
+	/* file syncs start from the tail offset, so they wouldn't gain
+	   anything from a snapshot. */
+	if (type == MAIL_INDEX_SYNC_HANDLER_FILE)
+		return FALSE;
+	if (index->indexid == 0 || hdr->indexid != index->indexid ||
+	    (hdr->flags & MAIL_INDEX_HDR_FLAG_CORRUPTED) != 0)
+		return FALSE;
+
+	if (hdr->log_file_seq != loaded_seq)
+		return TRUE;
+	return hdr->log_file_head_offset >= loaded_offset +
+		MAIL_INDEX_SNAPSHOT_MIN_LOG_SIZE;
+}
+
 int mail_index_map(struct mail_index *index,
 		   enum mail_index_sync_handler_type type)
 {
@@ -432,8 +733,13 @@ int mail_index_map(struct mail_index *index,
 		   logs (which we'll also do even if the reopening succeeds).
 		   if index files are unusable (e.g. major version change)
 		   don't even try to use the transaction log. */
-		ret = mail_index_map_latest_file(index, &reason);
+		ret = mail_index_map_latest_file(index,
+				type != MAIL_INDEX_SYNC_HANDLER_FILE, &reason);
 		if (ret > 0) {
+			uint32_t loaded_seq = index->map->hdr.log_file_seq;
+			uoff_t loaded_offset =
+				index->map->hdr.log_file_head_offset;
+
 			/* if we're creating the index file, we don't have any
 			   logs yet */
 			if (index->log->head != NULL && index->indexid != 0) {
@@ -441,10 +747,16 @@ int mail_index_map(struct mail_index *index,
 				   from transaction log */
 				ret = mail_index_sync_map(&index->map, type,
 							  TRUE, reason);
+				if (ret > 0 &&
+				    mail_index_want_snapshot(index, type,
+							     loaded_seq,
+							     loaded_offset))
+					mail_index_snapshot_write(index);
 			}
 			if (ret == 0) {
 				/* we fsck'd the index. try opening again. */
-				ret = mail_index_map_latest_file(index, &reason);
+				ret = mail_index_map_latest_file(index, FALSE,
+								 &reason);
 				if (ret > 0 && index->indexid != 0) {
 					ret = mail_index_sync_map(&index->map,
 						type, TRUE, reason);
@@ -7,6 +7,11 @@
 #include "mail-index-private.h"
 #include "mail-index-modseq.h"
 
+/* Binary search UIDs from a packed array for maps with at least this many
+   records. With large records the search would otherwise touch a new cache
+   line on nearly every step. */
+#define MAIL_INDEX_MAP_UID_LOOKUP_MIN_COUNT 4096
+
 void mail_index_map_init_extbufs(struct mail_index_map *map,
 				 unsigned int initial_count)
 {
@@ -275,9 +280,17 @@ static void mail_index_record_map_free(struct mail_index_map *map,
 			mail_index_set_syscall_error(map->index, "munmap()");
 		rec_map->mmap_base = NULL;
 	}
+	if (rec_map->records_deferred) {
+		if (close(rec_map->deferred_fd) < 0) {
+			mail_index_file_set_syscall_error(map->index,
+				rec_map->deferred_path, "close()");
+		}
+		i_free(rec_map->deferred_path);
+	}
 	array_free(&rec_map->maps);
 	if (rec_map->modseq != NULL)
 		mail_index_map_modseq_free(&rec_map->modseq);
+	i_free(rec_map->uid_lookup);
 	i_free(rec_map);
 }
 
@@ -326,6 +339,8 @@ static void mail_index_map_copy_records(struct mail_index_record_map *dest,
 {
 	size_t size;
 
+	i_assert(!src->records_deferred);
+
 	size = src->records_count * record_size;
 	/* +1% so we have a bit of space to grow. useful for huge mailboxes. */
 	dest->buffer = buffer_create_dynamic(default_pool,
@@ -429,6 +444,9 @@ void mail_index_record_map_move_to_private(struct mail_index_map *map)
 	struct mail_index_record_map *new_map;
 	const struct mail_index_record *rec;
 
+	if (map->rec_map->records_deferred)
+		mail_index_record_map_read_deferred(map->rec_map);
+
 	if (array_count(&map->rec_map->maps) > 1) {
 		new_map = mail_index_record_map_alloc(map);
 		mail_index_map_copy_records(new_map, map->rec_map,
@@ -451,6 +469,8 @@ void mail_index_record_map_move_to_private(struct mail_index_map *map)
 		}
 		buffer_set_used_size(new_map->buffer, new_map->records_count *
 				     map->hdr.record_size);
+		mail_index_record_map_truncate_uid_lookup(new_map,
+			new_map->records_count);
 	}
 }
 
@@ -497,17 +517,55 @@ bool mail_index_map_get_ext_idx(struct mail_index_map *map,
 	return *idx_r != (uint32_t)-1;
 }
 
+void mail_index_record_map_truncate_uid_lookup(struct mail_index_record_map *rec_map,
+					       unsigned int count)
+{
+	if (rec_map->uid_lookup_count > count)
+		rec_map->uid_lookup_count = count;
+}
+
+static const uint32_t *
+mail_index_map_get_uid_lookup(struct mail_index_map *map)
+{
+	struct mail_index_record_map *rec_map = map->rec_map;
+	unsigned int i, count = map->hdr.messages_count;
+	size_t new_alloc_count;
+
+	if (count < MAIL_INDEX_MAP_UID_LOOKUP_MIN_COUNT)
+		return NULL;
+	if (rec_map->uid_lookup_count >= count)
+		return rec_map->uid_lookup;
+
+	/* records are only appended after the UIDs were copied, so only
+	   the new ones need to be added. */
+	if (rec_map->uid_lookup_alloc_count < count) {
+		new_alloc_count = nearest_power(count);
+		rec_map->uid_lookup =
+			i_realloc(rec_map->uid_lookup,
+				  rec_map->uid_lookup_alloc_count *
+				  sizeof(uint32_t),
+				  new_alloc_count * sizeof(uint32_t));
+		rec_map->uid_lookup_alloc_count = new_alloc_count;
+	}
+	for (i = rec_map->uid_lookup_count; i < count; i++)
+		rec_map->uid_lookup[i] = MAIL_INDEX_REC_AT_SEQ(map, i+1)->uid;
+	rec_map->uid_lookup_count = count;
+	return rec_map->uid_lookup;
+}
+
 static uint32_t mail_index_bsearch_uid(struct mail_index_map *map,
 				       uint32_t uid, uint32_t left_idx,
 				       int nearest_side)
 {
 	const struct mail_index_record *rec_base, *rec;
-	uint32_t idx, right_idx, record_size;
+	const uint32_t *uids;
+	uint32_t idx, right_idx, record_size, idx_uid;
 
 	i_assert(map->hdr.messages_count <= map->rec_map->records_count);
 
-	rec_base = map->rec_map->records;
+	rec_base = MAIL_INDEX_MAP_RECORDS(map);
 	record_size = map->hdr.record_size;
+	uids = mail_index_map_get_uid_lookup(map);
 
 	idx = left_idx;
 	right_idx = I_MIN(map->hdr.messages_count, uid);
@@ -516,10 +574,15 @@ static uint32_t mail_index_bsearch_uid(struct mail_index_map *map,
 	while (left_idx < right_idx) {
 		idx = (left_idx + right_idx) / 2;
 
-                rec = CONST_PTR_OFFSET(rec_base, idx * record_size);
-		if (rec->uid < uid)
+		if (uids != NULL)
+			idx_uid = uids[idx];
+		else {
+			rec = CONST_PTR_OFFSET(rec_base, idx * record_size);
+			idx_uid = rec->uid;
+		}
+		if (idx_uid < uid)
 			left_idx = idx+1;
-		else if (rec->uid > uid)
+		else if (idx_uid > uid)
 			right_idx = idx;
 		else
 			break;
@@ -27,6 +27,12 @@ struct mail_index_sync_map_ctx;
    values. */
 #define MAIL_INDEX_MIN_WRITE_BYTES (1024*8)
 #define MAIL_INDEX_MAX_WRITE_BYTES (1024*128)
+/* Publish a map snapshot when at least this many bytes were synced from the
+   transaction log on top of the index file (or the snapshot). */
+#define MAIL_INDEX_SNAPSHOT_MIN_LOG_SIZE (1024*32)
+/* Snapshots that haven't been written for this long are no longer used and
+   they get deleted. The snapshot directory is scanned at most this often. */
+#define MAIL_INDEX_SNAPSHOT_DELETE_SECS (60*60)
 
 #define MAIL_INDEX_IS_IN_MEMORY(index) \
 	((index)->dir == NULL)
@@ -34,12 +40,14 @@ struct mail_index_sync_map_ctx;
 #define MAIL_INDEX_MAP_IS_IN_MEMORY(map) \
 	((map)->rec_map->mmap_base == NULL)
 
+#define MAIL_INDEX_MAP_RECORDS(map) \
+	mail_index_record_map_get_records((map)->rec_map)
 #define MAIL_INDEX_MAP_IDX(map, idx) \
 	((struct mail_index_record *) \
-	 PTR_OFFSET((map)->rec_map->records, (idx) * (map)->hdr.record_size))
+	 PTR_OFFSET(MAIL_INDEX_MAP_RECORDS(map), (idx) * (map)->hdr.record_size))
 #define MAIL_INDEX_REC_AT_SEQ(map, seq)					\
 	((struct mail_index_record *)					\
-	 PTR_OFFSET((map)->rec_map->records, ((seq)-1) * (map)->hdr.record_size))
+	 PTR_OFFSET(MAIL_INDEX_MAP_RECORDS(map), ((seq)-1) * (map)->hdr.record_size))
 
 #define MAIL_TRANSACTION_FLAG_UPDATE_IS_INTERNAL(u) \
 	((((u)->add_flags | (u)->remove_flags) & MAIL_INDEX_FLAGS_MASK) == 0 && \
@@ -128,8 +136,24 @@ struct mail_index_record_map {
 	void *records; /* struct mail_index_record[] */
 	unsigned int records_count;
 
+	/* If records_deferred is set, the records haven't been read into
+	   buffer yet. They're read from deferred_fd when they're first
+	   accessed. The header was already read and validated. */
+	int deferred_fd;
+	uoff_t deferred_offset;
+	size_t deferred_size;
+	char *deferred_path;
+	/* UID of the last deferred record, for header checks */
+	uint32_t deferred_last_uid;
+	bool records_deferred:1;
+
 	struct mail_index_map_modseq *modseq;
 	uint32_t last_appended_uid;
+
+	/* Packed copy of the records' UIDs for faster UID lookups in large
+	   maps. Built lazily and extended when records are appended. */
+	uint32_t *uid_lookup;
+	unsigned int uid_lookup_count, uid_lookup_alloc_count;
 };
 
 struct mail_index_map {
@@ -174,6 +198,10 @@ struct mail_index {
 	uoff_t log_rotate_min_size, log_rotate_max_size;
 	unsigned int log_rotate_min_created_ago_secs;
 	unsigned int log_rotate_log2_stale_secs;
+	struct mail_index_log_group_commit_stats log_group_commit_stats;
+	char *snapshot_dir;
+	char *compression_handler;
+	int compression_level;
 
 	pool_t extension_pool;
 	ARRAY(struct mail_index_registered_ext) extensions;
@@ -228,6 +256,7 @@ struct mail_index {
 	bool index_delete_requested:1; /* next sync sets it deleted */
 	bool index_deleted:1; /* no changes allowed anymore */
 	bool log_sync_locked:1;
+	bool log_group_commit:1;
 	bool readonly:1;
 	bool mapping:1;
 	bool syncing:1;
@@ -267,6 +296,23 @@ int mail_index_reopen_if_changed(struct mail_index *index,
 				 const char **reason_r);
 /* Update/rewrite the main index file from index->map */
 void mail_index_write(struct mail_index *index, bool want_rotate);
+/* Returns path to the shared snapshot of this index's map. */
+const char *mail_index_snapshot_get_path(struct mail_index *index);
+/* Publish index->map as a snapshot that other processes can map instead of
+   syncing the same transaction log on top of the index file. */
+void mail_index_snapshot_write(struct mail_index *index);
+
+/* Returns TRUE if index files should be written compressed. */
+bool mail_index_want_compression(struct mail_index *index);
+/* Returns a compressing stream writing to output. */
+struct ostream *
+mail_index_compression_create_ostream(struct mail_index *index,
+				      struct ostream *output);
+/* Decompress the file starting from offset and append the data to dest.
+   Returns 1 if ok, 0 if the file couldn't be decompressed, -1 if I/O
+   error or if compression support isn't loaded. */
+int mail_index_read_compressed(struct mail_index *index, const char *path,
+			       int fd, uoff_t offset, buffer_t *dest);
 
 void mail_index_flush_read_cache(struct mail_index *index, const char *path,
 				 int fd, bool locked);
@@ -311,6 +357,20 @@ void mail_index_map_lookup_seq_range(struct mail_index_map *map,
 				     uint32_t first_uid, uint32_t last_uid,
 				     uint32_t *first_seq_r,
 				     uint32_t *last_seq_r);
+/* Read the deferred records into memory. If reading fails, the error is set,
+   the records are zeroed and the maps using them are marked corrupted. */
+void mail_index_record_map_read_deferred(struct mail_index_record_map *rec_map);
+static inline void *
+mail_index_record_map_get_records(struct mail_index_record_map *rec_map)
+{
+	if (unlikely(rec_map->records_deferred))
+		mail_index_record_map_read_deferred(rec_map);
+	return rec_map->records;
+}
+/* Records after the first count were moved or removed. Drop their UIDs from
+   the UID lookup array. */
+void mail_index_record_map_truncate_uid_lookup(struct mail_index_record_map *rec_map,
+					       unsigned int count);
 
 /* Returns 1 on success, 0 on non-critical errors we want to silently fix,
    -1 if map isn't usable. The caller is responsible for logging the errors
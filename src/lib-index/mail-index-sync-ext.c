@@ -218,7 +218,7 @@ static void sync_ext_reorder(struct mail_index_map *map, uint32_t ext_map_idx,
 	/* copy the records to new buffer */
 	new_buffer_size = map->rec_map->records_count * new_record_size;
 	new_buffer = buffer_create_dynamic(default_pool, new_buffer_size);
-	src = map->rec_map->records;
+	src = MAIL_INDEX_MAP_RECORDS(map);
 	offset = 0;
 	for (rec_idx = 0; rec_idx < map->rec_map->records_count; rec_idx++) {
 		/* write the base record */
@@ -82,6 +82,10 @@ mail_index_sync_move_to_private_memory(struct mail_index_sync_map_ctx *ctx)
 
 	if (!MAIL_INDEX_MAP_IS_IN_MEMORY(ctx->view->map))
 		mail_index_map_move_to_memory(ctx->view->map);
+	else if (ctx->view->map->rec_map->records_deferred) {
+		/* appends are written directly to the buffer */
+		mail_index_record_map_read_deferred(ctx->view->map->rec_map);
+	}
 	mail_index_modseq_sync_map_replaced(ctx->modseq_ctx);
 	return map;
 }
@@ -260,6 +264,8 @@ sync_expunge_range(struct mail_index_sync_map_ctx *ctx, const ARRAY_TYPE(seq_ran
 	prev_seq2 = 0;
 	dest_seq1 = 1;
 	orig_rec_count = map->rec_map->records_count;
+	mail_index_record_map_truncate_uid_lookup(map->rec_map,
+						  range[0].seq1 - 1);
 	for (i = 0; i < count; i++) {
 		uint32_t seq1 = range[i].seq1;
 		uint32_t seq2 = range[i].seq2;
@@ -857,8 +857,8 @@ int mail_index_sync_commit(struct mail_index_sync_ctx **_ctx)
 		/* if cache compression fails, we don't really care.
 		   the cache offsets are updated only if the compression was
 		   successful. */
-		(void)mail_cache_compress(index->cache, ctx->ext_trans,
-					  &cache_lock);
+		(void)mail_cache_compress_step(index->cache, ctx->ext_trans,
+					       &cache_lock);
 	}
 
 	if ((ctx->flags & MAIL_INDEX_SYNC_FLAG_DROP_RECENT) != 0) {
@@ -894,6 +894,11 @@ int mail_index_sync_commit(struct mail_index_sync_ctx **_ctx)
 		ret = -1;
 	index->sync_commit_result = NULL;
 
+	if ((index->map->hdr.flags & MAIL_INDEX_HDR_FLAG_CORRUPTED) != 0) {
+		/* the records couldn't be read - don't write them */
+		ret = -1;
+	}
+
 	want_rotate = mail_transaction_log_want_rotate(index->log);
 	if (ret == 0 &&
 	    (want_rotate || mail_index_sync_want_index_write(index))) {
@@ -1,13 +1,20 @@
 /* Copyright (c) 2003-2017 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "ioloop.h"
+#include "str.h"
 #include "read-full.h"
 #include "write-full.h"
+#include "hostpid.h"
+#include "mkdir-parents.h"
 #include "ostream.h"
 #include "mail-index-private.h"
 #include "mail-transaction-log-private.h"
 
 #include <stdio.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/stat.h>
 
 #define MAIL_INDEX_MIN_UPDATE_SIZE 1024
 /* if we're updating >= count-n messages, recreate the index */
@@ -57,11 +64,57 @@ static int mail_index_create_backup(struct mail_index *index)
 	return 0;
 }
 
+static void
+mail_index_map_write_hdr(struct mail_index_map *map,
+			 const struct mail_index_header *hdr,
+			 struct ostream *output)
+{
+	unsigned int base_size;
+
+	base_size = I_MIN(map->hdr.base_header_size, sizeof(map->hdr));
+	o_stream_nsend(output, hdr, base_size);
+	o_stream_nsend(output, CONST_PTR_OFFSET(map->hdr_base, base_size),
+		       map->hdr.header_size - base_size);
+}
+
+static void
+mail_index_map_write(struct mail_index_map *map, struct ostream *output)
+{
+	mail_index_map_write_hdr(map, &map->hdr, output);
+	o_stream_nsend(output, MAIL_INDEX_MAP_RECORDS(map),
+		       map->rec_map->records_count * map->hdr.record_size);
+}
+
+static int
+mail_index_map_write_compressed(struct mail_index_map *map,
+				struct ostream *output, const char *path)
+{
+	struct mail_index_header hdr = map->hdr;
+	struct ostream *compressed_output;
+	int ret = 0;
+
+	/* only the records are compressed, so the header can still be read
+	   the usual way */
+	hdr.compat_flags |= MAIL_INDEX_COMPAT_COMPRESSED;
+	mail_index_map_write_hdr(map, &hdr, output);
+
+	compressed_output =
+		mail_index_compression_create_ostream(map->index, output);
+	o_stream_nsend(compressed_output, MAIL_INDEX_MAP_RECORDS(map),
+		       map->rec_map->records_count * map->hdr.record_size);
+	if (o_stream_nfinish(compressed_output) < 0) {
+		mail_index_set_error(map->index, "write(%s) failed: %s", path,
+				     o_stream_get_error(compressed_output));
+		ret = -1;
+	}
+	o_stream_destroy(&compressed_output);
+	return ret;
+}
+
 static int mail_index_recreate(struct mail_index *index)
 {
 	struct mail_index_map *map = index->map;
 	struct ostream *output;
-	unsigned int base_size;
 	const char *path;
 	int ret = 0, fd;
 
@@ -76,15 +129,12 @@ static int mail_index_recreate(struct mail_index *index)
 
 	output = o_stream_create_fd_file(fd, 0, FALSE);
 	o_stream_cork(output);
-
-	base_size = I_MIN(map->hdr.base_header_size, sizeof(map->hdr));
-	o_stream_nsend(output, &map->hdr, base_size);
-	o_stream_nsend(output, CONST_PTR_OFFSET(map->hdr_base, base_size),
-		       map->hdr.header_size - base_size);
-	o_stream_nsend(output, map->rec_map->records,
-		       map->rec_map->records_count * map->hdr.record_size);
+	if (!mail_index_want_compression(index))
+		mail_index_map_write(map, output);
+	else
+		ret = mail_index_map_write_compressed(map, output, path);
 	o_stream_nflush(output);
-	if (o_stream_nfinish(output) < 0) {
+	if (o_stream_nfinish(output) < 0 && ret == 0) {
 		mail_index_file_set_syscall_error(index, path, "write()");
 		ret = -1;
 	}
@@ -117,6 +167,126 @@ static int mail_index_recreate(struct mail_index *index)
 	return ret;
 }
 
+static void mail_index_snapshot_cleanup(struct mail_index *index)
+{
+	const char *dir = index->snapshot_dir;
+	time_t min_time = ioloop_time - MAIL_INDEX_SNAPSHOT_DELETE_SECS;
+	uid_t uid = geteuid();
+	DIR *dirp;
+	struct dirent *d;
+	struct stat st;
+	string_t *path;
+	size_t prefix_len, dir_len;
+
+	dirp = opendir(dir);
+	if (dirp == NULL) {
+		if (errno != ENOENT)
+			mail_index_file_set_syscall_error(index, dir, "opendir()");
+		return;
+	}
+	/* update atime immediately, so other processes don't start scanning
+	   the same directory */
+	if (utime(dir, NULL) < 0 && errno != ENOENT)
+		mail_index_file_set_syscall_error(index, dir, "utime()");
+
+	path = t_str_new(256);
+	str_printfa(path, "%s/", dir);
+	dir_len = str_len(path);
+	prefix_len = strlen(index->prefix);
+	while ((d = readdir(dirp)) != NULL) {
+		if (strncmp(d->d_name, index->prefix, prefix_len) != 0 ||
+		    d->d_name[prefix_len] != '.')
+			continue;
+
+		str_truncate(path, dir_len);
+		str_append(path, d->d_name);
+		/* the directory is shared between users. only the snapshots'
+		   owners can delete them. */
+		if (lstat(str_c(path), &st) < 0) {
+			if (errno != ENOENT) {
+				mail_index_file_set_syscall_error(index,
+					str_c(path), "lstat()");
+			}
+		} else if (S_ISREG(st.st_mode) && st.st_uid == uid &&
+			   st.st_mtime < min_time) {
+			i_unlink_if_exists(str_c(path));
+		}
+	}
+	if (closedir(dirp) < 0)
+		mail_index_file_set_syscall_error(index, dir, "closedir()");
+}
+
+static int mail_index_snapshot_mkdir(struct mail_index *index)
+{
+	mode_t old_mask;
+	int ret;
+
+	/* the directory is shared between users, similar to /tmp */
+	old_mask = umask(0);
+	ret = mkdir_parents(index->snapshot_dir, 01777);
+	umask(old_mask);
+	if (ret < 0 && errno != EEXIST) {
+		mail_index_file_set_syscall_error(index, index->snapshot_dir,
+						  "mkdir()");
+		return -1;
+	}
+	return 0;
+}
+
+void mail_index_snapshot_write(struct mail_index *index)
+{
+	struct mail_index_map *map = index->map;
+	struct ostream *output;
+	const char *path, *tmp_path;
+	struct stat st;
+	int ret = 0, fd;
+
+	i_assert(map->hdr.indexid == index->indexid);
+
+	if (mail_index_snapshot_mkdir(index) < 0)
+		return;
+
+	/* other processes may be writing the same snapshot */
+	path = mail_index_snapshot_get_path(index);
+	fd = mail_index_create_tmp_file(index, t_strdup_printf("%s.%s.%s",
+					path, my_hostname, my_pid), &tmp_path);
+	if (fd == -1)
+		return;
+
+	output = o_stream_create_fd_file(fd, 0, FALSE);
+	o_stream_cork(output);
+	mail_index_map_write(map, output);
+	o_stream_nflush(output);
+	if (o_stream_nfinish(output) < 0) {
+		mail_index_file_set_syscall_error(index, tmp_path, "write()");
+		ret = -1;
+	}
+	o_stream_destroy(&output);
+
+	/* the snapshot can always be recreated from the index and log files,
+	   so it's never fsynced */
+	if (close(fd) < 0) {
+		mail_index_file_set_syscall_error(index, tmp_path, "close()");
+		ret = -1;
+	}
+	if (ret == 0 && rename(tmp_path, path) < 0) {
+		/* with a sticky directory another user's snapshot can't be
+		   replaced. it's fine to just keep using that one. */
+		if (errno != EPERM && errno != EACCES) {
+			mail_index_set_error(index, "rename(%s, %s) failed: %m",
+					     tmp_path, path);
+		}
+		ret = -1;
+	}
+	if (ret < 0)
+		i_unlink(tmp_path);
+
+	/* check once in a while for old snapshots to delete */
+	if (stat(index->snapshot_dir, &st) == 0 &&
+	    st.st_atime < ioloop_time - MAIL_INDEX_SNAPSHOT_DELETE_SECS)
+		mail_index_snapshot_cleanup(index);
+}
+
 void mail_index_write(struct mail_index *index, bool want_rotate)
 {
 	struct mail_index_map *map = index->map;
@@ -5,7 +5,9 @@
 #include "array.h"
 #include "buffer.h"
 #include "eacces-error.h"
+#include "hex-binary.h"
 #include "hash.h"
+#include "md5.h"
 #include "str-sanitize.h"
 #include "mmap-util.h"
 #include "nfs-workarounds.h"
@@ -90,6 +92,8 @@ void mail_index_free(struct mail_index **_index)
 
 	i_free(index->ext_hdr_init_data);
 	i_free(index->gid_origin);
+	i_free(index->snapshot_dir);
+	i_free(index->compression_handler);
 	i_free(index->error);
 	i_free(index->dir);
 	i_free(index->prefix);
@@ -133,6 +137,36 @@ void mail_index_set_log_rotation(struct mail_index *index,
 	index->log_rotate_log2_stale_secs = log2_stale_secs;
 }
 
+void mail_index_set_log_group_commit(struct mail_index *index, bool enabled)
+{
+	index->log_group_commit = enabled;
+}
+
+void mail_index_get_log_group_commit_stats(struct mail_index *index,
+	struct mail_index_log_group_commit_stats *stats_r)
+{
+	*stats_r = index->log_group_commit_stats;
+}
+
+void mail_index_set_snapshot_dir(struct mail_index *index, const char *dir)
+{
+	i_free(index->snapshot_dir);
+	index->snapshot_dir = dir == NULL || dir[0] == '\0' ? NULL :
+		i_strdup(dir);
+}
+
+const char *mail_index_snapshot_get_path(struct mail_index *index)
+{
+	unsigned char digest[MD5_RESULTLEN];
+
+	i_assert(index->snapshot_dir != NULL);
+	i_assert(!MAIL_INDEX_IS_IN_MEMORY(index));
+
+	md5_get_digest(index->filepath, strlen(index->filepath), digest);
+	return t_strdup_printf("%s/%s.%s", index->snapshot_dir, index->prefix,
+			       binary_to_hex(digest, sizeof(digest)));
+}
+
 void mail_index_set_ext_init_data(struct mail_index *index, uint32_t ext_id,
 				  const void *data, size_t size)
 {
@@ -43,7 +43,10 @@ enum mail_index_open_flags {
 };
 
 enum mail_index_header_compat_flags {
-	MAIL_INDEX_COMPAT_LITTLE_ENDIAN		= 0x01
+	MAIL_INDEX_COMPAT_LITTLE_ENDIAN		= 0x01,
+	/* Everything after the header is compressed. Older versions see this
+	   as an incompatible file and rebuild it. */
+	MAIL_INDEX_COMPAT_COMPRESSED		= 0x02
 };
 
 enum mail_index_header_flag {
@@ -240,6 +243,28 @@ struct mail_index_transaction;
 struct mail_index_sync_ctx;
 struct mail_index_view_sync_ctx;
 
+struct mail_index_log_group_commit_stats {
+	/* Number of transactions that waited for a group commit */
+	unsigned int commit_count;
+	/* Number of fdatasync() calls done by this process, and how many bytes
+	   of transaction log they made durable in total (including other
+	   processes' transactions) */
+	unsigned int fsync_count;
+	unsigned long long fsync_bytes;
+	/* How long the transactions waited to become durable */
+	unsigned long long total_wait_usecs, max_wait_usecs;
+};
+
+struct mail_index_compression {
+	/* Returns a stream decompressing the input, or NULL if the compression
+	   format isn't recognized. */
+	struct istream *(*create_istream)(struct istream *input);
+	/* Returns a stream compressing to output with the named compression
+	   handler. */
+	struct ostream *(*create_ostream)(struct ostream *output,
+					  const char *handler, int level);
+};
+
 struct mail_index *mail_index_alloc(const char *dir, const char *prefix);
 void mail_index_free(struct mail_index **index);
 
@@ -262,6 +287,33 @@ void mail_index_set_log_rotation(struct mail_index *index,
 				 uoff_t min_size, uoff_t max_size,
 				 unsigned int min_created_ago_secs,
 				 unsigned int log2_stale_secs);
+/* Share the index map via snapshot files in the given directory (NULL =
+   disabled). A process that had to sync a lot of the transaction log writes
+   its map there, and processes opening the index later mmap() the snapshot
+   instead of the index file if it's newer. The directory should be in a
+   memory filesystem (e.g. /dev/shm). It can be shared by all users, since
+   the snapshots are named by the index path and created with the index
+   file's permissions. */
+void mail_index_set_snapshot_dir(struct mail_index *index, const char *dir);
+/* Don't fdatasync() transaction log appends while holding the log lock.
+   Instead the lock is released after write(), and a single fdatasync() makes
+   all the transactions written meanwhile by any process durable. Requires
+   fcntl() or flock() locking. */
+void mail_index_set_log_group_commit(struct mail_index *index, bool enabled);
+/* Returns statistics of the group commits done by this process. */
+void mail_index_get_log_group_commit_stats(struct mail_index *index,
+	struct mail_index_log_group_commit_stats *stats_r);
+/* Compress the main index file and the rotated dovecot.index.log.2 files
+   with the given compression handler (NULL = disabled). Only the file headers
+   are left uncompressed, so compressed index files are never mmap()ed.
+   Requires that compression functions have been registered. */
+void mail_index_set_compression(struct mail_index *index,
+				const char *handler, int level);
+/* Register the functions used for compressing and decompressing index files.
+   lib-index doesn't link with the compression libraries itself. Compressed
+   files can't be read without them. */
+void mail_index_register_compression(const struct mail_index_compression *compression);
+void mail_index_unregister_compression(const struct mail_index_compression *compression);
 /* When creating a new index file or reseting an existing one, add the given
    extension header data immediately to it. */
 void mail_index_set_ext_init_data(struct mail_index *index, uint32_t ext_id,
@@ -2,10 +2,22 @@
 
 #include "lib.h"
 #include "array.h"
+#include "file-lock.h"
+#include "time-util.h"
 #include "write-full.h"
 #include "mail-index-private.h"
 #include "mail-transaction-log-private.h"
 
+#include <sys/stat.h>
+
+/* Contents of the group commit file: how far the log is known to be
+   durable. */
+struct mail_transaction_log_group_commit_rec {
+	uint32_t indexid;
+	uint32_t file_seq;
+	uint64_t synced_offset;
+};
+
 void mail_transaction_log_append_add(struct mail_transaction_log_append_ctx *ctx,
 				     enum mail_transaction_type type,
 				     const void *data, size_t size)
@@ -58,6 +70,17 @@ log_buffer_move_to_memory(struct mail_transaction_log_append_ctx *ctx)
 	return 0;
 }
 
+static bool log_want_group_commit(struct mail_transaction_log_append_ctx *ctx)
+{
+	struct mail_index *index = ctx->log->index;
+
+	/* a sync keeps the log locked until it's finished, so it can't let
+	   others join its fdatasync() */
+	return index->log_group_commit && !index->log_sync_locked &&
+		index->lock_method != FILE_LOCK_METHOD_DOTLOCK &&
+		(index->flags & MAIL_INDEX_OPEN_FLAG_NFS_FLUSH) == 0;
+}
+
 static int log_buffer_write(struct mail_transaction_log_append_ctx *ctx)
 {
 	struct mail_transaction_log_file *file = ctx->log->head;
@@ -90,7 +113,9 @@ static int log_buffer_write(struct mail_transaction_log_append_ctx *ctx)
 	if ((ctx->want_fsync &&
 	     file->log->index->fsync_mode != FSYNC_MODE_NEVER) ||
 	    file->log->index->fsync_mode == FSYNC_MODE_ALWAYS) {
-		if (fdatasync(file->fd) < 0) {
+		if (log_want_group_commit(ctx))
+			ctx->group_fsync = TRUE;
+		else if (fdatasync(file->fd) < 0) {
 			mail_index_file_set_syscall_error(ctx->log->index,
 							  file->filepath,
 							  "fdatasync()");
@@ -213,6 +238,120 @@ mail_transaction_log_append_locked(struct mail_transaction_log_append_ctx *ctx)
 	return 0;
 }
 
+static int
+log_group_fsync_locked(struct mail_transaction_log_file *file,
+		       uoff_t offset, int fd, const char *path)
+{
+	struct mail_index *index = file->log->index;
+	struct mail_index_log_group_commit_stats *stats =
+		&index->log_group_commit_stats;
+	struct mail_transaction_log_group_commit_rec rec;
+	uoff_t synced_offset = 0;
+	struct stat st;
+	ssize_t ret;
+
+	ret = pread(fd, &rec, sizeof(rec), 0);
+	if (ret < 0)
+		mail_index_file_set_syscall_error(index, path, "pread()");
+	else if (ret == sizeof(rec) && rec.indexid == file->hdr.indexid &&
+		 rec.file_seq == file->hdr.file_seq)
+		synced_offset = rec.synced_offset;
+	if (synced_offset >= offset) {
+		/* another process's fdatasync() already included this */
+		return 0;
+	}
+
+	/* everything written before this fstat() becomes durable. others
+	   can keep writing to the log meanwhile. they'll wait for our lock
+	   and find out that we synced them as well. */
+	if (fstat(file->fd, &st) < 0) {
+		mail_index_file_set_syscall_error(index, file->filepath,
+						  "fstat()");
+		return -1;
+	}
+	if ((uoff_t)st.st_size < offset) {
+		mail_index_set_error(index,
+			"Transaction log file %s was truncated while syncing "
+			"(size %"PRIuUOFF_T" < %"PRIuUOFF_T")", file->filepath,
+			(uoff_t)st.st_size, offset);
+		return -1;
+	}
+	if (fdatasync(file->fd) < 0) {
+		mail_index_file_set_syscall_error(index, file->filepath,
+						  "fdatasync()");
+		return -1;
+	}
+	stats->fsync_count++;
+	stats->fsync_bytes += st.st_size - synced_offset;
+
+	i_zero(&rec);
+	rec.indexid = file->hdr.indexid;
+	rec.file_seq = file->hdr.file_seq;
+	rec.synced_offset = st.st_size;
+	if (pwrite_full(fd, &rec, sizeof(rec), 0) < 0) {
+		/* others just fdatasync() again */
+		mail_index_file_set_syscall_error(index, path, "pwrite_full()");
+	}
+	return 0;
+}
+
+static int
+log_group_fsync(struct mail_transaction_log_file *file, uoff_t offset)
+{
+	struct mail_index *index = file->log->index;
+	struct mail_index_log_group_commit_stats *stats =
+		&index->log_group_commit_stats;
+	struct file_lock *lock;
+	struct timeval start_time, end_time;
+	const char *path;
+	unsigned long long usecs;
+	mode_t old_mask;
+	int fd, ret = 0;
+
+	if (gettimeofday(&start_time, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+
+	path = t_strconcat(file->filepath,
+			   MAIL_TRANSACTION_LOG_GROUP_COMMIT_SUFFIX, NULL);
+	fd = open(path, O_RDWR);
+	if (fd == -1 && errno == ENOENT) {
+		old_mask = umask(0);
+		fd = open(path, O_RDWR | O_CREAT, index->mode);
+		umask(old_mask);
+		if (fd != -1)
+			mail_index_fchown(index, fd, path);
+	}
+	if (fd == -1) {
+		mail_index_file_set_syscall_error(index, path, "open()");
+		ret = -1;
+	} else {
+		ret = file_wait_lock(fd, path, F_WRLCK, index->lock_method,
+				     MAIL_TRANSACTION_LOG_LOCK_TIMEOUT, &lock);
+	}
+	if (ret > 0) {
+		ret = log_group_fsync_locked(file, offset, fd, path);
+		file_unlock(&lock);
+	} else if (fdatasync(file->fd) < 0) {
+		/* couldn't join a group commit, sync by ourself */
+		mail_index_file_set_syscall_error(index, file->filepath,
+						  "fdatasync()");
+		ret = -1;
+	} else {
+		ret = 0;
+	}
+	if (fd != -1)
+		i_close_fd(&fd);
+
+	if (gettimeofday(&end_time, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	usecs = timeval_diff_usecs(&end_time, &start_time);
+	stats->commit_count++;
+	stats->total_wait_usecs += usecs;
+	if (stats->max_wait_usecs < usecs)
+		stats->max_wait_usecs = usecs;
+	return ret;
+}
+
 int mail_transaction_log_append_begin(struct mail_index *index,
 				      enum mail_transaction_type flags,
 				      struct mail_transaction_log_append_ctx **ctx_r)
@@ -241,13 +380,20 @@ int mail_transaction_log_append_commit(struct mail_transaction_log_append_ctx **
 {
 	struct mail_transaction_log_append_ctx *ctx = *_ctx;
 	struct mail_index *index = ctx->log->index;
+	struct mail_transaction_log_file *file;
+	uoff_t sync_offset;
 	int ret = 0;
 
 	*_ctx = NULL;
 
 	ret = mail_transaction_log_append_locked(ctx);
+	file = index->log->head;
+	sync_offset = file->sync_offset;
 	if (!index->log_sync_locked)
-		mail_transaction_log_file_unlock(index->log->head, "appending");
+		mail_transaction_log_file_unlock(file, "appending");
+	if (ret == 0 && ctx->group_fsync) T_BEGIN {
+		ret = log_group_fsync(file, sync_offset);
+	} T_END;
 
 	buffer_free(&ctx->output);
 	i_free(ctx);
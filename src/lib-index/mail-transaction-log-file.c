@@ -8,10 +8,14 @@
 #include "read-full.h"
 #include "write-full.h"
 #include "mmap-util.h"
+#include "istream.h"
+#include "ostream.h"
 #include "mail-index-private.h"
 #include "mail-index-modseq.h"
 #include "mail-transaction-log-private.h"
 
+#include <stdio.h>
+
 #define LOG_PREFETCH IO_BLOCK_SIZE
 #define MEMORY_LOG_NAME "(in-memory transaction log file)"
 #define LOG_NEW_DOTLOCK_SUFFIX ".newlock"
@@ -536,7 +540,15 @@ mail_transaction_log_file_read_hdr(struct mail_transaction_log_file *file,
 #if !WORDS_BIGENDIAN
 		compat_flags |= MAIL_INDEX_COMPAT_LITTLE_ENDIAN;
 #endif
-		if (file->hdr.compat_flags != compat_flags) {
+		if ((file->hdr.compat_flags & MAIL_INDEX_COMPAT_COMPRESSED) != 0) {
+			/* small files were already read into the buffer,
+			   but they need to be decompressed first */
+			file->compressed = TRUE;
+			if (file->buffer != NULL)
+				buffer_free(&file->buffer);
+		}
+		if ((file->hdr.compat_flags & ~MAIL_INDEX_COMPAT_COMPRESSED) !=
+		    compat_flags) {
 			/* architecture change */
 			mail_index_set_error(file->log->index,
 					     "Rebuilding index file %s: "
@@ -1600,6 +1612,45 @@ mail_transaction_log_file_read(struct mail_transaction_log_file *file,
 	return ret;
 }
 
+static int
+mail_transaction_log_file_read_compressed(struct mail_transaction_log_file *file)
+{
+	void *data;
+	bool retry;
+	int ret;
+
+	i_assert(file->buffer == NULL && file->mmap_base == NULL);
+
+	/* the header isn't compressed */
+	file->buffer = buffer_create_dynamic(default_pool, LOG_PREFETCH);
+	file->buffer_offset = 0;
+	data = buffer_append_space_unsafe(file->buffer, file->hdr.hdr_size);
+	ret = pread_full(file->fd, data, file->hdr.hdr_size, 0);
+	if (ret > 0) {
+		ret = mail_index_read_compressed(file->log->index,
+						 file->filepath, file->fd,
+						 file->hdr.hdr_size,
+						 file->buffer);
+	} else if (ret == 0) {
+		mail_transaction_log_file_set_corrupted(file, "file shrank");
+	} else {
+		log_file_set_syscall_error(file, "pread()");
+	}
+	if (ret <= 0) {
+		buffer_free(&file->buffer);
+		return ret;
+	}
+	file->last_size = file->buffer->used;
+
+	if ((ret = mail_transaction_log_file_sync(file, &retry)) == 0) {
+		i_assert(!retry); /* retry happens only with mmap */
+	}
+	i_assert(file->sync_offset >= file->buffer_offset);
+	buffer_set_used_size(file->buffer,
+			     file->sync_offset - file->buffer_offset);
+	return ret;
+}
+
 static int
 log_file_map_check_offsets(struct mail_transaction_log_file *file,
 			   uoff_t start_offset, uoff_t end_offset)
@@ -1765,6 +1816,16 @@ int mail_transaction_log_file_map(struct mail_transaction_log_file *file,
 		file->locked_sync_offset_updated = TRUE;
 	}
 
+	if (file->compressed) {
+		/* the file can't change anymore. it's either fully read
+		   already or not at all. */
+		if (file->buffer == NULL &&
+		    (ret = mail_transaction_log_file_read_compressed(file)) <= 0)
+			return ret;
+		return log_file_map_check_offsets(file, start_offset,
+						  end_offset);
+	}
+
 	if (MAIL_TRANSACTION_LOG_FILE_IN_MEMORY(file)) {
 		if (start_offset < file->buffer_offset || file->buffer == NULL) {
 			/* we had moved the log to memory but failed to read
@@ -1837,3 +1898,83 @@ void mail_transaction_log_file_move_to_memory(struct mail_transaction_log_file
 	i_free(file->filepath);
 	file->filepath = i_strdup(file->log->filepath);
 }
+
+void mail_transaction_log_file_compress(struct mail_transaction_log_file *file,
+					const char *path)
+{
+	struct mail_index *index = file->log->index;
+	struct mail_transaction_log_header hdr;
+	struct istream *input;
+	struct ostream *output, *compressed_output;
+	struct stat st;
+	const char *tmp_path;
+	int fd, ret = 0;
+
+	i_assert(!MAIL_TRANSACTION_LOG_FILE_IN_MEMORY(file));
+
+	if (file->compressed || file->hdr.hdr_size != sizeof(file->hdr))
+		return;
+	if (nfs_safe_stat(path, &st) < 0) {
+		if (errno != ENOENT)
+			mail_index_file_set_syscall_error(index, path, "stat()");
+		return;
+	}
+	if (st.st_ino != file->st_ino || !CMP_DEV_T(st.st_dev, file->st_dev)) {
+		/* the rotated log isn't this file */
+		return;
+	}
+
+	fd = mail_index_create_tmp_file(index, path, &tmp_path);
+	if (fd == -1)
+		return;
+
+	hdr = file->hdr;
+	hdr.compat_flags |= MAIL_INDEX_COMPAT_COMPRESSED;
+	output = o_stream_create_fd_file(fd, 0, FALSE);
+	o_stream_cork(output);
+	o_stream_nsend(output, &hdr, sizeof(hdr));
+
+	input = i_stream_create_fd(file->fd, IO_BLOCK_SIZE);
+	i_stream_set_name(input, file->filepath);
+	i_stream_seek(input, file->hdr.hdr_size);
+	compressed_output = mail_index_compression_create_ostream(index, output);
+	o_stream_nsend_istream(compressed_output, input);
+	if (input->stream_errno != 0) {
+		errno = input->stream_errno;
+		log_file_set_syscall_error(file, "read()");
+		ret = -1;
+	}
+	if (o_stream_nfinish(compressed_output) < 0 && ret == 0) {
+		mail_index_set_error(index, "write(%s) failed: %s", tmp_path,
+				     o_stream_get_error(compressed_output));
+		ret = -1;
+	}
+	o_stream_destroy(&compressed_output);
+	i_stream_unref(&input);
+
+	if (o_stream_nfinish(output) < 0 && ret == 0) {
+		mail_index_file_set_syscall_error(index, tmp_path, "write()");
+		ret = -1;
+	}
+	o_stream_destroy(&output);
+
+	if (ret == 0 && index->fsync_mode == FSYNC_MODE_ALWAYS &&
+	    fdatasync(fd) < 0) {
+		mail_index_file_set_syscall_error(index, tmp_path,
+						  "fdatasync()");
+		ret = -1;
+	}
+	if (close(fd) < 0) {
+		mail_index_file_set_syscall_error(index, tmp_path, "close()");
+		ret = -1;
+	}
+	/* processes that already have the rotated log open keep reading the
+	   uncompressed file */
+	if (ret == 0 && rename(tmp_path, path) < 0) {
+		mail_index_set_error(index, "rename(%s, %s) failed: %m",
+				     tmp_path, path);
+		ret = -1;
+	}
+	if (ret < 0)
+		i_unlink(tmp_path);
+}
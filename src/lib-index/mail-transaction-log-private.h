@@ -10,6 +10,8 @@ struct dotlock_settings;
    mails. */
 #define MAIL_TRANSACTION_LOG_LOCK_TIMEOUT (3*60)
 #define MAIL_TRANSACTION_LOG_LOCK_CHANGE_TIMEOUT (3*60)
+/* Appended to the log path for the file that tracks group commits */
+#define MAIL_TRANSACTION_LOG_GROUP_COMMIT_SUFFIX ".fsync"
 
 /* Rotate when log is older than ROTATE_TIME and larger than MIN_SIZE */
 #define MAIL_TRANSACTION_LOG_ROTATE_DEFAULT_MIN_SIZE (1024*32)
@@ -81,6 +83,9 @@ struct mail_transaction_log_file {
 	bool locked:1;
 	bool locked_sync_offset_updated:1;
 	bool corrupted:1;
+	/* everything after the header is compressed. the whole file is read
+	   into buffer at once. */
+	bool compressed:1;
 };
 
 struct mail_transaction_log {
@@ -137,6 +142,10 @@ int mail_transaction_log_file_map(struct mail_transaction_log_file *file,
 				  uoff_t start_offset, uoff_t end_offset);
 void mail_transaction_log_file_move_to_memory(struct mail_transaction_log_file
 					      *file);
+/* Replace the rotated log in path with a compressed copy of the file, if the
+   path is still a link to it. */
+void mail_transaction_log_file_compress(struct mail_transaction_log_file *file,
+					const char *path);
 
 void mail_transaction_logs_clean(struct mail_transaction_log *log);
 
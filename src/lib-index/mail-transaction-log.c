@@ -269,6 +269,12 @@ int mail_transaction_log_rotate(struct mail_transaction_log *log, bool reset)
 			return -1;
 		}
 		i_assert(file->locked);
+
+		if (mail_index_want_compression(log->index)) {
+			/* the old head was just linked to .log.2 */
+			mail_transaction_log_file_compress(log->head,
+							   log->filepath2);
+		}
 	}
 
 	if (--log->head->refcount == 0)
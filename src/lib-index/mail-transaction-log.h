@@ -182,6 +182,8 @@ struct mail_transaction_log_append_ctx {
 	bool tail_offset_changed:1;
 	bool sync_includes_this:1;
 	bool want_fsync:1;
+	/* fdatasync() with a group commit after unlocking the log */
+	bool group_fsync:1;
 };
 
 #define LOG_IS_BEFORE(seq1, offset1, seq2, offset2) \
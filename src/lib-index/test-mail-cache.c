@@ -0,0 +1,577 @@
+/* Copyright (c) 2017 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "buffer.h"
+#include "str.h"
+#include "unlink-directory.h"
+#include "test-common.h"
+#include "mail-cache-private.h"
+
+#define TESTDIR_NAME ".dovecot.test"
+#define TEST_MSG_COUNT 100
+
+enum {
+	TEST_FIELD_FIXED,
+	TEST_FIELD_VAR,
+	TEST_FIELD_BITMASK,
+	TEST_FIELD_OTHER,
+
+	TEST_FIELD_COUNT
+};
+
+static struct mail_cache_field test_fields[TEST_FIELD_COUNT] = {
+	{ .name = "fixed", .type = MAIL_CACHE_FIELD_FIXED_SIZE,
+	  .field_size = sizeof(uint32_t) },
+	{ .name = "var", .type = MAIL_CACHE_FIELD_VARIABLE_SIZE,
+	  .field_size = UINT_MAX },
+	{ .name = "bitmask", .type = MAIL_CACHE_FIELD_BITMASK,
+	  .field_size = sizeof(uint32_t) },
+	{ .name = "other", .type = MAIL_CACHE_FIELD_STRING,
+	  .field_size = UINT_MAX },
+};
+
+static struct mail_index *
+test_index_open_flags(enum mail_index_open_flags flags)
+{
+	struct mail_index *index;
+	unsigned int i;
+
+	index = mail_index_alloc(TESTDIR_NAME, "test.dovecot.index");
+	test_assert(mail_index_open_or_create(index,
+			flags | MAIL_INDEX_OPEN_FLAG_CREATE) == 0);
+	for (i = 0; i < TEST_FIELD_COUNT; i++) {
+		test_fields[i].decision = MAIL_CACHE_DECISION_YES |
+			MAIL_CACHE_DECISION_FORCED;
+	}
+	mail_cache_register_fields(index->cache, test_fields, TEST_FIELD_COUNT);
+	return index;
+}
+
+static struct mail_index *test_index_open(void)
+{
+	return test_index_open_flags(0);
+}
+
+static const char *test_var_value(uint32_t uid)
+{
+	/* some messages have an empty value */
+	return uid % 10 == 0 ? "" : t_strdup_printf("value %u", uid);
+}
+
+static void test_cache_append(struct mail_index *index)
+{
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	uint32_t seq, uid;
+
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	uid = 1234;
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid, sizeof(uid), TRUE);
+	for (uid = 1; uid <= TEST_MSG_COUNT; uid++)
+		mail_index_append(trans, uid, &seq);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_index_view_close(&view);
+}
+
+static void test_cache_add_fields(struct mail_index *index,
+				  unsigned int field_mask)
+{
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	struct mail_cache_view *cache_view;
+	struct mail_cache_transaction_ctx *cache_trans;
+	uint32_t seq, uid, bits;
+	const char *value;
+
+	view = mail_index_view_open(index);
+	cache_view = mail_cache_view_open(index->cache, view);
+	trans = mail_index_transaction_begin(view, 0);
+	cache_trans = mail_cache_get_transaction(cache_view, trans);
+	for (seq = 1; seq <= mail_index_view_get_messages_count(view); seq++) T_BEGIN {
+		mail_index_lookup_uid(view, seq, &uid);
+		if ((field_mask & (1 << TEST_FIELD_FIXED)) != 0 &&
+		    uid % 7 != 0) {
+			/* some messages don't have the fixed field */
+			mail_cache_add(cache_trans, seq,
+				       test_fields[TEST_FIELD_FIXED].idx,
+				       &uid, sizeof(uid));
+		}
+		if ((field_mask & (1 << TEST_FIELD_VAR)) != 0) {
+			value = test_var_value(uid);
+			mail_cache_add(cache_trans, seq,
+				       test_fields[TEST_FIELD_VAR].idx,
+				       value, strlen(value));
+		}
+		if ((field_mask & (1 << TEST_FIELD_BITMASK)) != 0) {
+			/* bitmask gets merged */
+			bits = 0x01;
+			mail_cache_add(cache_trans, seq,
+				       test_fields[TEST_FIELD_BITMASK].idx,
+				       &bits, sizeof(bits));
+			bits = uid << 8;
+			mail_cache_add(cache_trans, seq,
+				       test_fields[TEST_FIELD_BITMASK].idx,
+				       &bits, sizeof(bits));
+		}
+		if ((field_mask & (1 << TEST_FIELD_OTHER)) != 0 &&
+		    uid % 3 == 0) {
+			mail_cache_add(cache_trans, seq,
+				       test_fields[TEST_FIELD_OTHER].idx,
+				       "other", 5);
+		}
+	} T_END;
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+}
+
+static void test_cache_add_all(struct mail_index *index)
+{
+	test_cache_append(index);
+	test_cache_add_fields(index, (1 << TEST_FIELD_COUNT) - 1);
+}
+
+static void test_cache_compress(struct mail_index *index)
+{
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	struct mail_cache_compress_lock *lock;
+
+	/* pretend that compression is wanted */
+	if (mail_cache_open_and_verify(index->cache) == 0 &&
+	    !MAIL_CACHE_IS_UNUSABLE(index->cache)) {
+		index->cache->need_compress_file_seq =
+			index->cache->hdr->file_seq;
+	}
+
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	test_assert(mail_cache_compress(index->cache, trans, &lock) == 0);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_cache_compress_unlock(&lock);
+	mail_index_view_close(&view);
+}
+
+static void test_cache_compress_step(struct mail_index *index)
+{
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	struct mail_cache_compress_lock *lock;
+
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	test_assert(mail_cache_compress_step(index->cache, trans, &lock) == 0);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_cache_compress_unlock(&lock);
+	mail_index_view_close(&view);
+}
+
+static void test_cache_expunge(struct mail_index *index, uint32_t seq)
+{
+	struct mail_index_sync_ctx *sync_ctx;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+
+	test_assert(mail_index_sync_begin(index, &sync_ctx, &view,
+					  &trans, 0) == 1);
+	mail_index_expunge(trans, seq);
+	test_assert(mail_index_sync_commit(&sync_ctx) == 0);
+}
+
+static void test_cache_verify(struct mail_index *index)
+{
+	struct mail_index_view *view;
+	struct mail_cache_view *cache_view;
+	buffer_t *buf = buffer_create_dynamic(pool_datastack_create(), 64);
+	uint32_t seq, uid, value;
+	const char *str;
+
+	view = mail_index_view_open(index);
+	cache_view = mail_cache_view_open(index->cache, view);
+	for (seq = 1; seq <= mail_index_view_get_messages_count(view); seq++) T_BEGIN {
+		mail_index_lookup_uid(view, seq, &uid);
+		test_assert_idx(mail_cache_field_exists_any(cache_view, seq), uid);
+
+		buffer_set_used_size(buf, 0);
+		if (uid % 7 == 0) {
+			test_assert_idx(mail_cache_lookup_field(cache_view, buf, seq,
+					test_fields[TEST_FIELD_FIXED].idx) == 0, uid);
+		} else {
+			test_assert_idx(mail_cache_lookup_field(cache_view, buf, seq,
+					test_fields[TEST_FIELD_FIXED].idx) == 1, uid);
+			test_assert_idx(buf->used == sizeof(value) &&
+					memcmp(buf->data, &uid, sizeof(uid)) == 0, uid);
+		}
+
+		buffer_set_used_size(buf, 0);
+		str = test_var_value(uid);
+		test_assert_idx(mail_cache_lookup_field(cache_view, buf, seq,
+				test_fields[TEST_FIELD_VAR].idx) == 1, uid);
+		test_assert_idx(buf->used == strlen(str) &&
+				memcmp(buf->data, str, buf->used) == 0, uid);
+
+		buffer_set_used_size(buf, 0);
+		test_assert_idx(mail_cache_lookup_field(cache_view, buf, seq,
+				test_fields[TEST_FIELD_BITMASK].idx) == 1, uid);
+		value = 0x01 | (uid << 8);
+		test_assert_idx(buf->used == sizeof(value) &&
+				memcmp(buf->data, &value, sizeof(value)) == 0, uid);
+
+		buffer_set_used_size(buf, 0);
+		test_assert_idx(mail_cache_lookup_field(cache_view, buf, seq,
+				test_fields[TEST_FIELD_OTHER].idx) ==
+				(uid % 3 == 0 ? 1 : 0), uid);
+	} T_END;
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+}
+
+static void
+test_cache_verify_range(struct mail_index *index, uint32_t seq1, uint32_t seq2)
+{
+	struct mail_index_view *view;
+	struct mail_cache_view *cache_view;
+	struct mail_cache_lookup_value *values, *value;
+	buffer_t *dest_buf = buffer_create_dynamic(pool_datastack_create(), 64);
+	buffer_t *buf = buffer_create_dynamic(pool_datastack_create(), 64);
+	unsigned int field_idxs[TEST_FIELD_COUNT];
+	unsigned int i;
+	uint32_t seq;
+	int ret;
+
+	/* look up the fields in reverse order to make sure the positions
+	   aren't mixed up */
+	for (i = 0; i < TEST_FIELD_COUNT; i++)
+		field_idxs[i] = test_fields[TEST_FIELD_COUNT-1 - i].idx;
+
+	view = mail_index_view_open(index);
+	cache_view = mail_cache_view_open(index->cache, view);
+	values = t_new(struct mail_cache_lookup_value,
+		       (seq2 - seq1 + 1) * TEST_FIELD_COUNT);
+	/* existing data in dest_buf is preserved */
+	buffer_append(dest_buf, "xyz", 3);
+	test_assert(mail_cache_lookup_field_range(cache_view, dest_buf,
+						  seq1, seq2, field_idxs,
+						  TEST_FIELD_COUNT,
+						  values) == 0);
+	test_assert(memcmp(dest_buf->data, "xyz", 3) == 0);
+
+	value = values;
+	for (seq = seq1; seq <= seq2; seq++) {
+		for (i = 0; i < TEST_FIELD_COUNT; i++, value++) {
+			buffer_set_used_size(buf, 0);
+			ret = mail_cache_lookup_field(cache_view, buf, seq,
+						      field_idxs[i]);
+			if (ret <= 0) {
+				test_assert_idx(value->data == NULL, seq);
+				continue;
+			}
+			test_assert_idx(value->data != NULL &&
+					value->size == buf->used &&
+					memcmp(value->data, buf->data,
+					       buf->used) == 0, seq);
+		}
+	}
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+}
+
+static void test_mail_cache_lookup_field_range(void)
+{
+	const char *column_fields[] = { "fixed", "var", NULL };
+	struct mail_index *index;
+	const char *error;
+
+	(void)unlink_directory(TESTDIR_NAME, UNLINK_DIRECTORY_FLAG_RMDIR, &error);
+	if (mkdir(TESTDIR_NAME, 0700) < 0)
+		i_error("mkdir(%s) failed: %m", TESTDIR_NAME);
+	ioloop_time = 1;
+
+	test_begin("mail cache lookup field range");
+	index = test_index_open();
+	test_cache_add_all(index);
+	test_cache_verify_range(index, 1, TEST_MSG_COUNT);
+	test_cache_verify_range(index, 7, 7);
+	test_cache_verify_range(index, 20, 35);
+
+	/* some of the fields in columns, some in records */
+	mail_cache_set_column_fields(index->cache, column_fields);
+	test_cache_compress(index);
+	test_cache_expunge(index, 10);
+	test_cache_verify_range(index, 1, TEST_MSG_COUNT - 1);
+	test_cache_verify_range(index, 5, 15);
+
+	mail_index_close(index);
+	mail_index_free(&index);
+	(void)unlink_directory(TESTDIR_NAME, UNLINK_DIRECTORY_FLAG_RMDIR, &error);
+	test_end();
+}
+
+static void
+test_mail_cache_columns_flags(enum mail_index_open_flags flags,
+			      const char *name)
+{
+	const char *column_fields[] = { "fixed", "var", "bitmask", NULL };
+	struct mail_index *index;
+	const char *error;
+	unsigned int i;
+
+	(void)unlink_directory(TESTDIR_NAME, UNLINK_DIRECTORY_FLAG_RMDIR, &error);
+	if (mkdir(TESTDIR_NAME, 0700) < 0)
+		i_error("mkdir(%s) failed: %m", TESTDIR_NAME);
+	ioloop_time = 1;
+
+	test_begin(name);
+	index = test_index_open_flags(flags);
+	test_cache_add_all(index);
+	test_cache_verify(index);
+
+	/* move the fields to columns */
+	mail_cache_set_column_fields(index->cache, column_fields);
+	test_cache_compress(index);
+	test_assert((index->cache->hdr->flags &
+		     MAIL_CACHE_HEADER_FLAG_COLUMNS) != 0);
+	test_assert(mail_cache_columns_read(index->cache) == 0);
+	test_assert(index->cache->columns_hdr.columns_count == 3);
+	test_assert(index->cache->columns_hdr.messages_count == TEST_MSG_COUNT);
+	test_cache_verify(index);
+
+	/* sequences no longer match the column rows */
+	test_cache_expunge(index, 1);
+	test_cache_expunge(index, 50);
+	test_cache_verify(index);
+	test_assert(index->cache->column_uids != NULL);
+	/* each column's bitmap and ends were read only once */
+	for (i = 0; i < index->cache->columns_hdr.columns_count; i++) {
+		test_assert_idx(index->cache->column_metas[i].exists != NULL, i);
+		test_assert_idx((index->cache->column_metas[i].ends != NULL) ==
+				(index->cache->columns[i].field_size ==
+				 (uint32_t)-1), i);
+	}
+
+	/* reopening reads the columns from the file */
+	mail_index_close(index);
+	mail_index_free(&index);
+	index = test_index_open_flags(flags);
+	test_cache_verify(index);
+
+	/* compressing again keeps the values in the columns */
+	mail_cache_set_column_fields(index->cache, column_fields);
+	test_cache_compress(index);
+	test_assert(mail_cache_columns_read(index->cache) == 0);
+	test_assert(index->cache->columns_hdr.messages_count ==
+		    TEST_MSG_COUNT - 2);
+	test_cache_verify(index);
+
+	/* and without the column fields they're moved back to records */
+	mail_index_close(index);
+	mail_index_free(&index);
+	index = test_index_open_flags(flags);
+	test_cache_compress(index);
+	test_assert((index->cache->hdr->flags &
+		     MAIL_CACHE_HEADER_FLAG_COLUMNS) == 0);
+	test_cache_verify(index);
+
+	mail_index_close(index);
+	mail_index_free(&index);
+	(void)unlink_directory(TESTDIR_NAME, UNLINK_DIRECTORY_FLAG_RMDIR, &error);
+	test_end();
+}
+
+static void test_mail_cache_columns(void)
+{
+	test_mail_cache_columns_flags(0, "mail cache columns");
+	test_mail_cache_columns_flags(MAIL_INDEX_OPEN_FLAG_MMAP_DISABLE,
+				      "mail cache columns mmap_disable");
+}
+
+static void test_mail_cache_compress_incremental(void)
+{
+	struct mail_cache_compress_stats stats;
+	struct mail_index *index;
+	const char *error;
+	unsigned int i;
+
+	(void)unlink_directory(TESTDIR_NAME, UNLINK_DIRECTORY_FLAG_RMDIR, &error);
+	if (mkdir(TESTDIR_NAME, 0700) < 0)
+		i_error("mkdir(%s) failed: %m", TESTDIR_NAME);
+	ioloop_time = 1;
+
+	test_begin("mail cache compress incremental");
+	index = test_index_open();
+	mail_cache_set_compress_chunk(index->cache, 30);
+	test_cache_append(index);
+	test_cache_add_fields(index, (1 << TEST_FIELD_FIXED) |
+			      (1 << TEST_FIELD_VAR));
+
+	/* the first step copies only the first chunk */
+	test_assert(mail_cache_open_and_verify(index->cache) == 0);
+	index->cache->need_compress_file_seq = index->cache->hdr->file_seq;
+	test_cache_compress_step(index);
+	test_assert(index->cache->compress_incr != NULL);
+	test_assert(index->cache->need_compress_file_seq != 0);
+
+	/* the already copied messages change, and one of the messages is
+	   expunged. the sync also continues the compression. */
+	test_cache_add_fields(index, (1 << TEST_FIELD_BITMASK) |
+			      (1 << TEST_FIELD_OTHER));
+	test_cache_expunge(index, 40);
+	test_assert(index->cache->compress_incr != NULL);
+
+	for (i = 0; i < 10 && index->cache->compress_incr != NULL; i++)
+		test_cache_compress_step(index);
+	test_assert(index->cache->compress_incr == NULL);
+	test_assert(index->cache->need_compress_file_seq == 0);
+
+	mail_cache_get_compress_stats(index->cache, &stats);
+	/* the cache file's creation is counted as well */
+	test_assert(stats.compress_count == 2);
+	test_assert(stats.step_count == 4);
+	test_assert(stats.max_lock_usecs >= stats.last_lock_usecs);
+
+	/* the first chunk was copied again */
+	test_assert(index->cache->hdr->record_count == TEST_MSG_COUNT - 1);
+	test_assert(index->cache->hdr->deleted_record_count == 30);
+	test_cache_verify(index);
+
+	/* the compressed file is also readable after reopening */
+	mail_index_close(index);
+	mail_index_free(&index);
+	index = test_index_open();
+	test_cache_verify(index);
+
+	mail_index_close(index);
+	mail_index_free(&index);
+	(void)unlink_directory(TESTDIR_NAME, UNLINK_DIRECTORY_FLAG_RMDIR, &error);
+	test_end();
+}
+
+#define TEST_INCR_STATE_PATH TESTDIR_NAME"/test.dovecot.index.cache.incr.state"
+#define TEST_INCR_TEMP_PATH TESTDIR_NAME"/test.dovecot.index.cache.incr.tmp"
+
+static void test_mail_cache_compress_incremental_start(struct mail_index *index)
+{
+	mail_cache_set_compress_chunk(index->cache, 30);
+	test_assert(mail_cache_open_and_verify(index->cache) == 0);
+	index->cache->need_compress_file_seq = index->cache->hdr->file_seq;
+	test_cache_compress_step(index);
+	test_assert(index->cache->compress_incr != NULL);
+}
+
+static void test_mail_cache_compress_incremental_resume(void)
+{
+	struct mail_cache_compress_stats stats;
+	struct mail_index *index;
+	struct stat st;
+	const char *error;
+	unsigned int i;
+
+	(void)unlink_directory(TESTDIR_NAME, UNLINK_DIRECTORY_FLAG_RMDIR, &error);
+	if (mkdir(TESTDIR_NAME, 0700) < 0)
+		i_error("mkdir(%s) failed: %m", TESTDIR_NAME);
+	ioloop_time = 1;
+
+	test_begin("mail cache compress incremental resume");
+	index = test_index_open();
+	test_cache_append(index);
+	test_cache_add_fields(index, (1 << TEST_FIELD_FIXED) |
+			      (1 << TEST_FIELD_VAR));
+	test_mail_cache_compress_incremental_start(index);
+
+	/* closing the cache saves the progress */
+	mail_index_close(index);
+	mail_index_free(&index);
+	test_assert(stat(TEST_INCR_STATE_PATH, &st) == 0);
+	test_assert(stat(TEST_INCR_TEMP_PATH, &st) == 0);
+
+	/* the next process continues after the first chunk. the messages
+	   that were already copied change meanwhile. */
+	index = test_index_open();
+	test_cache_add_fields(index, (1 << TEST_FIELD_BITMASK) |
+			      (1 << TEST_FIELD_OTHER));
+	mail_cache_set_compress_chunk(index->cache, 30);
+	test_assert(mail_cache_open_and_verify(index->cache) == 0);
+	index->cache->need_compress_file_seq = index->cache->hdr->file_seq;
+	for (i = 0; i < 10 && index->cache->need_compress_file_seq != 0; i++)
+		test_cache_compress_step(index);
+	test_assert(index->cache->compress_incr == NULL);
+	test_assert(index->cache->need_compress_file_seq == 0);
+	test_assert(stat(TEST_INCR_STATE_PATH, &st) < 0 && errno == ENOENT);
+
+	mail_cache_get_compress_stats(index->cache, &stats);
+	test_assert(stats.step_count == 3);
+	test_assert(index->cache->hdr->record_count == TEST_MSG_COUNT);
+	test_assert(index->cache->hdr->deleted_record_count == 30);
+	test_cache_verify(index);
+
+	/* a full compression drops the saved progress */
+	test_mail_cache_compress_incremental_start(index);
+	mail_index_close(index);
+	mail_index_free(&index);
+	index = test_index_open();
+	test_cache_compress(index);
+	test_assert(stat(TEST_INCR_STATE_PATH, &st) < 0 && errno == ENOENT);
+	test_assert(stat(TEST_INCR_TEMP_PATH, &st) < 0 && errno == ENOENT);
+	test_cache_verify(index);
+
+	mail_index_close(index);
+	mail_index_free(&index);
+	(void)unlink_directory(TESTDIR_NAME, UNLINK_DIRECTORY_FLAG_RMDIR, &error);
+	test_end();
+}
+
+static void test_mail_cache_header_value_parse(void)
+{
+	static const char headers[] =
+		"To: a\n\tb\nTo: c\n";
+	const unsigned char *hdr;
+	unsigned int lines_count;
+	uint32_t lines[3] = { 2, 5, 0 };
+	buffer_t *buf;
+	size_t size;
+
+	test_begin("mail cache header value parse");
+	buf = buffer_create_dynamic(pool_datastack_create(), 64);
+	buffer_append(buf, lines, sizeof(lines));
+	buffer_append(buf, headers, sizeof(headers)-1);
+	test_assert(mail_cache_header_value_parse(buf->data, buf->used,
+						  &lines_count, &hdr, &size));
+	test_assert(lines_count == 2);
+	test_assert(size == sizeof(headers)-1 &&
+		    memcmp(hdr, headers, size) == 0);
+	/* the first header continues on the next line */
+	test_assert(mail_cache_header_line_size(hdr, size) == 9);
+	test_assert(mail_cache_header_line_size(hdr + 9, size - 9) == 6);
+	/* without the trailing LF */
+	test_assert(mail_cache_header_line_size(hdr + 9, 5) == 5);
+	test_assert(mail_cache_header_line_size(hdr, 0) == 0);
+
+	/* no headers, just the line numbers' terminator */
+	test_assert(mail_cache_header_value_parse(&lines[2], sizeof(uint32_t),
+						  &lines_count, &hdr, &size));
+	test_assert(lines_count == 0 && size == 0);
+
+	/* the line numbers aren't terminated */
+	test_assert(!mail_cache_header_value_parse(lines, sizeof(uint32_t)*2,
+						   &lines_count, &hdr, &size));
+	test_assert(!mail_cache_header_value_parse(lines, 3, &lines_count,
+						   &hdr, &size));
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_mail_cache_columns,
+		test_mail_cache_lookup_field_range,
+		test_mail_cache_compress_incremental,
+		test_mail_cache_compress_incremental_resume,
+		test_mail_cache_header_value_parse,
+		NULL
+	};
+	return test_run(test_functions);
+}
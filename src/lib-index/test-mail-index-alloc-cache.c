@@ -0,0 +1,140 @@
+/* Copyright (c) 2017 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "unlink-directory.h"
+#include "test-common.h"
+#include "mail-index-private.h"
+#include "mail-index-alloc-cache.h"
+
+#include <sys/stat.h>
+
+#define TESTDIR_NAME ".dovecot.test"
+
+static struct mail_index_alloc_cache_stats prev_stats;
+
+static void test_cache_set(unsigned int max_count, uoff_t max_size,
+			   unsigned int max_owner_count)
+{
+	struct mail_index_alloc_cache_settings set;
+
+	i_zero(&set);
+	set.max_count = max_count;
+	set.max_size = max_size;
+	set.max_owner_count = max_owner_count;
+	set.timeout_secs = 60;
+	mail_index_alloc_cache_set_settings(&set);
+	mail_index_alloc_cache_get_stats(&prev_stats);
+}
+
+static void test_cache_get_stats(struct mail_index_alloc_cache_stats *stats_r)
+{
+	/* return the changes since the last call */
+	mail_index_alloc_cache_get_stats(stats_r);
+	stats_r->hits -= prev_stats.hits;
+	stats_r->misses -= prev_stats.misses;
+	stats_r->evictions -= prev_stats.evictions;
+	mail_index_alloc_cache_get_stats(&prev_stats);
+}
+
+static void test_index_use(const char *owner, const char *name)
+{
+	struct mail_index *index;
+	const char *dir = t_strconcat(TESTDIR_NAME"/", name, NULL);
+
+	if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+		i_fatal("mkdir(%s) failed: %m", dir);
+	index = mail_index_alloc_cache_get(owner, dir, dir,
+					   "test.dovecot.index");
+	test_assert(mail_index_open_or_create(index,
+					      MAIL_INDEX_OPEN_FLAG_CREATE) == 0);
+	mail_index_close(index);
+	mail_index_alloc_cache_unref(&index);
+}
+
+static void test_mail_index_alloc_cache_lru(void)
+{
+	struct mail_index_alloc_cache_stats stats;
+	struct ioloop *ioloop = io_loop_create();
+	const char *error;
+
+	(void)unlink_directory(TESTDIR_NAME, UNLINK_DIRECTORY_FLAG_RMDIR, &error);
+	if (mkdir(TESTDIR_NAME, 0700) < 0)
+		i_error("mkdir(%s) failed: %m", TESTDIR_NAME);
+
+	test_begin("mail index alloc cache lru");
+	test_cache_set(2, 0, 0);
+	test_index_use("user", "a");
+	test_index_use("user", "b");
+	test_index_use("user", "c");
+	test_cache_get_stats(&stats);
+	test_assert(stats.misses == 3 && stats.hits == 0);
+	test_assert(stats.evictions == 1 && stats.cached_count == 2);
+	test_assert(stats.cached_size > 0);
+
+	/* "a" was the least recently used */
+	test_index_use("user", "b");
+	test_index_use("user", "a");
+	test_cache_get_stats(&stats);
+	test_assert(stats.hits == 1 && stats.misses == 1);
+	/* now "c" was dropped */
+	test_index_use("user", "c");
+	test_cache_get_stats(&stats);
+	test_assert(stats.hits == 0 && stats.misses == 1);
+	test_assert(stats.cached_count == 2);
+
+	mail_index_alloc_cache_destroy_unrefed();
+	io_loop_destroy(&ioloop);
+	test_end();
+}
+
+static void test_mail_index_alloc_cache_limits(void)
+{
+	struct mail_index_alloc_cache_stats stats;
+	struct ioloop *ioloop = io_loop_create();
+	const char *error;
+
+	test_begin("mail index alloc cache owner limit");
+	test_cache_set(10, 0, 1);
+	test_index_use("user1", "a");
+	test_index_use("user1", "b");
+	test_index_use("user2", "c");
+	test_cache_get_stats(&stats);
+	test_assert(stats.evictions == 1 && stats.cached_count == 2);
+	test_index_use("user2", "c");
+	test_index_use("user1", "b");
+	test_cache_get_stats(&stats);
+	test_assert(stats.hits == 2 && stats.misses == 0);
+	mail_index_alloc_cache_destroy_unrefed();
+	test_end();
+
+	test_begin("mail index alloc cache size limit");
+	test_cache_set(10, 1, 0);
+	test_index_use("user", "a");
+	test_cache_get_stats(&stats);
+	test_assert(stats.evictions == 1 && stats.cached_count == 0);
+	test_end();
+
+	test_begin("mail index alloc cache timeout");
+	test_cache_set(10, 0, 0);
+	test_index_use("user", "a");
+	test_cache_get_stats(&stats);
+	test_assert(stats.cached_count == 1);
+	ioloop_time += 61;
+	mail_index_alloc_cache_evict_unused();
+	test_cache_get_stats(&stats);
+	test_assert(stats.cached_count == 0 && stats.evictions == 0);
+	io_loop_destroy(&ioloop);
+	(void)unlink_directory(TESTDIR_NAME, UNLINK_DIRECTORY_FLAG_RMDIR, &error);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_mail_index_alloc_cache_lru,
+		test_mail_index_alloc_cache_limits,
+		NULL
+	};
+	return test_run(test_functions);
+}
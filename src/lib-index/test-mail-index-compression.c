@@ -0,0 +1,189 @@
+/* Copyright (c) 2017 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "unlink-directory.h"
+#include "compression.h"
+#include "test-common.h"
+#include "mail-index-private.h"
+#include "mail-transaction-log-private.h"
+
+#include <sys/stat.h>
+
+#define TESTDIR_NAME ".dovecot.test"
+#define TEST_MSG_COUNT 1000
+
+static struct istream *test_create_istream(struct istream *input)
+{
+	const struct compression_handler *handler;
+
+	handler = compression_detect_handler(input);
+	if (handler == NULL)
+		return NULL;
+	return handler->create_istream(input, TRUE);
+}
+
+static struct ostream *
+test_create_ostream(struct ostream *output, const char *name, int level)
+{
+	return compression_lookup_handler(name)->create_ostream(output, level);
+}
+
+static const struct mail_index_compression test_compression = {
+	.create_istream = test_create_istream,
+	.create_ostream = test_create_ostream
+};
+
+static struct mail_index *test_index_open(void)
+{
+	struct mail_index *index;
+
+	index = mail_index_alloc(TESTDIR_NAME, "test.dovecot.index");
+	mail_index_set_compression(index, "gz", 6);
+	test_assert(mail_index_open_or_create(index,
+					      MAIL_INDEX_OPEN_FLAG_CREATE) == 0);
+	return index;
+}
+
+static void test_index_close(struct mail_index **index)
+{
+	mail_index_close(*index);
+	mail_index_free(index);
+}
+
+static void test_index_append(struct mail_index *index, unsigned int count)
+{
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	uint32_t seq, uid, uid_validity = 1234;
+
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view,
+			MAIL_INDEX_TRANSACTION_FLAG_EXTERNAL);
+	if (mail_index_view_get_messages_count(view) == 0) {
+		mail_index_update_header(trans,
+			offsetof(struct mail_index_header, uid_validity),
+			&uid_validity, sizeof(uid_validity), TRUE);
+	}
+	uid = mail_index_get_header(view)->next_uid;
+	for (; count > 0; count--, uid++)
+		mail_index_append(trans, uid, &seq);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_index_view_close(&view);
+}
+
+static void test_index_write(struct mail_index *index, bool rotate)
+{
+	struct mail_index_sync_ctx *sync_ctx;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+
+	test_assert(mail_index_sync_begin(index, &sync_ctx, &view, &trans,
+					  0) == 1);
+	index->need_recreate = TRUE;
+	if (rotate)
+		test_assert(mail_transaction_log_rotate(index->log, FALSE) == 0);
+	test_assert(mail_index_sync_commit(&sync_ctx) == 0);
+}
+
+static void test_index_verify(struct mail_index *index, unsigned int count)
+{
+	struct mail_index_view *view;
+	uint32_t uid;
+
+	view = mail_index_view_open(index);
+	test_assert(mail_index_view_get_messages_count(view) == count);
+	mail_index_lookup_uid(view, count, &uid);
+	test_assert(uid == count);
+	mail_index_view_close(&view);
+}
+
+static uint8_t test_file_compat_flags(const char *path, uoff_t offset,
+				      uoff_t *size_r)
+{
+	struct stat st;
+	uint8_t flags = 0;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	if (pread(fd, &flags, 1, offset) != 1 || fstat(fd, &st) < 0)
+		i_fatal("read(%s) failed: %m", path);
+	i_close_fd(&fd);
+	*size_r = st.st_size;
+	return flags;
+}
+
+static void test_mail_index_compression(void)
+{
+	struct mail_index *index;
+	struct mail_transaction_log_file *file;
+	const char *error, *reason;
+	uoff_t size, log_size, index_size;
+	uint32_t file_seq;
+
+	(void)unlink_directory(TESTDIR_NAME, UNLINK_DIRECTORY_FLAG_RMDIR, &error);
+	if (mkdir(TESTDIR_NAME, 0700) < 0)
+		i_error("mkdir(%s) failed: %m", TESTDIR_NAME);
+	ioloop_time = 1;
+	mail_index_register_compression(&test_compression);
+
+	test_begin("mail index compression");
+	index = test_index_open();
+	test_index_append(index, TEST_MSG_COUNT);
+	test_index_write(index, FALSE);
+	test_assert((test_file_compat_flags(index->filepath,
+		offsetof(struct mail_index_header, compat_flags), &size) &
+		     MAIL_INDEX_COMPAT_COMPRESSED) != 0);
+	test_assert(size < TEST_MSG_COUNT * index->map->hdr.record_size);
+
+	/* rotate the log while writing the index */
+	test_index_append(index, TEST_MSG_COUNT);
+	file_seq = index->log->head->hdr.file_seq;
+	test_index_write(index, TRUE);
+	test_assert(index->log->head->hdr.prev_file_seq == file_seq);
+	log_size = index->log->head->hdr.prev_file_offset;
+	test_assert((test_file_compat_flags(index->log->filepath2,
+		offsetof(struct mail_transaction_log_header, compat_flags),
+		&size) & MAIL_INDEX_COMPAT_COMPRESSED) != 0);
+	test_assert(size < log_size);
+	test_index_close(&index);
+
+	/* read the compressed index and the compressed .log.2 */
+	index = test_index_open();
+	test_index_verify(index, TEST_MSG_COUNT*2);
+	test_assert(mail_transaction_log_find_file(index->log, file_seq, FALSE,
+						   &file, &reason) == 1);
+	test_assert(file->compressed);
+	test_assert(mail_transaction_log_file_map(file, file->hdr.hdr_size,
+						  (uoff_t)-1) == 1);
+	test_assert(file->sync_offset == log_size);
+	test_index_close(&index);
+
+	/* the files can't be read without decompression support, but they
+	   must not be treated as corrupted either */
+	mail_index_unregister_compression(&test_compression);
+	(void)test_file_compat_flags(TESTDIR_NAME"/test.dovecot.index",
+		offsetof(struct mail_index_header, compat_flags), &index_size);
+	index = mail_index_alloc(TESTDIR_NAME, "test.dovecot.index");
+	test_expect_error_string("compression support isn't loaded");
+	test_assert(mail_index_open(index, 0) == -1);
+	mail_index_free(&index);
+	test_assert((test_file_compat_flags(TESTDIR_NAME"/test.dovecot.index",
+		offsetof(struct mail_index_header, compat_flags), &size) &
+		     MAIL_INDEX_COMPAT_COMPRESSED) != 0);
+	test_assert(size == index_size);
+
+	(void)unlink_directory(TESTDIR_NAME, UNLINK_DIRECTORY_FLAG_RMDIR, &error);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_mail_index_compression,
+		NULL
+	};
+	return test_run(test_functions);
+}
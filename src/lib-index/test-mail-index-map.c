@@ -2,11 +2,17 @@
 
 #include "lib.h"
 #include "array.h"
+#include "ioloop.h"
+#include "unlink-directory.h"
 #include "test-common.h"
 #include "mail-index-private.h"
 #include "mail-index-modseq.h"
 #include "mail-index-transaction-private.h"
 
+#include <sys/stat.h>
+
+#define TESTDIR_NAME ".dovecot.test"
+
 static void test_mail_index_map_lookup_seq_range_count(unsigned int messages_count)
 {
 	struct mail_index_record_map rec_map;
@@ -47,10 +53,202 @@ static void test_mail_index_map_lookup_seq_range(void)
 	test_end();
 }
 
+static void test_mail_index_map_lookup_seq_range_large(void)
+{
+	struct mail_index_record_map rec_map;
+	struct mail_index_map map;
+	uint32_t seq, first_seq, last_seq;
+	const unsigned int count = 10000;
+
+	test_begin("mail index map lookup seq range large");
+	i_zero(&map);
+	i_zero(&rec_map);
+	map.rec_map = &rec_map;
+	map.hdr.record_size = sizeof(struct mail_index_record) + 20;
+	rec_map.records_count = count;
+	rec_map.records = i_malloc(count * map.hdr.record_size);
+	for (seq = 1; seq <= count; seq++)
+		MAIL_INDEX_REC_AT_SEQ(&map, seq)->uid = seq*2;
+
+	/* UIDs are copied to the lookup array only up to messages_count */
+	map.hdr.messages_count = count/2;
+	map.hdr.next_uid = count + 1;
+	mail_index_map_lookup_seq_range(&map, 3, count, &first_seq, &last_seq);
+	test_assert(first_seq == 2 && last_seq == count/2);
+	test_assert(rec_map.uid_lookup_count == count/2);
+
+	/* appended records are added to it */
+	map.hdr.messages_count = count;
+	map.hdr.next_uid = count*2 + 1;
+	for (seq = 1; seq <= count; seq++) {
+		mail_index_map_lookup_seq_range(&map, seq*2, seq*2,
+						&first_seq, &last_seq);
+		test_assert(first_seq == seq && last_seq == seq);
+		mail_index_map_lookup_seq_range(&map, seq*2-1, seq*2+2,
+						&first_seq, &last_seq);
+		test_assert(first_seq == seq &&
+			    last_seq == I_MIN(seq+1, count));
+	}
+	test_assert(rec_map.uid_lookup_count == count);
+
+	/* expunge the second half's even sequences */
+	for (seq = count/2 + 1; seq <= count; seq++)
+		MAIL_INDEX_REC_AT_SEQ(&map, seq)->uid = count + (seq-count/2)*4;
+	mail_index_record_map_truncate_uid_lookup(&rec_map, count/2);
+	map.hdr.messages_count = count;
+	map.hdr.next_uid = count*3 + 1;
+	mail_index_map_lookup_seq_range(&map, count+1, count+3,
+					&first_seq, &last_seq);
+	test_assert(first_seq == 0 && last_seq == 0);
+	mail_index_map_lookup_seq_range(&map, count+4, count+4,
+					&first_seq, &last_seq);
+	test_assert(first_seq == count/2 + 1 && last_seq == count/2 + 1);
+	mail_index_map_lookup_seq_range(&map, count, count*3,
+					&first_seq, &last_seq);
+	test_assert(first_seq == count/2 && last_seq == count);
+
+	i_free(rec_map.uid_lookup);
+	i_free(rec_map.records);
+	test_end();
+}
+
+static void test_index_append(struct mail_index *index, unsigned int count)
+{
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	uint32_t seq, uid, uid_validity = 1234;
+
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view,
+			MAIL_INDEX_TRANSACTION_FLAG_EXTERNAL);
+	if (mail_index_view_get_messages_count(view) == 0) {
+		mail_index_update_header(trans,
+			offsetof(struct mail_index_header, uid_validity),
+			&uid_validity, sizeof(uid_validity), TRUE);
+	}
+	uid = mail_index_get_header(view)->next_uid;
+	for (; count > 0; count--, uid++)
+		mail_index_append(trans, uid, &seq);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_index_view_close(&view);
+}
+
+static void test_index_write(struct mail_index *index)
+{
+	struct mail_index_sync_ctx *sync_ctx;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+
+	test_assert(mail_index_sync_begin(index, &sync_ctx, &view, &trans,
+					  0) == 1);
+	index->need_recreate = TRUE;
+	test_assert(mail_index_sync_commit(&sync_ctx) == 0);
+}
+
+static struct mail_index *test_index_open(void)
+{
+	struct mail_index *index;
+
+	index = mail_index_alloc(TESTDIR_NAME, "test.dovecot.index");
+	test_assert(mail_index_open_or_create(index,
+			MAIL_INDEX_OPEN_FLAG_CREATE |
+			MAIL_INDEX_OPEN_FLAG_MMAP_DISABLE) == 0);
+	return index;
+}
+
+static void test_mail_index_map_read_deferred(void)
+{
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	const unsigned int count = 2000;
+	const char *error;
+	uint32_t uid, seq;
+
+	(void)unlink_directory(TESTDIR_NAME, UNLINK_DIRECTORY_FLAG_RMDIR, &error);
+	if (mkdir(TESTDIR_NAME, 0700) < 0)
+		i_error("mkdir(%s) failed: %m", TESTDIR_NAME);
+	ioloop_time = 1;
+
+	test_begin("mail index map read deferred");
+	index = test_index_open();
+	test_index_append(index, count);
+	test_index_write(index);
+	mail_index_close(index);
+	mail_index_free(&index);
+
+	/* the header is usable without reading the records */
+	index = test_index_open();
+	test_assert(index->map->rec_map->records_deferred);
+	view = mail_index_view_open(index);
+	test_assert(mail_index_view_get_messages_count(view) == count);
+	test_assert(mail_index_get_header(view)->next_uid == count + 1);
+	test_assert(index->map->rec_map->records_deferred);
+
+	/* records are read on the first access */
+	mail_index_lookup_uid(view, count, &uid);
+	test_assert(uid == count);
+	test_assert(!index->map->rec_map->records_deferred);
+	mail_index_lookup_uid(view, 1, &uid);
+	test_assert(uid == 1);
+	mail_index_view_close(&view);
+	mail_index_close(index);
+	mail_index_free(&index);
+
+	/* appending to a deferred map reads the records first */
+	index = test_index_open();
+	test_assert(index->map->rec_map->records_deferred);
+	test_index_append(index, 1);
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view,
+			MAIL_INDEX_TRANSACTION_FLAG_EXTERNAL);
+	mail_index_update_flags(trans, count, MODIFY_ADD, MAIL_SEEN);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	test_index_write(index);
+	mail_index_view_close(&view);
+	mail_index_close(index);
+	mail_index_free(&index);
+
+	index = test_index_open();
+	view = mail_index_view_open(index);
+	test_assert(mail_index_view_get_messages_count(view) == count + 1);
+	test_assert(mail_index_lookup_seq(view, count + 1, &seq) &&
+		    seq == count + 1);
+	test_assert(mail_index_lookup(view, count)->flags == MAIL_SEEN);
+	test_assert(mail_index_lookup(view, 1)->flags == 0);
+	mail_index_view_close(&view);
+	mail_index_close(index);
+	mail_index_free(&index);
+
+	/* truncating the file before the records are read marks the map
+	   corrupted instead of killing the process */
+	index = test_index_open();
+	test_assert(index->map->rec_map->records_deferred);
+	view = mail_index_view_open(index);
+	if (truncate(index->filepath, index->map->hdr.header_size +
+		     index->map->hdr.record_size) < 0)
+		i_fatal("truncate(%s) failed: %m", index->filepath);
+	test_expect_error_string("File was truncated");
+	mail_index_lookup_uid(view, count + 1, &uid);
+	test_expect_no_more_errors();
+	test_assert(uid == 0);
+	test_assert(mail_index_view_is_inconsistent(view));
+	test_assert((index->map->hdr.flags &
+		     MAIL_INDEX_HDR_FLAG_CORRUPTED) != 0);
+	mail_index_view_close(&view);
+	mail_index_close(index);
+	mail_index_free(&index);
+
+	(void)unlink_directory(TESTDIR_NAME, UNLINK_DIRECTORY_FLAG_RMDIR, &error);
+	test_end();
+}
+
 int main(void)
 {
 	static void (*const test_functions[])(void) = {
 		test_mail_index_map_lookup_seq_range,
+		test_mail_index_map_lookup_seq_range_large,
+		test_mail_index_map_read_deferred,
 		NULL
 	};
 	return test_run(test_functions);
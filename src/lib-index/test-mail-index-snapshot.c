@@ -0,0 +1,177 @@
+/* Copyright (c) 2017 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "unlink-directory.h"
+#include "test-common.h"
+#include "mail-index-private.h"
+
+#include <utime.h>
+#include <sys/stat.h>
+
+#define TESTDIR_NAME ".dovecot.test"
+#define TEST_SNAPSHOT_DIR TESTDIR_NAME"/snapshots"
+/* large enough for the index to be mmap()ed */
+#define TEST_MSG_COUNT 10000
+
+static struct mail_index *test_index_open(void)
+{
+	struct mail_index *index;
+
+	index = mail_index_alloc(TESTDIR_NAME, "test.dovecot.index");
+	mail_index_set_snapshot_dir(index, TEST_SNAPSHOT_DIR);
+	test_assert(mail_index_open_or_create(index,
+					      MAIL_INDEX_OPEN_FLAG_CREATE) == 0);
+	return index;
+}
+
+static void test_index_close(struct mail_index **index)
+{
+	mail_index_close(*index);
+	mail_index_free(index);
+}
+
+static void test_index_append(struct mail_index *index, unsigned int count)
+{
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	uint32_t seq, uid, uid_validity = 1234;
+
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	if (mail_index_view_get_messages_count(view) == 0) {
+		mail_index_update_header(trans,
+			offsetof(struct mail_index_header, uid_validity),
+			&uid_validity, sizeof(uid_validity), TRUE);
+	}
+	uid = mail_index_get_header(view)->next_uid;
+	for (; count > 0; count--, uid++)
+		mail_index_append(trans, uid, &seq);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_index_view_close(&view);
+}
+
+static void test_index_write(struct mail_index *index)
+{
+	struct mail_index_sync_ctx *sync_ctx;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+
+	test_assert(mail_index_sync_begin(index, &sync_ctx, &view, &trans,
+					  0) == 1);
+	index->need_recreate = TRUE;
+	test_assert(mail_index_sync_commit(&sync_ctx) == 0);
+}
+
+static void test_index_verify(struct mail_index *index, unsigned int count)
+{
+	struct mail_index_view *view;
+	uint32_t uid;
+
+	view = mail_index_view_open(index);
+	test_assert(mail_index_view_get_messages_count(view) == count);
+	mail_index_lookup_uid(view, count, &uid);
+	test_assert(uid == count);
+	mail_index_view_close(&view);
+}
+
+static uoff_t test_snapshot_size(struct mail_index *index)
+{
+	struct stat st;
+
+	if (stat(mail_index_snapshot_get_path(index), &st) < 0)
+		return 0;
+	return st.st_size;
+}
+
+static void test_mail_index_snapshot(void)
+{
+	struct mail_index *index, *index2;
+	struct stat st;
+	struct utimbuf old_times;
+	const char *error, *stale_path;
+	uoff_t snapshot_size;
+	int fd;
+
+	(void)unlink_directory(TESTDIR_NAME, UNLINK_DIRECTORY_FLAG_RMDIR, &error);
+	if (mkdir(TESTDIR_NAME, 0700) < 0)
+		i_error("mkdir(%s) failed: %m", TESTDIR_NAME);
+	ioloop_time = time(NULL);
+
+	test_begin("mail index snapshot");
+	index = test_index_open();
+	test_index_append(index, TEST_MSG_COUNT);
+	test_index_write(index);
+	test_assert(stat(index->filepath, &st) == 0 &&
+		    st.st_size > MAIL_INDEX_MMAP_MIN_SIZE);
+	/* these are only in the transaction log */
+	test_index_append(index, TEST_MSG_COUNT);
+	test_assert(test_snapshot_size(index) == 0);
+	test_index_close(&index);
+
+	/* opening the index syncs the log and publishes the map */
+	index = test_index_open();
+	test_index_verify(index, TEST_MSG_COUNT*2);
+	snapshot_size = test_snapshot_size(index);
+	test_assert(snapshot_size > (uoff_t)st.st_size);
+
+	/* the next process maps the snapshot */
+	index2 = test_index_open();
+	test_assert(index2->map->rec_map->mmap_base != NULL &&
+		    index2->map->rec_map->mmap_size == snapshot_size);
+	test_index_verify(index2, TEST_MSG_COUNT*2);
+
+	/* changes after the snapshot are synced from the log */
+	test_index_append(index2, 1);
+	test_index_close(&index2);
+	index2 = test_index_open();
+	test_assert(index2->map->rec_map->mmap_size == snapshot_size);
+	test_index_verify(index2, TEST_MSG_COUNT*2 + 1);
+	test_index_close(&index2);
+
+
+	/* once the index file is newer, the snapshot is ignored */
+	test_index_write(index);
+	test_index_close(&index);
+	index = test_index_open();
+	test_assert(index->map->rec_map->mmap_size != snapshot_size);
+	test_index_verify(index, TEST_MSG_COUNT*2 + 1);
+
+	/* old snapshots aren't used. writing the next snapshot deletes the
+	   old files from the directory. */
+	test_index_append(index, TEST_MSG_COUNT);
+	test_index_close(&index);
+	index = test_index_open();
+	snapshot_size = test_snapshot_size(index);
+	test_assert(snapshot_size > 0);
+	stale_path = TEST_SNAPSHOT_DIR"/test.dovecot.index.stale";
+	fd = creat(stale_path, 0600);
+	test_assert(fd != -1);
+	i_close_fd(&fd);
+	old_times.actime = old_times.modtime =
+		ioloop_time - MAIL_INDEX_SNAPSHOT_DELETE_SECS - 1;
+	test_assert(utime(mail_index_snapshot_get_path(index), &old_times) == 0);
+	test_assert(utime(stale_path, &old_times) == 0);
+	test_assert(utime(TEST_SNAPSHOT_DIR, &old_times) == 0);
+
+	index2 = test_index_open();
+	test_assert(index2->map->rec_map->mmap_size != snapshot_size);
+	test_index_verify(index2, TEST_MSG_COUNT*3 + 1);
+	test_assert(stat(mail_index_snapshot_get_path(index), &st) == 0 &&
+		    st.st_mtime >= ioloop_time);
+	test_assert(stat(stale_path, &st) < 0 && errno == ENOENT);
+	test_index_close(&index2);
+	test_index_close(&index);
+
+	(void)unlink_directory(TESTDIR_NAME, UNLINK_DIRECTORY_FLAG_RMDIR, &error);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_mail_index_snapshot,
+		NULL
+	};
+	return test_run(test_functions);
+}
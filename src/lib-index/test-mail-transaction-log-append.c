@@ -6,9 +6,17 @@
 #include "mail-index-private.h"
 #include "mail-transaction-log-private.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+
+#define TEST_WRITER_COUNT 5
+#define TEST_WRITER_TRANSACTION_COUNT 50
 
 static bool log_lock_failure = FALSE;
+static bool log_lock_concurrent = FALSE;
 
 void mail_index_file_set_syscall_error(struct mail_index *index ATTR_UNUSED,
 				       const char *filepath ATTR_UNUSED,
@@ -16,14 +24,43 @@ void mail_index_file_set_syscall_error(struct mail_index *index ATTR_UNUSED,
 {
 }
 
-int mail_transaction_log_lock_head(struct mail_transaction_log *log ATTR_UNUSED,
+void mail_index_set_error(struct mail_index *index ATTR_UNUSED,
+			  const char *fmt ATTR_UNUSED, ...)
+{
+}
+
+void mail_index_fchown(struct mail_index *index ATTR_UNUSED,
+		       int fd ATTR_UNUSED, const char *path ATTR_UNUSED)
+{
+}
+
+int mail_transaction_log_lock_head(struct mail_transaction_log *log,
 				   const char *lock_reason ATTR_UNUSED)
 {
-	return log_lock_failure ? -1 : 0;
+	struct mail_transaction_log_file *file = log->head;
+	struct stat st;
+
+	if (log_lock_failure)
+		return -1;
+	if (log_lock_concurrent) {
+		/* the real locking also finds the end of the log */
+		if (flock(file->fd, LOCK_EX) < 0)
+			i_fatal("flock() failed: %m");
+		if (fstat(file->fd, &st) < 0)
+			i_fatal("fstat() failed: %m");
+		file->sync_offset = file->last_size = st.st_size;
+	}
+	return 0;
 }
 
-void mail_transaction_log_file_unlock(struct mail_transaction_log_file *file ATTR_UNUSED,
-				      const char *lock_reason ATTR_UNUSED) {}
+void mail_transaction_log_file_unlock(struct mail_transaction_log_file *file,
+				      const char *lock_reason ATTR_UNUSED)
+{
+	if (log_lock_concurrent) {
+		if (flock(file->fd, LOCK_UN) < 0)
+			i_fatal("flock() failed: %m");
+	}
+}
 
 void mail_transaction_update_modseq(const struct mail_transaction_header *hdr,
 				    const void *data ATTR_UNUSED,
@@ -165,10 +202,185 @@ static void test_mail_transaction_log_append(void)
 	i_unlink(tmp_path);
 }
 
+static void ATTR_NORETURN
+test_append_concurrent_writer(const char *path, uint32_t writer_idx,
+			      int start_fd, int stats_fd)
+{
+	struct mail_transaction_log *log;
+	struct mail_transaction_log_file *file;
+	struct mail_transaction_log_append_ctx *ctx;
+	uint32_t data[2];
+	unsigned int i;
+	char c;
+	int ret = 0;
+
+	log = i_new(struct mail_transaction_log, 1);
+	log->index = i_new(struct mail_index, 1);
+	log->index->log = log;
+	log->index->fsync_mode = FSYNC_MODE_ALWAYS;
+	log->index->lock_method = FILE_LOCK_METHOD_FCNTL;
+	log->index->mode = 0600;
+	log->index->log_group_commit = TRUE;
+	log->head = file = i_new(struct mail_transaction_log_file, 1);
+	file->log = log;
+	file->filepath = i_strdup(path);
+	file->hdr.indexid = 1;
+	file->hdr.file_seq = 1;
+	file->fd = open(path, O_RDWR | O_APPEND);
+	if (file->fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	log_lock_concurrent = TRUE;
+
+	/* wait until all the writers exist */
+	if (read(start_fd, &c, 1) < 0)
+		i_fatal("read() failed: %m");
+
+	for (i = 0; i < TEST_WRITER_TRANSACTION_COUNT; i++) {
+		data[0] = writer_idx;
+		data[1] = i;
+		if (mail_transaction_log_append_begin(log->index, 0, &ctx) < 0)
+			test_exit(1);
+		mail_transaction_log_append_add(ctx, MAIL_TRANSACTION_APPEND,
+						data, sizeof(data));
+		if (mail_transaction_log_append_commit(&ctx) < 0)
+			ret = -1;
+	}
+	if (write(stats_fd, &log->index->log_group_commit_stats,
+		  sizeof(log->index->log_group_commit_stats)) < 0)
+		i_fatal("write() failed: %m");
+	test_exit(ret < 0 ? 1 : 0);
+}
+
+static void test_append_wait_size(int fd, off_t size)
+{
+	struct stat st;
+	unsigned int i;
+
+	for (i = 0; i < 10000; i++) {
+		if (fstat(fd, &st) < 0)
+			i_fatal("fstat() failed: %m");
+		if (st.st_size >= size)
+			return;
+		usleep(1000);
+	}
+	i_fatal("Timed out waiting for the writers");
+}
+
+static void test_mail_transaction_log_append_concurrent(void)
+{
+	struct mail_index_log_group_commit_stats stats;
+	const struct mail_transaction_header *hdr;
+	const uint32_t *data;
+	unsigned int next_idx[TEST_WRITER_COUNT];
+	unsigned int i, commit_count = 0, fsync_count = 0;
+	char tmp_path[] = "/tmp/dovecot.test.XXXXXX";
+	const char *fsync_path;
+	struct flock fl;
+	int fd, fsync_fd, start_fd[2], stats_fd[2], status;
+	buffer_t *buf;
+	bool success = TRUE;
+	ssize_t ret;
+
+	test_begin("transaction log append: concurrent group commit");
+	fd = mkstemp(tmp_path);
+	if (fd == -1)
+		i_fatal("mkstemp(%s) failed: %m", tmp_path);
+	if (pipe(start_fd) < 0 || pipe(stats_fd) < 0)
+		i_fatal("pipe() failed: %m");
+
+	/* hold the fsync lock until every writer has written its first
+	   transaction, so they're all waiting for the same group commit */
+	fsync_path = t_strconcat(tmp_path,
+				 MAIL_TRANSACTION_LOG_GROUP_COMMIT_SUFFIX, NULL);
+	fsync_fd = open(fsync_path, O_RDWR | O_CREAT, 0600);
+	if (fsync_fd == -1)
+		i_fatal("open(%s) failed: %m", fsync_path);
+	i_zero(&fl);
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	if (fcntl(fsync_fd, F_SETLK, &fl) < 0)
+		i_fatal("fcntl(%s) failed: %m", fsync_path);
+
+	for (i = 0; i < TEST_WRITER_COUNT; i++) {
+		switch (fork()) {
+		case -1:
+			i_fatal("fork() failed: %m");
+		case 0:
+			i_close_fd(&start_fd[1]);
+			test_append_concurrent_writer(tmp_path, i, start_fd[0],
+						      stats_fd[1]);
+		default:
+			break;
+		}
+	}
+	/* start all the writers at once */
+	i_close_fd(&start_fd[0]);
+	i_close_fd(&start_fd[1]);
+	i_close_fd(&stats_fd[1]);
+	test_append_wait_size(fd, TEST_WRITER_COUNT *
+			      (sizeof(*hdr) + sizeof(uint32_t)*2));
+	i_close_fd(&fsync_fd);
+
+	for (i = 0; i < TEST_WRITER_COUNT; i++) {
+		if (wait(&status) < 0)
+			i_fatal("wait() failed: %m");
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			success = FALSE;
+	}
+	test_assert(success);
+	while ((ret = read(stats_fd[0], &stats, sizeof(stats))) == sizeof(stats)) {
+		commit_count += stats.commit_count;
+		fsync_count += stats.fsync_count;
+		test_assert(stats.max_wait_usecs <= stats.total_wait_usecs);
+	}
+	test_assert(ret == 0);
+	i_close_fd(&stats_fd[0]);
+
+	/* every transaction waited for a group commit. the writers' first
+	   transactions were all made durable by a single fdatasync(). */
+	test_assert(commit_count == TEST_WRITER_COUNT *
+		    TEST_WRITER_TRANSACTION_COUNT);
+	test_assert(fsync_count > 0 &&
+		    fsync_count <= commit_count - (TEST_WRITER_COUNT - 1));
+
+	/* each writer's transactions are in the log in order */
+	buf = buffer_create_dynamic(default_pool, 4096);
+	while ((ret = read(fd, buffer_append_space_unsafe(buf, 4096),
+			   4096)) > 0)
+		buffer_set_used_size(buf, buf->used - 4096 + ret);
+	buffer_set_used_size(buf, buf->used - 4096);
+	test_assert(buf->used == TEST_WRITER_COUNT *
+		    TEST_WRITER_TRANSACTION_COUNT *
+		    (sizeof(*hdr) + sizeof(uint32_t)*2));
+
+	memset(next_idx, 0, sizeof(next_idx));
+	for (i = 0; i + sizeof(*hdr) + sizeof(uint32_t)*2 <= buf->used;
+	     i += sizeof(*hdr) + sizeof(uint32_t)*2) {
+		hdr = CONST_PTR_OFFSET(buf->data, i);
+		data = (const void *)(hdr + 1);
+		test_assert(hdr->type == MAIL_TRANSACTION_APPEND);
+		if (data[0] >= TEST_WRITER_COUNT) {
+			test_assert(data[0] < TEST_WRITER_COUNT);
+			break;
+		}
+		test_assert(data[1] == next_idx[data[0]]);
+		next_idx[data[0]]++;
+	}
+	for (i = 0; i < TEST_WRITER_COUNT; i++)
+		test_assert(next_idx[i] == TEST_WRITER_TRANSACTION_COUNT);
+
+	buffer_free(&buf);
+	i_close_fd(&fd);
+	i_unlink(tmp_path);
+	i_unlink(fsync_path);
+	test_end();
+}
+
 int main(void)
 {
 	static void (*const test_functions[])(void) = {
 		test_mail_transaction_log_append,
+		test_mail_transaction_log_append_concurrent,
 		NULL
 	};
 	return test_run(test_functions);
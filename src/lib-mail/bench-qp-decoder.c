@@ -0,0 +1,106 @@
+/* Copyright (c) 2017 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "str.h"
+#include "time-util.h"
+#include "simd-util.h"
+#include "qp-decoder.h"
+#include "test-common.h"
+
+#include <sys/time.h>
+
+static int
+bench_qp_decode(const string_t *input, unsigned int chunk_size,
+		string_t *output)
+{
+	struct qp_decoder *qp;
+	const char *error;
+	size_t pos, size, error_pos;
+	int ret = 0;
+
+	qp = qp_decoder_init(output);
+	for (pos = 0; pos < str_len(input); pos += size) {
+		size = I_MIN(chunk_size, str_len(input) - pos);
+		if (qp_decoder_more(qp, str_data(input) + pos, size,
+				    &error_pos, &error) < 0)
+			ret = -1;
+	}
+	if (qp_decoder_finish(qp, &error) < 0)
+		ret = -1;
+	qp_decoder_deinit(&qp);
+	return ret;
+}
+
+static unsigned long long
+bench_qp_decoder_usecs(enum simd_features mask, const string_t *input,
+		       string_t *output, int *ret_r)
+{
+	struct timeval start, end;
+	unsigned int i;
+
+	if (gettimeofday(&start, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	simd_set_features_mask(mask);
+	for (i = 0; i < 5; i++) {
+		str_truncate(output, 0);
+		/* feed the input in 8 kB blocks like istream-qp-decoder */
+		*ret_r = bench_qp_decode(input, 8192, output);
+	}
+	simd_set_features_mask((enum simd_features)-1);
+	if (gettimeofday(&end, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	return timeval_diff_usecs(&end, &start);
+}
+
+static void bench_qp_decoder(void)
+{
+	/* mostly plain text with some encoded characters and soft line
+	   breaks, as in a typical quoted-printable text attachment */
+	static const char *words[] = {
+		"the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog",
+		"p=C3=A4iv=C3=A4=C3=A4", "Dovecot", "mailbox", "=3D", "\t"
+	};
+	const size_t input_size = 4*1024*1024;
+	string_t *input, *scalar_output, *simd_output;
+	unsigned long long scalar_usecs, simd_usecs;
+	size_t line_start = 0;
+	const char *word;
+	int scalar_ret, simd_ret;
+
+	input = str_new(default_pool, input_size + 128);
+	while (str_len(input) < input_size) {
+		word = words[rand() % N_ELEMENTS(words)];
+		if (str_len(input) - line_start + strlen(word) > 74) {
+			str_append(input, rand() % 4 == 0 ? "\r\n" : "=\r\n");
+			line_start = str_len(input);
+		} else if (str_len(input) != line_start)
+			str_append_c(input, ' ');
+		str_append(input, word);
+	}
+	scalar_output = str_new(default_pool, input_size);
+	simd_output = str_new(default_pool, input_size);
+
+	scalar_usecs = bench_qp_decoder_usecs(0, input, scalar_output,
+					      &scalar_ret);
+	simd_usecs = bench_qp_decoder_usecs((enum simd_features)-1,
+					    input, simd_output, &simd_ret);
+	test_out_reason("qp-decoder",
+		scalar_ret == 0 && simd_ret == 0 &&
+		str_equals(scalar_output, simd_output),
+		t_strdup_printf("5 x %zu MB: scalar %llu ms, simd %llu ms",
+				str_len(input) / (1024*1024),
+				scalar_usecs / 1000, simd_usecs / 1000));
+	str_free(&input);
+	str_free(&scalar_output);
+	str_free(&simd_output);
+}
+
+/* Not run by "make check". Run with "make benchmark". */
+int main(void)
+{
+	static void (*const bench_functions[])(void) = {
+		bench_qp_decoder,
+		NULL
+	};
+	return test_run(bench_functions);
+}
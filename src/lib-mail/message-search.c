@@ -14,26 +14,55 @@ struct message_search_context {
 	enum message_search_flags flags;
 	normalizer_func_t *normalizer;
 
+	/* str_find_ctx is used with a single key, str_find_multi_ctx with
+	   multiple keys */
 	struct str_find_context *str_find_ctx;
+	struct str_find_multi_context *str_find_multi_ctx;
+	/* number of keys found when found_callback was last called */
+	unsigned int found_count;
+	message_search_found_callback_t *found_callback;
+	void *found_context;
 	struct message_part *prev_part;
 
 	struct message_decoder_context *decoder;
 	bool content_type_text:1; /* text/any or message/any */
+	bool found:1; /* single key was found */
 };
 
+static void message_search_reset_part(struct message_search_context *ctx);
+
 struct message_search_context *
 message_search_init(const char *normalized_key_utf8,
 		    normalizer_func_t *normalizer,
 		    enum message_search_flags flags)
+{
+	const char *keys[] = { normalized_key_utf8, NULL };
+
+	return message_search_init_multi(keys, normalizer, flags);
+}
+
+struct message_search_context *
+message_search_init_multi(const char *const *normalized_keys_utf8,
+			  normalizer_func_t *normalizer,
+			  enum message_search_flags flags)
 {
 	struct message_search_context *ctx;
+	unsigned int i;
 
-	i_assert(*normalized_key_utf8 != '\0');
+	i_assert(normalized_keys_utf8[0] != NULL);
+	for (i = 0; normalized_keys_utf8[i] != NULL; i++)
+		i_assert(normalized_keys_utf8[i][0] != '\0');
 
 	ctx = i_new(struct message_search_context, 1);
 	ctx->flags = flags;
 	ctx->decoder = message_decoder_init(normalizer, 0);
-	ctx->str_find_ctx = str_find_init(default_pool, normalized_key_utf8);
+	if (normalized_keys_utf8[1] == NULL) {
+		ctx->str_find_ctx =
+			str_find_init(default_pool, normalized_keys_utf8[0]);
+	} else {
+		ctx->str_find_multi_ctx =
+			str_find_multi_init(default_pool, normalized_keys_utf8);
+	}
 	return ctx;
 }
 
@@ -42,11 +71,23 @@ void message_search_deinit(struct message_search_context **_ctx)
 	struct message_search_context *ctx = *_ctx;
 
 	*_ctx = NULL;
-	str_find_deinit(&ctx->str_find_ctx);
+	if (ctx->str_find_ctx != NULL)
+		str_find_deinit(&ctx->str_find_ctx);
+	else
+		str_find_multi_deinit(&ctx->str_find_multi_ctx);
 	message_decoder_deinit(&ctx->decoder);
 	i_free(ctx);
 }
 
+#undef message_search_set_found_callback
+void message_search_set_found_callback(struct message_search_context *ctx,
+				       message_search_found_callback_t *callback,
+				       void *context)
+{
+	ctx->found_callback = callback;
+	ctx->found_context = context;
+}
+
 static void parse_content_type(struct message_search_context *ctx,
 			       struct message_header_line *hdr)
 {
@@ -78,19 +119,39 @@ static void handle_header(struct message_search_context *ctx,
 	}
 }
 
+static bool search_more(struct message_search_context *ctx,
+			const unsigned char *data, size_t size)
+{
+	unsigned int found_count;
+
+	if (ctx->str_find_ctx == NULL) {
+		if (str_find_multi_more(ctx->str_find_multi_ctx, data, size))
+			return TRUE;
+		found_count = str_find_multi_get_found_count(
+						ctx->str_find_multi_ctx);
+		if (found_count == ctx->found_count ||
+		    ctx->found_callback == NULL)
+			return FALSE;
+		/* new keys were found. maybe they're enough already. */
+		ctx->found_count = found_count;
+		return ctx->found_callback(ctx->found_context);
+	}
+	if (!str_find_more(ctx->str_find_ctx, data, size))
+		return FALSE;
+	ctx->found = TRUE;
+	return TRUE;
+}
+
 static bool search_header(struct message_search_context *ctx,
 			  const struct message_header_line *hdr)
 {
 	static const unsigned char crlf[2] = { '\r', '\n' };
 
-	return str_find_more(ctx->str_find_ctx,
-			     (const unsigned char *)hdr->name, hdr->name_len) ||
-		str_find_more(ctx->str_find_ctx,
-			      hdr->middle, hdr->middle_len) ||
-		str_find_more(ctx->str_find_ctx, hdr->full_value,
-			      hdr->full_value_len) ||
-		(!hdr->no_newline &&
-		 str_find_more(ctx->str_find_ctx, crlf, 2));
+	return search_more(ctx, (const unsigned char *)hdr->name,
+			   hdr->name_len) ||
+		search_more(ctx, hdr->middle, hdr->middle_len) ||
+		search_more(ctx, hdr->full_value, hdr->full_value_len) ||
+		(!hdr->no_newline && search_more(ctx, crlf, 2));
 }
 
 static bool message_search_more_decoded2(struct message_search_context *ctx,
@@ -100,7 +161,7 @@ static bool message_search_more_decoded2(struct message_search_context *ctx,
 		if (search_header(ctx, block->hdr))
 			return TRUE;
 	} else {
-		if (str_find_more(ctx->str_find_ctx, block->data, block->size))
+		if (search_more(ctx, block->data, block->size))
 			return TRUE;
 	}
 	return FALSE;
@@ -127,7 +188,7 @@ bool message_search_more_get_decoded(struct message_search_context *ctx,
 	if (raw_block->part != ctx->prev_part) {
 		/* part changes. we must change this before looking at
 		   content type */
-		message_search_reset(ctx);
+		message_search_reset_part(ctx);
 		ctx->prev_part = raw_block->part;
 
 		if (hdr == NULL) {
@@ -173,23 +234,45 @@ bool message_search_more_decoded(struct message_search_context *ctx,
 {
 	if (block->part != ctx->prev_part) {
 		/* part changes */
-		message_search_reset(ctx);
+		message_search_reset_part(ctx);
 		ctx->prev_part = block->part;
 	}
 
 	return message_search_more_decoded2(ctx, block);
 }
 
-void message_search_reset(struct message_search_context *ctx)
+static void message_search_reset_part(struct message_search_context *ctx)
 {
 	/* Content-Type defaults to text/plain */
 	ctx->content_type_text = TRUE;
 
 	ctx->prev_part = NULL;
-	str_find_reset(ctx->str_find_ctx);
+	if (ctx->str_find_ctx != NULL)
+		str_find_reset(ctx->str_find_ctx);
+	else
+		str_find_multi_reset(ctx->str_find_multi_ctx);
 	message_decoder_decode_reset(ctx->decoder);
 }
 
+void message_search_reset(struct message_search_context *ctx)
+{
+	message_search_reset_part(ctx);
+	ctx->found = FALSE;
+	ctx->found_count = 0;
+	if (ctx->str_find_multi_ctx != NULL)
+		str_find_multi_clear_found(ctx->str_find_multi_ctx);
+}
+
+bool message_search_key_found(struct message_search_context *ctx,
+			      unsigned int key_idx)
+{
+	if (ctx->str_find_ctx != NULL) {
+		i_assert(key_idx == 0);
+		return ctx->found;
+	}
+	return str_find_multi_key_found(ctx->str_find_multi_ctx, key_idx);
+}
+
 static int
 message_search_msg_real(struct message_search_context *ctx,
 			struct istream *input, struct message_part *parts,
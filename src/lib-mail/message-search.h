@@ -10,12 +10,35 @@ enum message_search_flags {
 	MESSAGE_SEARCH_FLAG_SKIP_HEADERS	= 0x01
 };
 
+/* Called when more keys have been found. Returns TRUE if the search can be
+   stopped without finding the rest of the keys. */
+typedef bool message_search_found_callback_t(void *context);
+
 /* The key must be given in UTF-8 charset */
 struct message_search_context *
 message_search_init(const char *normalized_key_utf8,
 		    normalizer_func_t *normalizer,
 		    enum message_search_flags flags);
+/* Search multiple keys at once. The keys array is NULL-terminated.
+   The search functions return TRUE only after all the keys have been found,
+   unless message_search_set_found_callback() stops the search earlier.
+   Use message_search_key_found() to check which keys were found. */
+struct message_search_context *
+message_search_init_multi(const char *const *normalized_keys_utf8,
+			  normalizer_func_t *normalizer,
+			  enum message_search_flags flags);
 void message_search_deinit(struct message_search_context **ctx);
+/* With multiple keys, call the callback whenever new keys have been found.
+   If it returns TRUE, the search functions return TRUE as if all the keys
+   had been found. */
+void message_search_set_found_callback(struct message_search_context *ctx,
+				       message_search_found_callback_t *callback,
+				       void *context);
+#define message_search_set_found_callback(ctx, callback, context) \
+	message_search_set_found_callback(ctx, \
+		(message_search_found_callback_t *)callback, \
+		(void *)((char *)context + \
+			 CALLBACK_TYPECHECK(callback, bool (*)(typeof(context)))))
 
 /* Returns TRUE if key is found from input buffer, FALSE if not. */
 bool message_search_more(struct message_search_context *ctx,
@@ -30,6 +53,10 @@ bool message_search_more_get_decoded(struct message_search_context *ctx,
 bool message_search_more_decoded(struct message_search_context *ctx,
 				 struct message_block *block);
 void message_search_reset(struct message_search_context *ctx);
+/* Returns TRUE if the key (index to the keys array, 0 with
+   message_search_init()) has been found since the last reset. */
+bool message_search_key_found(struct message_search_context *ctx,
+			      unsigned int key_idx);
 /* Search a full message. Returns 1 if match was found, 0 if not,
    -1 if error (if stream_error == 0, the parts contained broken data) */
 int message_search_msg(struct message_search_context *ctx,
@@ -3,6 +3,7 @@
 #include "lib.h"
 #include "buffer.h"
 #include "hex-binary.h"
+#include "simd-util.h"
 #include "qp-decoder.h"
 
 /* quoted-printable lines can be max 76 characters. if we've seen more than
@@ -48,6 +49,106 @@ void qp_decoder_deinit(struct qp_decoder **_qp)
 	i_free(qp);
 }
 
+/* Returns TRUE if src[i] can't be copied to output as-is. Whitespace can be
+   copied only if it's followed by something else than whitespace or a
+   newline. */
+#define QP_IS_SPECIAL(src, i, size) \
+	((src)[i] <= '=' && \
+	 ((src)[i] == '=' || (src)[i] == '\r' || (src)[i] == '\n' || \
+	  (QP_IS_TRAILING_WHITESPACE((src)[i]) && \
+	   ((i)+1 == (size) || QP_IS_TRAILING_WHITESPACE((src)[(i)+1]) || \
+	    (src)[(i)+1] == '\r' || (src)[(i)+1] == '\n'))))
+
+static size_t
+qp_text_len_scalar(const unsigned char *src, size_t src_size, size_t i)
+{
+	for (; i < src_size; i++) {
+		if (QP_IS_SPECIAL(src, i, src_size))
+			break;
+	}
+	return i;
+}
+
+#ifdef HAVE_X86_SIMD
+static size_t SIMD_TARGET("sse2")
+qp_text_len_sse2(const unsigned char *src, size_t src_size)
+{
+	const __m128i eq = _mm_set1_epi8('='), cr = _mm_set1_epi8('\r');
+	const __m128i lf = _mm_set1_epi8('\n'), sp = _mm_set1_epi8(' ');
+	const __m128i tab = _mm_set1_epi8('\t');
+	__m128i v, next, special, ws;
+	size_t i;
+	int mask;
+
+	/* the next byte is needed for whitespace */
+	for (i = 0; i + 17 <= src_size; i += 16) {
+		v = _mm_loadu_si128((const void *)(src + i));
+		next = _mm_loadu_si128((const void *)(src + i + 1));
+		special = _mm_or_si128(_mm_cmpeq_epi8(v, eq),
+			_mm_or_si128(_mm_cmpeq_epi8(v, cr),
+				     _mm_cmpeq_epi8(v, lf)));
+		ws = _mm_and_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(v, sp),
+				     _mm_cmpeq_epi8(v, tab)),
+			_mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(next, sp),
+					     _mm_cmpeq_epi8(next, tab)),
+				_mm_or_si128(_mm_cmpeq_epi8(next, cr),
+					     _mm_cmpeq_epi8(next, lf))));
+		mask = _mm_movemask_epi8(_mm_or_si128(special, ws));
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+	return qp_text_len_scalar(src, src_size, i);
+}
+
+static size_t SIMD_TARGET("avx2")
+qp_text_len_avx2(const unsigned char *src, size_t src_size)
+{
+	const __m256i eq = _mm256_set1_epi8('='), cr = _mm256_set1_epi8('\r');
+	const __m256i lf = _mm256_set1_epi8('\n'), sp = _mm256_set1_epi8(' ');
+	const __m256i tab = _mm256_set1_epi8('\t');
+	__m256i v, next, special, ws;
+	size_t i;
+	unsigned int mask;
+
+	for (i = 0; i + 33 <= src_size; i += 32) {
+		v = _mm256_loadu_si256((const void *)(src + i));
+		next = _mm256_loadu_si256((const void *)(src + i + 1));
+		special = _mm256_or_si256(_mm256_cmpeq_epi8(v, eq),
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, cr),
+					_mm256_cmpeq_epi8(v, lf)));
+		ws = _mm256_and_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, sp),
+					_mm256_cmpeq_epi8(v, tab)),
+			_mm256_or_si256(
+				_mm256_or_si256(_mm256_cmpeq_epi8(next, sp),
+						_mm256_cmpeq_epi8(next, tab)),
+				_mm256_or_si256(_mm256_cmpeq_epi8(next, cr),
+						_mm256_cmpeq_epi8(next, lf))));
+		mask = _mm256_movemask_epi8(_mm256_or_si256(special, ws));
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+	return i + qp_text_len_sse2(src + i, src_size - i);
+}
+#endif
+
+/* Returns the number of bytes in the beginning of src that can be copied to
+   the output as-is. */
+static size_t qp_text_len(const unsigned char *src, size_t src_size)
+{
+#ifdef HAVE_X86_SIMD
+	enum simd_features features = simd_get_features();
+
+	if ((features & SIMD_FEATURE_AVX2) != 0)
+		return qp_text_len_avx2(src, src_size);
+	if ((features & SIMD_FEATURE_SSE2) != 0)
+		return qp_text_len_sse2(src, src_size);
+#endif
+	return qp_text_len_scalar(src, src_size, 0);
+}
+
 static size_t
 qp_decoder_more_text(struct qp_decoder *qp, const unsigned char *src,
 		     size_t src_size)
@@ -55,10 +156,9 @@ qp_decoder_more_text(struct qp_decoder *qp, const unsigned char *src,
 	size_t i, start = 0, ret = src_size;
 
 	for (i = 0; i < src_size; i++) {
-		if (src[i] > '=') {
-			/* fast path */
-			continue;
-		}
+		i += qp_text_len(src + i, src_size - i);
+		if (i == src_size)
+			break;
 		switch (src[i]) {
 		case '=':
 			qp->state = STATE_EQUALS;
@@ -79,7 +179,7 @@ qp_decoder_more_text(struct qp_decoder *qp, const unsigned char *src,
 			buffer_append_c(qp->whitespace, src[i]);
 			break;
 		default:
-			continue;
+			i_unreached();
 		}
 		ret = i+1;
 		break;
@@ -2,6 +2,7 @@
 
 #include "lib.h"
 #include "str.h"
+#include "istream.h"
 #include "unichar.h"
 #include "message-parser.h"
 #include "message-search.h"
@@ -51,10 +52,91 @@ static void test_message_search_more_get_decoded(void)
 	test_end();
 }
 
+static unsigned int test_found_count;
+
+static bool test_message_search_found(struct message_search_context *ctx)
+{
+	test_found_count++;
+	return message_search_key_found(ctx, 1);
+}
+
+static void test_message_search_multi(void)
+{
+	static const char input[] =
+		"Subject: first\r\n"
+		"Content-Type: multipart/mixed; boundary=\"foo\"\r\n"
+		"\r\n"
+		"--foo\r\n"
+		"Content-Transfer-Encoding: base64\r\n"
+		"\r\n"
+		"c2Vjb25kIHBhcnQ=\r\n"
+		"--foo\r\n"
+		"Content-Type: application/octet-stream\r\n"
+		"\r\n"
+		"third\r\n"
+		"--foo\r\n"
+		"\r\n"
+		"fourth fir\r\n"
+		"--foo\r\n"
+		"\r\n"
+		"st\r\n"
+		"--foo--\r\n";
+	const char *keys[] = {
+		"first", "second part", "third", "fourth", "missing", NULL
+	};
+	struct message_search_context *ctx;
+	struct istream *input_stream;
+	const char *error;
+
+	test_begin("message_search_init_multi()");
+	ctx = message_search_init_multi(keys, NULL, 0);
+	input_stream = i_stream_create_from_data(input, sizeof(input)-1);
+	test_assert(message_search_msg(ctx, input_stream, NULL, &error) == 0);
+	test_assert(message_search_key_found(ctx, 0));
+	test_assert(message_search_key_found(ctx, 1));
+	/* not a text part */
+	test_assert(!message_search_key_found(ctx, 2));
+	test_assert(message_search_key_found(ctx, 3));
+	test_assert(!message_search_key_found(ctx, 4));
+	message_search_deinit(&ctx);
+
+	/* headers skipped, and matches don't continue across parts */
+	ctx = message_search_init_multi(keys, NULL,
+					MESSAGE_SEARCH_FLAG_SKIP_HEADERS);
+	i_stream_seek(input_stream, 0);
+	test_assert(message_search_msg(ctx, input_stream, NULL, &error) == 0);
+	test_assert(!message_search_key_found(ctx, 0));
+	test_assert(message_search_key_found(ctx, 1));
+	test_assert(message_search_key_found(ctx, 3));
+	message_search_deinit(&ctx);
+
+	/* the found callback stops the search before "fourth" */
+	ctx = message_search_init_multi(keys, NULL,
+					MESSAGE_SEARCH_FLAG_SKIP_HEADERS);
+	message_search_set_found_callback(ctx, test_message_search_found, ctx);
+	test_found_count = 0;
+	i_stream_seek(input_stream, 0);
+	test_assert(message_search_msg(ctx, input_stream, NULL, &error) == 1);
+	test_assert(message_search_key_found(ctx, 1));
+	test_assert(!message_search_key_found(ctx, 3));
+	test_assert(test_found_count == 1);
+	message_search_deinit(&ctx);
+
+	/* all keys found */
+	keys[2] = NULL;
+	ctx = message_search_init_multi(keys, NULL, 0);
+	i_stream_seek(input_stream, 0);
+	test_assert(message_search_msg(ctx, input_stream, NULL, &error) == 1);
+	message_search_deinit(&ctx);
+	i_stream_unref(&input_stream);
+	test_end();
+}
+
 int main(void)
 {
 	static void (*const test_functions[])(void) = {
 		test_message_search_more_get_decoded,
+		test_message_search_multi,
 		NULL
 	};
 	return test_run(test_functions);
@@ -2,6 +2,7 @@
 
 #include "lib.h"
 #include "str.h"
+#include "simd-util.h"
 #include "qp-decoder.h"
 #include "test-common.h"
 
@@ -85,10 +86,81 @@ static void test_qp_decoder(void)
 	test_end();
 }
 
+static int
+test_qp_decode_mask(enum simd_features mask, const string_t *input,
+		    unsigned int chunk_size, string_t *output,
+		    size_t *error_pos_r)
+{
+	struct qp_decoder *qp;
+	const char *error;
+	size_t pos, size, error_pos;
+	int ret = 0;
+
+	simd_set_features_mask(mask);
+	qp = qp_decoder_init(output);
+	*error_pos_r = (size_t)-1;
+	for (pos = 0; pos < str_len(input); pos += size) {
+		size = I_MIN(chunk_size, str_len(input) - pos);
+		if (qp_decoder_more(qp, str_data(input) + pos, size,
+				    &error_pos, &error) < 0) {
+			if (ret == 0)
+				*error_pos_r = pos + error_pos;
+			ret = -1;
+		}
+	}
+	if (qp_decoder_finish(qp, &error) < 0)
+		ret = -1;
+	qp_decoder_deinit(&qp);
+	simd_set_features_mask((enum simd_features)-1);
+	return ret;
+}
+
+static void test_qp_decoder_simd(void)
+{
+	static const char *tokens[] = {
+		" ", "\t", "  ", " \t ", "\r\n", "\n", "\r", "=", "=4A",
+		"=4a", "=\r\n", "= \r\n", "=\n", "=x", "=A", " =", "\x80",
+		"foo", "bar baz", "0123456789abcdefghijklmnopqrstuvwxyz"
+	};
+	static const enum simd_features masks[] = {
+		SIMD_FEATURE_SSE2, (enum simd_features)-1
+	};
+	string_t *input, *expected, *output;
+	size_t expected_pos, output_pos;
+	unsigned int i, j, m, len, chunk_size;
+	int expected_ret, ret;
+
+	test_begin("qp-decoder simd");
+	input = t_str_new(512);
+	expected = t_str_new(512);
+	output = t_str_new(512);
+	for (i = 0; i < 5000; i++) {
+		str_truncate(input, 0);
+		len = rand() % 100;
+		for (j = 0; j < len; j++)
+			str_append(input, tokens[rand() % N_ELEMENTS(tokens)]);
+		chunk_size = rand() % 2 == 0 ? UINT_MAX : 1U + rand() % 40;
+
+		str_truncate(expected, 0);
+		expected_ret = test_qp_decode_mask(0, input, chunk_size,
+						   expected, &expected_pos);
+		for (m = 0; m < N_ELEMENTS(masks); m++) {
+			str_truncate(output, 0);
+			ret = test_qp_decode_mask(masks[m], input, chunk_size,
+						  output, &output_pos);
+			test_assert_idx(ret == expected_ret &&
+					output_pos == expected_pos &&
+					str_equals(output, expected), i);
+		}
+	}
+	test_end();
+}
+
 int main(void)
 {
 	static void (*const test_functions[])(void) = {
 		test_qp_decoder,
+		test_qp_decoder_simd,
 		NULL
 	};
 	return test_run(test_functions);
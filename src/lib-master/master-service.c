@@ -9,6 +9,7 @@
 #include "env-util.h"
 #include "home-expand.h"
 #include "process-title.h"
+#include "mempool-stats.h"
 #include "restrict-access.h"
 #include "fd-close-on-exec.h"
 #include "settings-parser.h"
@@ -28,6 +29,9 @@
 /* getenv(MASTER_CONFIG_FILE_ENV) provides path to configuration file/socket */
 #define MASTER_CONFIG_FILE_ENV "CONFIG_FILE"
 
+/* Number of largest pools/data stack frames logged on SIGUSR2 */
+#define MASTER_SERVICE_MEMPOOL_STATS_LOG_COUNT 50
+
 /* getenv(MASTER_DOVECOT_VERSION_ENV) provides master's version number */
 #define MASTER_DOVECOT_VERSION_ENV "DOVECOT_VERSION"
 
@@ -94,6 +98,12 @@ sig_state_changed(const siginfo_t *si ATTR_UNUSED, void *context)
 	master_service_refresh_login_state(service);
 }
 
+static void sig_mempool_stats(const siginfo_t *si ATTR_UNUSED,
+			      void *context ATTR_UNUSED)
+{
+	mempool_stats_log(MASTER_SERVICE_MEMPOOL_STATS_LOG_COUNT);
+}
+
 static void master_service_verify_version_string(struct master_service *service)
 {
 	if (service->version_string != NULL &&
@@ -514,6 +524,12 @@ void master_service_init_finish(struct master_service *service)
 		lib_signals_set_handler(SIGUSR1, LIBSIG_FLAGS_SAFE,
 					sig_state_changed, service);
 	}
+	if (mempool_stats_enabled) {
+		/* DEBUG_MEMPOOL_STATS environment is set - log the memory
+		   usage when requested */
+		lib_signals_set_handler(SIGUSR2, LIBSIG_FLAGS_SAFE,
+					sig_mempool_stats, NULL);
+	}
 
 	if ((service->flags & MASTER_SERVICE_FLAG_STANDALONE) == 0) {
 		if (fstat(MASTER_STATUS_FD, &st) < 0 || !S_ISFIFO(st.st_mode))
@@ -9,8 +9,8 @@ void dbox_attachment_save_write_metadata(struct mail_save_context *ctx,
 					 string_t *str);
 
 /* Build a single message body stream out of the current message and all of its
-   attachments. */
-int dbox_attachment_file_get_stream(struct dbox_file *file,
+   attachments. If prefetch is TRUE, start reading the attachments already. */
+int dbox_attachment_file_get_stream(struct dbox_file *file, bool prefetch,
 				    struct istream **stream);
 
 #endif
@@ -281,8 +281,65 @@ get_mail_stream(struct dbox_mail *mail, uoff_t offset,
 	}
 	if (file->storage->attachment_dir == NULL)
 		return 1;
-	else
-		return dbox_attachment_file_get_stream(file, stream_r);
+	else {
+		return dbox_attachment_file_get_stream(file,
+				mail->prefetch_attachments, stream_r);
+	}
+}
+
+bool dbox_mail_prefetch(struct mail *_mail)
+{
+	struct dbox_mail *mail = (struct dbox_mail *)_mail;
+	struct index_mail_data *data = &mail->imail.data;
+	struct istream *input;
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED)
+	struct dbox_file *file;
+	uoff_t len;
+#endif
+	int ret;
+
+	if (data->access_part == 0) {
+		/* everything we need is cached */
+		return TRUE;
+	}
+	if (data->stream != NULL) {
+		/* already opened */
+		return !data->prefetch_sent;
+	}
+
+	/* NOTE: Opening the stream isn't asynchronous. It reads the mail's
+	   dbox metadata (and with mdbox the map index) already here, so only
+	   the reads after it are really prefetched. If the body is wanted,
+	   opening the stream also starts prefetching the external
+	   attachments. */
+	mail->prefetch_attachments =
+		(data->access_part & (READ_BODY | PARSE_BODY)) != 0;
+	ret = mail_get_stream_because(_mail, NULL, NULL, "prefetch", &input);
+	mail->prefetch_attachments = FALSE;
+	if (ret < 0)
+		return TRUE;
+	data->prefetch_sent = TRUE;
+
+/* HAVE_POSIX_FADVISE alone isn't enough for CentOS 4.9 */
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED)
+	/* the dbox file may contain other mails as well, so tell OS to start
+	   reading only this mail into memory */
+	file = mail->open_file;
+	if (file != NULL && file->fd != -1) {
+		if ((data->access_part & (READ_BODY | PARSE_BODY)) != 0)
+			len = file->cur_physical_size;
+		else
+			len = I_MIN(file->cur_physical_size,
+				    MAIL_READ_HDR_BLOCK_SIZE);
+		len += file->msg_header_size;
+		if (posix_fadvise(file->fd, file->cur_offset, len,
+				  POSIX_FADV_WILLNEED) < 0) {
+			i_error("posix_fadvise(%s) failed: %m",
+				file->cur_path);
+		}
+	}
+#endif
+	return FALSE;
 }
 
 int dbox_mail_get_stream(struct mail *_mail, bool get_body ATTR_UNUSED,
@@ -61,8 +61,8 @@ void mdbox_files_sync_input(struct mdbox_storage *storage)
 	}
 }
 
-static void
-mdbox_close_open_files(struct mdbox_storage *storage, unsigned int close_count)
+void mdbox_close_open_files(struct mdbox_storage *storage,
+			    unsigned int close_count)
 {
 	struct mdbox_file *const *files;
 	unsigned int i, count;
@@ -24,6 +24,9 @@ int mdbox_file_create_fd(struct dbox_file *file, const char *path,
 			 bool parents);
 
 void mdbox_files_free(struct mdbox_storage *storage);
+/* Close up to close_count of the cached files that aren't referenced. */
+void mdbox_close_open_files(struct mdbox_storage *storage,
+			    unsigned int close_count);
 void mdbox_files_sync_input(struct mdbox_storage *storage);
 
 #endif
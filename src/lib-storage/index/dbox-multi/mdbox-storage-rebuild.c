@@ -2,6 +2,7 @@
 
 #include "lib.h"
 #include "array.h"
+#include "buffer.h"
 #include "ioloop.h"
 #include "istream.h"
 #include "hash.h"
@@ -35,6 +36,22 @@ struct mdbox_rebuild_msg {
 	bool seen_zero_ref_in_map:1;
 };
 
+/* Message as returned by the file scanning. It's followed by the GUID
+   string and its NUL. */
+struct mdbox_rebuild_scan_msg {
+	guid_128_t guid_128;
+	uint32_t offset;
+	uint32_t rec_size;
+	uoff_t mail_size;
+	bool have_pop3_uidl;
+	bool have_pop3_order;
+};
+
+struct mdbox_rebuild_file {
+	uint32_t file_id;
+	const char *path;
+};
+
 struct rebuild_msg_mailbox {
 	struct mailbox *box;
 	struct mail_index_sync_ctx *sync_ctx;
@@ -51,6 +68,7 @@ struct mdbox_storage_rebuild_context {
 	struct mdbox_map_mail_index_header orig_map_hdr;
 	HASH_TABLE(uint8_t *, struct mdbox_rebuild_msg *) guid_hash;
 	ARRAY(struct mdbox_rebuild_msg *) msgs;
+	ARRAY(struct mdbox_rebuild_file) files;
 	ARRAY_TYPE(seq_range) seen_file_ids;
 
 	uint32_t rebuild_count;
@@ -79,6 +97,7 @@ mdbox_storage_rebuild_init(struct mdbox_storage *storage,
 	hash_table_create(&ctx->guid_hash, ctx->pool, 0,
 			  guid_128_hash, guid_128_cmp);
 	i_array_init(&ctx->msgs, 512);
+	i_array_init(&ctx->files, 128);
 	i_array_init(&ctx->seen_file_ids, 128);
 
 	ctx->storage->rebuilding_storage = TRUE;
@@ -95,6 +114,7 @@ mdbox_storage_rebuild_deinit(struct mdbox_storage_rebuild_context *ctx)
 	hash_table_destroy(&ctx->guid_hash);
 	pool_unref(&ctx->pool);
 	array_free(&ctx->seen_file_ids);
+	array_free(&ctx->files);
 	array_free(&ctx->msgs);
 	i_free(ctx);
 }
@@ -139,12 +159,10 @@ static void rebuild_scan_metadata(struct mdbox_storage_rebuild_context *ctx,
 		ctx->have_pop3_orders = TRUE;
 }
 
-static int rebuild_file_mails(struct mdbox_storage_rebuild_context *ctx,
-			      struct dbox_file *file, uint32_t file_id)
+static int rebuild_file_mails(struct dbox_file *file, buffer_t *result)
 {
+	struct mdbox_rebuild_scan_msg msg;
 	const char *guid;
-	uint8_t *guid_p;
-	struct mdbox_rebuild_msg *rec, *old_rec;
 	uoff_t offset, prev_offset;
 	bool last, first, fixed = FALSE;
 	int ret;
@@ -190,42 +208,19 @@ static int rebuild_file_mails(struct mdbox_storage_rebuild_context *ctx,
 			ret = 0;
 			break;
 		}
-		rebuild_scan_metadata(ctx, file);
 
-		rec = p_new(ctx->pool, struct mdbox_rebuild_msg, 1);
-		rec->file_id = file_id;
-		rec->offset = offset;
-		rec->rec_size = file->input->v_offset - offset;
-		rec->mail_size = dbox_file_get_plaintext_size(file);
-		mail_generate_guid_128_hash(guid, rec->guid_128);
-		i_assert(!guid_128_is_empty(rec->guid_128));
-		array_append(&ctx->msgs, &rec, 1);
-
-		guid_p = rec->guid_128;
-		old_rec = hash_table_lookup(ctx->guid_hash, guid_p);
-		if (old_rec == NULL)
-			hash_table_insert(ctx->guid_hash, guid_p, rec);
-		else if (rec->mail_size == old_rec->mail_size) {
-			/* two mails' GUID and size are the same, which quite
-			   likely means that their contents are the same as
-			   well. we'll compare the mail sizes instead of the
-			   record sizes, because the records' metadata may
-			   differ.
-
-			   save this duplicate mail with refcount=0 to the map,
-			   so it will eventually be purged. */
-			rec->seen_zero_ref_in_map = TRUE;
-		} else {
-			/* duplicate GUID, but not a duplicate message. */
-			i_error("mdbox %s: Duplicate GUID %s in "
-				"m.%u:%u (size=%"PRIuUOFF_T") and m.%u:%u "
-				"(size=%"PRIuUOFF_T")",
-				ctx->storage->storage_dir, guid,
-				old_rec->file_id, old_rec->offset, old_rec->mail_size,
-				rec->file_id, rec->offset, rec->mail_size);
-			rec->guid_hash_next = old_rec->guid_hash_next;
-			old_rec->guid_hash_next = rec;
-		}
+		i_zero(&msg);
+		msg.have_pop3_uidl = dbox_file_metadata_get(file,
+			DBOX_METADATA_POP3_UIDL) != NULL;
+		msg.have_pop3_order = dbox_file_metadata_get(file,
+			DBOX_METADATA_POP3_ORDER) != NULL;
+		msg.offset = offset;
+		msg.rec_size = file->input->v_offset - offset;
+		msg.mail_size = dbox_file_get_plaintext_size(file);
+		mail_generate_guid_128_hash(guid, msg.guid_128);
+		i_assert(!guid_128_is_empty(msg.guid_128));
+		buffer_append(result, &msg, sizeof(msg));
+		buffer_append(result, guid, strlen(guid)+1);
 	}
 	if (ret < 0)
 		return -1;
@@ -235,6 +230,128 @@ static int rebuild_file_mails(struct mdbox_storage_rebuild_context *ctx,
 		return 1;
 }
 
+static void rebuild_scan_file(unsigned int idx, buffer_t *result,
+			      struct mdbox_storage_rebuild_context *ctx)
+{
+	const struct mdbox_rebuild_file *rfile =
+		array_idx(&ctx->files, idx);
+	struct dbox_file *file;
+	bool deleted;
+	int8_t status;
+	int ret;
+
+	/* the first byte is the file's status, followed by the messages */
+	buffer_append_zero(result, sizeof(status));
+	file = mdbox_file_init(ctx->storage, rfile->file_id);
+	if ((ret = dbox_file_open(file, &deleted)) > 0 && !deleted)
+		ret = rebuild_file_mails(file, result);
+	dbox_file_unref(&file);
+	status = ret;
+	buffer_write(result, 0, &status, sizeof(status));
+}
+
+static void rebuild_add_msg(struct mdbox_storage_rebuild_context *ctx,
+			    uint32_t file_id,
+			    const struct mdbox_rebuild_scan_msg *msg,
+			    const char *guid)
+{
+	struct mdbox_rebuild_msg *rec, *old_rec;
+	uint8_t *guid_p;
+
+	if (msg->have_pop3_uidl)
+		ctx->have_pop3_uidls = TRUE;
+	if (msg->have_pop3_order)
+		ctx->have_pop3_orders = TRUE;
+
+	rec = p_new(ctx->pool, struct mdbox_rebuild_msg, 1);
+	rec->file_id = file_id;
+	rec->offset = msg->offset;
+	rec->rec_size = msg->rec_size;
+	rec->mail_size = msg->mail_size;
+	memcpy(rec->guid_128, msg->guid_128, sizeof(rec->guid_128));
+	array_append(&ctx->msgs, &rec, 1);
+
+	guid_p = rec->guid_128;
+	old_rec = hash_table_lookup(ctx->guid_hash, guid_p);
+	if (old_rec == NULL)
+		hash_table_insert(ctx->guid_hash, guid_p, rec);
+	else if (rec->mail_size == old_rec->mail_size) {
+		/* two mails' GUID and size are the same, which quite
+		   likely means that their contents are the same as
+		   well. we'll compare the mail sizes instead of the
+		   record sizes, because the records' metadata may
+		   differ.
+
+		   save this duplicate mail with refcount=0 to the map,
+		   so it will eventually be purged. */
+		rec->seen_zero_ref_in_map = TRUE;
+	} else {
+		/* duplicate GUID, but not a duplicate message. */
+		i_error("mdbox %s: Duplicate GUID %s in "
+			"m.%u:%u (size=%"PRIuUOFF_T") and m.%u:%u "
+			"(size=%"PRIuUOFF_T")",
+			ctx->storage->storage_dir, guid,
+			old_rec->file_id, old_rec->offset, old_rec->mail_size,
+			rec->file_id, rec->offset, rec->mail_size);
+		rec->guid_hash_next = old_rec->guid_hash_next;
+		old_rec->guid_hash_next = rec;
+	}
+}
+
+static int rebuild_add_file_result(struct mdbox_storage_rebuild_context *ctx,
+				   const struct mdbox_rebuild_file *rfile,
+				   const buffer_t *result)
+{
+	struct mdbox_rebuild_scan_msg msg;
+	const unsigned char *data = result->data;
+	const char *guid;
+	size_t pos, guid_len;
+	int8_t status;
+
+	i_assert(result->used >= sizeof(status));
+	memcpy(&status, data, sizeof(status));
+	for (pos = sizeof(status); pos < result->used; ) {
+		i_assert(result->used - pos > sizeof(msg));
+		memcpy(&msg, data + pos, sizeof(msg));
+		pos += sizeof(msg);
+		guid = (const char *)data + pos;
+		guid_len = strlen(guid);
+		i_assert(pos + guid_len < result->used);
+		pos += guid_len + 1;
+
+		rebuild_add_msg(ctx, rfile->file_id, &msg, guid);
+	}
+	if (status == 0) {
+		i_error("mdbox rebuild: Failed to fix file %s", rfile->path);
+		return 0;
+	}
+	return status < 0 ? -1 : 0;
+}
+
+static int rebuild_scan_files(struct mdbox_storage_rebuild_context *ctx)
+{
+	const struct mdbox_rebuild_file *files;
+	buffer_t *const *results;
+	unsigned int i, count;
+	int ret = 0;
+
+	files = array_get(&ctx->files, &count);
+	if (index_rebuild_scan(&ctx->storage->storage.storage,
+			       t_strdup_printf("mdbox %s rebuild",
+					       ctx->storage->storage_dir),
+			       count, rebuild_scan_file, ctx,
+			       ctx->pool, &results) < 0)
+		return -1;
+	/* the files may have been fixed by worker processes. make sure we
+	   don't keep using the old file handles. */
+	mdbox_close_open_files(ctx->storage, UINT_MAX);
+
+	for (i = 0; i < count && ret == 0; i++) T_BEGIN {
+		ret = rebuild_add_file_result(ctx, &files[i], results[i]);
+	} T_END;
+	return ret;
+}
+
 static int
 rebuild_rename_file(struct mdbox_storage_rebuild_context *ctx,
 		    const char *dir, const char **fname_p, uint32_t *file_id_r)
@@ -262,11 +379,9 @@ rebuild_rename_file(struct mdbox_storage_rebuild_context *ctx,
 static int rebuild_add_file(struct mdbox_storage_rebuild_context *ctx,
 			    const char *dir, const char *fname)
 {
-	struct dbox_file *file;
+	struct mdbox_rebuild_file *rfile;
 	uint32_t file_id;
 	const char *id_str, *ext;
-	bool deleted;
-	int ret = 0;
 
 	id_str = fname + strlen(MDBOX_MAIL_FILE_PREFIX);
 	if (str_to_uint32(id_str, &file_id) < 0 || file_id == 0) {
@@ -294,13 +409,10 @@ static int rebuild_add_file(struct mdbox_storage_rebuild_context *ctx,
 	}
 	seq_range_array_add(&ctx->seen_file_ids, file_id);
 
-	file = mdbox_file_init(ctx->storage, file_id);
-	if ((ret = dbox_file_open(file, &deleted)) > 0 && !deleted)
-		ret = rebuild_file_mails(ctx, file, file_id);
-	if (ret == 0)
-		i_error("mdbox rebuild: Failed to fix file %s/%s", dir, fname);
-	dbox_file_unref(&file);
-	return ret < 0 ? -1 : 0;
+	rfile = array_append_space(&ctx->files);
+	rfile->file_id = file_id;
+	rfile->path = p_strconcat(ctx->pool, dir, "/", fname, NULL);
+	return 0;
 }
 
 static void
@@ -940,6 +1052,8 @@ static int mdbox_storage_rebuild_scan(struct mdbox_storage_rebuild_context *ctx)
 				ctx->storage->alt_storage_dir, TRUE) < 0)
 			return -1;
 	}
+	if (rebuild_scan_files(ctx) < 0)
+		return -1;
 
 	if (rebuild_apply_map(ctx) < 0 ||
 	    rebuild_mailboxes(ctx) < 0 ||
@@ -2,6 +2,7 @@
 
 #include "lib.h"
 #include "array.h"
+#include "buffer.h"
 #include "index-rebuild.h"
 #include "mail-cache.h"
 #include "sdbox-storage.h"
@@ -24,11 +25,18 @@ static void sdbox_sync_set_uidvalidity(struct index_rebuild_context *ctx)
 		&uid_validity, sizeof(uid_validity), TRUE);
 }
 
-static int
-sdbox_sync_add_file_index(struct index_rebuild_context *ctx,
-			  struct dbox_file *file, uint32_t uid, bool primary)
+struct sdbox_rebuild_file {
+	uint32_t uid;
+	bool primary;
+};
+
+struct sdbox_rebuild_scan_context {
+	struct sdbox_mailbox *mbox;
+	ARRAY(struct sdbox_rebuild_file) files;
+};
+
+static int sdbox_sync_scan_file_open(struct dbox_file *file, bool primary)
 {
-	uint32_t seq;
 	bool deleted;
 	int ret;
 
@@ -56,43 +64,52 @@ sdbox_sync_add_file_index(struct index_rebuild_context *ctx,
 		   it twice. */
 		return 0;
 	}
+	return 1;
+}
 
-	mail_index_append(ctx->trans, uid, &seq);
-	T_BEGIN {
-		index_rebuild_index_metadata(ctx, seq, uid);
-	} T_END;
-	return 0;
+static void sdbox_sync_scan_file(unsigned int idx, buffer_t *result,
+				 struct sdbox_rebuild_scan_context *scan_ctx)
+{
+	const struct sdbox_rebuild_file *rfile =
+		array_idx(&scan_ctx->files, idx);
+	struct dbox_file *file;
+	int8_t status;
+
+	file = sdbox_file_init(scan_ctx->mbox, rfile->uid);
+	if (!rfile->primary)
+		file->cur_path = file->alt_path;
+	/* -1 = error, 0 = skip, 1 = add to index */
+	status = sdbox_sync_scan_file_open(file, rfile->primary);
+	dbox_file_unref(&file);
+	buffer_append(result, &status, sizeof(status));
 }
 
-static int
+static void
 sdbox_sync_add_file(struct index_rebuild_context *ctx,
+		    struct sdbox_rebuild_scan_context *scan_ctx,
 		    const char *fname, bool primary)
 {
-	struct sdbox_mailbox *mbox = (struct sdbox_mailbox *)ctx->box;
-	struct dbox_file *file;
+	struct sdbox_rebuild_file *rfile;
 	uint32_t uid;
-	int ret;
 
 	if (strncmp(fname, SDBOX_MAIL_FILE_PREFIX,
 		    strlen(SDBOX_MAIL_FILE_PREFIX)) != 0)
-		return 0;
+		return;
 	fname += strlen(SDBOX_MAIL_FILE_PREFIX);
 
 	if (str_to_uint32(fname, &uid) < 0 || uid == 0) {
 		i_warning("sdbox %s: Ignoring invalid filename %s",
 			  mailbox_get_path(ctx->box), fname);
-		return 0;
+		return;
 	}
 
-	file = sdbox_file_init(mbox, uid);
-	if (!primary)
-		file->cur_path = file->alt_path;
-	ret = sdbox_sync_add_file_index(ctx, file, uid, primary);
-	dbox_file_unref(&file);
-	return ret;
+	rfile = array_append_space(&scan_ctx->files);
+	rfile->uid = uid;
+	rfile->primary = primary;
 }
 
 static int sdbox_sync_index_rebuild_dir(struct index_rebuild_context *ctx,
+					struct sdbox_rebuild_scan_context *scan_ctx,
 					const char *path, bool primary)
 {
 	struct mail_storage *storage = ctx->box->storage;
@@ -114,13 +131,8 @@ static int sdbox_sync_index_rebuild_dir(struct index_rebuild_context *ctx,
 			"opendir(%s) failed: %m", path);
 		return -1;
 	}
-	do {
-		errno = 0;
-		if ((d = readdir(dir)) == NULL)
-			break;
-
-		ret = sdbox_sync_add_file(ctx, d->d_name, primary);
-	} while (ret >= 0);
+	for (errno = 0; (d = readdir(dir)) != NULL; errno = 0)
+		sdbox_sync_add_file(ctx, scan_ctx, d->d_name, primary);
 	if (errno != 0) {
 		mail_storage_set_critical(storage,
 			"readdir(%s) failed: %m", path);
@@ -135,6 +147,47 @@ static int sdbox_sync_index_rebuild_dir(struct index_rebuild_context *ctx,
 	return ret;
 }
 
+static int
+sdbox_sync_index_rebuild_files(struct index_rebuild_context *ctx,
+			       struct sdbox_rebuild_scan_context *scan_ctx)
+{
+	const struct sdbox_rebuild_file *files;
+	buffer_t *const *results;
+	unsigned int i, count;
+	uint32_t seq;
+	int8_t status;
+	pool_t pool;
+	int ret = 0;
+
+	pool = pool_alloconly_create("sdbox rebuild scan", 1024);
+	files = array_get(&scan_ctx->files, &count);
+	if (index_rebuild_scan(ctx->box->storage,
+			       t_strdup_printf("sdbox %s rebuild",
+					       mailbox_get_path(ctx->box)),
+			       count, sdbox_sync_scan_file, scan_ctx,
+			       pool, &results) < 0) {
+		pool_unref(&pool);
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		i_assert(results[i]->used == sizeof(status));
+		memcpy(&status, results[i]->data, sizeof(status));
+		if (status < 0) {
+			ret = -1;
+			break;
+		}
+		if (status > 0) {
+			mail_index_append(ctx->trans, files[i].uid, &seq);
+			T_BEGIN {
+				index_rebuild_index_metadata(ctx, seq,
+							     files[i].uid);
+			} T_END;
+		}
+	}
+	pool_unref(&pool);
+	return ret;
+}
+
 static void sdbox_sync_update_header(struct index_rebuild_context *ctx)
 {
 	struct sdbox_mailbox *mbox = (struct sdbox_mailbox *)ctx->box;
@@ -155,6 +208,7 @@ static void sdbox_sync_update_header(struct index_rebuild_context *ctx)
 static int
 sdbox_sync_index_rebuild_singles(struct index_rebuild_context *ctx)
 {
+	struct sdbox_rebuild_scan_context scan_ctx;
 	const char *path, *alt_path;
 	int ret = 0;
 
@@ -163,20 +217,29 @@ sdbox_sync_index_rebuild_singles(struct index_rebuild_context *ctx)
 				&alt_path) < 0)
 		return -1;
 
+	i_zero(&scan_ctx);
+	scan_ctx.mbox = (struct sdbox_mailbox *)ctx->box;
+	i_array_init(&scan_ctx.files, 128);
+
 	sdbox_sync_set_uidvalidity(ctx);
-	if (sdbox_sync_index_rebuild_dir(ctx, path, TRUE) < 0) {
+	if (sdbox_sync_index_rebuild_dir(ctx, &scan_ctx, path, TRUE) < 0) {
+		mail_storage_set_critical(ctx->box->storage,
+			"sdbox: Rebuilding failed on path %s",
+			mailbox_get_path(ctx->box));
+		ret = -1;
+	} else if (alt_path != NULL &&
+		   sdbox_sync_index_rebuild_dir(ctx, &scan_ctx,
+						alt_path, FALSE) < 0) {
+		mail_storage_set_critical(ctx->box->storage,
+			"sdbox: Rebuilding failed on alt path %s", alt_path);
+		ret = -1;
+	} else if (sdbox_sync_index_rebuild_files(ctx, &scan_ctx) < 0) {
 		mail_storage_set_critical(ctx->box->storage,
 			"sdbox: Rebuilding failed on path %s",
 			mailbox_get_path(ctx->box));
 		ret = -1;
-	} else if (alt_path != NULL) {
-		if (sdbox_sync_index_rebuild_dir(ctx, alt_path, FALSE) < 0) {
-			mail_storage_set_critical(ctx->box->storage,
-				"sdbox: Rebuilding failed on alt path %s",
-				alt_path);
-			ret = -1;
-		}
 	}
+	array_free(&scan_ctx.files);
 	sdbox_sync_update_header(ctx);
 	return ret;
 }
@@ -397,7 +397,7 @@ bool index_attachment_parse_extrefs(const char *line, pool_t pool,
 }
 
 int index_attachment_stream_get(struct fs *fs, const char *attachment_dir,
-				const char *path_suffix,
+				const char *path_suffix, bool prefetch,
 				struct istream **stream, uoff_t full_size,
 				const char *ext_refs, const char **error_r)
 {
@@ -424,6 +424,12 @@ int index_attachment_stream_get(struct fs *fs, const char *attachment_dir,
 				       extref->path, path_suffix);
 		file = fs_file_init(fs, path, FS_OPEN_MODE_READONLY |
 				    FS_OPEN_FLAG_SEEKABLE);
+		if (prefetch) {
+			/* start reading all the attachments in parallel.
+			   this is especially useful with high latency object
+			   storages. */
+			(void)fs_prefetch(file, 0);
+		}
 		input = i_stream_create_fs_file(&file, IO_BLOCK_SIZE);
 
 		ret = istream_attachment_connector_add(conn, input,
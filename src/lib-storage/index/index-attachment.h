@@ -44,8 +44,10 @@ void index_attachment_append_extrefs(string_t *str,
 bool index_attachment_parse_extrefs(const char *line, pool_t pool,
 				    ARRAY_TYPE(mail_attachment_extref) *extrefs);
 
+/* Replace stream with a stream that includes the external attachments.
+   If prefetch is TRUE, start reading all the attachment files already. */
 int index_attachment_stream_get(struct fs *fs, const char *attachment_dir,
-				const char *path_suffix,
+				const char *path_suffix, bool prefetch,
 				struct istream **stream, uoff_t full_size,
 				const char *ext_refs, const char **error_r);
 
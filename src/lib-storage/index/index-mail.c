@@ -19,6 +19,7 @@
 #include "mail-index-modseq.h"
 #include "index-storage.h"
 #include "istream-mail.h"
+#include "index-sort.h"
 #include "index-mail.h"
 
 #include <fcntl.h>
@@ -63,7 +64,20 @@ struct mail_cache_field global_cache_fields[MAIL_INDEX_CACHE_FIELD_COUNT] = {
 	{ .name = "binary.parts",
 	  .type = MAIL_CACHE_FIELD_VARIABLE_SIZE },
 	{ .name = "body.snippet",
-	  .type = MAIL_CACHE_FIELD_VARIABLE_SIZE }
+	  .type = MAIL_CACHE_FIELD_VARIABLE_SIZE },
+	/* normalized SORT keys, see index_sort_header_get() */
+	{ .name = "sort.cc",
+	  .type = MAIL_CACHE_FIELD_STRING },
+	{ .name = "sort.from",
+	  .type = MAIL_CACHE_FIELD_STRING },
+	{ .name = "sort.subject",
+	  .type = MAIL_CACHE_FIELD_STRING },
+	{ .name = "sort.to",
+	  .type = MAIL_CACHE_FIELD_STRING },
+	{ .name = "sort.displayfrom",
+	  .type = MAIL_CACHE_FIELD_STRING },
+	{ .name = "sort.displayto",
+	  .type = MAIL_CACHE_FIELD_STRING }
 	/* FIXME: for now need to update get_metadata_precache_fields() in
 	   index-status.c when adding more fields. those fields should probably
 	   just be moved here to the same struct. */
@@ -2221,6 +2235,8 @@ void index_mail_precache(struct mail *mail)
 		(void)mail_get_special(mail, MAIL_FETCH_POP3_ORDER, &str);
 	if ((cache & MAIL_FETCH_GUID) != 0)
 		(void)mail_get_special(mail, MAIL_FETCH_GUID, &str);
+	if ((cache & MAIL_FETCH_STREAM_HEADER) != 0)
+		index_sort_precache(mail);
 }
 
 static void
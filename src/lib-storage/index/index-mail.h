@@ -24,6 +24,12 @@ enum index_cache_field {
 	MAIL_CACHE_MESSAGE_PARTS,
 	MAIL_CACHE_BINARY_PARTS,
 	MAIL_CACHE_BODY_SNIPPET,
+	MAIL_CACHE_SORT_CC,
+	MAIL_CACHE_SORT_FROM,
+	MAIL_CACHE_SORT_SUBJECT,
+	MAIL_CACHE_SORT_TO,
+	MAIL_CACHE_SORT_DISPLAYFROM,
+	MAIL_CACHE_SORT_DISPLAYTO,
 
 	MAIL_INDEX_CACHE_FIELD_COUNT
 };
@@ -2,6 +2,11 @@
 
 #include "lib.h"
 #include "array.h"
+#include "buffer.h"
+#include "ioloop.h"
+#include "istream.h"
+#include "time-util.h"
+#include "write-full.h"
 #include "mail-cache.h"
 #include "mail-index-modseq.h"
 #include "mailbox-list-private.h"
@@ -9,6 +14,40 @@
 #include "index-storage.h"
 #include "index-rebuild.h"
 
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/* Log scanning progress this often. This is only logged, so with a proxied
+   doveadm the progress isn't visible to the doveadm client. */
+#define INDEX_REBUILD_PROGRESS_INTERVAL_MSECS (10*1000)
+
+struct index_rebuild_scan_result_hdr {
+	uint32_t idx;
+	uint32_t size;
+};
+
+struct index_rebuild_scan_worker {
+	struct index_rebuild_scan_context *ctx;
+	pid_t pid;
+	int fd;
+	struct istream *input;
+	struct io *io;
+};
+
+struct index_rebuild_scan_context {
+	struct mail_storage *storage;
+	const char *log_prefix;
+	pool_t pool;
+	buffer_t **results;
+	unsigned int count, scanned_count;
+
+	ARRAY(struct index_rebuild_scan_worker) workers;
+	unsigned int running_count;
+	struct ioloop *ioloop;
+	bool failed;
+};
+
 static void
 index_index_copy_cache(struct index_rebuild_context *ctx,
 		       struct mail_index_view *view,
@@ -228,3 +267,230 @@ void index_index_rebuild_deinit(struct index_rebuild_context **_ctx,
 	}
 	i_free(ctx);
 }
+
+static void index_rebuild_scan_progress(struct index_rebuild_scan_context *ctx)
+{
+	i_info("%s: Scanned %u/%u files", ctx->log_prefix,
+	       ctx->scanned_count, ctx->count);
+}
+
+static void
+index_rebuild_scan_serial(struct index_rebuild_scan_context *ctx,
+			  index_rebuild_scan_callback_t *callback,
+			  void *context)
+{
+	struct timeval last_progress = ioloop_timeval;
+	unsigned int i;
+
+	for (i = 0; i < ctx->count; i++) {
+		ctx->results[i] = buffer_create_dynamic(ctx->pool, 64);
+		T_BEGIN {
+			callback(i, ctx->results[i], context);
+		} T_END;
+		ctx->scanned_count++;
+
+		io_loop_time_refresh();
+		if (timeval_diff_msecs(&ioloop_timeval, &last_progress) >=
+		    INDEX_REBUILD_PROGRESS_INTERVAL_MSECS) {
+			index_rebuild_scan_progress(ctx);
+			last_progress = ioloop_timeval;
+		}
+	}
+}
+
+static void ATTR_NORETURN
+index_rebuild_scan_worker_run(int fd, unsigned int first_idx,
+			      unsigned int count, unsigned int step,
+			      index_rebuild_scan_callback_t *callback,
+			      void *context)
+{
+	struct index_rebuild_scan_result_hdr hdr;
+	buffer_t *result = buffer_create_dynamic(default_pool, 256);
+	unsigned int i;
+	int ret = 0;
+
+	for (i = first_idx; i < count && ret == 0; i += step) T_BEGIN {
+		buffer_set_used_size(result, 0);
+		callback(i, result, context);
+
+		hdr.idx = i;
+		hdr.size = result->used;
+		if (write_full(fd, &hdr, sizeof(hdr)) < 0 ||
+		    write_full(fd, result->data, result->used) < 0) {
+			if (errno != EPIPE)
+				i_error("write(rebuild scan pipe) failed: %m");
+			ret = -1;
+		}
+	} T_END;
+	/* don't run any of the parent's deinitialization */
+	_exit(ret < 0 ? 1 : 0);
+}
+
+static void
+index_rebuild_scan_worker_input(struct index_rebuild_scan_worker *worker)
+{
+	struct index_rebuild_scan_context *ctx = worker->ctx;
+	struct index_rebuild_scan_result_hdr hdr;
+	const unsigned char *data;
+	size_t size;
+	ssize_t ret;
+
+	ret = i_stream_read(worker->input);
+	data = i_stream_get_data(worker->input, &size);
+	while (size >= sizeof(hdr)) {
+		memcpy(&hdr, data, sizeof(hdr));
+		if (size - sizeof(hdr) < hdr.size)
+			break;
+		if (hdr.idx >= ctx->count || ctx->results[hdr.idx] != NULL) {
+			i_error("%s: Worker %s returned invalid file index %u",
+				ctx->log_prefix, dec2str(worker->pid), hdr.idx);
+			ctx->failed = TRUE;
+			ret = -1;
+			break;
+		}
+		ctx->results[hdr.idx] = buffer_create_dynamic(ctx->pool,
+							      hdr.size);
+		buffer_append(ctx->results[hdr.idx], data + sizeof(hdr),
+			      hdr.size);
+		ctx->scanned_count++;
+
+		i_stream_skip(worker->input, sizeof(hdr) + hdr.size);
+		data = i_stream_get_data(worker->input, &size);
+	}
+	if (ret >= 0)
+		return;
+
+	if (worker->input->stream_errno != 0) {
+		i_error("%s: read(worker %s) failed: %s", ctx->log_prefix,
+			dec2str(worker->pid), i_stream_get_error(worker->input));
+		ctx->failed = TRUE;
+	}
+	io_remove(&worker->io);
+	if (--ctx->running_count == 0)
+		io_loop_stop(ctx->ioloop);
+}
+
+static void
+index_rebuild_scan_workers(struct index_rebuild_scan_context *ctx,
+			   unsigned int worker_count,
+			   index_rebuild_scan_callback_t *callback,
+			   void *context)
+{
+	struct index_rebuild_scan_worker *worker;
+	struct timeout *to;
+	unsigned int i;
+	int fd[2], status;
+
+	i_array_init(&ctx->workers, worker_count);
+	for (i = 0; i < worker_count; i++) {
+		if (pipe(fd) < 0) {
+			mail_storage_set_critical(ctx->storage,
+						  "pipe() failed: %m");
+			ctx->failed = TRUE;
+			break;
+		}
+		worker = array_append_space(&ctx->workers);
+		worker->ctx = ctx;
+		worker->fd = fd[0];
+		worker->pid = fork();
+		if (worker->pid == 0) {
+			/* child - close the read sides of all the pipes */
+			array_foreach_modifiable(&ctx->workers, worker) {
+				if (worker->fd != -1)
+					i_close_fd(&worker->fd);
+			}
+			index_rebuild_scan_worker_run(fd[1], i, ctx->count,
+						      worker_count,
+						      callback, context);
+		}
+		i_close_fd(&fd[1]);
+		if (worker->pid == -1) {
+			mail_storage_set_critical(ctx->storage,
+						  "fork() failed: %m");
+			i_close_fd(&worker->fd);
+			ctx->failed = TRUE;
+			break;
+		}
+	}
+
+	ctx->ioloop = io_loop_create();
+	array_foreach_modifiable(&ctx->workers, worker) {
+		if (worker->fd == -1)
+			continue;
+		worker->input = i_stream_create_fd(worker->fd, (size_t)-1);
+		worker->io = io_add(worker->fd, IO_READ,
+				    index_rebuild_scan_worker_input, worker);
+		ctx->running_count++;
+	}
+	if (ctx->failed) {
+		/* kill the workers that were already started */
+		array_foreach_modifiable(&ctx->workers, worker) {
+			if (worker->pid > 0)
+				(void)kill(worker->pid, SIGTERM);
+		}
+	}
+	to = timeout_add(INDEX_REBUILD_PROGRESS_INTERVAL_MSECS,
+			 index_rebuild_scan_progress, ctx);
+	if (ctx->running_count > 0)
+		io_loop_run(ctx->ioloop);
+	timeout_remove(&to);
+
+	array_foreach_modifiable(&ctx->workers, worker) {
+		if (worker->pid <= 0)
+			continue;
+		i_stream_destroy(&worker->input);
+		i_close_fd(&worker->fd);
+		if (waitpid(worker->pid, &status, 0) < 0) {
+			i_error("waitpid(%s) failed: %m", dec2str(worker->pid));
+			ctx->failed = TRUE;
+		} else if (status != 0 && !ctx->failed) {
+			i_error("%s: Worker %s exited with status %d",
+				ctx->log_prefix, dec2str(worker->pid), status);
+			ctx->failed = TRUE;
+		}
+	}
+	io_loop_destroy(&ctx->ioloop);
+	array_free(&ctx->workers);
+
+	if (!ctx->failed && ctx->scanned_count != ctx->count) {
+		i_error("%s: Workers scanned only %u/%u files",
+			ctx->log_prefix, ctx->scanned_count, ctx->count);
+		ctx->failed = TRUE;
+	}
+}
+
+#undef index_rebuild_scan
+int index_rebuild_scan(struct mail_storage *storage, const char *log_prefix,
+		       unsigned int count,
+		       index_rebuild_scan_callback_t *callback, void *context,
+		       pool_t pool, buffer_t *const **results_r)
+{
+	struct index_rebuild_scan_context ctx;
+	unsigned int worker_count = storage->set->mail_rebuild_workers;
+
+	i_zero(&ctx);
+	ctx.storage = storage;
+	ctx.log_prefix = log_prefix;
+	ctx.pool = pool;
+	ctx.count = count;
+	if (count == 0) {
+		*results_r = NULL;
+		return 0;
+	}
+	ctx.results = p_new(pool, buffer_t *, count);
+
+	if (worker_count > count)
+		worker_count = count;
+	if (worker_count <= 1)
+		index_rebuild_scan_serial(&ctx, callback, context);
+	else {
+		index_rebuild_scan_workers(&ctx, worker_count,
+					   callback, context);
+		if (ctx.failed) {
+			mail_storage_set_internal_error(storage);
+			return -1;
+		}
+	}
+	*results_r = ctx.results;
+	return 0;
+}
@@ -2,6 +2,7 @@
 #define INDEX_REBUILD_H
 
 struct mailbox_list;
+struct mail_storage;
 
 struct index_rebuild_context {
 	struct mailbox *box;
@@ -29,4 +30,30 @@ void index_index_rebuild_deinit(struct index_rebuild_context **ctx,
 void index_rebuild_index_metadata(struct index_rebuild_context *ctx,
 				  uint32_t new_seq, uint32_t uid);
 
+/* Called once for each file that is scanned. The callback appends whatever
+   it needs later to result. If mail_rebuild_workers is larger than 1, this
+   is called in a forked worker process, so the callback must not change any
+   state that is needed by the parent process. */
+typedef void index_rebuild_scan_callback_t(unsigned int idx, buffer_t *result,
+					   void *context);
+
+/* Call callback for files 0..count-1. Up to mail_rebuild_workers worker
+   processes are used to scan the files in parallel, which bounds the number
+   of concurrent I/O requests. Progress is logged periodically with
+   log_prefix. The results are returned in results_r[idx] in the same order
+   as the files, so the caller can merge them into the index the same way
+   regardless of how many workers were used. The results are allocated from
+   pool. Returns 0 if ok, -1 if the scanning failed. */
+int index_rebuild_scan(struct mail_storage *storage, const char *log_prefix,
+		       unsigned int count,
+		       index_rebuild_scan_callback_t *callback, void *context,
+		       pool_t pool, buffer_t *const **results_r);
+#define index_rebuild_scan(storage, log_prefix, count, callback, context, \
+			   pool, results_r) \
+	index_rebuild_scan(storage, log_prefix, count + \
+		CALLBACK_TYPECHECK(callback, void (*)( \
+			unsigned int, buffer_t *, typeof(context))), \
+		(index_rebuild_scan_callback_t *)callback, \
+		(void *)context, pool, results_r)
+
 #endif
@@ -19,10 +19,15 @@ struct index_search_context {
 	struct mail *cur_mail;
 	struct index_mail *cur_imail;
 	struct mail_thread_context *thread_ctx;
+	/* SEARCH_BODY and SEARCH_TEXT args searched with a single pass */
+	struct search_body_multi *body_multi, *text_multi;
 
 	ARRAY(struct mail *) mails;
 	unsigned int unused_mail_idx;
-	unsigned int max_mails;
+	/* current prefetch window, adjusted between 2 and prefetch_max_mails
+	   based on how long the returned mails take to be handled */
+	unsigned int max_mails, prefetch_max_mails;
+	struct timeval last_mail_return_timeval;
 
 	struct timeval search_start_time, last_notify;
 	struct timeval last_nonblock_timeval;
@@ -33,6 +38,7 @@ struct index_search_context {
 	bool have_seqsets:1;
 	bool have_index_args:1;
 	bool have_mailbox_args:1;
+	bool body_multi_initialized:1;
 };
 
 struct mail *index_search_get_mail(struct index_search_context *ctx);
@@ -37,6 +37,15 @@
 #define SEARCH_INITIAL_MAX_COST 30000
 #define SEARCH_RECALC_MIN_USECS 50000
 
+/* Initial number of mails to prefetch ahead */
+#define SEARCH_PREFETCH_INITIAL_MAILS 4
+/* If the caller spent longer than this handling a returned mail, it was
+   most likely waiting for the mail to be read. Prefetch further ahead. */
+#define SEARCH_PREFETCH_SLOW_USECS 5000
+/* If the caller spent less than this handling a returned mail, the mail was
+   already read by the time it was needed. Prefetch less far ahead. */
+#define SEARCH_PREFETCH_FAST_USECS 500
+
 struct search_header_context {
         struct index_search_context *index_ctx;
         struct index_mail *imail;
@@ -58,6 +67,17 @@ struct search_body_context {
 	struct message_part *part;
 };
 
+ARRAY_DEFINE_TYPE(mail_search_arg_p, struct mail_search_arg *);
+struct search_body_multi {
+	struct message_search_context *msg_search_ctx;
+	/* all the search args, for checking if the result is already known */
+	struct mail_search_arg *search_args;
+	/* the args in the same order as the message search keys */
+	ARRAY_TYPE(mail_search_arg_p) args;
+	/* the args that need to be searched for the current mail */
+	ARRAY_TYPE(mail_search_arg_p) pending_args;
+};
+
 static void search_parse_msgset_args(unsigned int messages_count,
 				     struct mail_search_arg *args,
 				     uint32_t *seq1_r, uint32_t *seq2_r);
@@ -417,6 +437,18 @@ static int search_sent(enum mail_search_arg_type type, time_t search_time,
 	}
 }
 
+static const char *
+msg_search_arg_normalize(struct index_search_context *ctx,
+			 struct mail_search_arg *arg)
+{
+	string_t *dtc = t_str_new(128);
+
+	if (ctx->mail_ctx.normalizer(arg->value.str,
+				     strlen(arg->value.str), dtc) < 0)
+		i_panic("search key not utf8: %s", arg->value.str);
+	return str_c(dtc);
+}
+
 static struct message_search_context *
 msg_search_arg_context(struct index_search_context *ctx,
 		       struct mail_search_arg *arg)
@@ -424,20 +456,16 @@ msg_search_arg_context(struct index_search_context *ctx,
 	enum message_search_flags flags = 0;
 
 	if (arg->context == NULL) T_BEGIN {
-		string_t *dtc = t_str_new(128);
-
-		if (ctx->mail_ctx.normalizer(arg->value.str,
-					     strlen(arg->value.str), dtc) < 0)
-			i_panic("search key not utf8: %s", arg->value.str);
+		const char *key = msg_search_arg_normalize(ctx, arg);
 
 		if (arg->type == SEARCH_BODY)
 			flags |= MESSAGE_SEARCH_FLAG_SKIP_HEADERS;
-		/* we don't get here if arg is "", but dtc can be "" if it
+		/* we don't get here if arg is "", but key can be "" if it
 		   only contains characters that we need to ignore. handle
 		   those searches by returning them as non-matched. */
-		if (str_len(dtc) > 0) {
+		if (key[0] != '\0') {
 			arg->context =
-				message_search_init(str_c(dtc),
+				message_search_init(key,
 						    ctx->mail_ctx.normalizer,
 						    flags);
 		}
@@ -625,26 +653,156 @@ static void search_header(struct message_header_line *hdr,
 	}
 }
 
-static void search_body(struct mail_search_arg *arg,
-			struct search_body_context *ctx)
+static void
+search_body_multi_collect(struct mail_search_arg *arg,
+			  ARRAY_TYPE(mail_search_arg_p) *body_args,
+			  ARRAY_TYPE(mail_search_arg_p) *text_args)
 {
-	struct message_search_context *msg_search_ctx;
-	const char *error;
-	int ret;
+	for (; arg != NULL; arg = arg->next) {
+		switch (arg->type) {
+		case SEARCH_BODY:
+			array_append(body_args, &arg, 1);
+			break;
+		case SEARCH_TEXT:
+			array_append(text_args, &arg, 1);
+			break;
+		case SEARCH_SUB:
+		case SEARCH_OR:
+			search_body_multi_collect(arg->value.subargs,
+						  body_args, text_args);
+			break;
+		default:
+			break;
+		}
+	}
+}
 
-	switch (arg->type) {
-	case SEARCH_BODY:
-	case SEARCH_TEXT:
-		break;
-	default:
-		return;
+static bool
+search_body_multi_find_arg(struct search_body_multi *multi,
+			   struct mail_search_arg *arg, unsigned int *idx_r);
+
+static void
+search_body_multi_set_found(struct search_body_multi *multi)
+{
+	struct mail_search_arg *const *argp;
+	unsigned int idx;
+
+	array_foreach(&multi->pending_args, argp) {
+		if (!search_body_multi_find_arg(multi, *argp, &idx))
+			i_unreached();
+		if (message_search_key_found(multi->msg_search_ctx, idx))
+			ARG_SET_RESULT(*argp, 1);
 	}
+}
 
-	msg_search_ctx = msg_search_arg_context(ctx->index_ctx, arg);
-	if (msg_search_ctx == NULL) {
-		ARG_SET_RESULT(arg, 0);
+static bool search_body_multi_found(struct search_body_multi *multi)
+{
+	/* stop searching as soon as the found keys decide the result. the
+	   keys that aren't found can't be decided before the end. */
+	search_body_multi_set_found(multi);
+	return mail_search_args_foreach(multi->search_args, search_none,
+					(void *)NULL) >= 0;
+}
+
+static struct search_body_multi *
+search_body_multi_init(struct index_search_context *ctx,
+		       const ARRAY_TYPE(mail_search_arg_p) *args,
+		       enum message_search_flags flags)
+{
+	struct search_body_multi *multi;
+	struct mail_search_arg *const *argp;
+	ARRAY_TYPE(const_string) keys;
+	const char *key;
+
+	if (array_count(args) < 2)
+		return NULL;
+
+	multi = i_new(struct search_body_multi, 1);
+	i_array_init(&multi->args, array_count(args));
+	i_array_init(&multi->pending_args, array_count(args));
+	t_array_init(&keys, array_count(args) + 1);
+	array_foreach(args, argp) {
+		if ((*argp)->value.str[0] == '\0')
+			continue;
+		key = msg_search_arg_normalize(ctx, *argp);
+		if (key[0] == '\0') {
+			/* never matches - search_body() handles it */
+			continue;
+		}
+		array_append(&multi->args, argp, 1);
+		array_append(&keys, &key, 1);
+	}
+	if (array_count(&keys) < 2) {
+		array_free(&multi->args);
+		array_free(&multi->pending_args);
+		i_free(multi);
+		return NULL;
+	}
+	array_append_zero(&keys);
+	multi->search_args = ctx->mail_ctx.args->args;
+	multi->msg_search_ctx =
+		message_search_init_multi(array_idx(&keys, 0),
+					  ctx->mail_ctx.normalizer, flags);
+	message_search_set_found_callback(multi->msg_search_ctx,
+					  search_body_multi_found, multi);
+	return multi;
+}
+
+static void search_body_multi_init_all(struct index_search_context *ctx)
+{
+	ARRAY_TYPE(mail_search_arg_p) body_args, text_args;
+
+	ctx->body_multi_initialized = TRUE;
+	T_BEGIN {
+		t_array_init(&body_args, 8);
+		t_array_init(&text_args, 8);
+		search_body_multi_collect(ctx->mail_ctx.args->args,
+					  &body_args, &text_args);
+		ctx->body_multi = search_body_multi_init(ctx, &body_args,
+					MESSAGE_SEARCH_FLAG_SKIP_HEADERS);
+		ctx->text_multi = search_body_multi_init(ctx, &text_args, 0);
+	} T_END;
+}
+
+static void search_body_multi_deinit(struct search_body_multi **_multi)
+{
+	struct search_body_multi *multi = *_multi;
+
+	if (multi == NULL)
 		return;
+	*_multi = NULL;
+
+	message_search_deinit(&multi->msg_search_ctx);
+	array_free(&multi->args);
+	array_free(&multi->pending_args);
+	i_free(multi);
+}
+
+static bool
+search_body_multi_find_arg(struct search_body_multi *multi,
+			   struct mail_search_arg *arg, unsigned int *idx_r)
+{
+	struct mail_search_arg *const *args;
+	unsigned int i, count;
+
+	if (multi == NULL)
+		return FALSE;
+
+	args = array_get(&multi->args, &count);
+	for (i = 0; i < count; i++) {
+		if (args[i] == arg) {
+			*idx_r = i;
+			return TRUE;
+		}
 	}
+	return FALSE;
+}
+
+static int search_body_msg(struct search_body_context *ctx,
+			   struct message_search_context *msg_search_ctx)
+{
+	const char *error;
+	int ret;
 
 	i_stream_seek(ctx->input, 0);
 	ret = message_search_msg(msg_search_ctx, ctx->input, ctx->part, &error);
@@ -661,8 +819,78 @@ static void search_body(struct mail_search_arg *arg,
 			"read(%s) failed: %s", i_stream_get_name(ctx->input),
 			i_stream_get_error(ctx->input));
 	}
+	return ret;
+}
+
+static void search_body(struct mail_search_arg *arg,
+			struct search_body_context *ctx)
+{
+	struct message_search_context *msg_search_ctx;
+	struct search_body_multi *multi;
+	unsigned int idx;
+
+	switch (arg->type) {
+	case SEARCH_BODY:
+		multi = ctx->index_ctx->body_multi;
+		break;
+	case SEARCH_TEXT:
+		multi = ctx->index_ctx->text_multi;
+		break;
+	default:
+		return;
+	}
+
+	if (search_body_multi_find_arg(multi, arg, &idx)) {
+		/* searched later together with the other keys */
+		array_append(&multi->pending_args, &arg, 1);
+		return;
+	}
+
+	msg_search_ctx = msg_search_arg_context(ctx->index_ctx, arg);
+	if (msg_search_ctx == NULL) {
+		ARG_SET_RESULT(arg, 0);
+		return;
+	}
+	ARG_SET_RESULT(arg, search_body_msg(ctx, msg_search_ctx));
+}
+
+static void
+search_body_multi_pending(struct search_body_context *ctx,
+			  struct search_body_multi *multi)
+{
+	struct mail_search_arg *const *argp;
+	unsigned int idx;
+	int ret;
+
+	if (multi == NULL || array_count(&multi->pending_args) == 0)
+		return;
+
+	ret = search_body_msg(ctx, multi->msg_search_ctx);
+	if (ret > 0) {
+		/* the search was stopped, because the found keys already
+		   decided the result. the rest of the keys weren't necessarily
+		   searched for. */
+		search_body_multi_set_found(multi);
+		array_clear(&multi->pending_args);
+		return;
+	}
+	array_foreach(&multi->pending_args, argp) {
+		if (!search_body_multi_find_arg(multi, *argp, &idx))
+			i_unreached();
+		if (ret < 0)
+			ARG_SET_RESULT(*argp, -1);
+		else if (message_search_key_found(multi->msg_search_ctx, idx))
+			ARG_SET_RESULT(*argp, 1);
+		else
+			ARG_SET_RESULT(*argp, 0);
+	}
+	array_clear(&multi->pending_args);
+}
 
-	ARG_SET_RESULT(arg, ret);
+static void search_body_multi_clear(struct search_body_multi *multi)
+{
+	if (multi != NULL)
+		array_clear(&multi->pending_args);
 }
 
 static int search_arg_match_text(struct mail_search_arg *args,
@@ -777,7 +1005,24 @@ static int search_arg_match_text(struct mail_search_arg *args,
 	body_ctx.input = input;
 	(void)mail_get_parts(ctx->cur_mail, &body_ctx.part);
 
-	return mail_search_args_foreach(args, search_body, &body_ctx);
+	/* OR'ed BODY and TEXT keys are searched with a single pass over the
+	   message. search_body() only collects them. */
+	if (!ctx->body_multi_initialized)
+		search_body_multi_init_all(ctx);
+	ret = mail_search_args_foreach(args, search_body, &body_ctx);
+	if (ret < 0) {
+		search_body_multi_pending(&body_ctx, ctx->body_multi);
+		ret = mail_search_args_foreach(args, search_none,
+					       (void *)NULL);
+	}
+	if (ret < 0) {
+		search_body_multi_pending(&body_ctx, ctx->text_multi);
+		ret = mail_search_args_foreach(args, search_none,
+					       (void *)NULL);
+	}
+	search_body_multi_clear(ctx->body_multi);
+	search_body_multi_clear(ctx->text_multi);
+	return ret;
 }
 
 static bool
@@ -1163,13 +1408,17 @@ wanted_sort_fields_get(struct mailbox *box,
 
 		switch (sort_program[i] & MAIL_SORT_MASK) {
 		case MAIL_SORT_ARRIVAL:
-			*wanted_fields_r |= MAIL_FETCH_RECEIVED_DATE;
+			/* the primary date sort key is looked up in
+			   index_sort_list_finish() for all the mails at once */
+			if (i > 0)
+				*wanted_fields_r |= MAIL_FETCH_RECEIVED_DATE;
 			break;
 		case MAIL_SORT_CC:
 			header = "Cc";
 			break;
 		case MAIL_SORT_DATE:
-			*wanted_fields_r |= MAIL_FETCH_DATE;
+			if (i > 0)
+				*wanted_fields_r |= MAIL_FETCH_DATE;
 			break;
 		case MAIL_SORT_FROM:
 			header = "From";
@@ -1218,9 +1467,11 @@ index_storage_search_init(struct mailbox_transaction_context *t,
 	ctx->mail_ctx.args = args;
 	ctx->mail_ctx.sort_program = index_sort_program_init(t, sort_program);
 
-	ctx->max_mails = t->box->storage->set->mail_prefetch_count + 1;
-	if (ctx->max_mails == 0)
-		ctx->max_mails = UINT_MAX;
+	ctx->prefetch_max_mails = t->box->storage->set->mail_prefetch_count + 1;
+	if (ctx->prefetch_max_mails == 0)
+		ctx->prefetch_max_mails = UINT_MAX;
+	ctx->max_mails = I_MIN(ctx->prefetch_max_mails,
+			       SEARCH_PREFETCH_INITIAL_MAILS);
 	ctx->next_time_check_cost = SEARCH_INITIAL_MAX_COST;
 	if (gettimeofday(&ctx->last_nonblock_timeval, NULL) < 0)
 		i_fatal("gettimeofday() failed: %m");
@@ -1282,6 +1533,8 @@ int index_storage_search_deinit(struct mail_search_context *_ctx)
 	mail_search_args_reset(ctx->mail_ctx.args->args, FALSE);
 	(void)mail_search_args_foreach(ctx->mail_ctx.args->args,
 				       search_arg_deinit, ctx);
+	search_body_multi_deinit(&ctx->body_multi);
+	search_body_multi_deinit(&ctx->text_multi);
 
 	if (ctx->mail_ctx.wanted_headers != NULL)
 		mailbox_header_lookup_unref(&ctx->mail_ctx.wanted_headers);
@@ -1418,7 +1671,7 @@ static int search_match_next(struct index_search_context *ctx)
 	}
 
 	/* avoid doing extra work for as long as possible */
-	if (ctx->max_mails > 1) {
+	if (ctx->prefetch_max_mails > 1) {
 		/* we're doing prefetching. if we have to read the mail,
 		   do a prefetch first and the final search later */
 		n--;
@@ -1593,8 +1846,11 @@ struct mail *index_search_get_mail(struct index_search_context *ctx)
 	struct mail *const *mails, *mail;
 	unsigned int count;
 
-	if (ctx->unused_mail_idx == ctx->max_mails)
+	if (ctx->unused_mail_idx >= ctx->max_mails) {
+		/* the window may have been shrunk below the number of
+		   already prefetched mails */
 		return NULL;
+	}
 
 	mails = array_get(&ctx->mails, &count);
 	if (ctx->unused_mail_idx < count)
@@ -1709,6 +1965,35 @@ static int search_more(struct index_search_context *ctx,
 	return ret;
 }
 
+static void search_prefetch_update_window(struct index_search_context *ctx)
+{
+	struct timeval now;
+	long long usecs;
+
+	if (ctx->prefetch_max_mails <= 2)
+		return;
+
+	if (gettimeofday(&now, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	if (ctx->mail_ctx.paused) {
+		/* the caller was waiting for something else */
+		ctx->mail_ctx.paused = FALSE;
+	} else if (ctx->last_mail_return_timeval.tv_sec != 0) {
+		usecs = timeval_diff_usecs(&now,
+					   &ctx->last_mail_return_timeval);
+		if (usecs >= SEARCH_PREFETCH_SLOW_USECS) {
+			if (ctx->max_mails < ctx->prefetch_max_mails / 2)
+				ctx->max_mails *= 2;
+			else
+				ctx->max_mails = ctx->prefetch_max_mails;
+		} else if (usecs >= 0 && usecs < SEARCH_PREFETCH_FAST_USECS &&
+			   ctx->max_mails > 2) {
+			ctx->max_mails--;
+		}
+	}
+	ctx->last_mail_return_timeval = now;
+}
+
 bool index_storage_search_next_nonblock(struct mail_search_context *_ctx,
 					struct mail **mail_r, bool *tryagain_r)
 {
@@ -1727,6 +2012,7 @@ bool index_storage_search_next_nonblock(struct mail_search_context *_ctx,
 		}
 		if (ret < 0)
 			return FALSE;
+		search_prefetch_update_window(ctx);
 		*mail_r = mail;
 		return TRUE;
 	}
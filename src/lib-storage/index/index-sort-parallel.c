@@ -0,0 +1,190 @@
+/* Copyright (c) 2017 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "index-sort-parallel.h"
+
+#ifdef HAVE_PTHREAD
+#  include <signal.h>
+#  include <pthread.h>
+#endif
+
+/* Use threads only if each of them gets at least this many elements */
+#define INDEX_SORT_PARALLEL_MIN_COUNT 8192
+#define INDEX_SORT_PARALLEL_MAX_THREADS 64
+
+#ifdef HAVE_PTHREAD
+struct sort_task {
+	int (*cmp)(const void *, const void *);
+	size_t size;
+
+	/* qsort() src if dest is NULL, otherwise merge src's two
+	   consecutive sorted runs into dest */
+	unsigned char *src, *dest;
+	unsigned int count1, count2;
+};
+
+/* NOTE: This is called by the worker threads, so it must not call anything
+   that isn't thread-safe. */
+static void sort_task_run(struct sort_task *task)
+{
+	const unsigned char *p1, *p2, *end1, *end2;
+	unsigned char *dest = task->dest;
+	size_t size = task->size;
+
+	if (dest == NULL) {
+		qsort(task->src, task->count1, size, task->cmp);
+		return;
+	}
+
+	p1 = task->src; end1 = p1 + task->count1 * size;
+	p2 = end1; end2 = p2 + task->count2 * size;
+	while (p1 < end1 && p2 < end2) {
+		if (task->cmp(p1, p2) <= 0) {
+			memcpy(dest, p1, size);
+			p1 += size;
+		} else {
+			memcpy(dest, p2, size);
+			p2 += size;
+		}
+		dest += size;
+	}
+	memcpy(dest, p1, end1 - p1);
+	memcpy(dest + (end1 - p1), p2, end2 - p2);
+}
+
+static void *sort_task_thread(void *context)
+{
+	sort_task_run(context);
+	return NULL;
+}
+
+static void sort_tasks_run(struct sort_task *tasks, unsigned int count)
+{
+	pthread_t *threads;
+	bool *started;
+	sigset_t set, old_set;
+	unsigned int i;
+	int ret;
+
+	threads = i_new(pthread_t, count);
+	started = i_new(bool, count);
+
+	/* signals must be handled only by the main thread's ioloop, so keep
+	   them blocked in the worker threads */
+	sigfillset(&set);
+	if ((ret = pthread_sigmask(SIG_BLOCK, &set, &old_set)) != 0)
+		i_fatal("pthread_sigmask() failed: %s", strerror(ret));
+	for (i = 1; i < count; i++) {
+		ret = pthread_create(&threads[i], NULL,
+				     sort_task_thread, &tasks[i]);
+		if (ret != 0) {
+			i_error("pthread_create() failed: %s", strerror(ret));
+			break;
+		}
+		started[i] = TRUE;
+	}
+	if ((ret = pthread_sigmask(SIG_SETMASK, &old_set, NULL)) != 0)
+		i_fatal("pthread_sigmask() failed: %s", strerror(ret));
+
+	sort_task_run(&tasks[0]);
+	for (i = 1; i < count; i++) {
+		if (!started[i])
+			sort_task_run(&tasks[i]);
+		else if ((ret = pthread_join(threads[i], NULL)) != 0)
+			i_panic("pthread_join() failed: %s", strerror(ret));
+	}
+	i_free(started);
+	i_free(threads);
+}
+
+static void
+index_sort_parallel_merge(unsigned char *base, unsigned int count,
+			  size_t size, unsigned int threads,
+			  int (*cmp)(const void *, const void *))
+{
+	struct sort_task *tasks;
+	unsigned int *bounds, i, j, runs;
+	unsigned char *src, *dest, *tmp, *tmp2;
+
+	tasks = i_new(struct sort_task, threads);
+	bounds = i_new(unsigned int, threads + 1);
+	for (i = 0; i <= threads; i++)
+		bounds[i] = (uint64_t)count * i / threads;
+
+	/* sort the chunks */
+	for (i = 0; i < threads; i++) {
+		tasks[i].cmp = cmp;
+		tasks[i].size = size;
+		tasks[i].src = base + bounds[i] * size;
+		tasks[i].count1 = bounds[i+1] - bounds[i];
+	}
+	sort_tasks_run(tasks, threads);
+
+	/* merge them pairwise until there's only one left */
+	tmp = i_malloc(count * size);
+	src = base; dest = tmp;
+	for (runs = threads; runs > 1; runs = j) {
+		for (i = j = 0; i < runs; i += 2, j++) {
+			tasks[j].src = src + bounds[i] * size;
+			tasks[j].dest = dest + bounds[i] * size;
+			tasks[j].count1 = bounds[i+1] - bounds[i];
+			tasks[j].count2 = i + 1 == runs ? 0 :
+				bounds[i+2] - bounds[i+1];
+			bounds[j] = bounds[i];
+		}
+		bounds[j] = count;
+		sort_tasks_run(tasks, j);
+
+		tmp2 = src;
+		src = dest;
+		dest = tmp2;
+	}
+	if (src != base)
+		memcpy(base, src, count * size);
+	i_free(tmp);
+	i_free(bounds);
+	i_free(tasks);
+}
+
+void index_sort_array_parallel_i(struct array *array,
+				 int (*parallel_cmp)(const void *, const void *),
+				 int (*cmp)(const void *, const void *),
+				 unsigned int max_threads)
+{
+	unsigned char *base;
+	unsigned int i, j, count, threads;
+	size_t size = array->element_size;
+
+	count = array_count_i(array);
+	threads = I_MIN(max_threads, INDEX_SORT_PARALLEL_MAX_THREADS);
+	threads = I_MIN(threads, count / INDEX_SORT_PARALLEL_MIN_COUNT);
+	if (threads <= 1) {
+		array_sort_i(array, cmp);
+		return;
+	}
+
+	base = buffer_get_modifiable_data(array->buffer, NULL);
+	index_sort_parallel_merge(base, count, size, threads, parallel_cmp);
+	if (parallel_cmp == cmp)
+		return;
+
+	/* sort the runs that parallel_cmp couldn't order */
+	for (i = 0; i < count; i = j) {
+		for (j = i + 1; j < count; j++) {
+			if (parallel_cmp(base + i * size, base + j * size) != 0)
+				break;
+		}
+		if (j - i > 1)
+			qsort(base + i * size, j - i, size, cmp);
+	}
+}
+#else
+void index_sort_array_parallel_i(struct array *array,
+	int (*parallel_cmp)(const void *, const void *) ATTR_UNUSED,
+	int (*cmp)(const void *, const void *),
+	unsigned int max_threads ATTR_UNUSED)
+{
+	array_sort_i(array, cmp);
+}
+#endif
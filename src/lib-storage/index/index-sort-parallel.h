@@ -0,0 +1,26 @@
+#ifndef INDEX_SORT_PARALLEL_H
+#define INDEX_SORT_PARALLEL_H
+
+/* Sort the array so that the result is the same as with
+   array_sort(array, cmp). If max_threads > 1 and the array is large enough,
+   the array is first merge sorted by parallel_cmp using up to max_threads
+   threads. parallel_cmp must not use anything except the elements and data
+   that isn't modified while sorting (so no mail lookups, data stack or
+   allocations). It must order the elements the same way as cmp, except it
+   may return 0 where cmp wouldn't. Each run of such equal elements is then
+   sorted by cmp in the calling thread. If cmp itself is safe to use in
+   threads, the same function can be given for both. */
+void index_sort_array_parallel_i(struct array *array,
+				 int (*parallel_cmp)(const void *, const void *),
+				 int (*cmp)(const void *, const void *),
+				 unsigned int max_threads);
+#define index_sort_array_parallel(array, parallel_cmp, cmp, max_threads) \
+	index_sort_array_parallel_i(&(array)->arr + \
+		CALLBACK_TYPECHECK(parallel_cmp, int (*)(typeof(*(array)->v), \
+							 typeof(*(array)->v))) + \
+		CALLBACK_TYPECHECK(cmp, int (*)(typeof(*(array)->v), \
+						typeof(*(array)->v))), \
+		(int (*)(const void *, const void *))parallel_cmp, \
+		(int (*)(const void *, const void *))cmp, max_threads)
+
+#endif
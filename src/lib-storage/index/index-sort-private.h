@@ -17,6 +17,8 @@ struct mail_search_sort_program {
 	unsigned int iter_idx;
 };
 
+/* Returns the maximum number of threads to use for sorting. */
+unsigned int index_sort_max_threads(struct mail_search_sort_program *program);
 int index_sort_header_get(struct mail *mail, uint32_t seq,
 			  enum mail_sort_type sort_type, string_t *dest);
 int index_sort_node_cmp_type(struct mail *mail,
@@ -0,0 +1,75 @@
+/* Copyright (c) 2017 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "index-sort-radix.h"
+
+static inline unsigned int
+radix_key_byte(const unsigned char *elem, size_t key_offset, bool reverse,
+	       unsigned int shift)
+{
+	uint32_t key;
+
+	memcpy(&key, elem + key_offset, sizeof(key));
+	if (reverse)
+		key = ~key;
+	return (key >> shift) & 0xff;
+}
+
+void index_sort_array_radix_i(struct array *array, size_t key_offset,
+			      bool reverse,
+			      int (*cmp)(const void *, const void *))
+{
+	unsigned char *base, *buf, *src, *dest, *tmp;
+	unsigned int i, j, count, shift, counts[256], pos, n;
+	size_t size = array->element_size;
+	uint32_t key, next_key;
+
+	count = array_count_i(array);
+	if (count < 2)
+		return;
+
+	base = buffer_get_modifiable_data(array->buffer, NULL);
+	buf = i_malloc(count * size);
+	src = base; dest = buf;
+	for (shift = 0; shift < 32; shift += 8) {
+		memset(counts, 0, sizeof(counts));
+		for (i = 0; i < count; i++) {
+			n = radix_key_byte(src + i*size, key_offset,
+					   reverse, shift);
+			counts[n]++;
+		}
+		n = radix_key_byte(src, key_offset, reverse, shift);
+		if (counts[n] == count) {
+			/* all the elements have the same byte here */
+			continue;
+		}
+		for (i = pos = 0; i < N_ELEMENTS(counts); i++) {
+			n = counts[i];
+			counts[i] = pos;
+			pos += n;
+		}
+		for (i = 0; i < count; i++) {
+			n = radix_key_byte(src + i*size, key_offset,
+					   reverse, shift);
+			memcpy(dest + counts[n]++ * size, src + i*size, size);
+		}
+		tmp = src; src = dest; dest = tmp;
+	}
+	if (src != base)
+		memcpy(base, src, count * size);
+	i_free(buf);
+
+	/* order the elements with identical keys by cmp */
+	for (i = 0; i < count; i = j) {
+		memcpy(&key, base + i*size + key_offset, sizeof(key));
+		for (j = i + 1; j < count; j++) {
+			memcpy(&next_key, base + j*size + key_offset,
+			       sizeof(next_key));
+			if (next_key != key)
+				break;
+		}
+		if (j - i > 1)
+			qsort(base + i*size, j - i, size, cmp);
+	}
+}
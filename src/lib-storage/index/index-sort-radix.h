@@ -0,0 +1,21 @@
+#ifndef INDEX_SORT_RADIX_H
+#define INDEX_SORT_RADIX_H
+
+/* Sort the array by the uint32_t key at key_offset in each element, in
+   descending order if reverse is TRUE. The keys are radix sorted, and only
+   the runs of elements with identical keys are sorted by cmp. The result
+   is the same as with array_sort(array, cmp), as long as cmp orders the
+   elements by the key first. */
+void index_sort_array_radix_i(struct array *array, size_t key_offset,
+			      bool reverse,
+			      int (*cmp)(const void *, const void *));
+#define index_sort_array_radix(array, key_member, reverse, cmp) \
+	index_sort_array_radix_i(&(array)->arr + \
+		CALLBACK_TYPECHECK(cmp, int (*)(typeof(*(array)->v), \
+						typeof(*(array)->v))) + \
+		COMPILE_ERROR_IF_TRUE(sizeof((*(array)->v_modifiable)->key_member) != \
+				      sizeof(uint32_t)), \
+		offsetof(typeof(**(array)->v_modifiable), key_member), \
+		reverse, (int (*)(const void *, const void *))cmp)
+
+#endif
@@ -12,8 +12,16 @@
 #include "array.h"
 #include "str.h"
 #include "index-storage.h"
+#include "index-sort-parallel.h"
+#include "index-sort-radix.h"
 #include "index-sort-private.h"
 
+/* Use radix sort for the sort IDs when there are at least this many
+   messages. With less the comparison sort is faster. This is far below
+   the size where index_sort_array_parallel() would use threads, so the
+   nonzero nodes are never sorted in parallel. */
+#define INDEX_SORT_RADIX_MIN_COUNT 1024
+
 
 struct mail_sort_node {
 	uint32_t seq:29;
@@ -237,8 +245,23 @@ void index_sort_list_add_string(struct mail_search_sort_program *program,
 	index_sort_node_add(ctx, &node);
 }
 
-static int sort_node_zero_string_cmp(const struct mail_sort_node *n1,
-				     const struct mail_sort_node *n2)
+static int
+sort_node_cmp_secondary(struct sort_string_context *ctx,
+			uint32_t seq1, uint32_t seq2, bool parallel)
+{
+	if (parallel && ctx->program->sort_program[1] != MAIL_SORT_END) {
+		/* the mail can't be accessed from the sort threads.
+		   index_sort_array_parallel() sorts these afterwards. */
+		return 0;
+	}
+	return index_sort_node_cmp_type(ctx->program->temp_mail,
+					ctx->program->sort_program + 1,
+					seq1, seq2);
+}
+
+static int
+sort_node_zero_string_cmp_full(const struct mail_sort_node *n1,
+			       const struct mail_sort_node *n2, bool parallel)
 {
 	struct sort_string_context *ctx = static_zero_cmp_context;
 	int ret;
@@ -247,9 +270,20 @@ static int sort_node_zero_string_cmp(const struct mail_sort_node *n1,
 	if (ret != 0)
 		return !ctx->reverse ? ret : -ret;
 
-	return index_sort_node_cmp_type(ctx->program->temp_mail,
-					ctx->program->sort_program + 1,
-					n1->seq, n2->seq);
+	return sort_node_cmp_secondary(ctx, n1->seq, n2->seq, parallel);
+}
+
+static int sort_node_zero_string_cmp(const struct mail_sort_node *n1,
+				     const struct mail_sort_node *n2)
+{
+	return sort_node_zero_string_cmp_full(n1, n2, FALSE);
+}
+
+static int
+sort_node_zero_string_parallel_cmp(const struct mail_sort_node *n1,
+				   const struct mail_sort_node *n2)
+{
+	return sort_node_zero_string_cmp_full(n1, n2, TRUE);
 }
 
 static void index_sort_zeroes(struct sort_string_context *ctx)
@@ -284,7 +318,10 @@ static void index_sort_zeroes(struct sort_string_context *ctx)
 
 	/* we have all strings, sort nodes based on them */
 	static_zero_cmp_context = ctx;
-	array_sort(&ctx->zero_nodes, sort_node_zero_string_cmp);
+	index_sort_array_parallel(&ctx->zero_nodes,
+				  sort_node_zero_string_parallel_cmp,
+				  sort_node_zero_string_cmp,
+				  index_sort_max_threads(ctx->program));
 }
 
 static const char *
@@ -721,9 +758,19 @@ static int sort_node_cmp(const struct mail_sort_node *n1,
 	if (n1->sort_id > n2->sort_id)
 		return !ctx->reverse ? 1 : -1;
 
-	return index_sort_node_cmp_type(ctx->program->temp_mail,
-					ctx->program->sort_program + 1,
-					n1->seq, n2->seq);
+	return sort_node_cmp_secondary(ctx, n1->seq, n2->seq, FALSE);
+}
+
+static void index_sort_nonzero_nodes(struct sort_string_context *ctx)
+{
+	if (array_count(&ctx->nonzero_nodes) < INDEX_SORT_RADIX_MIN_COUNT) {
+		array_sort(&ctx->nonzero_nodes, sort_node_cmp);
+		return;
+	}
+	/* sort IDs already specify the order, so there's no need to compare
+	   them. just bucket the nodes by them. */
+	index_sort_array_radix(&ctx->nonzero_nodes, sort_id, ctx->reverse,
+			       sort_node_cmp);
 }
 
 static void index_sort_add_missing(struct sort_string_context *ctx)
@@ -785,7 +832,7 @@ void index_sort_list_finish_string(struct mail_search_sort_program *program)
 	static_zero_cmp_context = ctx;
 	if (array_count(&ctx->zero_nodes) == 0) {
 		/* fast path: we have all sort IDs */
-		array_sort(&ctx->nonzero_nodes, sort_node_cmp);
+		index_sort_nonzero_nodes(ctx);
 
 		nodes = array_get(&ctx->nonzero_nodes, &count);
 		if (!array_is_created(&program->seqs))
@@ -812,7 +859,7 @@ void index_sort_list_finish_string(struct mail_search_sort_program *program)
 		/* add messages not in seqs list */
 		index_sort_add_missing(ctx);
 		/* sort all messages with sort IDs */
-		array_sort(&ctx->nonzero_nodes, sort_node_cmp);
+		index_sort_nonzero_nodes(ctx);
 		for (;;) {
 			/* sort all messages without sort IDs */
 			index_sort_zeroes(ctx);
@@ -8,8 +8,15 @@
 #include "message-header-decode.h"
 #include "imap-base-subject.h"
 #include "index-storage.h"
+#include "index-mail.h"
+#include "index-sort-parallel.h"
 #include "index-sort-private.h"
 
+/* Look up the cached dates for at most this many sequences at a time */
+#define INDEX_SORT_CACHE_RANGE_MAX_SEQS 1024
+/* Split the looked up sequence range if there are more than this many
+   non-matching messages between two matches */
+#define INDEX_SORT_CACHE_RANGE_MAX_GAP 8
 
 struct mail_sort_node_date {
 	uint32_t seq;
@@ -37,35 +44,16 @@ struct sort_cmp_context {
 
 static struct sort_cmp_context static_node_cmp_context;
 
-static void
-index_sort_list_add_arrival(struct mail_search_sort_program *program,
-			    struct mail *mail)
-{
-	ARRAY_TYPE(mail_sort_node_date) *nodes = program->context;
-	struct mail_sort_node_date *node;
-
-	node = array_append_space(nodes);
-	node->seq = mail->seq;
-	if (mail_get_received_date(mail, &node->date) < 0)
-		node->date = 0;
-}
-
 static void
 index_sort_list_add_date(struct mail_search_sort_program *program,
 			 struct mail *mail)
 {
 	ARRAY_TYPE(mail_sort_node_date) *nodes = program->context;
 	struct mail_sort_node_date *node;
-	int tz;
 
+	/* the dates are looked up by index_sort_list_finish_date() */
 	node = array_append_space(nodes);
 	node->seq = mail->seq;
-	if (mail_get_date(mail, &node->date, &tz) < 0)
-		node->date = 0;
-	else if (node->date == 0) {
-		if (mail_get_received_date(mail, &node->date) < 0)
-			node->date = 0;
-	}
 }
 
 static void
@@ -127,6 +115,11 @@ index_sort_list_add_relevancy(struct mail_search_sort_program *program,
 	node->num = index_sort_get_relevancy(mail);
 }
 
+unsigned int index_sort_max_threads(struct mail_search_sort_program *program)
+{
+	return program->t->box->storage->set->mail_sort_max_threads;
+}
+
 void index_sort_list_add(struct mail_search_sort_program *program,
 			 struct mail *mail)
 {
@@ -137,8 +130,24 @@ void index_sort_list_add(struct mail_search_sort_program *program,
 	} T_END;
 }
 
-static int sort_node_date_cmp(const struct mail_sort_node_date *n1,
-			      const struct mail_sort_node_date *n2)
+static int
+sort_node_cmp_secondary(uint32_t seq1, uint32_t seq2, bool parallel)
+{
+	struct sort_cmp_context *ctx = &static_node_cmp_context;
+
+	if (parallel && ctx->program->sort_program[1] != MAIL_SORT_END) {
+		/* the mail can't be accessed from the sort threads.
+		   index_sort_array_parallel() sorts these afterwards. */
+		return 0;
+	}
+	return index_sort_node_cmp_type(ctx->mail,
+					ctx->program->sort_program + 1,
+					seq1, seq2);
+}
+
+static int sort_node_date_cmp_full(const struct mail_sort_node_date *n1,
+				   const struct mail_sort_node_date *n2,
+				   bool parallel)
 {
 	struct sort_cmp_context *ctx = &static_node_cmp_context;
 
@@ -147,24 +156,151 @@ static int sort_node_date_cmp(const struct mail_sort_node_date *n1,
 	if (n1->date > n2->date)
 		return !ctx->reverse ? 1 : -1;
 
-	return index_sort_node_cmp_type(ctx->mail,
-					ctx->program->sort_program + 1,
-					n1->seq, n2->seq);
+	return sort_node_cmp_secondary(n1->seq, n2->seq, parallel);
+}
+
+static int sort_node_date_cmp(const struct mail_sort_node_date *n1,
+			      const struct mail_sort_node_date *n2)
+{
+	return sort_node_date_cmp_full(n1, n2, FALSE);
+}
+
+static int
+sort_node_date_parallel_cmp(const struct mail_sort_node_date *n1,
+			    const struct mail_sort_node_date *n2)
+{
+	return sort_node_date_cmp_full(n1, n2, TRUE);
+}
+
+static void
+index_sort_get_date(struct mail *mail, bool arrival, time_t *date_r)
+{
+	int tz;
+
+	if (arrival) {
+		if (mail_get_received_date(mail, date_r) < 0)
+			*date_r = 0;
+	} else if (mail_get_date(mail, date_r, &tz) < 0)
+		*date_r = 0;
+	else if (*date_r == 0) {
+		if (mail_get_received_date(mail, date_r) < 0)
+			*date_r = 0;
+	}
+}
+
+static bool
+index_sort_get_cached_date(const struct mail_cache_lookup_value *sent,
+			   const struct mail_cache_lookup_value *received,
+			   time_t *date_r)
+{
+	const struct mail_sent_date *sent_date;
+	uint32_t t;
+
+	if (sent != NULL) {
+		if (sent->data == NULL || sent->size != sizeof(*sent_date))
+			return FALSE;
+		sent_date = sent->data;
+		if (sent_date->time != 0) {
+			*date_r = sent_date->time;
+			return TRUE;
+		}
+		/* no valid Date: header, fallback to received date */
+	}
+	if (received->data == NULL || received->size != sizeof(t))
+		return FALSE;
+	memcpy(&t, received->data, sizeof(t));
+	*date_r = t;
+	return TRUE;
+}
+
+static void
+index_sort_list_fill_dates(struct mail_search_sort_program *program,
+			   struct mail_sort_node_date *nodes,
+			   unsigned int count)
+{
+	struct index_mailbox_context *ibox =
+		INDEX_STORAGE_CONTEXT(program->t->box);
+	struct mail_cache_view *cache_view = program->t->cache_view;
+	struct mail_cache_lookup_value *values, *value;
+	unsigned int field_idxs[2], fields_count, i, j, n;
+	uint32_t seq1, seq2;
+	buffer_t *buf;
+	bool arrival;
+
+	arrival = (program->sort_program[0] &
+		   MAIL_SORT_MASK) == MAIL_SORT_ARRIVAL;
+	fields_count = 0;
+	if (!arrival) {
+		field_idxs[fields_count++] =
+			ibox->cache_fields[MAIL_CACHE_SENT_DATE].idx;
+	}
+	field_idxs[fields_count++] =
+		ibox->cache_fields[MAIL_CACHE_RECEIVED_DATE].idx;
+
+	buf = buffer_create_dynamic(default_pool, 1024);
+	values = i_new(struct mail_cache_lookup_value,
+		       INDEX_SORT_CACHE_RANGE_MAX_SEQS * fields_count);
+	for (i = 0; i < count; i = j) {
+		/* look up the cached dates for a range of mostly matching
+		   messages at once */
+		seq1 = nodes[i].seq;
+		for (j = i + 1; j < count; j++) {
+			if (nodes[j].seq <= nodes[j-1].seq ||
+			    nodes[j].seq - nodes[j-1].seq >
+			    INDEX_SORT_CACHE_RANGE_MAX_GAP ||
+			    nodes[j].seq - seq1 >= INDEX_SORT_CACHE_RANGE_MAX_SEQS)
+				break;
+		}
+		seq2 = nodes[j-1].seq;
+
+		buffer_set_used_size(buf, 0);
+		if (mail_cache_lookup_field_range(cache_view, buf, seq1, seq2,
+						  field_idxs, fields_count,
+						  values) < 0) {
+			memset(values, 0, sizeof(*values) *
+			       (seq2 - seq1 + 1) * fields_count);
+		}
+		for (n = i; n < j; n++) {
+			value = &values[(nodes[n].seq - seq1) * fields_count];
+			if (index_sort_get_cached_date(arrival ? NULL : value,
+						       &value[fields_count-1],
+						       &nodes[n].date))
+				continue;
+
+			/* not cached, get it via the mail */
+			T_BEGIN {
+				mail_set_seq(program->temp_mail, nodes[n].seq);
+				index_sort_get_date(program->temp_mail,
+						    arrival, &nodes[n].date);
+			} T_END;
+		}
+	}
+	i_free(values);
+	buffer_free(&buf);
 }
 
 static void
 index_sort_list_finish_date(struct mail_search_sort_program *program)
 {
 	ARRAY_TYPE(mail_sort_node_date) *nodes = program->context;
+	struct mail_sort_node_date *date_nodes;
+	unsigned int count;
+
+	date_nodes = array_get_modifiable(nodes, &count);
+	if (count > 0)
+		index_sort_list_fill_dates(program, date_nodes, count);
 
-	array_sort(nodes, sort_node_date_cmp);
+	index_sort_array_parallel(nodes, sort_node_date_parallel_cmp,
+				  sort_node_date_cmp,
+				  index_sort_max_threads(program));
 	memcpy(&program->seqs, nodes, sizeof(program->seqs));
 	i_free(nodes);
 	program->context = NULL;
 }
 
-static int sort_node_size_cmp(const struct mail_sort_node_size *n1,
-			      const struct mail_sort_node_size *n2)
+static int sort_node_size_cmp_full(const struct mail_sort_node_size *n1,
+				   const struct mail_sort_node_size *n2,
+				   bool parallel)
 {
 	struct sort_cmp_context *ctx = &static_node_cmp_context;
 
@@ -173,9 +309,20 @@ static int sort_node_size_cmp(const struct mail_sort_node_size *n1,
 	if (n1->size > n2->size)
 		return !ctx->reverse ? 1 : -1;
 
-	return index_sort_node_cmp_type(ctx->mail,
-					ctx->program->sort_program + 1,
-					n1->seq, n2->seq);
+	return sort_node_cmp_secondary(n1->seq, n2->seq, parallel);
+}
+
+static int sort_node_size_cmp(const struct mail_sort_node_size *n1,
+			      const struct mail_sort_node_size *n2)
+{
+	return sort_node_size_cmp_full(n1, n2, FALSE);
+}
+
+static int
+sort_node_size_parallel_cmp(const struct mail_sort_node_size *n1,
+			    const struct mail_sort_node_size *n2)
+{
+	return sort_node_size_cmp_full(n1, n2, TRUE);
 }
 
 static void
@@ -183,14 +330,17 @@ index_sort_list_finish_size(struct mail_search_sort_program *program)
 {
 	ARRAY_TYPE(mail_sort_node_size) *nodes = program->context;
 
-	array_sort(nodes, sort_node_size_cmp);
+	index_sort_array_parallel(nodes, sort_node_size_parallel_cmp,
+				  sort_node_size_cmp,
+				  index_sort_max_threads(program));
 	memcpy(&program->seqs, nodes, sizeof(program->seqs));
 	i_free(nodes);
 	program->context = NULL;
 }
 
-static int sort_node_float_cmp(const struct mail_sort_node_float *n1,
-			       const struct mail_sort_node_float *n2)
+static int sort_node_float_cmp_full(const struct mail_sort_node_float *n1,
+				    const struct mail_sort_node_float *n2,
+				    bool parallel)
 {
 	struct sort_cmp_context *ctx = &static_node_cmp_context;
 
@@ -199,9 +349,20 @@ static int sort_node_float_cmp(const struct mail_sort_node_float *n1,
 	if (n1->num > n2->num)
 		return !ctx->reverse ? 1 : -1;
 
-	return index_sort_node_cmp_type(ctx->mail,
-					ctx->program->sort_program + 1,
-					n1->seq, n2->seq);
+	return sort_node_cmp_secondary(n1->seq, n2->seq, parallel);
+}
+
+static int sort_node_float_cmp(const struct mail_sort_node_float *n1,
+			       const struct mail_sort_node_float *n2)
+{
+	return sort_node_float_cmp_full(n1, n2, FALSE);
+}
+
+static int
+sort_node_float_parallel_cmp(const struct mail_sort_node_float *n1,
+			     const struct mail_sort_node_float *n2)
+{
+	return sort_node_float_cmp_full(n1, n2, TRUE);
 }
 
 static void
@@ -212,7 +373,9 @@ index_sort_list_finish_float(struct mail_search_sort_program *program)
 	/* NOTE: higher relevancy is returned first, unlike with all
 	   other number based sort keys, so temporarily reverse the search */
 	static_node_cmp_context.reverse = !static_node_cmp_context.reverse;
-	array_sort(nodes, sort_node_float_cmp);
+	index_sort_array_parallel(nodes, sort_node_float_parallel_cmp,
+				  sort_node_float_cmp,
+				  index_sort_max_threads(program));
 	static_node_cmp_context.reverse = !static_node_cmp_context.reverse;
 
 	memcpy(&program->seqs, nodes, sizeof(program->seqs));
@@ -275,11 +438,7 @@ index_sort_program_init(struct mailbox_transaction_context *t,
 		nodes = i_malloc(sizeof(*nodes));
 		i_array_init(nodes, 128);
 
-		if ((program->sort_program[0] &
-		     MAIL_SORT_MASK) == MAIL_SORT_ARRIVAL)
-			program->sort_list_add = index_sort_list_add_arrival;
-		else
-			program->sort_list_add = index_sort_list_add_date;
+		program->sort_list_add = index_sort_list_add_date;
 		program->sort_list_finish = index_sort_list_finish_date;
 		program->context = nodes;
 		break;
@@ -405,16 +564,73 @@ get_display_name(struct mail *mail, const char *header, const char **name_r)
 	return 0;
 }
 
-int index_sort_header_get(struct mail *mail, uint32_t seq,
-			  enum mail_sort_type sort_type, string_t *dest)
+static unsigned int
+index_sort_get_cache_field_idx(struct mail *mail, enum mail_sort_type sort_type)
+{
+	struct index_mailbox_context *ibox = INDEX_STORAGE_CONTEXT(mail->box);
+	enum index_cache_field field;
+
+	switch (sort_type & MAIL_SORT_MASK) {
+	case MAIL_SORT_CC:
+		field = MAIL_CACHE_SORT_CC;
+		break;
+	case MAIL_SORT_FROM:
+		field = MAIL_CACHE_SORT_FROM;
+		break;
+	case MAIL_SORT_SUBJECT:
+		field = MAIL_CACHE_SORT_SUBJECT;
+		break;
+	case MAIL_SORT_TO:
+		field = MAIL_CACHE_SORT_TO;
+		break;
+	case MAIL_SORT_DISPLAYFROM:
+		field = MAIL_CACHE_SORT_DISPLAYFROM;
+		break;
+	case MAIL_SORT_DISPLAYTO:
+		field = MAIL_CACHE_SORT_DISPLAYTO;
+		break;
+	default:
+		i_unreached();
+	}
+	return ibox->cache_fields[field].idx;
+}
+
+static bool
+index_sort_header_get_cached(struct mail *mail, unsigned int field_idx,
+			     string_t *dest)
+{
+	const unsigned char *data;
+	size_t size;
+
+	if (mail_cache_lookup_field(mail->transaction->cache_view, dest,
+				    mail->seq, field_idx) <= 0)
+		return FALSE;
+
+	/* the key is stored with its trailing NUL */
+	data = str_data(dest);
+	size = str_len(dest);
+	if (size == 0 || data[size-1] != '\0' ||
+	    memchr(data, '\0', size-1) != NULL) {
+		str_truncate(dest, 0);
+		mail_set_cache_corrupted(mail, 0, t_strdup_printf(
+			"Broken %s cache field",
+			mail_cache_register_get_field(mail->box->cache,
+						      field_idx)->name));
+		return FALSE;
+	}
+	str_truncate(dest, size-1);
+	mail->transaction->stats.cache_hit_count++;
+	return TRUE;
+}
+
+static int
+index_sort_header_get_uncached(struct mail *mail,
+			       enum mail_sort_type sort_type, string_t *dest)
 {
 	const char *str;
 	int ret;
 	bool reply_or_fw;
 
-	mail_set_seq(mail, seq);
-	str_truncate(dest, 0);
-
 	switch (sort_type & MAIL_SORT_MASK) {
 	case MAIL_SORT_SUBJECT:
 		if ((ret = mail_get_first_header(mail, "Subject", &str)) <= 0)
@@ -446,6 +662,50 @@ int index_sort_header_get(struct mail *mail, uint32_t seq,
 	return ret;
 }
 
+int index_sort_header_get(struct mail *mail, uint32_t seq,
+			  enum mail_sort_type sort_type, string_t *dest)
+{
+	unsigned int field_idx;
+	int ret;
+
+	mail_set_seq(mail, seq);
+	str_truncate(dest, 0);
+
+	/* Normalizing the headers is the expensive part of string sorting,
+	   so the result is kept in cache. Since messages are immutable the
+	   cached key never needs to be updated. */
+	field_idx = index_sort_get_cache_field_idx(mail, sort_type);
+	if (index_sort_header_get_cached(mail, field_idx, dest))
+		return 0;
+
+	if ((ret = index_sort_header_get_uncached(mail, sort_type, dest)) < 0)
+		return ret;
+	index_mail_cache_add_idx((struct index_mail *)mail, field_idx,
+				 str_data(dest), str_len(dest)+1);
+	return 0;
+}
+
+void index_sort_precache(struct mail *mail)
+{
+	static const enum mail_sort_type sort_types[] = {
+		MAIL_SORT_CC, MAIL_SORT_FROM, MAIL_SORT_SUBJECT,
+		MAIL_SORT_TO, MAIL_SORT_DISPLAYFROM, MAIL_SORT_DISPLAYTO
+	};
+	unsigned int i, field_idx;
+
+	for (i = 0; i < N_ELEMENTS(sort_types); i++) {
+		field_idx = index_sort_get_cache_field_idx(mail, sort_types[i]);
+		if (!mail_cache_field_want_add(mail->transaction->cache_trans,
+					       mail->seq, field_idx))
+			continue;
+		T_BEGIN {
+			string_t *str = t_str_new(128);
+			(void)index_sort_header_get(mail, mail->seq,
+						    sort_types[i], str);
+		} T_END;
+	}
+}
+
 int index_sort_node_cmp_type(struct mail *mail,
 			     const enum mail_sort_type *sort_program,
 			     uint32_t seq1, uint32_t seq2)
@@ -12,6 +12,10 @@ void index_sort_list_add(struct mail_search_sort_program *program,
 			 struct mail *mail);
 void index_sort_list_finish(struct mail_search_sort_program *program);
 
+/* Add the mail's normalized sort keys to cache for the sort types whose
+   cache fields are wanted. */
+void index_sort_precache(struct mail *mail);
+
 bool index_sort_list_next(struct mail_search_sort_program *program,
 			  uint32_t *seq_r);
 
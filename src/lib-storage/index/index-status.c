@@ -176,6 +176,16 @@ void index_storage_get_open_status(struct mailbox *box,
 	if ((items & STATUS_LAST_CACHED_SEQ) != 0)
 		get_last_cached_seq(box, &status_r->last_cached_seq);
 
+	if ((items & STATUS_CACHE_COMPRESS) != 0) {
+		struct mail_cache_compress_stats stats;
+
+		mail_cache_get_compress_stats(box->cache, &stats);
+		status_r->cache_compress_count = stats.compress_count;
+		status_r->cache_compress_last_lock_usecs =
+			stats.last_lock_usecs;
+		status_r->cache_compress_max_lock_usecs = stats.max_lock_usecs;
+	}
+
 	if ((items & STATUS_KEYWORDS) != 0)
 		status_r->keywords = mail_index_get_keywords(box->index);
 	if ((items & STATUS_PERMANENT_FLAGS) != 0) {
@@ -235,6 +245,7 @@ static void get_metadata_precache_fields(struct mailbox *box,
 		const char *name = fields[i].name;
 
 		if (strncmp(name, "hdr.", 4) == 0 ||
+		    strncmp(name, "sort.", 5) == 0 ||
 		    strcmp(name, "date.sent") == 0 ||
 		    strcmp(name, "imap.envelope") == 0)
 			cache |= MAIL_FETCH_STREAM_HEADER;
@@ -90,6 +90,11 @@ static void index_cache_register_defaults(struct mailbox *box)
 			    set->mail_never_cache_fields,
 			    MAIL_CACHE_DECISION_NO |
 			    MAIL_CACHE_DECISION_FORCED);
+	if (set->mail_cache_column_fields[0] != '\0') {
+		mail_cache_set_column_fields(cache,
+			t_strsplit_spaces(set->mail_cache_column_fields, " ,"));
+	}
+	mail_cache_set_compress_chunk(cache, set->mail_cache_compress_chunk);
 }
 
 void index_storage_lock_notify(struct mailbox *box,
@@ -161,7 +166,8 @@ index_mailbox_alloc_index(struct mailbox *box, struct mail_index **index_r)
 	    mailbox_get_path_to(box, MAILBOX_LIST_PATH_TYPE_INDEX,
 				&index_dir) <= 0)
 		index_dir = NULL;
-	*index_r = mail_index_alloc_cache_get(mailbox_path, index_dir,
+	*index_r = mail_index_alloc_cache_get(box->storage->user->username,
+					      mailbox_path, index_dir,
 					      box->index_prefix);
 	return 0;
 }
@@ -232,6 +238,10 @@ int index_storage_mailbox_alloc_index(struct mailbox *box)
 	mail_index_set_lock_method(box->index,
 		box->storage->set->parsed_lock_method,
 		mail_storage_get_lock_timeout(box->storage, UINT_MAX));
+	mail_index_set_snapshot_dir(box->index,
+				    box->storage->set->mail_index_snapshot_dir);
+	mail_index_set_log_group_commit(box->index,
+		box->storage->set->mail_index_log_group_commit);
 	return 0;
 }
 
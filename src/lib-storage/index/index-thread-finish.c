@@ -5,6 +5,7 @@
 #include "hash.h"
 #include "imap-base-subject.h"
 #include "mail-storage-private.h"
+#include "index-sort-parallel.h"
 #include "index-thread-private.h"
 
 
@@ -129,6 +130,14 @@ static int mail_thread_root_node_cmp(const struct mail_thread_root_node *r1,
 	return mail_thread_child_node_cmp(&r1->node, &r2->node);
 }
 
+static void thread_sort_roots(struct thread_finish_context *ctx)
+{
+	/* the comparison uses only the nodes, so it's safe for threads */
+	index_sort_array_parallel(&ctx->roots, mail_thread_root_node_cmp,
+		mail_thread_root_node_cmp,
+		ctx->tmp_mail->box->storage->set->mail_sort_max_threads);
+}
+
 static uint32_t
 thread_lookup_existing(struct thread_finish_context *ctx, uint32_t idx)
 {
@@ -400,7 +409,7 @@ static void sort_root_nodes(struct thread_finish_context *ctx)
 		}
 	}
 	array_free(&sorted_children);
-	array_sort(&ctx->roots, mail_thread_root_node_cmp);
+	thread_sort_roots(ctx);
 }
 
 static int mail_thread_root_node_idx_cmp(const void *key, const void *value)
@@ -453,7 +462,7 @@ static void sort_root_nodes_ref2(struct thread_finish_context *ctx,
 		if (root->node.sort_date < child.sort_date)
 			root->node.sort_date = child.sort_date;
 	}
-	array_sort(&ctx->roots, mail_thread_root_node_cmp);
+	thread_sort_roots(ctx);
 }
 
 static void mail_thread_create_shadows(struct thread_finish_context *ctx,
@@ -6,6 +6,7 @@
 #include "array.h"
 #include "bsearch-insert-pos.h"
 #include "hash2.h"
+#include "mail-cache.h"
 #include "message-id.h"
 #include "mail-search.h"
 #include "mail-search-build.h"
@@ -17,6 +18,18 @@
 #define MAIL_THREAD_CONTEXT(obj) \
 	MODULE_CONTEXT(obj, mail_thread_storage_module)
 
+/* Look up the cached headers for this many messages at a time while
+   building the thread index */
+#define MAIL_THREAD_CACHE_RANGE_SEQS 1024
+
+enum mail_thread_cache_header {
+	MAIL_THREAD_CACHE_HDR_MESSAGE_ID,
+	MAIL_THREAD_CACHE_HDR_IN_REPLY_TO,
+	MAIL_THREAD_CACHE_HDR_REFERENCES,
+
+	MAIL_THREAD_CACHE_HDR_COUNT
+};
+
 struct mail_thread_context {
 	struct mailbox *box;
 	struct mailbox_transaction_context *t;
@@ -240,50 +253,71 @@ static int thread_get_mail_header(struct mail *mail, const char *name,
 	return 0;
 }
 
-static int
-mail_thread_map_add_mail(struct mail_thread_context *ctx, struct mail *mail)
+static void
+mail_thread_map_add_msgids(struct mail_thread_context *ctx, uint32_t uid,
+			   const char *message_id, const char *references,
+			   bool *have_references_r)
 {
-	const char *message_id, *in_reply_to, *references, *msgid;
+	const char *msgid;
 	uint32_t ref_index;
 
-	if (thread_get_mail_header(mail, HDR_MESSAGE_ID, &message_id) < 0 ||
-	    thread_get_mail_header(mail, HDR_REFERENCES, &references) < 0)
-		return -1;
-
 	/* add Message-ID: */
 	msgid = message_id_get_next(&message_id);
 	if (msgid != NULL) {
-		mail_index_strmap_view_sync_add(ctx->strmap_sync, mail->uid,
+		mail_index_strmap_view_sync_add(ctx->strmap_sync, uid,
 						MAIL_THREAD_NODE_REF_MSGID,
 						msgid);
 	} else {
 		mail_index_strmap_view_sync_add_unique(ctx->strmap_sync,
-					mail->uid, MAIL_THREAD_NODE_REF_MSGID);
+					uid, MAIL_THREAD_NODE_REF_MSGID);
 	}
 
 	/* add References: if there are any valid ones */
 	msgid = message_id_get_next(&references);
+	*have_references_r = msgid != NULL;
 	if (msgid != NULL) {
 		ref_index = MAIL_THREAD_NODE_REF_REFERENCES1;
 		do {
 			mail_index_strmap_view_sync_add(ctx->strmap_sync,
-							mail->uid,
-							ref_index, msgid);
+							uid, ref_index, msgid);
 			ref_index++;
 			msgid = message_id_get_next(&references);
 		} while (msgid != NULL);
-	} else {
+	}
+}
+
+static void
+mail_thread_map_add_in_reply_to(struct mail_thread_context *ctx, uint32_t uid,
+				const char *in_reply_to)
+{
+	const char *msgid;
+
+	msgid = message_id_get_next(&in_reply_to);
+	if (msgid != NULL) {
+		mail_index_strmap_view_sync_add(ctx->strmap_sync, uid,
+						MAIL_THREAD_NODE_REF_INREPLYTO,
+						msgid);
+	}
+}
+
+static int
+mail_thread_map_add_mail(struct mail_thread_context *ctx, struct mail *mail)
+{
+	const char *message_id, *in_reply_to, *references;
+	bool have_references;
+
+	if (thread_get_mail_header(mail, HDR_MESSAGE_ID, &message_id) < 0 ||
+	    thread_get_mail_header(mail, HDR_REFERENCES, &references) < 0)
+		return -1;
+
+	mail_thread_map_add_msgids(ctx, mail->uid, message_id, references,
+				   &have_references);
+	if (!have_references) {
 		/* no References:, use In-Reply-To: */
 		if (thread_get_mail_header(mail, HDR_IN_REPLY_TO,
 					   &in_reply_to) < 0)
 			return -1;
-
-		msgid = message_id_get_next(&in_reply_to);
-		if (msgid != NULL) {
-			mail_index_strmap_view_sync_add(ctx->strmap_sync,
-				mail->uid, MAIL_THREAD_NODE_REF_INREPLYTO,
-				msgid);
-		}
+		mail_thread_map_add_in_reply_to(ctx, mail->uid, in_reply_to);
 	}
 	if (ctx->failed) {
 		/* message-id lookup failed in hash compare */
@@ -292,6 +326,95 @@ mail_thread_map_add_mail(struct mail_thread_context *ctx, struct mail *mail)
 	return 0;
 }
 
+static bool
+mail_thread_get_cached_header(const struct mail_cache_lookup_value *value,
+			      const char **value_r)
+{
+	const unsigned char *headers, *p, *end;
+	unsigned int lines_count;
+	size_t size;
+
+	if (value->data == NULL)
+		return FALSE;
+	if (value->size == 0) {
+		/* header doesn't exist */
+		*value_r = NULL;
+		return TRUE;
+	}
+
+	/* the first header line is the first instance of the header */
+	if (!mail_cache_header_value_parse(value->data, value->size,
+					   &lines_count, &headers, &size) ||
+	    lines_count == 0)
+		return FALSE;
+	end = headers + mail_cache_header_line_size(headers, size);
+
+	/* skip over "Name:" and return the rest of the (multiline) header */
+	p = memchr(headers, ':', end - headers);
+	if (p == NULL)
+		return FALSE;
+	if (end != headers && end[-1] == '\n')
+		end--;
+	*value_r = t_strdup_until(p + 1, end);
+	return TRUE;
+}
+
+static int
+mail_thread_map_add_cached(struct mail_thread_context *ctx, uint32_t seq,
+			   const struct mail_cache_lookup_value *values)
+{
+	const char *message_id, *in_reply_to, *references;
+	uint32_t uid;
+	bool have_references;
+
+	if (!mail_thread_get_cached_header(
+			&values[MAIL_THREAD_CACHE_HDR_MESSAGE_ID], &message_id) ||
+	    !mail_thread_get_cached_header(
+			&values[MAIL_THREAD_CACHE_HDR_REFERENCES], &references) ||
+	    !mail_thread_get_cached_header(
+			&values[MAIL_THREAD_CACHE_HDR_IN_REPLY_TO], &in_reply_to)) {
+		/* not cached, get the headers via the mail */
+		mail_set_seq(ctx->tmp_mail, seq);
+		return mail_thread_map_add_mail(ctx, ctx->tmp_mail);
+	}
+
+	mail_index_lookup_uid(ctx->t->view, seq, &uid);
+	mail_thread_map_add_msgids(ctx, uid, message_id, references,
+				   &have_references);
+	if (!have_references)
+		mail_thread_map_add_in_reply_to(ctx, uid, in_reply_to);
+	return ctx->failed ? -1 : 0;
+}
+
+static int
+mail_thread_map_add_range(struct mail_thread_context *ctx,
+			  const unsigned int field_idxs[],
+			  uint32_t seq1, uint32_t seq2)
+{
+	struct mail_cache_lookup_value *values;
+	buffer_t *buf;
+	uint32_t seq;
+	int ret = 0;
+
+	buf = buffer_create_dynamic(default_pool, 4096);
+	values = i_new(struct mail_cache_lookup_value,
+		       (seq2 - seq1 + 1) * MAIL_THREAD_CACHE_HDR_COUNT);
+	if (mail_cache_lookup_field_range(ctx->t->cache_view, buf, seq1, seq2,
+					  field_idxs,
+					  MAIL_THREAD_CACHE_HDR_COUNT,
+					  values) < 0) {
+		memset(values, 0, sizeof(*values) *
+		       (seq2 - seq1 + 1) * MAIL_THREAD_CACHE_HDR_COUNT);
+	}
+	for (seq = seq1; seq <= seq2 && ret == 0; seq++) T_BEGIN {
+		ret = mail_thread_map_add_cached(ctx, seq,
+			&values[(seq - seq1) * MAIL_THREAD_CACHE_HDR_COUNT]);
+	} T_END;
+	i_free(values);
+	buffer_free(&buf);
+	return ret;
+}
+
 static int mail_thread_index_map_build(struct mail_thread_context *ctx)
 {
 	static const char *wanted_headers[] = {
@@ -300,10 +423,8 @@ static int mail_thread_index_map_build(struct mail_thread_context *ctx)
 	};
 	struct mail_thread_mailbox *tbox = MAIL_THREAD_CONTEXT(ctx->box);
 	struct mailbox_header_lookup_ctx *headers_ctx;
-	struct mail_search_args *search_args;
-	struct mail_search_context *search_ctx;
-	struct mail *mail;
-	uint32_t last_uid, seq1, seq2;
+	unsigned int field_idxs[MAIL_THREAD_CACHE_HDR_COUNT];
+	uint32_t last_uid, seq, seq1, seq2;
 	int ret = 0;
 
 	if (tbox->strmap_view == NULL) {
@@ -320,6 +441,18 @@ static int mail_thread_index_map_build(struct mail_thread_context *ctx)
 
 	headers_ctx = mailbox_header_lookup_init(ctx->box, wanted_headers);
 	ctx->tmp_mail = mail_alloc(ctx->t, 0, headers_ctx);
+	mailbox_header_lookup_unref(&headers_ctx);
+
+	/* the header lookup registered the cache fields */
+	field_idxs[MAIL_THREAD_CACHE_HDR_MESSAGE_ID] =
+		mail_cache_register_lookup(ctx->box->cache,
+					   "hdr."HDR_MESSAGE_ID);
+	field_idxs[MAIL_THREAD_CACHE_HDR_IN_REPLY_TO] =
+		mail_cache_register_lookup(ctx->box->cache,
+					   "hdr."HDR_IN_REPLY_TO);
+	field_idxs[MAIL_THREAD_CACHE_HDR_REFERENCES] =
+		mail_cache_register_lookup(ctx->box->cache,
+					   "hdr."HDR_REFERENCES);
 
 	/* add all missing UIDs */
 	ctx->strmap_sync = mail_index_strmap_view_sync_init(tbox->strmap_view,
@@ -329,25 +462,18 @@ static int mail_thread_index_map_build(struct mail_thread_context *ctx)
 	if (seq1 == 0) {
 		/* nothing is missing */
 		mail_index_strmap_view_sync_commit(&ctx->strmap_sync);
-		mailbox_header_lookup_unref(&headers_ctx);
 		return 0;
 	}
 
-	search_args = mail_search_build_init();
-	mail_search_build_add_seqset(search_args, seq1, seq2);
-	search_ctx = mailbox_search_init(ctx->t, search_args, NULL,
-					 0, headers_ctx);
-	mailbox_header_lookup_unref(&headers_ctx);
-	mail_search_args_unref(&search_args);
+	/* look up the headers from cache for multiple messages at once.
+	   messages that don't have them cached are looked up via tmp_mail. */
+	for (seq = seq1; seq <= seq2 && ret == 0; ) {
+		uint32_t range_end = seq2 - seq < MAIL_THREAD_CACHE_RANGE_SEQS ?
+			seq2 : seq + MAIL_THREAD_CACHE_RANGE_SEQS - 1;
 
-	while (mailbox_search_next(search_ctx, &mail)) {
-		if (mail_thread_map_add_mail(ctx, mail) < 0) {
-			ret = -1;
-			break;
-		}
+		ret = mail_thread_map_add_range(ctx, field_idxs, seq, range_end);
+		seq = range_end + 1;
 	}
-	if (mailbox_search_deinit(&search_ctx) < 0)
-		ret = -1;
 
 	if (ret < 0)
 		mail_index_strmap_view_sync_rollback(&ctx->strmap_sync);
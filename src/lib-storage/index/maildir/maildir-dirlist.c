@@ -0,0 +1,525 @@
+/* Copyright (c) 2017 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "array.h"
+#include "llist.h"
+#include "str.h"
+#include "strnum.h"
+#include "istream.h"
+#include "write-full.h"
+#include "file-dotlock.h"
+#include "maildir-storage.h"
+#include "maildir-uidlist.h"
+#include "maildir-sync.h"
+#include "maildir-dirlist.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#if defined(__linux__)
+#  include <sys/syscall.h>
+#  ifdef SYS_getdents64
+#    define HAVE_MAILDIR_GETDENTS64
+#  endif
+#endif
+
+/* Read this much of directory entries at a time with getdents64(). A large
+   buffer means fewer round trips to the server with NFS. */
+#define MAILDIR_DIRLIST_BUF_SIZE (256*1024)
+/* Without getdents64() read this many entries with readdir() at a time. */
+#define MAILDIR_DIRLIST_READDIR_COUNT 2048
+/* If the directory changes while it's being listed this many times in a row,
+   give up and let the caller scan it directly. */
+#define MAILDIR_DIRLIST_MAX_RESTARTS 3
+#define MAILDIR_DIRLIST_LOCK_STALE_TIMEOUT (60*2)
+#define MAILDIR_DIRLIST_CACHE_VERSION 1
+
+#ifdef HAVE_MAILDIR_GETDENTS64
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+#endif
+
+struct maildir_dirlist_key {
+	ino_t ino;
+	time_t mtime;
+	unsigned long mtime_nsecs;
+};
+
+struct maildir_dirlist {
+	struct maildir_dirlist *prev, *next;
+
+	struct maildir_mailbox *mbox;
+	char *dir_path, *cache_path;
+
+	pool_t pool;
+	ARRAY_TYPE(const_string) names;
+	/* directory's stat when the listing was started */
+	struct maildir_dirlist_key key;
+	time_t scan_time;
+
+	/* directory's stat when the cache file was last read */
+	struct maildir_dirlist_key cache_key;
+	unsigned int restart_count;
+
+	/* listing in progress: */
+	struct timeout *to;
+#ifdef HAVE_MAILDIR_GETDENTS64
+	int fd;
+	unsigned char *buf;
+#else
+	DIR *dirp;
+#endif
+
+	bool ready:1;
+	bool cache_read:1;
+};
+
+/* Listings in progress, i.e. the ones with a timeout */
+static struct maildir_dirlist *maildir_dirlists_running = NULL;
+static bool maildir_dirlist_switch_callback_added = FALSE;
+
+static void
+maildir_dirlist_ioloop_switched(struct ioloop *prev_ioloop ATTR_UNUSED)
+{
+	struct maildir_dirlist *list;
+
+	/* The listings' timeouts were added to the previous ioloop, which may
+	   be getting destroyed. Move them to the current ioloop, so the
+	   listings continue there. */
+	for (list = maildir_dirlists_running; list != NULL; list = list->next)
+		list->to = io_loop_move_timeout(&list->to);
+}
+
+static void maildir_dirlist_stop(struct maildir_dirlist *list)
+{
+	timeout_remove(&list->to);
+	DLLIST_REMOVE(&maildir_dirlists_running, list);
+	if (maildir_dirlists_running == NULL) {
+		io_loop_remove_switch_callback(maildir_dirlist_ioloop_switched);
+		maildir_dirlist_switch_callback_added = FALSE;
+	}
+}
+
+static void maildir_dirlist_key_set(struct maildir_dirlist_key *key,
+				    const struct stat *st)
+{
+	key->ino = st->st_ino;
+	key->mtime = st->st_mtime;
+	key->mtime_nsecs = ST_MTIME_NSEC(*st);
+}
+
+static bool maildir_dirlist_key_equals(const struct maildir_dirlist_key *key,
+				       const struct stat *st)
+{
+	return key->ino == st->st_ino && key->mtime == st->st_mtime &&
+		ST_NTIMES_EQUAL(key->mtime_nsecs, ST_MTIME_NSEC(*st));
+}
+
+struct maildir_dirlist *
+maildir_dirlist_init(struct maildir_mailbox *mbox, const char *dir_path)
+{
+	struct maildir_dirlist *list;
+	const char *control_dir;
+
+	if (mailbox_get_path_to(&mbox->box, MAILBOX_LIST_PATH_TYPE_CONTROL,
+				&control_dir) <= 0)
+		i_unreached();
+
+	list = i_new(struct maildir_dirlist, 1);
+	list->mbox = mbox;
+	list->dir_path = i_strdup(dir_path);
+	list->cache_path = i_strconcat(control_dir,
+				       "/"MAILDIR_DIRLIST_CACHE_NAME, NULL);
+	list->pool = pool_alloconly_create("maildir dirlist", 1024*16);
+	i_array_init(&list->names, 1024);
+#ifdef HAVE_MAILDIR_GETDENTS64
+	list->fd = -1;
+#endif
+	return list;
+}
+
+static void maildir_dirlist_close(struct maildir_dirlist *list)
+{
+	if (list->to != NULL)
+		maildir_dirlist_stop(list);
+#ifdef HAVE_MAILDIR_GETDENTS64
+	if (list->fd != -1) {
+		if (close(list->fd) < 0)
+			i_error("close(%s) failed: %m", list->dir_path);
+		list->fd = -1;
+	}
+	i_free_and_null(list->buf);
+#else
+	if (list->dirp != NULL) {
+		if (closedir(list->dirp) < 0)
+			i_error("closedir(%s) failed: %m", list->dir_path);
+		list->dirp = NULL;
+	}
+#endif
+}
+
+static void maildir_dirlist_clear(struct maildir_dirlist *list)
+{
+	maildir_dirlist_close(list);
+	array_clear(&list->names);
+	p_clear(list->pool);
+	i_zero(&list->key);
+	list->scan_time = 0;
+	list->ready = FALSE;
+}
+
+void maildir_dirlist_deinit(struct maildir_dirlist **_list)
+{
+	struct maildir_dirlist *list = *_list;
+
+	*_list = NULL;
+	maildir_dirlist_close(list);
+	array_free(&list->names);
+	pool_unref(&list->pool);
+	i_free(list->dir_path);
+	i_free(list->cache_path);
+	i_free(list);
+}
+
+static void maildir_dirlist_add(struct maildir_dirlist *list, const char *name)
+{
+	const char *p_name;
+
+	if (name[0] == '.')
+		return;
+	p_name = p_strdup(list->pool, name);
+	array_append(&list->names, &p_name, 1);
+}
+
+#ifdef HAVE_MAILDIR_GETDENTS64
+static int maildir_dirlist_open(struct maildir_dirlist *list, struct stat *st_r)
+{
+	list->fd = open(list->dir_path, O_RDONLY | O_DIRECTORY);
+	if (list->fd == -1) {
+		if (errno != ENOENT)
+			i_error("open(%s) failed: %m", list->dir_path);
+		return -1;
+	}
+	if (fstat(list->fd, st_r) < 0) {
+		i_error("fstat(%s) failed: %m", list->dir_path);
+		return -1;
+	}
+	list->buf = i_malloc(MAILDIR_DIRLIST_BUF_SIZE);
+	return 0;
+}
+
+static int maildir_dirlist_read_batch(struct maildir_dirlist *list)
+{
+	const struct linux_dirent64 *d;
+	long ret, pos;
+
+	ret = syscall(SYS_getdents64, list->fd, list->buf,
+		      MAILDIR_DIRLIST_BUF_SIZE);
+	if (ret < 0) {
+		i_error("getdents64(%s) failed: %m", list->dir_path);
+		return -1;
+	}
+	for (pos = 0; pos < ret; pos += d->d_reclen) {
+		d = (const void *)(list->buf + pos);
+		maildir_dirlist_add(list, d->d_name);
+	}
+	return ret > 0 ? 1 : 0;
+}
+#else
+static int maildir_dirlist_open(struct maildir_dirlist *list, struct stat *st_r)
+{
+	list->dirp = opendir(list->dir_path);
+	if (list->dirp == NULL) {
+		if (errno != ENOENT)
+			i_error("opendir(%s) failed: %m", list->dir_path);
+		return -1;
+	}
+#ifdef HAVE_DIRFD
+	if (fstat(dirfd(list->dirp), st_r) < 0) {
+		i_error("fstat(%s) failed: %m", list->dir_path);
+		return -1;
+	}
+#else
+	if (stat(list->dir_path, st_r) < 0) {
+		i_error("stat(%s) failed: %m", list->dir_path);
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+static int maildir_dirlist_read_batch(struct maildir_dirlist *list)
+{
+	struct dirent *dp;
+	unsigned int i;
+
+	errno = 0;
+	for (i = 0; i < MAILDIR_DIRLIST_READDIR_COUNT; i++) {
+		if ((dp = readdir(list->dirp)) == NULL) {
+			if (errno != 0) {
+				i_error("readdir(%s) failed: %m",
+					list->dir_path);
+				return -1;
+			}
+			return 0;
+		}
+		maildir_dirlist_add(list, dp->d_name);
+	}
+	return 1;
+}
+#endif
+
+static int maildir_dirlist_write_fd(struct maildir_dirlist *list,
+				    const char *path, int fd)
+{
+	const char *const *names;
+	unsigned int i, count;
+	string_t *str;
+
+	names = array_get(&list->names, &count);
+	str = t_str_new(128 + count * 64);
+	str_printfa(str, "%u %llu %ld %lu %ld %u\n",
+		    MAILDIR_DIRLIST_CACHE_VERSION,
+		    (unsigned long long)list->key.ino, (long)list->key.mtime,
+		    list->key.mtime_nsecs, (long)list->scan_time, count);
+	for (i = 0; i < count; i++) {
+		if (strchr(names[i], '\n') != NULL) {
+			/* can't be written to the cache */
+			return 0;
+		}
+		str_append(str, names[i]);
+		str_append_c(str, '\n');
+	}
+	if (write_full(fd, str_data(str), str_len(str)) < 0) {
+		i_error("write_full(%s) failed: %m", path);
+		return -1;
+	}
+	return 1;
+}
+
+static void maildir_dirlist_write_cache(struct maildir_dirlist *list)
+{
+	struct mailbox *box = &list->mbox->box;
+	const struct mailbox_permissions *perm = mailbox_get_permissions(box);
+	struct dotlock_settings dotlock_set;
+	struct dotlock *dotlock;
+	mode_t old_mask;
+	int fd, ret;
+
+	i_zero(&dotlock_set);
+	dotlock_set.use_excl_lock = box->storage->set->dotlock_use_excl;
+	dotlock_set.nfs_flush = box->storage->set->mail_nfs_storage;
+	dotlock_set.timeout = MAILDIR_DIRLIST_LOCK_STALE_TIMEOUT + 2;
+	dotlock_set.stale_timeout = MAILDIR_DIRLIST_LOCK_STALE_TIMEOUT;
+	dotlock_set.temp_prefix = mailbox_list_get_temp_prefix(box->list);
+
+	old_mask = umask(0777 & ~perm->file_create_mode);
+	fd = file_dotlock_open(&dotlock_set, list->cache_path,
+			       DOTLOCK_CREATE_FLAG_NONBLOCK, &dotlock);
+	umask(old_mask);
+	if (fd == -1) {
+		/* someone else is already writing it */
+		if (errno != EAGAIN && errno != ENOENT) {
+			i_error("file_dotlock_open(%s) failed: %m",
+				list->cache_path);
+		}
+		return;
+	}
+
+	T_BEGIN {
+		ret = maildir_dirlist_write_fd(list,
+				file_dotlock_get_lock_path(dotlock), fd);
+	} T_END;
+	if (ret <= 0)
+		file_dotlock_delete(&dotlock);
+	else if (file_dotlock_replace(&dotlock, 0) < 0) {
+		i_error("file_dotlock_replace(%s) failed: %m",
+			list->cache_path);
+	} else {
+		/* the cache now matches what we have in memory */
+		list->cache_key = list->key;
+		list->cache_read = TRUE;
+	}
+}
+
+static int
+maildir_dirlist_parse_header(const char *line, struct maildir_dirlist_key *key_r,
+			     time_t *scan_time_r, unsigned int *count_r)
+{
+	const char *const *args = t_strsplit_spaces(line, " ");
+	unsigned int version;
+	unsigned long nsecs;
+
+	if (str_array_length(args) != 6 ||
+	    str_to_uint(args[0], &version) < 0 ||
+	    version != MAILDIR_DIRLIST_CACHE_VERSION ||
+	    str_to_ino(args[1], &key_r->ino) < 0 ||
+	    str_to_time(args[2], &key_r->mtime) < 0 ||
+	    str_to_ulong(args[3], &nsecs) < 0 ||
+	    str_to_time(args[4], scan_time_r) < 0 ||
+	    str_to_uint(args[5], count_r) < 0)
+		return -1;
+	key_r->mtime_nsecs = nsecs;
+	return 0;
+}
+
+static void maildir_dirlist_read_cache(struct maildir_dirlist *list,
+				       const struct stat *st)
+{
+	struct maildir_dirlist_key key;
+	struct istream *input;
+	const char *line;
+	time_t scan_time;
+	unsigned int count;
+	int fd, ret;
+
+	list->cache_read = TRUE;
+	maildir_dirlist_key_set(&list->cache_key, st);
+
+	fd = open(list->cache_path, O_RDONLY);
+	if (fd == -1) {
+		if (errno != ENOENT)
+			i_error("open(%s) failed: %m", list->cache_path);
+		return;
+	}
+	input = i_stream_create_fd_autoclose(&fd, (size_t)-1);
+	T_BEGIN {
+		line = i_stream_read_next_line(input);
+		ret = line == NULL ? 0 :
+			maildir_dirlist_parse_header(line, &key, &scan_time,
+						     &count);
+	} T_END;
+	if (line == NULL || ret < 0 ||
+	    !maildir_dirlist_key_equals(&key, st) ||
+	    scan_time <= key.mtime + MAILDIR_SYNC_SECS) {
+		/* the cache is outdated or broken */
+		i_stream_destroy(&input);
+		return;
+	}
+
+	maildir_dirlist_clear(list);
+	while ((line = i_stream_read_next_line(input)) != NULL)
+		maildir_dirlist_add(list, line);
+	if (input->stream_errno != 0) {
+		i_error("read(%s) failed: %s", list->cache_path,
+			i_stream_get_error(input));
+		maildir_dirlist_clear(list);
+	} else if (array_count(&list->names) != count) {
+		/* partially written? */
+		maildir_dirlist_clear(list);
+	} else {
+		list->key = key;
+		list->scan_time = scan_time;
+		list->ready = TRUE;
+	}
+	i_stream_destroy(&input);
+}
+
+bool maildir_dirlist_is_usable(struct maildir_dirlist *list,
+			       const struct stat *st)
+{
+	if (list->to != NULL)
+		return FALSE;
+
+	if (!list->ready || !maildir_dirlist_key_equals(&list->key, st)) {
+		if (!list->cache_read ||
+		    !maildir_dirlist_key_equals(&list->cache_key, st))
+			maildir_dirlist_read_cache(list, st);
+		if (!list->ready || !maildir_dirlist_key_equals(&list->key, st))
+			return FALSE;
+	}
+	/* changes done within the same second may not have been seen */
+	if (list->scan_time <= list->key.mtime + MAILDIR_SYNC_SECS)
+		return FALSE;
+	list->restart_count = 0;
+	return TRUE;
+}
+
+static void maildir_dirlist_read_next(struct maildir_dirlist *list)
+{
+	struct mailbox *box = &list->mbox->box;
+	int ret;
+
+	if ((ret = maildir_dirlist_read_batch(list)) > 0)
+		return;
+
+	maildir_dirlist_close(list);
+	if (ret < 0) {
+		maildir_dirlist_clear(list);
+		return;
+	}
+	list->ready = TRUE;
+	maildir_dirlist_write_cache(list);
+
+	/* let the caller find out about the changes */
+	if (box->notify_callback != NULL)
+		box->notify_callback(box, box->notify_context);
+}
+
+static void maildir_dirlist_start(struct maildir_dirlist *list)
+{
+	i_assert(list->to == NULL);
+
+	list->to = timeout_add_short(0, maildir_dirlist_read_next, list);
+	DLLIST_PREPEND(&maildir_dirlists_running, list);
+	if (!maildir_dirlist_switch_callback_added) {
+		io_loop_add_switch_callback(maildir_dirlist_ioloop_switched);
+		maildir_dirlist_switch_callback_added = TRUE;
+	}
+}
+
+bool maildir_dirlist_scan_background(struct maildir_dirlist *list,
+				     const struct stat *st)
+{
+	struct stat st2;
+
+	if (list->to != NULL) {
+		/* listing already in progress */
+		if (maildir_dirlist_key_equals(&list->key, st))
+			return TRUE;
+	} else if (maildir_dirlist_is_usable(list, st)) {
+		return FALSE;
+	}
+
+	if (list->restart_count >= MAILDIR_DIRLIST_MAX_RESTARTS ||
+	    ioloop_time <= st->st_mtime + MAILDIR_SYNC_SECS) {
+		/* the directory is changing all the time or it was just
+		   changed. the listing wouldn't be usable anyway. */
+		maildir_dirlist_clear(list);
+		list->restart_count = 0;
+		return FALSE;
+	}
+
+	maildir_dirlist_clear(list);
+	list->restart_count++;
+	if (maildir_dirlist_open(list, &st2) < 0) {
+		maildir_dirlist_clear(list);
+		return FALSE;
+	}
+	maildir_dirlist_key_set(&list->key, &st2);
+	list->scan_time = time(NULL);
+	maildir_dirlist_start(list);
+	return TRUE;
+}
+
+const char *const *
+maildir_dirlist_get_names(struct maildir_dirlist *list, unsigned int *count_r)
+{
+	i_assert(list->ready);
+
+	return array_get(&list->names, count_r);
+}
+
+time_t maildir_dirlist_get_scan_time(struct maildir_dirlist *list)
+{
+	i_assert(list->ready);
+
+	return list->scan_time;
+}
@@ -0,0 +1,36 @@
+#ifndef MAILDIR_DIRLIST_H
+#define MAILDIR_DIRLIST_H
+
+#include <sys/stat.h>
+
+#define MAILDIR_DIRLIST_CACHE_NAME "dovecot-cur.cache"
+
+struct maildir_mailbox;
+
+/* Listing of maildir's cur/ directory. It's built in the background without
+   blocking the caller and it's saved to MAILDIR_DIRLIST_CACHE_NAME file.
+   The listing is usable only as long as the directory's inode and mtime
+   haven't changed since it was started. */
+struct maildir_dirlist *
+maildir_dirlist_init(struct maildir_mailbox *mbox, const char *dir_path);
+void maildir_dirlist_deinit(struct maildir_dirlist **list);
+
+/* Returns TRUE if the listing matches the directory's current stat.
+   If there's no such listing in memory, try to read it from the cache
+   file. */
+bool maildir_dirlist_is_usable(struct maildir_dirlist *list,
+			       const struct stat *st);
+/* Start listing the directory in the background, unless it's already being
+   done. Returns FALSE if the caller should instead scan the directory
+   itself, because the listing is already usable or because the directory
+   keeps changing faster than it can be listed. */
+bool maildir_dirlist_scan_background(struct maildir_dirlist *list,
+				     const struct stat *st);
+
+/* Returns the file names in the usable listing. */
+const char *const *
+maildir_dirlist_get_names(struct maildir_dirlist *list, unsigned int *count_r);
+/* Returns the time when the usable listing was started. */
+time_t maildir_dirlist_get_scan_time(struct maildir_dirlist *list);
+
+#endif
@@ -79,6 +79,8 @@ struct maildir_mailbox {
 	/* maildir sync: */
 	struct maildir_uidlist *uidlist;
 	struct maildir_keywords *keywords;
+	/* cur/ listing with maildir_background_scan=yes */
+	struct maildir_dirlist *cur_list;
 
 	struct maildir_index_header maildir_hdr;
 	uint32_t maildir_ext_id;
@@ -651,8 +651,10 @@ int maildir_sync_index(struct maildir_index_sync_context *ctx,
 	ctx->mbox->box.tmp_sync_view = NULL;
 
 	/* check cur/ mtime later. if we came here from saving messages they
-	   could still be moved to cur/ directory. */
-	ctx->update_maildir_hdr_cur = TRUE;
+	   could still be moved to cur/ directory. if cur/ is still being
+	   listed in the background, its changes haven't been synced yet. */
+	ctx->update_maildir_hdr_cur = ctx->maildir_sync_ctx == NULL ||
+		!maildir_sync_is_cur_background(ctx->maildir_sync_ctx);
 	mbox->maildir_hdr.cur_check_time = time_before_sync;
 
 	if (uid_validity == 0) {
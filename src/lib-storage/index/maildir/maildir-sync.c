@@ -182,6 +182,7 @@
 #include "maildir-uidlist.h"
 #include "maildir-filename.h"
 #include "maildir-sync.h"
+#include "maildir-dirlist.h"
 
 #include <stdio.h>
 #include <stddef.h>
@@ -229,6 +230,7 @@ struct maildir_sync_context {
 	bool partial:1;
 	bool locked:1;
 	bool racing:1;
+	bool cur_background:1;
 };
 
 void maildir_sync_set_racing(struct maildir_sync_context *ctx)
@@ -236,6 +238,11 @@ void maildir_sync_set_racing(struct maildir_sync_context *ctx)
 	ctx->racing = TRUE;
 }
 
+bool maildir_sync_is_cur_background(struct maildir_sync_context *ctx)
+{
+	return ctx->cur_background;
+}
+
 void maildir_sync_notify(struct maildir_sync_context *ctx)
 {
 	time_t now;
@@ -397,6 +404,50 @@ maildir_stat(struct maildir_mailbox *mbox, const char *path, struct stat *st_r)
 	return -1;
 }
 
+static int
+maildir_scan_dir_listed(struct maildir_sync_context *ctx, const struct stat *st)
+{
+	struct maildir_dirlist *list = ctx->mbox->cur_list;
+	const char *const *names;
+	unsigned int i, count;
+	int ret = 0;
+
+	ctx->mbox->maildir_hdr.cur_check_time =
+		maildir_dirlist_get_scan_time(list);
+	ctx->mbox->maildir_hdr.cur_mtime = st->st_mtime;
+	ctx->mbox->maildir_hdr.cur_mtime_nsecs = ST_MTIME_NSEC(*st);
+
+	names = maildir_dirlist_get_names(list, &count);
+	for (i = 0; i < count; i++) {
+		if (names[i][0] == MAILDIR_INFO_SEP) {
+			/* don't even try to use file with empty base name */
+			if (maildir_rename_empty_basename(ctx, ctx->cur_dir,
+							  names[i]) < 0)
+				return -1;
+			continue;
+		}
+
+		if ((i % MAILDIR_SLOW_CHECK_COUNT) == 0)
+			maildir_sync_notify(ctx);
+
+		ret = maildir_uidlist_sync_next(ctx->uidlist_sync_ctx,
+						names[i], 0);
+		if (ret <= 0) {
+			if (ret < 0)
+				return -1;
+
+			/* possibly duplicate - try fixing it */
+			T_BEGIN {
+				ret = maildir_fix_duplicate(ctx, ctx->cur_dir,
+							    names[i]);
+			} T_END;
+			if (ret < 0)
+				return -1;
+		}
+	}
+	return 0;
+}
+
 static int
 maildir_scan_dir(struct maildir_sync_context *ctx, bool new_dir, bool final,
 		 enum maildir_scan_why why)
@@ -414,6 +465,15 @@ maildir_scan_dir(struct maildir_sync_context *ctx, bool new_dir, bool final,
 	bool move_new, dir_changed = FALSE;
 
 	path = new_dir ? ctx->new_dir : ctx->cur_dir;
+	if (!new_dir && ctx->mbox->cur_list != NULL) {
+		/* use the background listing if the directory hasn't
+		   changed since it was started */
+		if (maildir_stat(ctx->mbox, path, &st) < 0)
+			return -1;
+		if (maildir_dirlist_is_usable(ctx->mbox->cur_list, &st))
+			return maildir_scan_dir_listed(ctx, &st);
+	}
+
 	for (i = 0;; i++) {
 		dirp = opendir(path);
 		if (dirp != NULL)
@@ -572,7 +632,7 @@ maildir_scan_dir(struct maildir_sync_context *ctx, bool new_dir, bool final,
 			ctx->mbox->maildir_hdr.new_mtime_nsecs =
 				ST_MTIME_NSEC(st);
 		}
-		if (stat(ctx->cur_dir, &st) == 0) {
+		if (!ctx->cur_background && stat(ctx->cur_dir, &st) == 0) {
 			ctx->mbox->maildir_hdr.new_check_time =
 				I_MAX(st.st_mtime, start_time);
 			ctx->mbox->maildir_hdr.cur_mtime = st.st_mtime;
@@ -789,6 +849,25 @@ static int maildir_sync_get_changes(struct maildir_sync_context *ctx,
 	return mail_index_sync_have_any(mbox->box.index, flags) ? 1 : 0;
 }
 
+static bool
+maildir_sync_want_background_scan(struct maildir_sync_context *ctx,
+				  enum maildir_scan_why why)
+{
+	struct maildir_mailbox *mbox = ctx->mbox;
+	struct stat st;
+
+	if (!mbox->storage->set->maildir_background_scan ||
+	    (why & (WHY_FORCED | WHY_FIRSTSYNC | WHY_FINDRECENT)) != 0 ||
+	    mbox->syncing_commit || current_ioloop == NULL)
+		return FALSE;
+
+	if (maildir_stat(mbox, ctx->cur_dir, &st) < 0)
+		return FALSE;
+	if (mbox->cur_list == NULL)
+		mbox->cur_list = maildir_dirlist_init(mbox, ctx->cur_dir);
+	return maildir_dirlist_scan_background(mbox->cur_list, &st);
+}
+
 static int ATTR_NULL(3)
 maildir_sync_context(struct maildir_sync_context *ctx, bool forced,
 		     uint32_t *find_uid, bool *lost_files_r)
@@ -857,6 +936,14 @@ maildir_sync_context(struct maildir_sync_context *ctx, bool forced,
 	   problem rarely happens except under high amount of modifications.
 	*/
 
+	if (cur_changed && maildir_sync_want_background_scan(ctx, why)) {
+		/* cur/ is being listed in the background. sync only new/ for
+		   now and show the old state of cur/ until the listing is
+		   finished. */
+		ctx->cur_background = TRUE;
+		cur_changed = FALSE;
+	}
+
 	if (!cur_changed) {
 		ctx->partial = TRUE;
 		sync_flags = MAILDIR_UIDLIST_SYNC_PARTIAL;
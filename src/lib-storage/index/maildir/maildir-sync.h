@@ -39,6 +39,9 @@ void maildir_sync_index_rollback(struct maildir_index_sync_context **_ctx);
 struct maildir_keywords_sync_ctx *
 maildir_sync_get_keywords_sync_ctx(struct maildir_index_sync_context *ctx);
 void maildir_sync_set_racing(struct maildir_sync_context *ctx);
+/* Returns TRUE if cur/ changes are being listed in the background and they
+   aren't included in this sync. */
+bool maildir_sync_is_cur_background(struct maildir_sync_context *ctx);
 void maildir_sync_notify(struct maildir_sync_context *ctx);
 void maildir_sync_set_new_msgs_count(struct maildir_index_sync_context *ctx,
 				     unsigned int count);
@@ -617,6 +617,8 @@ struct mail_search_context {
 
 	bool seen_lost_data:1;
 	bool progress_hidden:1;
+	/* mailbox_search_pause() was called */
+	bool paused:1;
 };
 
 struct mail_save_data {
@@ -35,9 +35,20 @@ static const struct setting_define mail_storage_setting_defines[] = {
 	DEF(SET_STR, mail_cache_fields),
 	DEF(SET_STR, mail_always_cache_fields),
 	DEF(SET_STR, mail_never_cache_fields),
+	DEF(SET_STR, mail_cache_column_fields),
 	DEF(SET_STR, mail_server_comment),
 	DEF(SET_STR, mail_server_admin),
+	DEF(SET_STR_VARS, mail_index_snapshot_dir),
+	DEF(SET_BOOL, mail_index_log_group_commit),
+	DEF(SET_UINT, mail_index_cache_max_count),
+	DEF(SET_SIZE, mail_index_cache_max_size),
+	DEF(SET_UINT, mail_index_cache_max_user_count),
+	DEF(SET_TIME, mail_index_cache_timeout),
+	DEF(SET_BOOL, mail_index_cache_persistent),
 	DEF(SET_UINT, mail_cache_min_mail_count),
+	DEF(SET_UINT, mail_cache_compress_chunk),
+	DEF(SET_UINT, mail_rebuild_workers),
+	DEF(SET_UINT, mail_sort_max_threads),
 	DEF(SET_TIME, mailbox_idle_check_interval),
 	DEF(SET_UINT, mail_max_keyword_length),
 	DEF(SET_TIME, mail_max_lock_timeout),
@@ -76,9 +87,20 @@ const struct mail_storage_settings mail_storage_default_settings = {
 	.mail_cache_fields = "flags",
 	.mail_always_cache_fields = "",
 	.mail_never_cache_fields = "imap.envelope",
+	.mail_cache_column_fields = "",
 	.mail_server_comment = "",
 	.mail_server_admin = "",
+	.mail_index_snapshot_dir = "",
+	.mail_index_log_group_commit = FALSE,
+	.mail_index_cache_max_count = 3,
+	.mail_index_cache_max_size = 0,
+	.mail_index_cache_max_user_count = 0,
+	.mail_index_cache_timeout = 10,
+	.mail_index_cache_persistent = FALSE,
 	.mail_cache_min_mail_count = 0,
+	.mail_cache_compress_chunk = 0,
+	.mail_rebuild_workers = 0,
+	.mail_sort_max_threads = 0,
 	.mailbox_idle_check_interval = 30,
 	.mail_max_keyword_length = 50,
 	.mail_max_lock_timeout = 0,
@@ -21,9 +21,18 @@ struct mail_storage_settings {
 	const char *mail_cache_fields;
 	const char *mail_always_cache_fields;
 	const char *mail_never_cache_fields;
+	const char *mail_cache_column_fields;
 	const char *mail_server_comment;
 	const char *mail_server_admin;
+	const char *mail_index_snapshot_dir;
 	unsigned int mail_cache_min_mail_count;
+	unsigned int mail_cache_compress_chunk;
+	unsigned int mail_rebuild_workers;
+	unsigned int mail_sort_max_threads;
+	unsigned int mail_index_cache_max_count;
+	uoff_t mail_index_cache_max_size;
+	unsigned int mail_index_cache_max_user_count;
+	unsigned int mail_index_cache_timeout;
 	unsigned int mailbox_idle_check_interval;
 	unsigned int mail_max_keyword_length;
 	unsigned int mail_max_lock_timeout;
@@ -35,6 +44,8 @@ struct mail_storage_settings {
 	bool dotlock_use_excl;
 	bool mail_nfs_storage;
 	bool mail_nfs_index;
+	bool mail_index_log_group_commit;
+	bool mail_index_cache_persistent;
 	bool mailbox_list_index;
 	bool mailbox_list_index_very_dirty_syncs;
 	bool mail_debug;
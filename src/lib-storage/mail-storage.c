@@ -64,6 +64,7 @@ void mail_storage_deinit(void)
 	mailbox_lists_deinit();
 	mailbox_attributes_deinit();
 	dsasl_clients_deinit();
+	mail_index_alloc_cache_destroy_unrefed();
 }
 
 void mail_storage_class_register(struct mail_storage *storage_class)
@@ -308,6 +309,19 @@ mail_storage_find(struct mail_user *user,
 	return NULL;
 }
 
+static void
+mail_storage_set_index_cache(const struct mail_storage_settings *set)
+{
+	struct mail_index_alloc_cache_settings cache_set;
+
+	i_zero(&cache_set);
+	cache_set.max_count = set->mail_index_cache_max_count;
+	cache_set.max_size = set->mail_index_cache_max_size;
+	cache_set.max_owner_count = set->mail_index_cache_max_user_count;
+	cache_set.timeout_secs = set->mail_index_cache_timeout;
+	mail_index_alloc_cache_set_settings(&cache_set);
+}
+
 int mail_storage_create_full(struct mail_namespace *ns, const char *driver,
 			     const char *data, enum mail_storage_flags flags,
 			     struct mail_storage **storage_r,
@@ -391,6 +405,9 @@ int mail_storage_create_full(struct mail_namespace *ns, const char *driver,
 	storage->set = ns->mail_set;
 	storage->flags = flags;
 	p_array_init(&storage->module_contexts, storage->pool, 5);
+	/* the index cache is shared by the whole process, so the latest
+	   user's settings are used */
+	mail_storage_set_index_cache(storage->set);
 
 	if (storage->v.create != NULL &&
 	    storage->v.create(storage, ns, error_r) < 0) {
@@ -421,6 +438,7 @@ int mail_storage_create(struct mail_namespace *ns, const char *driver,
 void mail_storage_unref(struct mail_storage **_storage)
 {
 	struct mail_storage *storage = *_storage;
+	bool keep_indexes;
 
 	i_assert(storage->refcount > 0);
 
@@ -437,6 +455,15 @@ void mail_storage_unref(struct mail_storage **_storage)
 	}
 	if (storage->obj_refcount != 0)
 		i_panic("Trying to deinit storage before freeing its objects");
+	keep_indexes = storage->set->mail_index_cache_persistent;
+	if (storage->set->mail_debug) {
+		struct mail_index_alloc_cache_stats stats;
+
+		mail_index_alloc_cache_get_stats(&stats);
+		i_debug("Index cache: hits=%u misses=%u evictions=%u "
+			"cached=%u size=%"PRIuUOFF_T, stats.hits, stats.misses,
+			stats.evictions, stats.cached_count, stats.cached_size);
+	}
 
 	DLLIST_REMOVE(&storage->user->storages, storage);
 
@@ -450,7 +477,12 @@ void mail_storage_unref(struct mail_storage **_storage)
 	*_storage = NULL;
 	pool_unref(&storage->pool);
 
-	mail_index_alloc_cache_destroy_unrefed();
+	if (keep_indexes) {
+		/* the process may be reused for the same user soon */
+		mail_index_alloc_cache_evict_unused();
+	} else {
+		mail_index_alloc_cache_destroy_unrefed();
+	}
 }
 
 void mail_storage_obj_ref(struct mail_storage *storage)
@@ -1206,8 +1238,8 @@ static int mailbox_alloc_index_pvt(struct mailbox *box)
 	if (mailbox_create_missing_dir(box, MAILBOX_LIST_PATH_TYPE_INDEX_PRIVATE) < 0)
 		return -1;
 
-	box->index_pvt = mail_index_alloc_cache_get(NULL, index_dir,
-		t_strconcat(box->index_prefix, ".pvt", NULL));
+	box->index_pvt = mail_index_alloc_cache_get(box->storage->user->username,
+		NULL, index_dir, t_strconcat(box->index_prefix, ".pvt", NULL));
 	mail_index_set_fsync_mode(box->index_pvt,
 				  box->storage->set->parsed_fsync_mode, 0);
 	mail_index_set_lock_method(box->index_pvt,
@@ -1908,6 +1940,11 @@ bool mailbox_search_next_nonblock(struct mail_search_context *ctx,
 	}
 }
 
+void mailbox_search_pause(struct mail_search_context *ctx)
+{
+	ctx->paused = TRUE;
+}
+
 bool mailbox_search_seen_lost_data(struct mail_search_context *ctx)
 {
 	return ctx->seen_lost_data;
@@ -90,6 +90,7 @@ enum mailbox_status_items {
 	STATUS_LAST_CACHED_SEQ	= 0x800,
 	STATUS_CHECK_OVER_QUOTA	= 0x1000, /* return error if over quota */
 	STATUS_HIGHESTPVTMODSEQ	= 0x2000,
+	STATUS_CACHE_COMPRESS	= 0x4000,
 	/* status items that must not be looked up with
 	   mailbox_get_open_status(), because they can return failure. */
 #define MAILBOX_STATUS_FAILING_ITEMS \
@@ -252,6 +253,11 @@ struct mailbox_status {
 	uint64_t highest_modseq; /* STATUS_HIGHESTMODSEQ */
 	/* 0 if no private index (STATUS_HIGHESTPVTMODSEQ) */
 	uint64_t highest_pvt_modseq;
+	/* Cache compressions done by this process and how long they kept
+	   the cache locked (STATUS_CACHE_COMPRESS) */
+	unsigned int cache_compress_count;
+	uint64_t cache_compress_last_lock_usecs;
+	uint64_t cache_compress_max_lock_usecs;
 
 	/* NULL-terminated array of keywords (STATUS_KEYWORDS) */
 	const ARRAY_TYPE(keywords) *keywords;
@@ -670,6 +676,11 @@ bool mailbox_search_next(struct mail_search_context *ctx, struct mail **mail_r);
    more results will be returned by calling the function again. */
 bool mailbox_search_next_nonblock(struct mail_search_context *ctx,
 				  struct mail **mail_r, bool *tryagain_r);
+/* Tell the search that the caller is going to wait for something else than
+   the returned mails (e.g. client output). The time until the next
+   mailbox_search_next*() call isn't then counted as time spent handling the
+   mail when adjusting how many mails are prefetched. */
+void mailbox_search_pause(struct mail_search_context *ctx);
 /* Returns TRUE if some messages were already expunged and we couldn't
    determine correctly if those messages should have been returned in this
    search. */
@@ -0,0 +1,85 @@
+/* Copyright (c) 2017 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "test-common.h"
+#include "index/index-sort-parallel.h"
+
+struct test_sort_node {
+	uint32_t key;
+	uint32_t seq;
+};
+ARRAY_DEFINE_TYPE(test_sort_node, struct test_sort_node);
+
+static int test_sort_node_key_cmp(const struct test_sort_node *n1,
+				  const struct test_sort_node *n2)
+{
+	return n1->key < n2->key ? -1 :
+		(n1->key > n2->key ? 1 : 0);
+}
+
+static int test_sort_node_cmp(const struct test_sort_node *n1,
+			      const struct test_sort_node *n2)
+{
+	int ret;
+
+	if ((ret = test_sort_node_key_cmp(n1, n2)) != 0)
+		return ret;
+	return n1->seq < n2->seq ? -1 :
+		(n1->seq > n2->seq ? 1 : 0);
+}
+
+static void
+test_index_sort_parallel_count(unsigned int count, unsigned int max_key,
+			       unsigned int max_threads)
+{
+	ARRAY_TYPE(test_sort_node) nodes, nodes2, expected;
+	struct test_sort_node *node;
+	unsigned int i;
+
+	i_array_init(&nodes, count);
+	for (i = 0; i < count; i++) {
+		node = array_append_space(&nodes);
+		node->key = rand() % max_key;
+		node->seq = i + 1;
+	}
+	i_array_init(&nodes2, count);
+	array_append_array(&nodes2, &nodes);
+	i_array_init(&expected, count);
+	array_append_array(&expected, &nodes);
+	array_sort(&expected, test_sort_node_cmp);
+
+	/* ties are left for the full comparison */
+	index_sort_array_parallel(&nodes, test_sort_node_key_cmp,
+				  test_sort_node_cmp, max_threads);
+	test_assert(array_cmp(&nodes, &expected));
+	/* the same comparison for both */
+	index_sort_array_parallel(&nodes2, test_sort_node_cmp,
+				  test_sort_node_cmp, max_threads);
+	test_assert(array_cmp(&nodes2, &expected));
+
+	array_free(&nodes);
+	array_free(&nodes2);
+	array_free(&expected);
+}
+
+static void test_index_sort_parallel(void)
+{
+	test_begin("index sort parallel");
+	test_index_sort_parallel_count(0, 10, 4);
+	test_index_sort_parallel_count(100, 10, 4);
+	test_index_sort_parallel_count(100000, 100, 0);
+	test_index_sort_parallel_count(100000, 100, 3);
+	test_index_sort_parallel_count(100000, 100000, 4);
+	test_index_sort_parallel_count(100001, 3, 7);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_index_sort_parallel,
+		NULL
+	};
+	return test_run(test_functions);
+}
@@ -0,0 +1,75 @@
+/* Copyright (c) 2017 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "test-common.h"
+#include "index/index-sort-radix.h"
+
+struct test_sort_node {
+	uint32_t seq;
+	uint32_t key;
+};
+ARRAY_DEFINE_TYPE(test_sort_node, struct test_sort_node);
+
+static bool test_sort_reverse;
+
+static int test_sort_node_cmp(const struct test_sort_node *n1,
+			      const struct test_sort_node *n2)
+{
+	if (n1->key != n2->key)
+		return (n1->key < n2->key) != test_sort_reverse ? -1 : 1;
+	/* secondary order the opposite way, so ties are sorted by this */
+	return n1->seq < n2->seq ? 1 :
+		(n1->seq > n2->seq ? -1 : 0);
+}
+
+static void
+test_index_sort_radix_count(unsigned int count, uint32_t max_key,
+			    bool reverse)
+{
+	ARRAY_TYPE(test_sort_node) nodes, expected;
+	struct test_sort_node *node;
+	unsigned int i;
+
+	test_sort_reverse = reverse;
+	i_array_init(&nodes, count + 1);
+	for (i = 0; i < count; i++) {
+		node = array_append_space(&nodes);
+		node->seq = i + 1;
+		node->key = max_key == (uint32_t)-1 ?
+			((uint32_t)rand() << 16) ^ (uint32_t)rand() :
+			(uint32_t)rand() % (max_key + 1);
+	}
+	i_array_init(&expected, count + 1);
+	array_append_array(&expected, &nodes);
+	array_sort(&expected, test_sort_node_cmp);
+
+	index_sort_array_radix(&nodes, key, reverse, test_sort_node_cmp);
+	test_assert(array_cmp(&nodes, &expected));
+
+	array_free(&nodes);
+	array_free(&expected);
+}
+
+static void test_index_sort_radix(void)
+{
+	test_begin("index sort radix");
+	test_index_sort_radix_count(0, 10, FALSE);
+	test_index_sort_radix_count(1, 10, TRUE);
+	test_index_sort_radix_count(1000, 0, FALSE);
+	test_index_sort_radix_count(1000, 10, FALSE);
+	test_index_sort_radix_count(1000, 10, TRUE);
+	test_index_sort_radix_count(10000, 0xffff, FALSE);
+	test_index_sort_radix_count(10000, (uint32_t)-1, FALSE);
+	test_index_sort_radix_count(10000, (uint32_t)-1, TRUE);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_index_sort_radix,
+		NULL
+	};
+	return test_run(test_functions);
+}
@@ -0,0 +1,239 @@
+/* Copyright (c) 2017 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "ioloop.h"
+#include "istream.h"
+#include "str.h"
+#include "path-util.h"
+#include "unlink-directory.h"
+#include "master-service.h"
+#include "settings-parser.h"
+#include "mail-cache.h"
+#include "mail-namespace.h"
+#include "mail-search-build.h"
+#include "mail-storage-private.h"
+#include "mail-storage-service.h"
+#include "test-common.h"
+
+/* enough messages for index_sort_nonzero_nodes() to use radix sort */
+#define TEST_MSG_COUNT 1100
+#define TEST_SUBJECT_COUNT 100
+
+static struct mail_storage_service_ctx *storage_service;
+static struct mail_storage_service_user *service_user;
+static struct mail_user *test_user;
+static struct ioloop *test_ioloop;
+static char *test_home;
+/* subject number of each message, indexed by seq-1 */
+static ARRAY(unsigned int) test_subjects;
+
+static void test_user_init(void)
+{
+	struct setting_parser_context *set_parser;
+	const char *error, *cwd;
+
+	if (t_get_working_dir(&cwd, &error) < 0)
+		i_fatal("%s", error);
+	test_home = i_strdup_printf("%s/.test-index-sort/", cwd);
+	(void)unlink_directory(test_home, UNLINK_DIRECTORY_FLAG_RMDIR, &error);
+
+	struct mail_storage_service_input input = {
+		.userdb_fields = (const char *const[]) {
+			"mail=maildir:~/",
+			t_strdup_printf("home=%s", test_home),
+			NULL
+		},
+		.username = "testuser",
+		.no_userdb_lookup = TRUE,
+	};
+
+	storage_service = mail_storage_service_init(master_service, NULL,
+		MAIL_STORAGE_SERVICE_FLAG_NO_RESTRICT_ACCESS |
+		MAIL_STORAGE_SERVICE_FLAG_NO_LOG_INIT |
+		MAIL_STORAGE_SERVICE_FLAG_NO_PLUGINS);
+	if (mail_storage_service_lookup(storage_service, &input,
+					&service_user, &error) < 0)
+		i_fatal("mail_storage_service_lookup() failed: %s", error);
+	set_parser = mail_storage_service_user_get_settings_parser(service_user);
+	if (settings_parse_line(set_parser, "mail_fsync=never") < 0)
+		i_fatal("%s", settings_parser_get_error(set_parser));
+	if (mail_storage_service_next(storage_service, service_user,
+				      &test_user, &error) < 0)
+		i_fatal("mail_storage_service_next() failed: %s", error);
+}
+
+static void test_user_deinit(void)
+{
+	const char *error;
+
+	mail_user_unref(&test_user);
+	mail_storage_service_user_free(&service_user);
+	mail_storage_service_deinit(&storage_service);
+	if (unlink_directory(test_home, UNLINK_DIRECTORY_FLAG_RMDIR,
+			     &error) < 0)
+		i_error("unlink_directory(%s) failed: %s", test_home, error);
+	i_free(test_home);
+}
+
+static void test_save_mails(struct mailbox *box, unsigned int count)
+{
+	struct mailbox_transaction_context *t;
+	struct mail_save_context *save_ctx;
+	struct istream *input;
+	const char *msg;
+	unsigned int subject;
+	int ret;
+
+	t = mailbox_transaction_begin(box, MAILBOX_TRANSACTION_FLAG_EXTERNAL);
+	while (count-- > 0) {
+		subject = rand() % TEST_SUBJECT_COUNT;
+		array_append(&test_subjects, &subject, 1);
+		msg = t_strdup_printf("Subject: %s test %03u\n\nbody\n",
+				      subject % 2 == 0 ? "Re:" : "", subject);
+		input = i_stream_create_from_data(msg, strlen(msg));
+		save_ctx = mailbox_save_alloc(t);
+		if (mailbox_save_begin(&save_ctx, input) < 0)
+			i_fatal("mailbox_save_begin() failed");
+		do {
+			if (mailbox_save_continue(save_ctx) < 0)
+				i_fatal("mailbox_save_continue() failed");
+		} while ((ret = i_stream_read(input)) > 0);
+		i_assert(ret == -1);
+		if (mailbox_save_finish(&save_ctx) < 0)
+			i_fatal("mailbox_save_finish() failed");
+		i_stream_unref(&input);
+	}
+	if (mailbox_transaction_commit(&t) < 0)
+		i_fatal("mailbox_transaction_commit() failed");
+	if (mailbox_sync(box, 0) < 0)
+		i_fatal("mailbox_sync() failed");
+}
+
+static void test_sort_subjects(struct mailbox *box, bool reverse,
+			       bool check_ties, unsigned long *cache_hits_r)
+{
+	const enum mail_sort_type sort_program[] = {
+		MAIL_SORT_SUBJECT | (reverse ? MAIL_SORT_FLAG_REVERSE : 0),
+		MAIL_SORT_END
+	};
+	struct mailbox_transaction_context *t;
+	struct mail_search_args *search_args;
+	struct mail_search_context *search_ctx;
+	struct mail *mail;
+	const unsigned int *subjects;
+	unsigned int count, n = 0;
+	uint32_t prev_seq = 0, prev_subject = 0, subject;
+	bool ordered = TRUE;
+
+	subjects = array_get(&test_subjects, &count);
+	t = mailbox_transaction_begin(box, 0);
+	search_args = mail_search_build_init();
+	mail_search_build_add_all(search_args);
+	search_ctx = mailbox_search_init(t, search_args, sort_program, 0, NULL);
+	mail_search_args_unref(&search_args);
+	while (mailbox_search_next(search_ctx, &mail)) {
+		/* ties are ordered by ascending sequence in both directions */
+		subject = subjects[mail->seq-1];
+		if (n > 0 && (subject == prev_subject ?
+			      check_ties && mail->seq < prev_seq :
+			      (subject < prev_subject) != reverse))
+			ordered = FALSE;
+		prev_subject = subject;
+		prev_seq = mail->seq;
+		n++;
+	}
+	test_assert(mailbox_search_deinit(&search_ctx) == 0);
+	test_assert(n == count);
+	test_assert(ordered);
+	*cache_hits_r = t->stats.cache_hit_count;
+	test_assert(mailbox_transaction_commit(&t) == 0);
+}
+
+static void test_index_sort_subject(void)
+{
+	struct mail_namespace *ns;
+	struct mailbox *box;
+	struct mailbox_transaction_context *t;
+	const unsigned int *subjects;
+	unsigned int field_idx, seq, count;
+	unsigned long cache_hits;
+	string_t *str;
+
+	test_begin("index sort subject");
+	i_array_init(&test_subjects, TEST_MSG_COUNT + 10);
+	ns = mail_namespace_find_inbox(test_user->namespaces);
+	box = mailbox_alloc(ns->list, "INBOX", 0);
+	test_assert(mailbox_open(box) == 0);
+	test_save_mails(box, TEST_MSG_COUNT);
+
+	/* the first sort assigns the sort IDs and caches the keys */
+	test_sort_subjects(box, FALSE, TRUE, &cache_hits);
+	test_assert(cache_hits == 0);
+
+	/* all the messages have sort IDs now, so they're radix sorted */
+	test_sort_subjects(box, FALSE, TRUE, &cache_hits);
+	test_sort_subjects(box, TRUE, TRUE, &cache_hits);
+
+	/* the normalized keys round trip through the cache */
+	field_idx = mail_cache_register_lookup(box->cache, "sort.subject");
+	test_assert(field_idx != UINT_MAX);
+	subjects = array_get(&test_subjects, &count);
+	str = t_str_new(64);
+	t = mailbox_transaction_begin(box, 0);
+	for (seq = 1; seq <= count; seq += 97) {
+		str_truncate(str, 0);
+		test_assert_idx(mail_cache_lookup_field(t->cache_view, str, seq,
+							field_idx) == 1, seq);
+		test_assert_idx(str_len(str) > 0 &&
+			strcmp(str_c(str), t_strdup_printf("TEST %03u",
+				subjects[seq-1])) == 0, seq);
+	}
+	test_assert(mailbox_transaction_commit(&t) == 0);
+
+	/* giving sort IDs to new messages compares them to the old
+	   messages' keys, which now come from the cache. merging the new
+	   messages doesn't order them by sequence among the old messages
+	   with the same subject, but the next sort does. */
+	test_save_mails(box, 10);
+	test_sort_subjects(box, FALSE, FALSE, &cache_hits);
+	test_assert(cache_hits > 0);
+	test_sort_subjects(box, FALSE, TRUE, &cache_hits);
+
+	mailbox_free(&box);
+	array_free(&test_subjects);
+	test_end();
+}
+
+static void test_setup(void)
+{
+	test_ioloop = io_loop_create();
+	test_user_init();
+}
+
+static void test_teardown(void)
+{
+	test_user_deinit();
+	io_loop_destroy(&test_ioloop);
+}
+
+int main(int argc, char **argv)
+{
+	static void (*const test_functions[])(void) = {
+		test_setup,
+		test_index_sort_subject,
+		test_teardown,
+		NULL
+	};
+	int ret;
+
+	master_service = master_service_init("test-index-sort",
+					     MASTER_SERVICE_FLAG_STANDALONE |
+					     MASTER_SERVICE_FLAG_NO_CONFIG_SETTINGS |
+					     MASTER_SERVICE_FLAG_NO_SSL_INIT |
+					     MASTER_SERVICE_FLAG_NO_INIT_DATASTACK_FRAME,
+					     &argc, &argv, "");
+	ret = test_run(test_functions);
+	master_service_deinit(&master_service);
+	return ret;
+}
@@ -0,0 +1,352 @@
+/* Copyright (c) 2017 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "path-util.h"
+#include "unlink-directory.h"
+#include "write-full.h"
+#include "master-service.h"
+#include "settings-parser.h"
+#include "mail-namespace.h"
+#include "mail-storage-service.h"
+#include "maildir-storage.h"
+#include "maildir-uidlist.h"
+#include "maildir-sync.h"
+#include "maildir-dirlist.h"
+#include "test-common.h"
+
+#include <fcntl.h>
+#include <utime.h>
+
+#define TEST_FILE_COUNT 100
+
+static struct mail_storage_service_ctx *storage_service;
+static struct mail_storage_service_user *service_user;
+static struct mail_user *test_user;
+static struct ioloop *test_ioloop;
+static char *test_home;
+
+static struct mailbox *test_box;
+static char *test_cur_dir, *test_cache_path;
+
+static void test_user_init(void)
+{
+	const char *error, *cwd;
+
+	if (t_get_working_dir(&cwd, &error) < 0)
+		i_fatal("%s", error);
+	test_home = i_strdup_printf("%s/.test-maildir-dirlist/", cwd);
+	(void)unlink_directory(test_home, UNLINK_DIRECTORY_FLAG_RMDIR, &error);
+
+	struct mail_storage_service_input input = {
+		.userdb_fields = (const char *const[]) {
+			"mail=maildir:~/",
+			t_strdup_printf("home=%s", test_home),
+			NULL
+		},
+		.username = "testuser",
+		.no_userdb_lookup = TRUE,
+	};
+
+	storage_service = mail_storage_service_init(master_service, NULL,
+		MAIL_STORAGE_SERVICE_FLAG_NO_RESTRICT_ACCESS |
+		MAIL_STORAGE_SERVICE_FLAG_NO_LOG_INIT |
+		MAIL_STORAGE_SERVICE_FLAG_NO_PLUGINS);
+	if (mail_storage_service_lookup(storage_service, &input,
+					&service_user, &error) < 0)
+		i_fatal("mail_storage_service_lookup() failed: %s", error);
+	if (mail_storage_service_next(storage_service, service_user,
+				      &test_user, &error) < 0)
+		i_fatal("mail_storage_service_next() failed: %s", error);
+}
+
+static void test_user_deinit(void)
+{
+	const char *error;
+
+	mail_user_unref(&test_user);
+	mail_storage_service_user_free(&service_user);
+	mail_storage_service_deinit(&storage_service);
+	if (unlink_directory(test_home, UNLINK_DIRECTORY_FLAG_RMDIR,
+			     &error) < 0)
+		i_error("unlink_directory(%s) failed: %s", test_home, error);
+	i_free(test_home);
+}
+
+static void test_cur_dir_set_mtime(time_t mtime, struct stat *st_r)
+{
+	struct utimbuf ut;
+
+	ut.actime = ut.modtime = mtime;
+	if (utime(test_cur_dir, &ut) < 0)
+		i_fatal("utime(%s) failed: %m", test_cur_dir);
+	if (stat(test_cur_dir, st_r) < 0)
+		i_fatal("stat(%s) failed: %m", test_cur_dir);
+}
+
+static void test_cur_dir_add_file(unsigned int n)
+{
+	const char *path;
+	int fd;
+
+	path = t_strdup_printf("%s/%u.test:2,", test_cur_dir, n);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	i_close_fd(&fd);
+}
+
+static void test_write_cache(const char *data)
+{
+	int fd;
+
+	fd = open(test_cache_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", test_cache_path);
+	if (write_full(fd, data, strlen(data)) < 0)
+		i_fatal("write(%s) failed: %m", test_cache_path);
+	i_close_fd(&fd);
+}
+
+static void test_notify_callback(struct mailbox *box ATTR_UNUSED,
+				 void *context ATTR_UNUSED)
+{
+	io_loop_stop(current_ioloop);
+}
+
+static void test_notify_timeout(void *context ATTR_UNUSED)
+{
+	i_error("maildir dirlist timed out");
+	io_loop_stop(current_ioloop);
+}
+
+/* Run the ioloop until the background listing is finished */
+static void test_dirlist_run(void)
+{
+	struct timeout *to;
+
+	to = timeout_add(10*1000, test_notify_timeout, (void *)NULL);
+	io_loop_run(current_ioloop);
+	timeout_remove(&to);
+}
+
+static bool test_dirlist_names_ok(struct maildir_dirlist *list)
+{
+	const char *const *names;
+	bool seen[TEST_FILE_COUNT];
+	unsigned int i, n, count;
+
+	memset(seen, 0, sizeof(seen));
+	names = maildir_dirlist_get_names(list, &count);
+	if (count != TEST_FILE_COUNT)
+		return FALSE;
+	for (i = 0; i < count; i++) {
+		if (sscanf(names[i], "%u.test:2,", &n) != 1 ||
+		    n >= TEST_FILE_COUNT || seen[n])
+			return FALSE;
+		seen[n] = TRUE;
+	}
+	return TRUE;
+}
+
+static void test_maildir_dirlist_cache(void)
+{
+	struct maildir_mailbox *mbox = (struct maildir_mailbox *)test_box;
+	struct maildir_dirlist *list, *list2;
+	struct stat st;
+	unsigned int i;
+	time_t scan_time;
+
+	test_begin("maildir dirlist cache");
+	for (i = 0; i < TEST_FILE_COUNT; i++)
+		test_cur_dir_add_file(i);
+	test_cur_dir_set_mtime(ioloop_time - 10, &st);
+
+	/* listing is done in the background */
+	list = maildir_dirlist_init(mbox, test_cur_dir);
+	test_assert(!maildir_dirlist_is_usable(list, &st));
+	test_assert(maildir_dirlist_scan_background(list, &st));
+	test_assert(!maildir_dirlist_is_usable(list, &st));
+	test_dirlist_run();
+	test_assert(maildir_dirlist_is_usable(list, &st));
+	test_assert(test_dirlist_names_ok(list));
+	scan_time = maildir_dirlist_get_scan_time(list);
+	/* nothing to do, since the listing is already usable */
+	test_assert(!maildir_dirlist_scan_background(list, &st));
+	maildir_dirlist_deinit(&list);
+
+	/* the listing was written to the cache file */
+	list = maildir_dirlist_init(mbox, test_cur_dir);
+	test_assert(maildir_dirlist_is_usable(list, &st));
+	test_assert(test_dirlist_names_ok(list));
+	test_assert(maildir_dirlist_get_scan_time(list) == scan_time);
+
+	/* the listing and the cache become unusable when the directory
+	   changes */
+	test_cur_dir_set_mtime(ioloop_time - 5, &st);
+	test_assert(!maildir_dirlist_is_usable(list, &st));
+	list2 = maildir_dirlist_init(mbox, test_cur_dir);
+	test_assert(!maildir_dirlist_is_usable(list2, &st));
+	maildir_dirlist_deinit(&list2);
+
+	/* write the cache again for the new mtime */
+	test_assert(maildir_dirlist_scan_background(list, &st));
+	test_dirlist_run();
+	test_assert(maildir_dirlist_is_usable(list, &st));
+	maildir_dirlist_deinit(&list);
+	test_end();
+}
+
+static void test_maildir_dirlist_broken_cache(void)
+{
+	struct maildir_mailbox *mbox = (struct maildir_mailbox *)test_box;
+	struct maildir_dirlist *list;
+	struct stat st;
+	const char *key, *now, *hdr;
+	unsigned int i;
+
+	test_begin("maildir dirlist broken cache");
+	test_cur_dir_set_mtime(ioloop_time - 10, &st);
+	key = t_strdup_printf("%llu %ld %lu",
+			      (unsigned long long)st.st_ino, (long)st.st_mtime,
+			      (unsigned long)ST_MTIME_NSEC(st));
+	now = dec2str(ioloop_time);
+
+	/* a valid cache with a single file */
+	test_write_cache(t_strdup_printf("1 %s %s 1\n1.test:2,\n", key, now));
+	list = maildir_dirlist_init(mbox, test_cur_dir);
+	test_assert(maildir_dirlist_is_usable(list, &st));
+	maildir_dirlist_deinit(&list);
+
+	const char *broken_headers[] = {
+		"",
+		t_strdup_printf("1 %s %s", key, now),
+		t_strdup_printf("2 %s %s 1", key, now),
+		t_strdup_printf("1 %s x 1", key),
+		t_strdup_printf("1 %s %s 1 1", key, now),
+		t_strdup_printf("1 %s %s 2", key, now),
+	};
+	for (i = 0; i < N_ELEMENTS(broken_headers); i++) {
+		test_write_cache(t_strconcat(broken_headers[i],
+					     "\n1.test:2,\n", NULL));
+		list = maildir_dirlist_init(mbox, test_cur_dir);
+		test_assert_idx(!maildir_dirlist_is_usable(list, &st), i);
+		maildir_dirlist_deinit(&list);
+	}
+
+	/* the listing must have been started after the last change */
+	hdr = t_strdup_printf("1 %s %ld 1\n1.test:2,\n", key,
+			      (long)st.st_mtime + MAILDIR_SYNC_SECS);
+	test_write_cache(hdr);
+	list = maildir_dirlist_init(mbox, test_cur_dir);
+	test_assert(!maildir_dirlist_is_usable(list, &st));
+	maildir_dirlist_deinit(&list);
+	test_end();
+}
+
+static void test_maildir_dirlist_restart(void)
+{
+	struct maildir_mailbox *mbox = (struct maildir_mailbox *)test_box;
+	struct maildir_dirlist *list;
+	struct ioloop *ioloop;
+	struct stat st;
+	unsigned int i;
+
+	test_begin("maildir dirlist restart");
+	i_unlink_if_exists(test_cache_path);
+	list = maildir_dirlist_init(mbox, test_cur_dir);
+
+	/* a directory that was just changed isn't listed */
+	test_cur_dir_set_mtime(ioloop_time, &st);
+	test_assert(!maildir_dirlist_scan_background(list, &st));
+
+	/* a directory that keeps changing while it's listed is given up
+	   after a few restarts */
+	for (i = 0; i < 3; i++) {
+		test_cur_dir_set_mtime(ioloop_time - 10 - i, &st);
+		test_assert_idx(maildir_dirlist_scan_background(list, &st), i);
+	}
+	test_cur_dir_set_mtime(ioloop_time - 20, &st);
+	test_assert(!maildir_dirlist_scan_background(list, &st));
+	test_assert(!maildir_dirlist_is_usable(list, &st));
+
+	/* the restart count was reset, so listing works again */
+	test_assert(maildir_dirlist_scan_background(list, &st));
+
+	/* the listing continues in a nested ioloop without restarting */
+	ioloop = io_loop_create();
+	test_assert(maildir_dirlist_scan_background(list, &st));
+	test_dirlist_run();
+	io_loop_destroy(&ioloop);
+	test_assert(maildir_dirlist_is_usable(list, &st));
+	test_assert(test_dirlist_names_ok(list));
+
+	/* the listing's timeout is moved back when the nested ioloop is
+	   destroyed, so it doesn't leak */
+	test_cur_dir_set_mtime(ioloop_time - 30, &st);
+	test_assert(maildir_dirlist_scan_background(list, &st));
+	ioloop = io_loop_create();
+	io_loop_destroy(&ioloop);
+	test_dirlist_run();
+	test_assert(maildir_dirlist_is_usable(list, &st));
+	test_assert(test_dirlist_names_ok(list));
+	maildir_dirlist_deinit(&list);
+	test_end();
+}
+
+static void test_setup(void)
+{
+	struct mail_namespace *ns;
+	const char *path;
+
+	test_ioloop = io_loop_create();
+	test_user_init();
+
+	ns = mail_namespace_find_inbox(test_user->namespaces);
+	test_box = mailbox_alloc(ns->list, "INBOX", 0);
+	if (mailbox_open(test_box) < 0)
+		i_fatal("mailbox_open(INBOX) failed");
+	if (mailbox_get_path_to(test_box, MAILBOX_LIST_PATH_TYPE_MAILBOX,
+				&path) <= 0)
+		i_unreached();
+	test_cur_dir = i_strconcat(path, "/cur", NULL);
+	if (mailbox_get_path_to(test_box, MAILBOX_LIST_PATH_TYPE_CONTROL,
+				&path) <= 0)
+		i_unreached();
+	test_cache_path = i_strconcat(path, "/"MAILDIR_DIRLIST_CACHE_NAME,
+				      NULL);
+	test_box->notify_callback = test_notify_callback;
+}
+
+static void test_teardown(void)
+{
+	test_box->notify_callback = NULL;
+	mailbox_free(&test_box);
+	i_free_and_null(test_cur_dir);
+	i_free_and_null(test_cache_path);
+	test_user_deinit();
+	io_loop_destroy(&test_ioloop);
+}
+
+int main(int argc, char **argv)
+{
+	static void (*const test_functions[])(void) = {
+		test_setup,
+		test_maildir_dirlist_cache,
+		test_maildir_dirlist_broken_cache,
+		test_maildir_dirlist_restart,
+		test_teardown,
+		NULL
+	};
+	int ret;
+
+	master_service = master_service_init("test-maildir-dirlist",
+					     MASTER_SERVICE_FLAG_STANDALONE |
+					     MASTER_SERVICE_FLAG_NO_CONFIG_SETTINGS |
+					     MASTER_SERVICE_FLAG_NO_SSL_INIT |
+					     MASTER_SERVICE_FLAG_NO_INIT_DATASTACK_FRAME,
+					     &argc, &argv, "");
+	ret = test_run(test_functions);
+	master_service_deinit(&master_service);
+	return ret;
+}
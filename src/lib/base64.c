@@ -3,6 +3,7 @@
 #include "lib.h"
 #include "base64.h"
 #include "buffer.h"
+#include "simd-util.h"
 
 static const char b64enc[] =
 	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
@@ -81,6 +82,175 @@ void base64_encode(const void *src, size_t src_size, buffer_t *dest)
 #define IS_EMPTY(c) \
 	((c) == '\n' || (c) == '\r' || (c) == ' ' || (c) == '\t')
 
+#ifdef HAVE_X86_SIMD
+/* The SIMD code decodes only blocks that contain nothing but base64
+   characters. Everything else (whitespace, padding, errors) is left for the
+   scalar code. */
+#define BASE64_SIMD_MIN_SIZE 16
+/* Decoded output is collected to a stack buffer of this size before it's
+   appended to dest. */
+#define BASE64_SIMD_BUF_SIZE 384
+
+static inline __m128i SIMD_TARGET("ssse3")
+base64_decode_16(__m128i v, int *valid_mask_r)
+{
+	__m128i az_upper, az_lower, digit, plus, slash, shift;
+
+	/* translate the characters to 6bit values. characters >= 0x80 are
+	   negative, so they don't match any range */
+	az_upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A'-1)),
+				 _mm_cmplt_epi8(v, _mm_set1_epi8('Z'+1)));
+	az_lower = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('a'-1)),
+				 _mm_cmplt_epi8(v, _mm_set1_epi8('z'+1)));
+	digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0'-1)),
+			      _mm_cmplt_epi8(v, _mm_set1_epi8('9'+1)));
+	plus = _mm_cmpeq_epi8(v, _mm_set1_epi8('+'));
+	slash = _mm_cmpeq_epi8(v, _mm_set1_epi8('/'));
+
+	*valid_mask_r = _mm_movemask_epi8(
+		_mm_or_si128(_mm_or_si128(az_upper, az_lower),
+			     _mm_or_si128(digit, _mm_or_si128(plus, slash))));
+
+	shift = _mm_or_si128(
+		_mm_or_si128(_mm_and_si128(az_upper, _mm_set1_epi8(-'A')),
+			     _mm_and_si128(az_lower, _mm_set1_epi8(26-'a'))),
+		_mm_or_si128(_mm_and_si128(digit, _mm_set1_epi8(52-'0')),
+			     _mm_or_si128(_mm_and_si128(plus, _mm_set1_epi8(62-'+')),
+					  _mm_and_si128(slash, _mm_set1_epi8(63-'/')))));
+	v = _mm_add_epi8(v, shift);
+
+	/* pack each 4x6 bits into 24 bits: first combine pairs into 12 bits,
+	   then the 12bit pairs into 24 bits */
+	v = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+	v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+	/* put the 3 bytes of each 32bit word into big endian order, and
+	   the 12 output bytes to the beginning */
+	return _mm_shuffle_epi8(v, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+						 14, 13, 12, -1, -1, -1, -1));
+}
+
+static size_t SIMD_TARGET("ssse3")
+base64_decode_ssse3(const unsigned char *src, size_t src_size,
+		    buffer_t *dest, size_t *skip_r)
+{
+	unsigned char buf[BASE64_SIMD_BUF_SIZE + 16];
+	size_t src_pos = 0, buf_used = 0;
+	unsigned int invalid_pos;
+	int valid_mask;
+	__m128i v;
+
+	*skip_r = 0;
+	while (src_pos + 16 <= src_size) {
+		v = base64_decode_16(_mm_loadu_si128((const void *)(src + src_pos)),
+				     &valid_mask);
+		_mm_storeu_si128((void *)(buf + buf_used), v);
+		if (valid_mask != 0xffff) {
+			/* use the full quads before the first non-base64
+			   character and skip over the character */
+			invalid_pos = __builtin_ctz(~valid_mask);
+			buf_used += invalid_pos / 4 * 3;
+			src_pos += invalid_pos / 4 * 4;
+			*skip_r = invalid_pos % 4 + 1;
+			break;
+		}
+		buf_used += 12;
+		src_pos += 16;
+		if (buf_used + 12 > BASE64_SIMD_BUF_SIZE) {
+			buffer_append(dest, buf, buf_used);
+			buf_used = 0;
+		}
+	}
+	buffer_append(dest, buf, buf_used);
+	return src_pos;
+}
+
+static size_t SIMD_TARGET("avx2")
+base64_decode_avx2(const unsigned char *src, size_t src_size,
+		   buffer_t *dest, size_t *skip_r)
+{
+	unsigned char buf[BASE64_SIMD_BUF_SIZE + 32];
+	size_t src_pos = 0, buf_used = 0;
+	__m256i v, az_upper, az_lower, digit, plus, slash, shift;
+	unsigned int valid_mask;
+
+	*skip_r = 0;
+	while (src_pos + 32 <= src_size) {
+		v = _mm256_loadu_si256((const void *)(src + src_pos));
+		az_upper = _mm256_and_si256(
+			_mm256_cmpgt_epi8(v, _mm256_set1_epi8('A'-1)),
+			_mm256_cmpgt_epi8(_mm256_set1_epi8('Z'+1), v));
+		az_lower = _mm256_and_si256(
+			_mm256_cmpgt_epi8(v, _mm256_set1_epi8('a'-1)),
+			_mm256_cmpgt_epi8(_mm256_set1_epi8('z'+1), v));
+		digit = _mm256_and_si256(
+			_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0'-1)),
+			_mm256_cmpgt_epi8(_mm256_set1_epi8('9'+1), v));
+		plus = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('+'));
+		slash = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/'));
+
+		valid_mask = _mm256_movemask_epi8(
+			_mm256_or_si256(_mm256_or_si256(az_upper, az_lower),
+				_mm256_or_si256(digit,
+						_mm256_or_si256(plus, slash))));
+		if (valid_mask != 0xffffffff) {
+			*skip_r = __builtin_ctz(~valid_mask) + 1;
+			break;
+		}
+
+		shift = _mm256_or_si256(
+			_mm256_or_si256(
+				_mm256_and_si256(az_upper, _mm256_set1_epi8(-'A')),
+				_mm256_and_si256(az_lower, _mm256_set1_epi8(26-'a'))),
+			_mm256_or_si256(
+				_mm256_and_si256(digit, _mm256_set1_epi8(52-'0')),
+				_mm256_or_si256(
+					_mm256_and_si256(plus, _mm256_set1_epi8(62-'+')),
+					_mm256_and_si256(slash, _mm256_set1_epi8(63-'/')))));
+		v = _mm256_add_epi8(v, shift);
+		v = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+		v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+		v = _mm256_shuffle_epi8(v, _mm256_setr_epi8(
+			2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+			2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+		/* move the 12 bytes of the high lane next to the low lane's */
+		v = _mm256_permutevar8x32_epi32(v,
+			_mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7));
+		_mm256_storeu_si256((void *)(buf + buf_used), v);
+		buf_used += 24;
+		src_pos += 32;
+		if (buf_used + 24 > BASE64_SIMD_BUF_SIZE) {
+			buffer_append(dest, buf, buf_used);
+			buf_used = 0;
+		}
+	}
+	buffer_append(dest, buf, buf_used);
+	return src_pos;
+}
+
+/* Decode as many 16 byte blocks from the beginning of src as possible.
+   Returns the number of bytes decoded. skip_r is set to the number of bytes
+   after them that the SIMD code can't handle. */
+static size_t
+base64_decode_simd(const unsigned char *src, size_t src_size,
+		   buffer_t *dest, size_t *skip_r)
+{
+	enum simd_features features = simd_get_features();
+	size_t pos = 0;
+
+	if ((features & SIMD_FEATURE_SSSE3) == 0) {
+		*skip_r = src_size;
+		return 0;
+	}
+	if ((features & SIMD_FEATURE_AVX2) != 0)
+		pos = base64_decode_avx2(src, src_size, dest, skip_r);
+	/* finish the last 16 bytes, or the valid half of the failed block */
+	pos += base64_decode_ssse3(src + pos, src_size - pos, dest, skip_r);
+	if (*skip_r == 0)
+		*skip_r = src_size - pos;
+	return pos;
+}
+#endif
+
 int base64_decode(const void *src, size_t src_size,
 		  size_t *src_pos_r, buffer_t *dest)
 {
@@ -88,8 +258,22 @@ int base64_decode(const void *src, size_t src_size,
 	size_t src_pos;
 	unsigned char input[4], output[3];
 	int ret = 1;
+#ifdef HAVE_X86_SIMD
+	size_t size, skip, simd_skip_until = 0;
+#endif
 
 	for (src_pos = 0; src_pos+3 < src_size; ) {
+#ifdef HAVE_X86_SIMD
+		if (src_pos >= simd_skip_until &&
+		    src_size - src_pos >= BASE64_SIMD_MIN_SIZE) {
+			size = base64_decode_simd(src_c + src_pos,
+						  src_size - src_pos, dest, &skip);
+			src_pos += size;
+			simd_skip_until = src_pos + skip;
+			if (size > 0)
+				continue;
+		}
+#endif
 		input[0] = b64dec[src_c[src_pos]];
 		if (input[0] == 0xff) {
 			if (unlikely(!IS_EMPTY(src_c[src_pos]))) {
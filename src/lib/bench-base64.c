@@ -0,0 +1,68 @@
+/* Copyright (c) 2017 Dovecot authors, see the included COPYING file */
+
+#include "bench-lib.h"
+#include "buffer.h"
+#include "time-util.h"
+#include "simd-util.h"
+#include "base64.h"
+
+#include <sys/time.h>
+
+static unsigned long long
+bench_base64_usecs(enum simd_features mask, const buffer_t *input,
+		   buffer_t *output)
+{
+	struct timeval start, end;
+	unsigned int i;
+
+	if (gettimeofday(&start, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	simd_set_features_mask(mask);
+	for (i = 0; i < 5; i++) {
+		buffer_set_used_size(output, 0);
+		if (base64_decode(input->data, input->used, NULL, output) < 0)
+			buffer_set_used_size(output, 0);
+	}
+	simd_set_features_mask((enum simd_features)-1);
+	if (gettimeofday(&end, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	return timeval_diff_usecs(&end, &start);
+}
+
+void bench_base64_decode(void)
+{
+	/* base64 encoded attachment with the usual 76 character lines */
+	const size_t data_size = 4*1024*1024, line_size = 57;
+	unsigned char *data;
+	buffer_t *input, *scalar_output, *simd_output;
+	unsigned long long scalar_usecs, simd_usecs;
+	size_t i;
+
+	data = i_malloc(data_size);
+	for (i = 0; i < data_size; i++)
+		data[i] = rand();
+	input = buffer_create_dynamic(default_pool,
+				      MAX_BASE64_ENCODED_SIZE(data_size) +
+				      data_size / line_size * 2 + 2);
+	for (i = 0; i < data_size; i += line_size) {
+		base64_encode(data + i, I_MIN(line_size, data_size - i), input);
+		buffer_append(input, "\r\n", 2);
+	}
+	scalar_output = buffer_create_dynamic(default_pool, data_size);
+	simd_output = buffer_create_dynamic(default_pool, data_size);
+
+	scalar_usecs = bench_base64_usecs(0, input, scalar_output);
+	simd_usecs = bench_base64_usecs((enum simd_features)-1,
+					input, simd_output);
+	test_out_reason("base64 decode",
+		scalar_output->used == data_size &&
+		memcmp(scalar_output->data, data, data_size) == 0 &&
+		buffer_cmp(scalar_output, simd_output),
+		t_strdup_printf("5 x %zu MB: scalar %llu ms, simd %llu ms",
+				input->used / (1024*1024),
+				scalar_usecs / 1000, simd_usecs / 1000));
+	buffer_free(&input);
+	buffer_free(&scalar_output);
+	buffer_free(&simd_output);
+	i_free(data);
+}
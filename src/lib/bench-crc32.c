@@ -0,0 +1,59 @@
+/* Copyright (c) 2017 Dovecot authors, see the included COPYING file */
+
+#include "bench-lib.h"
+#include "time-util.h"
+#include "simd-util.h"
+#include "crc32.h"
+
+#include <sys/time.h>
+
+static unsigned long long
+bench_crc32_usecs(bool castagnoli, const unsigned char *data,
+		  size_t size, unsigned int rounds, uint32_t *crc_r)
+{
+	struct timeval start, end;
+	uint32_t crc = 0;
+	unsigned int i;
+
+	if (gettimeofday(&start, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	for (i = 0; i < rounds; i++) {
+		crc = castagnoli ? crc32c_data_more(crc, data, size) :
+			crc32_data_more(crc, data, size);
+	}
+	if (gettimeofday(&end, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	*crc_r = crc;
+	return timeval_diff_usecs(&end, &start);
+}
+
+void bench_crc32(void)
+{
+	const size_t size = 1024*1024;
+	const unsigned int rounds = 64;
+	unsigned long long crc32_usecs[2], crc32c_usecs[2];
+	uint32_t crc32[2], crc32c[2];
+	unsigned char *data;
+	unsigned int i;
+
+	data = i_malloc(size);
+	for (i = 0; i < size; i++)
+		data[i] = rand();
+	/* [0] = table lookups, [1] = SIMD */
+	for (i = 0; i < 2; i++) {
+		simd_set_features_mask(i == 0 ? 0 : (enum simd_features)-1);
+		crc32_usecs[i] = bench_crc32_usecs(FALSE, data, size,
+						   rounds, &crc32[i]);
+		crc32c_usecs[i] = bench_crc32_usecs(TRUE, data, size,
+						    rounds, &crc32c[i]);
+	}
+	simd_set_features_mask((enum simd_features)-1);
+	test_out_reason("crc32",
+		crc32[0] == crc32[1] && crc32c[0] == crc32c[1],
+		t_strdup_printf("%u MB: crc32 %llu/%llu ms, "
+				"crc32c %llu/%llu ms (slice-by-8/simd)",
+				rounds, crc32_usecs[0] / 1000,
+				crc32_usecs[1] / 1000, crc32c_usecs[0] / 1000,
+				crc32c_usecs[1] / 1000));
+	i_free(data);
+}
@@ -0,0 +1,66 @@
+/* Copyright (c) 2017 Dovecot authors, see the included COPYING file */
+
+#include "bench-lib.h"
+#include "time-util.h"
+#include "hash.h"
+
+#include <sys/time.h>
+
+static unsigned long long
+bench_hash_usecs(bool open, char *const *keys, unsigned int key_count,
+		 unsigned int lookups, unsigned int *found_r)
+{
+	HASH_TABLE(char *, char *) hash;
+	struct timeval start, end;
+	unsigned int i, idx = 0, found = 0;
+
+	if (gettimeofday(&start, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	if (open)
+		hash_table_create_open(&hash, default_pool, 0, str_hash, strcmp);
+	else
+		hash_table_create(&hash, default_pool, 0, str_hash, strcmp);
+	/* insert only the first half of the keys, so half of the lookups
+	   are misses */
+	for (i = 0; i < key_count / 2; i++)
+		hash_table_insert(hash, keys[i], keys[i]);
+	for (i = 0; i < lookups; i++) {
+		idx = (idx + 7919) % key_count;
+		if (hash_table_lookup(hash, keys[idx]) != NULL)
+			found++;
+	}
+	for (i = 0; i < key_count / 2; i++)
+		hash_table_remove(hash, keys[i]);
+	hash_table_destroy(&hash);
+	if (gettimeofday(&end, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+
+	*found_r = found;
+	return timeval_diff_usecs(&end, &start);
+}
+
+void bench_hash(void)
+{
+	const unsigned int key_count = 400000, lookups = key_count * 3;
+	unsigned long long chained_usecs, open_usecs;
+	char **keys;
+	unsigned int i, chained_found, open_found;
+
+	/* username-like keys, as in e.g. auth cache */
+	keys = i_new(char *, key_count);
+	for (i = 0; i < key_count; i++)
+		keys[i] = i_strdup_printf("user%u@example.com", i);
+
+	chained_usecs = bench_hash_usecs(FALSE, keys, key_count, lookups,
+					 &chained_found);
+	open_usecs = bench_hash_usecs(TRUE, keys, key_count, lookups,
+				      &open_found);
+	test_out_reason("hash",
+		chained_found == lookups / 2 && open_found == lookups / 2,
+		t_strdup_printf("%u keys, %u lookups: chained %llu ms, "
+				"open %llu ms", key_count / 2, lookups,
+				chained_usecs / 1000, open_usecs / 1000));
+	for (i = 0; i < key_count; i++)
+		i_free(keys[i]);
+	i_free(keys);
+}
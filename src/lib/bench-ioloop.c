@@ -0,0 +1,74 @@
+/* Copyright (c) 2017 Dovecot authors, see the included COPYING file */
+
+#include "bench-lib.h"
+#include "time-util.h"
+#include "ioloop.h"
+
+#include <sys/time.h>
+
+static void bench_ioloop_stop(void *context ATTR_UNUSED)
+{
+	io_loop_stop(current_ioloop);
+}
+
+static void bench_ioloop_callback(unsigned int *fired)
+{
+	(*fired)++;
+}
+
+static unsigned long long
+bench_ioloop_timeout_usecs(bool coarse, unsigned int count,
+			   unsigned int resets, unsigned int *fired_r)
+{
+	struct ioloop *ioloop;
+	struct timeout **timeouts, *to;
+	struct timeval start, end;
+	unsigned int i, msecs, idx = 0, fired = 0;
+
+	ioloop = io_loop_create();
+	timeouts = i_new(struct timeout *, count);
+	if (gettimeofday(&start, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	for (i = 0; i < count; i++) {
+		/* e.g. IMAP IDLE and login timeouts */
+		msecs = 30000 + (i % 300) * 1000;
+		timeouts[i] = coarse ?
+			timeout_add(msecs, bench_ioloop_callback, &fired) :
+			timeout_add_short(msecs, bench_ioloop_callback, &fired);
+	}
+	/* start the added timeouts */
+	to = timeout_add_short(0, bench_ioloop_stop, (void *)NULL);
+	io_loop_run(ioloop);
+	timeout_remove(&to);
+
+	for (i = 0; i < resets; i++) {
+		idx = (idx + 7919) % count;
+		timeout_reset(timeouts[idx]);
+	}
+	for (i = 0; i < count; i++)
+		timeout_remove(&timeouts[i]);
+	if (gettimeofday(&end, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	i_free(timeouts);
+	io_loop_destroy(&ioloop);
+
+	*fired_r = fired;
+	return timeval_diff_usecs(&end, &start);
+}
+
+void bench_ioloop_timeout(void)
+{
+	const unsigned int count = 100000, resets = count * 10;
+	unsigned long long heap_usecs, wheel_usecs;
+	unsigned int heap_fired, wheel_fired;
+
+	heap_usecs = bench_ioloop_timeout_usecs(FALSE, count, resets,
+						&heap_fired);
+	wheel_usecs = bench_ioloop_timeout_usecs(TRUE, count, resets,
+						 &wheel_fired);
+	test_out_reason("ioloop timeout",
+		heap_fired == 0 && wheel_fired == 0,
+		t_strdup_printf("%u timeouts, %u resets: heap %llu ms, "
+				"timing wheel %llu ms", count, resets,
+				heap_usecs / 1000, wheel_usecs / 1000));
+}
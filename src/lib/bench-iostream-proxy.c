@@ -0,0 +1,170 @@
+/* Copyright (c) 2017 Dovecot authors, see the included COPYING file */
+
+#include "bench-lib.h"
+#include "istream.h"
+#include "ostream.h"
+#include "ioloop.h"
+#include "iostream-proxy.h"
+#include "fd-set-nonblock.h"
+#include "time-util.h"
+
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define BENCH_PROXY_THROUGHPUT_SIZE (64*1024*1024)
+#define BENCH_PROXY_THROUGHPUT_CHUNK (64*1024)
+#define BENCH_PROXY_PATTERN_LEN 251
+
+struct bench_proxy_throughput_ctx {
+	struct ostream *output;
+	struct istream *input;
+	struct io *io;
+
+	unsigned char data[BENCH_PROXY_THROUGHPUT_CHUNK + BENCH_PROXY_PATTERN_LEN];
+	size_t sent, received;
+	unsigned int errors;
+};
+
+static int
+bench_proxy_throughput_send(struct bench_proxy_throughput_ctx *ctx)
+{
+	size_t size;
+	ssize_t ret;
+
+	while (ctx->sent < BENCH_PROXY_THROUGHPUT_SIZE) {
+		size = I_MIN(BENCH_PROXY_THROUGHPUT_CHUNK,
+			     BENCH_PROXY_THROUGHPUT_SIZE - ctx->sent);
+		ret = o_stream_send(ctx->output, ctx->data +
+				    ctx->sent % BENCH_PROXY_PATTERN_LEN, size);
+		if (ret < 0) {
+			ctx->errors++;
+			return -1;
+		}
+		ctx->sent += ret;
+		if ((size_t)ret < size)
+			return 0;
+	}
+	return o_stream_flush(ctx->output);
+}
+
+static void
+bench_proxy_throughput_read(struct bench_proxy_throughput_ctx *ctx)
+{
+	const unsigned char *data;
+	size_t i, size;
+	ssize_t ret;
+
+	while ((ret = i_stream_read_more(ctx->input, &data, &size)) > 0) {
+		for (i = 0; i < size; i++) {
+			if (data[i] != (ctx->received + i) %
+			    BENCH_PROXY_PATTERN_LEN)
+				ctx->errors++;
+		}
+		ctx->received += size;
+		i_stream_skip(ctx->input, size);
+	}
+	if (ret < 0 || ctx->received >= BENCH_PROXY_THROUGHPUT_SIZE) {
+		if (ctx->received != BENCH_PROXY_THROUGHPUT_SIZE)
+			ctx->errors++;
+		io_loop_stop(current_ioloop);
+	}
+}
+
+static void
+bench_proxy_throughput_completed(enum iostream_proxy_side side ATTR_UNUSED,
+				bool success,
+				struct bench_proxy_throughput_ctx *ctx)
+{
+	if (!success)
+		ctx->errors++;
+}
+
+static unsigned long long
+bench_iostream_proxy_usecs(bool filter, unsigned int *errors_r)
+{
+	struct bench_proxy_throughput_ctx ctx;
+	struct istream *left_in, *right_in, *input;
+	struct ostream *left_out, *right_out;
+	struct iostream_proxy *proxy;
+	struct ioloop *ioloop;
+	struct timeval start, end;
+	int sfdl[2], sfdr[2];
+	unsigned int i;
+
+	memset(&ctx, 0, sizeof(ctx));
+	for (i = 0; i < sizeof(ctx.data); i++)
+		ctx.data[i] = i % BENCH_PROXY_PATTERN_LEN;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sfdl) < 0 ||
+	    socketpair(AF_UNIX, SOCK_STREAM, 0, sfdr) < 0)
+		i_fatal("socketpair() failed: %m");
+	for (i = 0; i < 2; i++) {
+		fd_set_nonblock(sfdl[i], TRUE);
+		fd_set_nonblock(sfdr[i], TRUE);
+	}
+	ioloop = io_loop_create();
+
+	left_in = i_stream_create_fd(sfdl[1], IO_BLOCK_SIZE);
+	left_out = o_stream_create_fd(sfdl[1], IO_BLOCK_SIZE);
+	right_in = i_stream_create_fd(sfdr[1], IO_BLOCK_SIZE);
+	right_out = o_stream_create_fd(sfdr[1], IO_BLOCK_SIZE);
+	if (filter) {
+		/* any filter in the chain disables splice() */
+		input = i_stream_create_limit(left_in, (uoff_t)-1);
+		i_stream_unref(&left_in);
+		left_in = input;
+	}
+	proxy = iostream_proxy_create(left_in, left_out, right_in, right_out);
+	i_stream_unref(&left_in);
+	o_stream_unref(&left_out);
+	i_stream_unref(&right_in);
+	o_stream_unref(&right_out);
+	iostream_proxy_set_completion_callback(proxy,
+		bench_proxy_throughput_completed, &ctx);
+
+	ctx.output = o_stream_create_fd(sfdl[0], (size_t)-1);
+	ctx.input = i_stream_create_fd(sfdr[0], BENCH_PROXY_THROUGHPUT_CHUNK);
+	o_stream_set_flush_callback(ctx.output, bench_proxy_throughput_send,
+				    &ctx);
+	ctx.io = io_add_istream(ctx.input, bench_proxy_throughput_read, &ctx);
+
+	if (gettimeofday(&start, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	iostream_proxy_start(proxy);
+	o_stream_set_flush_pending(ctx.output, TRUE);
+	io_loop_run(ioloop);
+	if (gettimeofday(&end, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+
+	io_remove(&ctx.io);
+	iostream_proxy_unref(&proxy);
+	o_stream_unref(&ctx.output);
+	i_stream_unref(&ctx.input);
+	io_loop_destroy(&ioloop);
+	for (i = 0; i < 2; i++) {
+		i_close_fd(&sfdl[i]);
+		i_close_fd(&sfdr[i]);
+	}
+	*errors_r = ctx.errors;
+	return timeval_diff_usecs(&end, &start);
+}
+
+void bench_iostream_proxy(void)
+{
+	unsigned long long copy_usecs, splice_usecs;
+	unsigned int copy_errors, splice_errors;
+
+	copy_usecs = bench_iostream_proxy_usecs(TRUE, &copy_errors);
+	splice_usecs = bench_iostream_proxy_usecs(FALSE,
+							    &splice_errors);
+	test_out_reason("iostream_proxy throughput",
+		copy_errors == 0 && splice_errors == 0,
+		t_strdup_printf("%u MB: copy %llu MB/s, splice %llu MB/s",
+			BENCH_PROXY_THROUGHPUT_SIZE / (1024*1024),
+			BENCH_PROXY_THROUGHPUT_SIZE * 1000000ULL /
+			(copy_usecs + 1) / (1024*1024),
+			BENCH_PROXY_THROUGHPUT_SIZE * 1000000ULL /
+			(splice_usecs + 1) / (1024*1024)));
+}
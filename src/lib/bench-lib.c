@@ -0,0 +1,21 @@
+/* Copyright (c) 2017 Dovecot authors, see the included COPYING file */
+
+#include "bench-lib.h"
+
+/* The benchmarks aren't run by "make check", since they take a while and
+   their timings are only meaningful when compared against each other on
+   an otherwise idle machine. Run them with "make benchmark". */
+int main(int argc, char **argv)
+{
+	const char *match = "";
+	if (argc > 2 && strcmp(argv[1], "--match") == 0)
+		match = argv[2];
+
+	static const struct named_test bench_functions[] = {
+#define BENCH(x) TEST_NAMED(x)
+#include "bench-lib.inc"
+#undef BENCH
+		{ NULL, NULL }
+	};
+	return test_run_named(bench_functions, match);
+}
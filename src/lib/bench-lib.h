@@ -0,0 +1,11 @@
+#ifndef BENCH_LIB
+#define BENCH_LIB
+
+#include "lib.h"
+#include "test-common.h"
+
+#define BENCH(x) TEST_DECL(x)
+#include "bench-lib.inc"
+#undef BENCH
+
+#endif
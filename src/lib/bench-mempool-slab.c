@@ -0,0 +1,59 @@
+/* Copyright (c) 2017 Dovecot authors, see the included COPYING file */
+
+#include "bench-lib.h"
+#include "time-util.h"
+
+#include <sys/time.h>
+
+static unsigned long long
+bench_mempool_slab_usecs(pool_t pool, unsigned int *errors_r)
+{
+#define BENCH_SLAB_CONNS 1000
+	void *conns[BENCH_SLAB_CONNS];
+	struct timeval start, end;
+	unsigned int i, idx;
+
+	*errors_r = 0;
+	memset(conns, 0, sizeof(conns));
+	if (gettimeofday(&start, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	/* connection churn: replace random connections with new ones that
+	   have a few differently sized structs */
+	for (i = 0; i < 2000000; i++) {
+		idx = (i * 7919) % BENCH_SLAB_CONNS;
+		if (conns[idx] != NULL)
+			p_free(pool, conns[idx]);
+		conns[idx] = p_malloc(pool, 64 + (i % 4) * 96);
+		if (*(unsigned char *)conns[idx] != 0)
+			(*errors_r)++;
+		*(unsigned char *)conns[idx] = 1;
+	}
+	for (i = 0; i < BENCH_SLAB_CONNS; i++)
+		p_free(pool, conns[i]);
+	if (gettimeofday(&end, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	return timeval_diff_usecs(&end, &start);
+}
+
+void bench_mempool_slab(void)
+{
+	unsigned long long system_usecs, slab_usecs;
+	unsigned int system_errors, slab_errors;
+	struct pool_slab_stats stats;
+	pool_t pool;
+
+	pool = pool_slab_create("benchmark");
+	system_usecs = bench_mempool_slab_usecs(system_pool, &system_errors);
+	slab_usecs = bench_mempool_slab_usecs(pool, &slab_errors);
+	pool_slab_get_stats(pool, &stats);
+	test_out_reason("mempool slab",
+		system_errors == 0 && slab_errors == 0 &&
+		stats.used_size == 0,
+		t_strdup_printf("%llu allocs: system %llu ms, slab %llu ms "
+				"(%llu%% reused)",
+				(unsigned long long)stats.alloc_count,
+				system_usecs / 1000, slab_usecs / 1000,
+				(unsigned long long)(stats.reuse_count * 100 /
+						     stats.alloc_count)));
+	pool_unref(&pool);
+}
@@ -0,0 +1,69 @@
+/* Copyright (c) 2017 Dovecot authors, see the included COPYING file */
+
+#include "bench-lib.h"
+#include "str.h"
+#include "str-find.h"
+#include "time-util.h"
+
+#include <sys/time.h>
+
+static unsigned long long bench_str_find_usecs(struct timeval *start)
+{
+	struct timeval end;
+
+	if (gettimeofday(&end, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	return timeval_diff_usecs(&end, start);
+}
+
+void bench_str_find(void)
+{
+	static const char *words[] = {
+		"the ", "mail ", "server ", "message ", "and ", "of ",
+		"header ", "body ", "search ", "with ", "a ", "to ", "\r\n"
+	};
+	const char *keys[] = {
+		"invoice", "password", "unsubscribe", "meeting", NULL
+	};
+	struct str_find_context *ctx;
+	struct str_find_multi_context *multi_ctx;
+	struct timeval start;
+	unsigned long long single_usecs, multi_usecs;
+	string_t *text;
+	unsigned int i, round, found = 0;
+
+	text = str_new(default_pool, 1024*1024 + 16);
+	while (str_len(text) < 1024*1024)
+		str_append(text, words[rand() % N_ELEMENTS(words)]);
+
+	/* search all keys separately, like done with OR'ed SEARCH keys */
+	if (gettimeofday(&start, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	for (round = 0; round < 20; round++) {
+		for (i = 0; keys[i] != NULL; i++) {
+			ctx = str_find_init(default_pool, keys[i]);
+			if (str_find_more(ctx, str_data(text), str_len(text)))
+				found++;
+			str_find_deinit(&ctx);
+		}
+	}
+	single_usecs = bench_str_find_usecs(&start);
+
+	if (gettimeofday(&start, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	for (round = 0; round < 20; round++) {
+		multi_ctx = str_find_multi_init(default_pool, keys);
+		(void)str_find_multi_more(multi_ctx, str_data(text),
+					  str_len(text));
+		found += str_find_multi_get_found_count(multi_ctx);
+		str_find_multi_deinit(&multi_ctx);
+	}
+	multi_usecs = bench_str_find_usecs(&start);
+	str_free(&text);
+
+	test_out_reason("str_find benchmark", found == 0,
+		t_strdup_printf("20 MB, %u keys: str_find %llu MB/s, "
+				"str_find_multi %llu MB/s", i,
+				20 * 1000000ULL / (single_usecs + 1),
+				20 * 1000000ULL / (multi_usecs + 1)));
+}
@@ -1,10 +1,19 @@
 #ifndef CRC32_H
 #define CRC32_H
 
+#include "hash-method.h"
+
 uint32_t crc32_data(const void *data, size_t size) ATTR_PURE;
 uint32_t crc32_str(const char *str) ATTR_PURE;
 
 uint32_t crc32_data_more(uint32_t crc, const void *data, size_t size) ATTR_PURE;
 uint32_t crc32_str_more(uint32_t crc, const char *str) ATTR_PURE;
 
+/* CRC-32C (Castagnoli). This is faster than crc32_*() on CPUs that support
+   SSE4.2, so it should be preferred for new checksums. */
+uint32_t crc32c_data(const void *data, size_t size) ATTR_PURE;
+uint32_t crc32c_data_more(uint32_t crc, const void *data, size_t size) ATTR_PURE;
+
+extern const struct hash_method hash_method_crc32c;
+
 #endif
@@ -3,6 +3,7 @@
 /* @UNSAFE: whole file */
 
 #include "lib.h"
+#include "mempool-stats.h"
 #include "data-stack.h"
 
 
@@ -60,6 +61,10 @@ struct stack_frame_block {
 	size_t block_space_used[BLOCK_FRAME_COUNT];
 	size_t last_alloc_size[BLOCK_FRAME_COUNT];
 	const char *marker[BLOCK_FRAME_COUNT];
+	/* data_stack_used_size when the frame was pushed, and the highest
+	   value it has had since then */
+	size_t used_size_start[BLOCK_FRAME_COUNT];
+	size_t used_size_peak[BLOCK_FRAME_COUNT];
 #ifdef DEBUG
 	/* Fairly arbitrary profiling data */
 	unsigned long long alloc_bytes[BLOCK_FRAME_COUNT];
@@ -87,6 +92,12 @@ static struct stack_block *unused_block; /* largest unused block is kept here */
 
 static struct stack_block *last_buffer_block;
 static size_t last_buffer_size;
+/* total size of the allocations in all frames. This is updated only while
+   mempool stats are enabled. */
+static size_t data_stack_used_size;
+/* The frames whose ID is at least this were pushed while mempool stats were
+   enabled, so only they have valid used_size_start/peak. */
+static unsigned int data_stack_stats_frame_id = UINT_MAX;
 #ifdef DEBUG
 static bool clean_after_pop = TRUE;
 #else
@@ -177,6 +188,17 @@ data_stack_frame_t t_push(const char *marker)
 	current_frame_block->block_space_used[frame_pos] = current_block->left;
 	current_frame_block->last_alloc_size[frame_pos] = 0;
 	current_frame_block->marker[frame_pos] = marker;
+	if (unlikely(mempool_stats_enabled)) {
+		if (data_stack_stats_frame_id > data_stack_frame_id)
+			data_stack_stats_frame_id = data_stack_frame_id;
+		current_frame_block->used_size_start[frame_pos] =
+			data_stack_used_size;
+		current_frame_block->used_size_peak[frame_pos] =
+			data_stack_used_size;
+	} else if (unlikely(data_stack_stats_frame_id != UINT_MAX)) {
+		/* stats were disabled */
+		data_stack_stats_frame_id = UINT_MAX;
+	}
 #ifdef DEBUG
 	current_frame_block->alloc_bytes[frame_pos] = 0ULL;
 	current_frame_block->alloc_count[frame_pos] = 0;
@@ -194,14 +216,16 @@ data_stack_frame_t t_push(const char *marker)
 data_stack_frame_t t_push_named(const char *format, ...)
 {
 	data_stack_frame_t ret = t_push(NULL);
-#ifdef DEBUG
 	va_list args;
+
+#ifndef DEBUG
+	/* the name is needed only for debugging and memory usage stats */
+	if (likely(!mempool_stats_enabled))
+		return ret;
+#endif
 	va_start(args, format);
 	current_frame_block->marker[frame_pos] = p_strdup_vprintf(unsafe_data_stack_pool, format, args);
 	va_end(args);
-#else
-	(void)format; /* unused in non-DEBUG builds */
-#endif
 
 	return ret;
 }
@@ -275,6 +299,8 @@ static void t_pop_verify(void)
 void t_pop_last_unsafe(void)
 {
 	struct stack_frame_block *frame_block;
+	size_t used_size_peak = 0;
+	bool stats = FALSE;
 
 	if (unlikely(frame_pos < 0))
 		i_panic("t_pop() called with empty stack");
@@ -283,6 +309,22 @@ void t_pop_last_unsafe(void)
 #ifdef DEBUG
 	t_pop_verify();
 #endif
+	if (likely(!mempool_stats_enabled))
+		data_stack_stats_frame_id = UINT_MAX;
+	else if (data_stack_frame_id - 1 < data_stack_stats_frame_id) {
+		/* pushed before stats were enabled. the frames pushed after
+		   this one is popped are accounted for. */
+		data_stack_stats_frame_id = data_stack_frame_id - 1;
+	} else {
+		stats = TRUE;
+		used_size_peak = current_frame_block->used_size_peak[frame_pos];
+		mempool_stats_data_stack_frame(
+			current_frame_block->marker[frame_pos],
+			used_size_peak -
+			current_frame_block->used_size_start[frame_pos]);
+		data_stack_used_size =
+			current_frame_block->used_size_start[frame_pos];
+	}
 
 	/* update the current block */
 	current_block = current_frame_block->block[frame_pos];
@@ -318,6 +360,10 @@ void t_pop_last_unsafe(void)
 		frame_block->prev = unused_frame_blocks;
 		unused_frame_blocks = frame_block;
 	}
+	/* the parent frame's peak includes its child frames */
+	if (stats && current_frame_block != NULL &&
+	    current_frame_block->used_size_peak[frame_pos] < used_size_peak)
+		current_frame_block->used_size_peak[frame_pos] = used_size_peak;
 	data_stack_frame_id--;
 }
 
@@ -375,6 +421,16 @@ static struct stack_block *mem_block_alloc(size_t min_size)
 	return block;
 }
 
+static void data_stack_stats_alloc(size_t size)
+{
+	data_stack_used_size += size;
+	if (current_frame_block->used_size_peak[frame_pos] <
+	    data_stack_used_size) {
+		current_frame_block->used_size_peak[frame_pos] =
+			data_stack_used_size;
+	}
+}
+
 static void *t_malloc_real(size_t size, bool permanent)
 {
 	void *ret;
@@ -432,8 +488,11 @@ static void *t_malloc_real(size_t size, bool permanent)
 
 	if (current_block->left - alloc_size < current_block->lowwater)
 		current_block->lowwater = current_block->left - alloc_size;
-	if (permanent)
+	if (permanent) {
 		current_block->left -= alloc_size;
+		if (unlikely(mempool_stats_enabled))
+			data_stack_stats_alloc(alloc_size);
+	}
 
 #ifdef DEBUG
 	if (warn && getenv("DEBUG_SILENT") == NULL) {
@@ -511,6 +570,8 @@ bool t_try_realloc(void *mem, size_t size)
 				current_block->lowwater = current_block->left;
 			current_frame_block->last_alloc_size[frame_pos] =
 				new_alloc_size;
+			if (unlikely(mempool_stats_enabled))
+				data_stack_stats_alloc(alloc_growth);
 #ifdef DEBUG
 			/* All reallocs are permanent by definition
 			   However, they don't count as a new allocation */
@@ -1,6 +1,7 @@
 /* Copyright (c) 2010-2017 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "crc32.h"
 #include "md4.h"
 #include "md5.h"
 #include "sha1.h"
@@ -82,6 +83,7 @@ const struct hash_method *hash_methods[] = {
 	&hash_method_sha512,
 	&hash_method_sha3_256,
 	&hash_method_sha3_512,
+	&hash_method_crc32c,
 	&hash_method_size,
 	NULL
 };
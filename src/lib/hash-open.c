@@ -0,0 +1,364 @@
+/* Copyright (c) 2017 Dovecot authors, see the included COPYING file */
+
+/* @UNSAFE: whole file */
+
+#include "lib.h"
+#include "hash-open.h"
+
+/* Must be a power of 2 */
+#define HASH_OPEN_MIN_SIZE 16
+/* Maximum number of entries for the given number of slots (7/8 load) */
+#define HASH_OPEN_MAX_ENTRIES(size) ((size) - (size) / 8)
+
+/* entry_pos[] value for entries removed while the table is frozen */
+#define HASH_OPEN_ENTRY_REMOVED ((unsigned int)-1)
+
+struct hash_open_slot {
+	/* NULL if the slot is empty */
+	void *key;
+	void *value;
+	unsigned int hash;
+	/* index to entry_pos[] */
+	unsigned int entry_idx;
+};
+
+struct hash_open_table {
+	int frozen;
+	unsigned int initial_size;
+	unsigned int nodes_count, removed_count;
+
+	/* Robin Hood -probed slots with the keys and values inline, so a lookup
+	   usually touches only a single cache line. size is a power of 2. */
+	unsigned int size, mask;
+	struct hash_open_slot *slots;
+
+	/* entry_pos[entry_idx] is the slot position of the entry. Inserting
+	   and removing may move slots around, but entry indexes stay the same
+	   while the table is frozen, so iterating goes through these. When not
+	   frozen, removing an entry moves the last entry to its place. */
+	unsigned int *entry_pos;
+	unsigned int entries_count;
+
+	hash_callback_t *hash_cb;
+	hash_cmp_callback_t *key_compare_cb;
+};
+
+static unsigned int hash_open_mix(unsigned int hash)
+{
+	/* The hash callbacks don't necessarily have well distributed low bits
+	   (e.g. pointers with direct_hash()), which matters with power-of-2
+	   sized tables. Spread them with murmur3's finalizer. */
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6b;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35;
+	hash ^= hash >> 16;
+	return hash;
+}
+
+static inline unsigned int
+hash_open_slot_dist(const struct hash_open_table *table,
+		    unsigned int pos, unsigned int hash)
+{
+	return (pos - (hash & table->mask)) & table->mask;
+}
+
+static unsigned int hash_open_size_for(unsigned int count)
+{
+	unsigned int size = HASH_OPEN_MIN_SIZE;
+
+	while (HASH_OPEN_MAX_ENTRIES(size) < count) {
+		i_assert(size < (1U << 31));
+		size <<= 1;
+	}
+	return size;
+}
+
+struct hash_open_table *
+hash_open_create(unsigned int initial_size, hash_callback_t *hash_cb,
+		 hash_cmp_callback_t *key_compare_cb)
+{
+	struct hash_open_table *table;
+
+	table = i_new(struct hash_open_table, 1);
+	table->initial_size = hash_open_size_for(initial_size);
+	table->hash_cb = hash_cb;
+	table->key_compare_cb = key_compare_cb;
+
+	table->size = table->initial_size;
+	table->mask = table->size - 1;
+	table->slots = i_new(struct hash_open_slot, table->size);
+	table->entry_pos = i_new(unsigned int,
+				 HASH_OPEN_MAX_ENTRIES(table->size));
+	return table;
+}
+
+void hash_open_destroy(struct hash_open_table **_table)
+{
+	struct hash_open_table *table = *_table;
+
+	*_table = NULL;
+
+	i_assert(table->frozen == 0);
+
+	i_free(table->slots);
+	i_free(table->entry_pos);
+	i_free(table);
+}
+
+void hash_open_clear(struct hash_open_table *table)
+{
+	i_assert(table->frozen == 0);
+
+	memset(table->slots, 0, sizeof(*table->slots) * table->size);
+	table->entries_count = 0;
+	table->nodes_count = 0;
+	table->removed_count = 0;
+}
+
+static inline void
+hash_open_slot_set(struct hash_open_table *table, unsigned int pos,
+		   const struct hash_open_slot *slot)
+{
+	table->slots[pos] = *slot;
+	table->entry_pos[slot->entry_idx] = pos;
+}
+
+static void
+hash_open_slot_insert(struct hash_open_table *table,
+		      struct hash_open_slot new_slot)
+{
+	struct hash_open_slot *slot, tmp_slot;
+	unsigned int pos, dist, slot_dist;
+
+	pos = new_slot.hash & table->mask;
+	for (dist = 0;; dist++) {
+		slot = &table->slots[pos];
+		if (slot->key == NULL) {
+			hash_open_slot_set(table, pos, &new_slot);
+			return;
+		}
+		slot_dist = hash_open_slot_dist(table, pos, slot->hash);
+		if (slot_dist < dist) {
+			/* the existing slot is closer to its home position -
+			   take its place and continue inserting it instead */
+			tmp_slot = *slot;
+			hash_open_slot_set(table, pos, &new_slot);
+			new_slot = tmp_slot;
+			dist = slot_dist;
+		}
+		pos = (pos + 1) & table->mask;
+	}
+}
+
+static void hash_open_slot_delete(struct hash_open_table *table,
+				  unsigned int pos)
+{
+	unsigned int next_pos = (pos + 1) & table->mask;
+
+	/* shift the following slots backwards until we find an empty slot or
+	   a slot that is already in its home position */
+	while (table->slots[next_pos].key != NULL &&
+	       hash_open_slot_dist(table, next_pos,
+				   table->slots[next_pos].hash) > 0) {
+		hash_open_slot_set(table, pos, &table->slots[next_pos]);
+		pos = next_pos;
+		next_pos = (next_pos + 1) & table->mask;
+	}
+	memset(&table->slots[pos], 0, sizeof(table->slots[pos]));
+}
+
+static struct hash_open_slot *
+hash_open_find_slot(const struct hash_open_table *table,
+		    const void *key, unsigned int hash)
+{
+	struct hash_open_slot *slot;
+	unsigned int pos, dist;
+
+	pos = hash & table->mask;
+	for (dist = 0;; dist++) {
+		slot = &table->slots[pos];
+		if (slot->key == NULL ||
+		    hash_open_slot_dist(table, pos, slot->hash) < dist) {
+			/* with Robin Hood ordering the key would have been
+			   found by now */
+			return NULL;
+		}
+		if (slot->hash == hash &&
+		    (slot->key == key ||
+		     table->key_compare_cb(slot->key, key) == 0))
+			return slot;
+		pos = (pos + 1) & table->mask;
+	}
+}
+
+static void hash_open_compact_entries(struct hash_open_table *table)
+{
+	unsigned int src, dest = 0;
+
+	for (src = 0; src < table->entries_count; src++) {
+		if (table->entry_pos[src] == HASH_OPEN_ENTRY_REMOVED)
+			continue;
+		table->entry_pos[dest] = table->entry_pos[src];
+		table->slots[table->entry_pos[dest]].entry_idx = dest;
+		dest++;
+	}
+	i_assert(dest == table->nodes_count);
+	table->entries_count = dest;
+	table->removed_count = 0;
+}
+
+static void hash_open_resize(struct hash_open_table *table,
+			     unsigned int new_size)
+{
+	struct hash_open_slot *old_slots;
+	unsigned int i, old_size;
+
+	if (table->frozen == 0 && table->removed_count > 0)
+		hash_open_compact_entries(table);
+	i_assert(table->entries_count <= HASH_OPEN_MAX_ENTRIES(new_size));
+
+	table->entry_pos = i_realloc(table->entry_pos,
+		sizeof(*table->entry_pos) * HASH_OPEN_MAX_ENTRIES(table->size),
+		sizeof(*table->entry_pos) * HASH_OPEN_MAX_ENTRIES(new_size));
+
+	old_slots = table->slots;
+	old_size = table->size;
+	table->size = new_size;
+	table->mask = new_size - 1;
+	table->slots = i_new(struct hash_open_slot, table->size);
+
+	for (i = 0; i < old_size; i++) {
+		if (old_slots[i].key != NULL)
+			hash_open_slot_insert(table, old_slots[i]);
+	}
+	i_free(old_slots);
+}
+
+static unsigned int hash_open_shrink_size(struct hash_open_table *table)
+{
+	if (table->size <= table->initial_size ||
+	    table->nodes_count >= table->size / 8)
+		return table->size;
+	return I_MAX(hash_open_size_for(table->nodes_count * 2),
+		     table->initial_size);
+}
+
+bool hash_open_lookup(const struct hash_open_table *table, const void *key,
+		      void **orig_key_r, void **value_r)
+{
+	const struct hash_open_slot *slot;
+
+	slot = hash_open_find_slot(table, key,
+				   hash_open_mix(table->hash_cb(key)));
+	if (slot == NULL)
+		return FALSE;
+
+	*orig_key_r = slot->key;
+	*value_r = slot->value;
+	return TRUE;
+}
+
+void hash_open_insert(struct hash_open_table *table, void *key, void *value,
+		      bool update)
+{
+	struct hash_open_slot *slot, new_slot;
+	unsigned int hash;
+
+	i_assert(key != NULL);
+
+	hash = hash_open_mix(table->hash_cb(key));
+	slot = hash_open_find_slot(table, key, hash);
+	if (slot != NULL) {
+		i_assert(update);
+		slot->value = value;
+		return;
+	}
+
+	if (table->entries_count == HASH_OPEN_MAX_ENTRIES(table->size)) {
+		hash_open_resize(table,
+				 hash_open_size_for(table->entries_count + 1));
+	}
+
+	new_slot.key = key;
+	new_slot.value = value;
+	new_slot.hash = hash;
+	new_slot.entry_idx = table->entries_count++;
+	hash_open_slot_insert(table, new_slot);
+	table->nodes_count++;
+}
+
+bool hash_open_try_remove(struct hash_open_table *table, const void *key)
+{
+	struct hash_open_slot *slot;
+	unsigned int entry_idx, last_idx, new_size;
+
+	slot = hash_open_find_slot(table, key,
+				   hash_open_mix(table->hash_cb(key)));
+	if (slot == NULL)
+		return FALSE;
+
+	entry_idx = slot->entry_idx;
+	hash_open_slot_delete(table, slot - table->slots);
+	table->nodes_count--;
+
+	if (table->frozen != 0) {
+		/* keep iteration positions valid */
+		table->entry_pos[entry_idx] = HASH_OPEN_ENTRY_REMOVED;
+		table->removed_count++;
+		return TRUE;
+	}
+
+	last_idx = table->entries_count - 1;
+	if (entry_idx != last_idx) {
+		table->entry_pos[entry_idx] = table->entry_pos[last_idx];
+		table->slots[table->entry_pos[entry_idx]].entry_idx = entry_idx;
+	}
+	table->entries_count--;
+
+	new_size = hash_open_shrink_size(table);
+	if (new_size != table->size)
+		hash_open_resize(table, new_size);
+	return TRUE;
+}
+
+unsigned int hash_open_count(const struct hash_open_table *table)
+{
+	return table->nodes_count;
+}
+
+bool hash_open_iterate(const struct hash_open_table *table, unsigned int *pos,
+		       void **key_r, void **value_r)
+{
+	const struct hash_open_slot *slot;
+	unsigned int slot_pos;
+
+	i_assert(table->frozen > 0);
+
+	while (*pos < table->entries_count) {
+		slot_pos = table->entry_pos[(*pos)++];
+		if (slot_pos != HASH_OPEN_ENTRY_REMOVED) {
+			slot = &table->slots[slot_pos];
+			*key_r = slot->key;
+			*value_r = slot->value;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+void hash_open_freeze(struct hash_open_table *table)
+{
+	table->frozen++;
+}
+
+void hash_open_thaw(struct hash_open_table *table)
+{
+	i_assert(table->frozen > 0);
+
+	if (--table->frozen > 0)
+		return;
+
+	if (table->removed_count > 0)
+		hash_open_resize(table, hash_open_shrink_size(table));
+}
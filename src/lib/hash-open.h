@@ -0,0 +1,35 @@
+#ifndef HASH_OPEN_H
+#define HASH_OPEN_H
+
+#include "hash.h"
+
+/* Open-addressing backend for struct hash_table. This is used internally by
+   hash.c for tables created with hash_table_create_open(). Nothing else should
+   need to call these directly. */
+
+struct hash_open_table *
+hash_open_create(unsigned int initial_size, hash_callback_t *hash_cb,
+		 hash_cmp_callback_t *key_compare_cb);
+void hash_open_destroy(struct hash_open_table **table);
+void hash_open_clear(struct hash_open_table *table);
+
+bool hash_open_lookup(const struct hash_open_table *table, const void *key,
+		      void **orig_key_r, void **value_r);
+/* Insert key/value. If the key already exists and update=TRUE, keep the
+   original key and replace the value. If update=FALSE, assert-crash. */
+void hash_open_insert(struct hash_open_table *table, void *key, void *value,
+		      bool update);
+bool hash_open_try_remove(struct hash_open_table *table, const void *key);
+unsigned int hash_open_count(const struct hash_open_table *table) ATTR_PURE;
+
+/* Iterate entries starting from *pos, which must initially be 0. The table
+   must be frozen while iterating. */
+bool hash_open_iterate(const struct hash_open_table *table, unsigned int *pos,
+		       void **key_r, void **value_r);
+
+/* While frozen, removed entries are only marked as removed so that iteration
+   positions stay valid. Inserting is allowed and may grow the table. */
+void hash_open_freeze(struct hash_open_table *table);
+void hash_open_thaw(struct hash_open_table *table);
+
+#endif
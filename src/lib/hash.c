@@ -4,6 +4,7 @@
 
 #include "lib.h"
 #include "hash.h"
+#include "hash-open.h"
 #include "primes.h"
 
 #include <ctype.h>
@@ -12,6 +13,8 @@
 
 #undef hash_table_create
 #undef hash_table_create_direct
+#undef hash_table_create_open
+#undef hash_table_create_direct_open
 #undef hash_table_destroy
 #undef hash_table_clear
 #undef hash_table_lookup
@@ -44,6 +47,10 @@ struct hash_table {
 
 	hash_callback_t *hash_cb;
 	hash_cmp_callback_t *key_compare_cb;
+
+	/* Non-NULL if this is an open-addressing table. The fields above
+	   aren't used then. */
+	struct hash_open_table *open;
 };
 
 struct hash_iterate_context {
@@ -98,6 +105,26 @@ void hash_table_create_direct(struct hash_table **table_r, pool_t node_pool,
 			  direct_hash, direct_cmp);
 }
 
+void hash_table_create_open(struct hash_table **table_r, pool_t node_pool,
+			    unsigned int initial_size, hash_callback_t *hash_cb,
+			    hash_cmp_callback_t *key_compare_cb)
+{
+	struct hash_table *table;
+
+	pool_ref(node_pool);
+	table = i_new(struct hash_table, 1);
+	table->node_pool = node_pool;
+	table->open = hash_open_create(initial_size, hash_cb, key_compare_cb);
+	*table_r = table;
+}
+
+void hash_table_create_direct_open(struct hash_table **table_r,
+				   pool_t node_pool, unsigned int initial_size)
+{
+	hash_table_create_open(table_r, node_pool, initial_size,
+			       direct_hash, direct_cmp);
+}
+
 static void free_node(struct hash_table *table, struct hash_node *node)
 {
 	if (!table->node_pool->alloconly_pool)
@@ -137,7 +164,9 @@ void hash_table_destroy(struct hash_table **_table)
 
 	i_assert(table->frozen == 0);
 
-	if (!table->node_pool->alloconly_pool) {
+	if (table->open != NULL)
+		hash_open_destroy(&table->open);
+	else if (!table->node_pool->alloconly_pool) {
 		hash_table_destroy_nodes(table);
 		destroy_node_list(table, table->free_nodes);
 	}
@@ -151,6 +180,11 @@ void hash_table_clear(struct hash_table *table, bool free_nodes)
 {
 	i_assert(table->frozen == 0);
 
+	if (table->open != NULL) {
+		hash_open_clear(table->open);
+		return;
+	}
+
 	if (!table->node_pool->alloconly_pool)
 		hash_table_destroy_nodes(table);
 
@@ -189,6 +223,13 @@ void *hash_table_lookup(const struct hash_table *table, const void *key)
 {
 	struct hash_node *node;
 
+	if (table->open != NULL) {
+		void *orig_key, *value;
+
+		return hash_open_lookup(table->open, key, &orig_key, &value) ?
+			value : NULL;
+	}
+
 	node = hash_table_lookup_node(table, key, table->hash_cb(key));
 	return node != NULL ? node->value : NULL;
 }
@@ -199,6 +240,11 @@ bool hash_table_lookup_full(const struct hash_table *table,
 {
 	struct hash_node *node;
 
+	if (table->open != NULL) {
+		return hash_open_lookup(table->open, lookup_key,
+					orig_key, value);
+	}
+
 	node = hash_table_lookup_node(table, lookup_key,
 				      table->hash_cb(lookup_key));
 	if (node == NULL)
@@ -294,11 +340,19 @@ hash_table_insert_node(struct hash_table *table, void *key, void *value,
 
 void hash_table_insert(struct hash_table *table, void *key, void *value)
 {
+	if (table->open != NULL) {
+		hash_open_insert(table->open, key, value, FALSE);
+		return;
+	}
 	hash_table_insert_node(table, key, value, HASH_TABLE_OP_INSERT);
 }
 
 void hash_table_update(struct hash_table *table, void *key, void *value)
 {
+	if (table->open != NULL) {
+		hash_open_insert(table->open, key, value, TRUE);
+		return;
+	}
 	hash_table_insert_node(table, key, value, HASH_TABLE_OP_UPDATE);
 }
 
@@ -344,6 +398,9 @@ bool hash_table_try_remove(struct hash_table *table, const void *key)
 	struct hash_node *node;
 	unsigned int hash;
 
+	if (table->open != NULL)
+		return hash_open_try_remove(table->open, key);
+
 	hash = table->hash_cb(key);
 
 	node = hash_table_lookup_node(table, key, hash);
@@ -362,6 +419,8 @@ bool hash_table_try_remove(struct hash_table *table, const void *key)
 
 unsigned int hash_table_count(const struct hash_table *table)
 {
+	if (table->open != NULL)
+		return hash_open_count(table->open);
 	return table->nodes_count;
 }
 
@@ -373,7 +432,8 @@ struct hash_iterate_context *hash_table_iterate_init(struct hash_table *table)
 
 	ctx = i_new(struct hash_iterate_context, 1);
 	ctx->table = table;
-	ctx->next = &table->nodes[0];
+	if (table->open == NULL)
+		ctx->next = &table->nodes[0];
 	return ctx;
 }
 
@@ -400,6 +460,15 @@ bool hash_table_iterate(struct hash_iterate_context *ctx,
 {
 	struct hash_node *node;
 
+	if (ctx->table->open != NULL) {
+		if (!hash_open_iterate(ctx->table->open, &ctx->pos,
+				       key_r, value_r)) {
+			*key_r = *value_r = NULL;
+			return FALSE;
+		}
+		return TRUE;
+	}
+
 	node = ctx->next;
 	if (node != NULL && node->key == NULL)
 		node = hash_table_iterate_next(ctx, node);
@@ -425,11 +494,19 @@ void hash_table_iterate_deinit(struct hash_iterate_context **_ctx)
 
 void hash_table_freeze(struct hash_table *table)
 {
-	table->frozen++;
+	if (table->open != NULL)
+		hash_open_freeze(table->open);
+	else
+		table->frozen++;
 }
 
 void hash_table_thaw(struct hash_table *table)
 {
+	if (table->open != NULL) {
+		hash_open_thaw(table->open);
+		return;
+	}
+
 	i_assert(table->frozen > 0);
 
 	if (--table->frozen > 0)
@@ -23,8 +23,8 @@ void hash_table_create(struct hash_table **table_r, pool_t node_pool,
 		       hash_callback_t *hash_cb,
 		       hash_cmp_callback_t *key_compare_cb);
 #if defined (__GNUC__) && !defined(__cplusplus)
-#  define hash_table_create(table, pool, size, hash_cb, key_cmp_cb) \
-	({(void)COMPILE_ERROR_IF_TRUE( \
+#  define HASH_TABLE_CREATE_TYPE_CHECK(table, hash_cb, key_cmp_cb) \
+	(void)COMPILE_ERROR_IF_TRUE( \
 		sizeof((*table)._key) != sizeof(void *) || \
 		sizeof((*table)._value) != sizeof(void *)); \
 	(void)COMPILE_ERROR_IF_TRUE( \
@@ -36,7 +36,9 @@ void hash_table_create(struct hash_table **table_r, pool_t node_pool,
 		!__builtin_types_compatible_p(typeof(&hash_cb), \
 			unsigned int (*)(typeof((*table)._key))) && \
 		!__builtin_types_compatible_p(typeof(&hash_cb), \
-			unsigned int (*)(typeof((*table)._const_key)))); \
+			unsigned int (*)(typeof((*table)._const_key))))
+#  define hash_table_create(table, pool, size, hash_cb, key_cmp_cb) \
+	({HASH_TABLE_CREATE_TYPE_CHECK(table, hash_cb, key_cmp_cb); \
 	hash_table_create(&(*table)._table, pool, size, \
 		(hash_callback_t *)hash_cb, \
 		(hash_cmp_callback_t *)key_cmp_cb);})
@@ -61,6 +63,42 @@ void hash_table_create_direct(struct hash_table **table_r, pool_t node_pool,
 	hash_table_create_direct(&(*table)._table, pool, size)
 #endif
 
+/* Create an open-addressing hash table. The keys and values are stored
+   directly in Robin Hood -probed slots, so there are no per-node allocations
+   and a lookup usually touches only a single cache line. This is usually
+   faster for large tables, especially with string keys. Otherwise the table
+   behaves exactly like one created with hash_table_create(), and the same
+   hash_table_*() API is used with it. node_pool isn't used for any
+   allocations. */
+void hash_table_create_open(struct hash_table **table_r, pool_t node_pool,
+			    unsigned int initial_size,
+			    hash_callback_t *hash_cb,
+			    hash_cmp_callback_t *key_compare_cb);
+#if defined (__GNUC__) && !defined(__cplusplus)
+#  define hash_table_create_open(table, pool, size, hash_cb, key_cmp_cb) \
+	({HASH_TABLE_CREATE_TYPE_CHECK(table, hash_cb, key_cmp_cb); \
+	hash_table_create_open(&(*table)._table, pool, size, \
+		(hash_callback_t *)hash_cb, \
+		(hash_cmp_callback_t *)key_cmp_cb);})
+#else
+#  define hash_table_create_open(table, pool, size, hash_cb, key_cmp_cb) \
+	hash_table_create_open(&(*table)._table, pool, size, \
+		(hash_callback_t *)hash_cb, \
+		(hash_cmp_callback_t *)key_cmp_cb)
+#endif
+void hash_table_create_direct_open(struct hash_table **table_r,
+				   pool_t node_pool, unsigned int initial_size);
+#if defined (__GNUC__) && !defined(__cplusplus)
+#  define hash_table_create_direct_open(table, pool, size) \
+	({(void)COMPILE_ERROR_IF_TRUE( \
+		sizeof((*table)._key) != sizeof(void *) || \
+		sizeof((*table)._value) != sizeof(void *)); \
+	hash_table_create_direct_open(&(*table)._table, pool, size);})
+#else
+#  define hash_table_create_direct_open(table, pool, size) \
+	hash_table_create_direct_open(&(*table)._table, pool, size)
+#endif
+
 #define hash_table_is_created(table) \
 	((table)._table != NULL)
 
@@ -6,7 +6,19 @@
 #include "ioloop-private.h"
 #include "ioloop-iolist.h"
 
-#ifdef IOLOOP_EPOLL
+#if defined(IOLOOP_EPOLL) || defined(IOLOOP_URING)
+
+#ifdef IOLOOP_URING
+/* ioloop-uring.c falls back to epoll when the kernel doesn't support
+   io_uring. It owns handler_context then, so use a separate one here. */
+#  define ioloop_handler_context ioloop_epoll_context
+#  define handler_context epoll_context
+#  define io_loop_handler_init io_loop_handler_epoll_init
+#  define io_loop_handler_deinit io_loop_handler_epoll_deinit
+#  define io_loop_handle_add io_loop_handle_epoll_add
+#  define io_loop_handle_remove io_loop_handle_epoll_remove
+#  define io_loop_handler_run_internal io_loop_handler_epoll_run_internal
+#endif
 
 #include <sys/epoll.h>
 #include <unistd.h>
@@ -225,4 +237,4 @@ void io_loop_handler_run_internal(struct ioloop *ioloop)
 	}
 }
 
-#endif	/* IOLOOP_EPOLL */
+#endif	/* IOLOOP_EPOLL || IOLOOP_URING */
@@ -2,6 +2,7 @@
 #define IOLOOP_PRIVATE_H
 
 #include "priorityq.h"
+#include "timing-wheel.h"
 #include "ioloop.h"
 #include "array-decl.h"
 
@@ -17,10 +18,17 @@ struct ioloop {
 	struct io_file *io_files;
 	struct io_file *next_io_file;
 	struct priorityq *timeouts;
+	/* Coarse timeouts are kept here until their second comes. Then they're
+	   moved to the timeouts priority queue. */
+	struct timing_wheel *timeouts_wheel;
 	ARRAY(struct timeout *) timeouts_new;
 	struct io_wait_timer *wait_timers;
 
         struct ioloop_handler_context *handler_context;
+#ifdef IOLOOP_URING
+	/* epoll fallback, used when the kernel doesn't support io_uring */
+	struct ioloop_epoll_context *epoll_context;
+#endif
         struct ioloop_notify_handler_context *notify_handler_context;
 	unsigned int max_fd_count;
 
@@ -76,8 +84,12 @@ struct timeout {
 
 	struct ioloop *ioloop;
 	struct ioloop_context *ctx;
+	struct timing_wheel_item wheel_item;
 
 	bool one_shot:1;
+	/* Added with timeout_add() using at least 1 second interval. Kept in
+	   the timing wheel while the timeout isn't close to expiring. */
+	bool coarse:1;
 };
 
 struct io_wait_timer {
@@ -115,6 +127,16 @@ void io_loop_handle_remove(struct io_file *io, bool closed);
 void io_loop_handler_init(struct ioloop *ioloop, unsigned int initial_fd_count);
 void io_loop_handler_deinit(struct ioloop *ioloop);
 
+#ifdef IOLOOP_URING
+/* epoll handler, used by ioloop-uring.c as fallback */
+void io_loop_handler_epoll_run_internal(struct ioloop *ioloop);
+void io_loop_handle_epoll_add(struct io_file *io);
+void io_loop_handle_epoll_remove(struct io_file *io, bool closed);
+void io_loop_handler_epoll_init(struct ioloop *ioloop,
+				unsigned int initial_fd_count);
+void io_loop_handler_epoll_deinit(struct ioloop *ioloop);
+#endif
+
 void io_loop_notify_remove(struct io *io);
 void io_loop_notify_handler_deinit(struct ioloop *ioloop);
 
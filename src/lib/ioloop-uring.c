@@ -0,0 +1,558 @@
+/* Copyright (c) 2017 Dovecot authors, see the included COPYING file */
+
+/* @UNSAFE: whole file */
+
+#include "lib.h"
+#include "array.h"
+#include "fd-close-on-exec.h"
+#include "ioloop-private.h"
+#include "ioloop-iolist.h"
+
+#ifdef IOLOOP_URING
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* EXT_ARG is needed for waiting with a timeout in the same io_uring_enter()
+   call that submits the queued requests. NODROP guarantees that completions
+   aren't lost when the completion queue overflows. */
+#define IO_URING_REQUIRED_FEATURES \
+	(IORING_FEAT_EXT_ARG | IORING_FEAT_NODROP)
+
+#define IO_URING_MIN_SQ_ENTRIES 64
+#define IO_URING_MAX_SQ_ENTRIES 4096
+#define IO_URING_CQ_ENTRIES (IO_URING_MAX_SQ_ENTRIES * 2)
+
+#define IO_URING_ERROR (POLLERR | POLLHUP)
+#define IO_URING_INPUT (POLLIN | POLLPRI | IO_URING_ERROR)
+#define IO_URING_OUTPUT	(POLLOUT | IO_URING_ERROR)
+
+/* user_data for requests whose completions are ignored. Poll requests always
+   have a non-zero generation, so they never match this. */
+#define IO_URING_USER_DATA_IGNORE 0
+#define IO_URING_USER_DATA(fd, gen) \
+	(((uint64_t)(unsigned int)(fd) << 32) | (gen))
+
+struct io_uring_fd {
+	struct io_list list;
+	/* Generation of the currently armed poll request. Completions of
+	   older requests are ignored. */
+	uint32_t poll_gen;
+	uint32_t poll_events;
+	/* Events of the reaped completion that haven't been dispatched yet */
+	uint32_t revents;
+	bool armed:1;
+	bool pending:1;
+};
+
+struct ioloop_uring_sq {
+	unsigned int *khead, *ktail, *karray;
+	unsigned int ring_mask, ring_entries;
+	struct io_uring_sqe *sqes;
+	/* our tail, published to *ktail when entering */
+	unsigned int sqe_tail;
+
+	void *ring_ptr;
+	size_t ring_size, sqes_size;
+};
+
+struct ioloop_uring_cq {
+	unsigned int *khead, *ktail;
+	unsigned int ring_mask;
+	struct io_uring_cqe *cqes;
+
+	void *ring_ptr;
+	size_t ring_size;
+};
+
+struct ioloop_handler_context {
+	int ring_fd;
+	struct ioloop_uring_sq sq;
+	struct ioloop_uring_cq cq;
+
+	uint32_t next_gen;
+	ARRAY(struct io_uring_fd *) fd_index;
+	/* fds with pending completions. Nested runs keep appending to the
+	   same queue, and the next dispatched fd is at pending_pos. */
+	ARRAY(int) pending_fds;
+	unsigned int pending_pos;
+};
+
+static int
+sys_io_uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int
+sys_io_uring_enter(int ring_fd, unsigned int to_submit,
+		   unsigned int min_complete, unsigned int flags,
+		   const void *arg, size_t arg_size)
+{
+	return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+		       flags, arg, arg_size);
+}
+
+static void *
+io_uring_mmap(struct ioloop_handler_context *ctx, size_t size, off_t offset)
+{
+	void *ptr;
+
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ctx->ring_fd, offset);
+	if (ptr == MAP_FAILED)
+		i_fatal("mmap(io_uring) failed: %m");
+	return ptr;
+}
+
+static bool
+io_uring_ctx_init(struct ioloop_handler_context *ctx,
+		  unsigned int initial_fd_count)
+{
+	struct io_uring_params params;
+	unsigned int i, entries;
+	char *sq_ptr, *cq_ptr;
+
+	entries = nearest_power(initial_fd_count * 2);
+	entries = I_MAX(entries, IO_URING_MIN_SQ_ENTRIES);
+	entries = I_MIN(entries, IO_URING_MAX_SQ_ENTRIES);
+
+	i_zero(&params);
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = IO_URING_CQ_ENTRIES;
+	ctx->ring_fd = sys_io_uring_setup(entries, &params);
+	if (ctx->ring_fd < 0) {
+		/* ENOSYS: not compiled into kernel, EPERM: disabled by
+		   kernel.io_uring_disabled sysctl or seccomp, EINVAL: too
+		   old kernel */
+		if (errno == ENOSYS || errno == EPERM || errno == EINVAL)
+			return FALSE;
+		if (errno != EMFILE)
+			i_fatal("io_uring_setup(): %m");
+		else {
+			i_fatal("io_uring_setup(): %m (you may need to increase "
+				"the open files limit)");
+		}
+	}
+	if ((params.features & IO_URING_REQUIRED_FEATURES) !=
+	    IO_URING_REQUIRED_FEATURES) {
+		if (close(ctx->ring_fd) < 0)
+			i_error("close(io_uring) failed: %m");
+		return FALSE;
+	}
+	fd_close_on_exec(ctx->ring_fd, TRUE);
+
+	ctx->sq.ring_size = params.sq_off.array +
+		params.sq_entries * sizeof(unsigned int);
+	ctx->cq.ring_size = params.cq_off.cqes +
+		params.cq_entries * sizeof(struct io_uring_cqe);
+	if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+		ctx->sq.ring_size = ctx->cq.ring_size =
+			I_MAX(ctx->sq.ring_size, ctx->cq.ring_size);
+	}
+	ctx->sq.ring_ptr = io_uring_mmap(ctx, ctx->sq.ring_size,
+					 IORING_OFF_SQ_RING);
+	if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0)
+		ctx->cq.ring_ptr = ctx->sq.ring_ptr;
+	else {
+		ctx->cq.ring_ptr = io_uring_mmap(ctx, ctx->cq.ring_size,
+						 IORING_OFF_CQ_RING);
+	}
+	ctx->sq.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ctx->sq.sqes = io_uring_mmap(ctx, ctx->sq.sqes_size, IORING_OFF_SQES);
+
+	sq_ptr = ctx->sq.ring_ptr;
+	ctx->sq.khead = (void *)(sq_ptr + params.sq_off.head);
+	ctx->sq.ktail = (void *)(sq_ptr + params.sq_off.tail);
+	ctx->sq.karray = (void *)(sq_ptr + params.sq_off.array);
+	ctx->sq.ring_mask = *(unsigned int *)(sq_ptr + params.sq_off.ring_mask);
+	ctx->sq.ring_entries =
+		*(unsigned int *)(sq_ptr + params.sq_off.ring_entries);
+	ctx->sq.sqe_tail = *ctx->sq.ktail;
+	/* SQEs are used in ring order, so the indirection array is fixed */
+	for (i = 0; i < ctx->sq.ring_entries; i++)
+		ctx->sq.karray[i] = i;
+
+	cq_ptr = ctx->cq.ring_ptr;
+	ctx->cq.khead = (void *)(cq_ptr + params.cq_off.head);
+	ctx->cq.ktail = (void *)(cq_ptr + params.cq_off.tail);
+	ctx->cq.ring_mask = *(unsigned int *)(cq_ptr + params.cq_off.ring_mask);
+	ctx->cq.cqes = (void *)(cq_ptr + params.cq_off.cqes);
+	return TRUE;
+}
+
+void io_loop_handler_init(struct ioloop *ioloop, unsigned int initial_fd_count)
+{
+	struct ioloop_handler_context *ctx;
+
+	ioloop->handler_context = ctx = i_new(struct ioloop_handler_context, 1);
+	if (!io_uring_ctx_init(ctx, initial_fd_count)) {
+		ctx->ring_fd = -1;
+		io_loop_handler_epoll_init(ioloop, initial_fd_count);
+		return;
+	}
+
+	i_array_init(&ctx->pending_fds, initial_fd_count);
+	i_array_init(&ctx->fd_index, initial_fd_count);
+}
+
+void io_loop_handler_deinit(struct ioloop *ioloop)
+{
+	struct ioloop_handler_context *ctx = ioloop->handler_context;
+	struct io_uring_fd **fds;
+	unsigned int i, count;
+
+	if (ioloop->epoll_context != NULL) {
+		io_loop_handler_epoll_deinit(ioloop);
+		i_free(ioloop->handler_context);
+		return;
+	}
+
+	fds = array_get_modifiable(&ctx->fd_index, &count);
+	for (i = 0; i < count; i++)
+		i_free(fds[i]);
+
+	if (ctx->cq.ring_ptr != ctx->sq.ring_ptr)
+		(void)munmap(ctx->cq.ring_ptr, ctx->cq.ring_size);
+	(void)munmap(ctx->sq.ring_ptr, ctx->sq.ring_size);
+	(void)munmap(ctx->sq.sqes, ctx->sq.sqes_size);
+	if (close(ctx->ring_fd) < 0)
+		i_error("close(io_uring) failed: %m");
+	array_free(&ctx->fd_index);
+	array_free(&ctx->pending_fds);
+	i_free(ioloop->handler_context);
+}
+
+static void io_uring_reap_events(struct ioloop_handler_context *ctx);
+
+static unsigned int io_uring_sq_pending(struct ioloop_handler_context *ctx)
+{
+	/* publish the queued SQEs to the kernel */
+	__atomic_store_n(ctx->sq.ktail, ctx->sq.sqe_tail, __ATOMIC_RELEASE);
+	return ctx->sq.sqe_tail -
+		__atomic_load_n(ctx->sq.khead, __ATOMIC_ACQUIRE);
+}
+
+static void io_uring_submit(struct ioloop_handler_context *ctx)
+{
+	unsigned int to_submit = io_uring_sq_pending(ctx);
+	unsigned int flags = 0;
+	int ret;
+
+	while (to_submit > 0) {
+		ret = sys_io_uring_enter(ctx->ring_fd, to_submit, 0, flags,
+					 NULL, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EBUSY && errno != EAGAIN)
+				i_fatal("io_uring_enter(submit) failed: %m");
+			/* the completion queue overflowed or the kernel was
+			   short of resources. move the completions out of the
+			   ring, so the kernel can flush the overflowed ones
+			   there, and try again. */
+			io_uring_reap_events(ctx);
+			flags = IORING_ENTER_GETEVENTS;
+			continue;
+		}
+		to_submit = io_uring_sq_pending(ctx);
+	}
+}
+
+static struct io_uring_sqe *io_uring_get_sqe(struct ioloop_handler_context *ctx)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int head;
+
+	head = __atomic_load_n(ctx->sq.khead, __ATOMIC_ACQUIRE);
+	if (ctx->sq.sqe_tail - head >= ctx->sq.ring_entries) {
+		/* submission queue is full. the requests are normally
+		   submitted only when waiting for events. */
+		io_uring_submit(ctx);
+	}
+	sqe = &ctx->sq.sqes[ctx->sq.sqe_tail & ctx->sq.ring_mask];
+	ctx->sq.sqe_tail++;
+	i_zero(sqe);
+	return sqe;
+}
+
+static uint32_t io_uring_event_mask(struct io_list *list)
+{
+	uint32_t events = 0;
+	struct io_file *io;
+	int i;
+
+	for (i = 0; i < IOLOOP_IOLIST_IOS_PER_FD; i++) {
+		io = list->ios[i];
+
+		if (io == NULL)
+			continue;
+
+		if ((io->io.condition & IO_READ) != 0)
+			events |= IO_URING_INPUT;
+		if ((io->io.condition & IO_WRITE) != 0)
+			events |= IO_URING_OUTPUT;
+		if ((io->io.condition & IO_ERROR) != 0)
+			events |= IO_URING_ERROR;
+	}
+	return events;
+}
+
+static void
+io_uring_fd_disarm(struct ioloop_handler_context *ctx, int fd,
+		   struct io_uring_fd *ufd)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!ufd->armed)
+		return;
+
+	sqe = io_uring_get_sqe(ctx);
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = IO_URING_USER_DATA(fd, ufd->poll_gen);
+	sqe->user_data = IO_URING_USER_DATA_IGNORE;
+	ufd->armed = FALSE;
+	ufd->poll_gen = 0;
+}
+
+static void
+io_uring_fd_arm(struct ioloop_handler_context *ctx, int fd,
+		struct io_uring_fd *ufd)
+{
+	struct io_uring_sqe *sqe;
+	uint32_t events;
+
+	/* a new poll request replaces the not yet dispatched completion */
+	ufd->pending = FALSE;
+	events = io_uring_event_mask(&ufd->list);
+	if (ufd->armed) {
+		if (ufd->poll_events == events)
+			return;
+		io_uring_fd_disarm(ctx, fd, ufd);
+	}
+	ufd->poll_events = events;
+	if (events == 0)
+		return;
+
+	if (++ctx->next_gen == 0)
+		ctx->next_gen++;
+	ufd->poll_gen = ctx->next_gen;
+
+	/* Use one-shot polls and re-arm them after the events have been
+	   handled. This keeps the level-triggered semantics that the ioloop
+	   API expects, which multishot polls wouldn't. */
+	sqe = io_uring_get_sqe(ctx);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+#ifdef WORDS_BIGENDIAN
+	sqe->poll32_events = (events << 16) | (events >> 16);
+#else
+	sqe->poll32_events = events;
+#endif
+	sqe->user_data = IO_URING_USER_DATA(fd, ufd->poll_gen);
+	ufd->armed = TRUE;
+}
+
+void io_loop_handle_add(struct io_file *io)
+{
+	struct ioloop_handler_context *ctx = io->io.ioloop->handler_context;
+	struct io_uring_fd **ufdp;
+
+	if (io->io.ioloop->epoll_context != NULL) {
+		io_loop_handle_epoll_add(io);
+		return;
+	}
+
+	ufdp = array_idx_modifiable(&ctx->fd_index, io->fd);
+	if (*ufdp == NULL)
+		*ufdp = i_new(struct io_uring_fd, 1);
+
+	(void)ioloop_iolist_add(&(*ufdp)->list, io);
+	io_uring_fd_arm(ctx, io->fd, *ufdp);
+}
+
+void io_loop_handle_remove(struct io_file *io, bool closed)
+{
+	struct ioloop_handler_context *ctx = io->io.ioloop->handler_context;
+	struct io_uring_fd *ufd;
+
+	if (io->io.ioloop->epoll_context != NULL) {
+		io_loop_handle_epoll_remove(io, closed);
+		return;
+	}
+
+	/* Unlike with epoll, the poll request needs to be removed even if the
+	   fd was already closed, because io_uring holds its own reference to
+	   the file until the request is gone. */
+	ufd = *(struct io_uring_fd *const *)array_idx(&ctx->fd_index, io->fd);
+	if (ioloop_iolist_del(&ufd->list, io))
+		io_uring_fd_disarm(ctx, io->fd, ufd);
+	else
+		io_uring_fd_arm(ctx, io->fd, ufd);
+	i_free(io);
+}
+
+static int
+io_uring_submit_and_wait(struct ioloop_handler_context *ctx, int msecs)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int to_submit;
+
+	to_submit = io_uring_sq_pending(ctx);
+
+	i_zero(&arg);
+	if (msecs >= 0) {
+		ts.tv_sec = msecs / 1000;
+		ts.tv_nsec = (long long)(msecs % 1000) * 1000000;
+		arg.ts = (uintptr_t)&ts;
+	}
+	return sys_io_uring_enter(ctx->ring_fd, to_submit, 1,
+				  IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+				  &arg, sizeof(arg));
+}
+
+static void io_uring_reap_events(struct ioloop_handler_context *ctx)
+{
+	const struct io_uring_cqe *cqe;
+	struct io_uring_fd *ufd;
+	unsigned int head, tail;
+	int fd;
+
+	/* move the completions out of the ring to the fds, so that the
+	   callbacks can safely queue new requests */
+	head = *ctx->cq.khead;
+	tail = __atomic_load_n(ctx->cq.ktail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		cqe = &ctx->cq.cqes[head & ctx->cq.ring_mask];
+		if (cqe->user_data == IO_URING_USER_DATA_IGNORE)
+			continue;
+
+		fd = cqe->user_data >> 32;
+		if ((unsigned int)fd >= array_count(&ctx->fd_index))
+			continue;
+		ufd = *(struct io_uring_fd *const *)array_idx(&ctx->fd_index, fd);
+		if (ufd == NULL || !ufd->armed ||
+		    ufd->poll_gen != (uint32_t)cqe->user_data) {
+			/* completion of an already removed request */
+			continue;
+		}
+		/* the one-shot poll is gone now, so the fd must be re-armed
+		   whether or not the completion gets dispatched */
+		ufd->armed = FALSE;
+		ufd->pending = TRUE;
+		ufd->revents = cqe->res < 0 ? POLLERR : (uint32_t)cqe->res;
+		array_append(&ctx->pending_fds, &fd, 1);
+	}
+	__atomic_store_n(ctx->cq.khead, head, __ATOMIC_RELEASE);
+}
+
+static void io_uring_rearm_pending(struct ioloop_handler_context *ctx)
+{
+	const int *fds;
+	struct io_uring_fd *ufd;
+	unsigned int i, count;
+
+	fds = array_get(&ctx->pending_fds, &count);
+	for (i = ctx->pending_pos; i < count; i++) {
+		ufd = *(struct io_uring_fd *const *)
+			array_idx(&ctx->fd_index, fds[i]);
+		if (ufd->pending)
+			io_uring_fd_arm(ctx, fds[i], ufd);
+	}
+	array_clear(&ctx->pending_fds);
+	ctx->pending_pos = 0;
+}
+
+static void
+io_uring_dispatch(struct ioloop_handler_context *ctx, int fd,
+		  struct io_uring_fd *ufd)
+{
+	struct io_file *io;
+	uint32_t revents = ufd->revents;
+	bool call;
+	int i;
+
+	ufd->pending = FALSE;
+	for (i = 0; i < IOLOOP_IOLIST_IOS_PER_FD; i++) {
+		io = ufd->list.ios[i];
+		if (io == NULL)
+			continue;
+
+		call = FALSE;
+		if ((revents & (POLLHUP | POLLERR)) != 0)
+			call = TRUE;
+		else if ((io->io.condition & IO_READ) != 0)
+			call = (revents & POLLIN) != 0;
+		else if ((io->io.condition & IO_WRITE) != 0)
+			call = (revents & POLLOUT) != 0;
+		else if ((io->io.condition & IO_ERROR) != 0)
+			call = (revents & IO_URING_ERROR) != 0;
+
+		if (call)
+			io_loop_call_io(&io->io);
+	}
+	/* the callbacks may have already re-armed it */
+	if (!ufd->armed)
+		io_uring_fd_arm(ctx, fd, ufd);
+}
+
+void io_loop_handler_run_internal(struct ioloop *ioloop)
+{
+	struct ioloop_handler_context *ctx = ioloop->handler_context;
+	struct io_uring_fd *ufd;
+	struct timeval tv;
+	int msecs, ret, fd;
+
+	i_assert(ctx != NULL);
+
+	if (ioloop->epoll_context != NULL) {
+		io_loop_handler_epoll_run_internal(ioloop);
+		return;
+	}
+
+        /* get the time left for next timeout task */
+	msecs = io_loop_get_wait_time(ioloop, &tv);
+	if (ioloop->io_files == NULL && msecs < 0)
+		i_panic("BUG: No IOs or timeouts set. Not waiting for infinity.");
+	if (ctx->pending_pos < array_count(&ctx->pending_fds)) {
+		/* nested run: don't wait before handling the outer run's
+		   remaining completions */
+		msecs = 0;
+	}
+
+	/* the queued poll requests are submitted with the same syscall */
+	ret = io_uring_submit_and_wait(ctx, msecs);
+	if (ret < 0 && errno != EINTR && errno != ETIME &&
+	    errno != EBUSY && errno != EAGAIN)
+		i_fatal("io_uring_enter(): %m");
+	io_uring_reap_events(ctx);
+
+	/* execute timeout handlers */
+        io_loop_handle_timeouts(ioloop);
+
+	if (!ioloop->running) {
+		/* the completions are handled by the next run */
+		io_uring_rearm_pending(ctx);
+		return;
+	}
+
+	/* a nested run within the callbacks may dispatch the rest of the
+	   queue and clear it */
+	while (ctx->pending_pos < array_count(&ctx->pending_fds)) {
+		fd = *array_idx(&ctx->pending_fds, ctx->pending_pos);
+		ctx->pending_pos++;
+		ufd = *(struct io_uring_fd *const *)
+			array_idx(&ctx->fd_index, fd);
+		if (ufd->pending)
+			io_uring_dispatch(ctx, fd, ufd);
+	}
+	array_clear(&ctx->pending_fds);
+	ctx->pending_pos = 0;
+}
+
+#endif	/* IOLOOP_URING */
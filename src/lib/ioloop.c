@@ -216,6 +216,7 @@ timeout_add_common(const char *source_filename, unsigned int source_linenum,
 
 	timeout = i_new(struct timeout, 1);
 	timeout->item.idx = UINT_MAX;
+	timing_wheel_item_init(&timeout->wheel_item);
 	timeout->source_filename = source_filename;
 	timeout->source_linenum = source_linenum;
 	timeout->ioloop = current_ioloop;
@@ -231,15 +232,52 @@ timeout_add_common(const char *source_filename, unsigned int source_linenum,
 	return timeout;
 }
 
-#undef timeout_add
-struct timeout *timeout_add(unsigned int msecs, const char *source_filename,
-			    unsigned int source_linenum,
-			    timeout_callback_t *callback, void *context)
+static struct timeout *
+timeout_from_wheel_item(struct timing_wheel_item *item)
+{
+	return (struct timeout *)((char *)item -
+				  offsetof(struct timeout, wheel_item));
+}
+
+static bool timeout_is_queued(const struct timeout *timeout)
+{
+	return timeout->item.idx != UINT_MAX ||
+		timing_wheel_item_is_linked(&timeout->wheel_item);
+}
+
+static void timeout_queue(struct timeout *timeout)
+{
+	struct ioloop *ioloop = timeout->ioloop;
+
+	if (timeout->coarse && timeout->next_run.tv_sec >
+	    timing_wheel_get_time(ioloop->timeouts_wheel)) {
+		timing_wheel_add(ioloop->timeouts_wheel, &timeout->wheel_item,
+				 timeout->next_run.tv_sec);
+	} else {
+		priorityq_add(ioloop->timeouts, &timeout->item);
+	}
+}
+
+static void timeout_unqueue(struct timeout *timeout)
+{
+	if (timeout->item.idx != UINT_MAX)
+		priorityq_remove(timeout->ioloop->timeouts, &timeout->item);
+	else {
+		timing_wheel_remove(timeout->ioloop->timeouts_wheel,
+				    &timeout->wheel_item);
+	}
+}
+
+static struct timeout *
+timeout_add_msecs(unsigned int msecs, const char *source_filename,
+		  unsigned int source_linenum,
+		  timeout_callback_t *callback, void *context, bool coarse)
 {
 	struct timeout *timeout;
 
 	timeout = timeout_add_common(source_filename, source_linenum, callback, context);
 	timeout->msecs = msecs;
+	timeout->coarse = coarse && msecs >= 1000;
 
 	if (msecs > 0) {
 		/* start this timeout in the next run cycle */
@@ -253,13 +291,23 @@ struct timeout *timeout_add(unsigned int msecs, const char *source_filename,
 	return timeout;
 }
 
+#undef timeout_add
+struct timeout *timeout_add(unsigned int msecs, const char *source_filename,
+			    unsigned int source_linenum,
+			    timeout_callback_t *callback, void *context)
+{
+	return timeout_add_msecs(msecs, source_filename, source_linenum,
+				 callback, context, TRUE);
+}
+
 #undef timeout_add_short
 struct timeout *
 timeout_add_short(unsigned int msecs, const char *source_filename,
 		  unsigned int source_linenum,
 		  timeout_callback_t *callback, void *context)
 {
-	return timeout_add(msecs, source_filename, source_linenum, callback, context);
+	return timeout_add_msecs(msecs, source_filename, source_linenum,
+				 callback, context, FALSE);
 }
 
 #undef timeout_add_absolute
@@ -289,11 +337,12 @@ timeout_copy(const struct timeout *old_to)
 		(old_to->source_filename, old_to->source_linenum,
 		 old_to->callback, old_to->context);
 	new_to->one_shot = old_to->one_shot;
+	new_to->coarse = old_to->coarse;
 	new_to->msecs = old_to->msecs;
 	new_to->next_run = old_to->next_run;
 
-	if (old_to->item.idx != UINT_MAX)
-		priorityq_add(new_to->ioloop->timeouts, &new_to->item);
+	if (timeout_is_queued(old_to))
+		timeout_queue(new_to);
 	else if (!new_to->one_shot) {
 		i_assert(new_to->msecs > 0);
 		array_append(&new_to->ioloop->timeouts_new, &new_to, 1);
@@ -315,8 +364,8 @@ void timeout_remove(struct timeout **_timeout)
 	struct ioloop *ioloop = timeout->ioloop;
 
 	*_timeout = NULL;
-	if (timeout->item.idx != UINT_MAX)
-		priorityq_remove(timeout->ioloop->timeouts, &timeout->item);
+	if (timeout_is_queued(timeout))
+		timeout_unqueue(timeout);
 	else if (!timeout->one_shot && timeout->msecs > 0) {
 		struct timeout *const *to_idx;
 		array_foreach(&ioloop->timeouts_new, to_idx) {
@@ -333,7 +382,7 @@ void timeout_remove(struct timeout **_timeout)
 static void ATTR_NULL(2)
 timeout_reset_timeval(struct timeout *timeout, struct timeval *tv_now)
 {
-	if (timeout->item.idx == UINT_MAX)
+	if (!timeout_is_queued(timeout))
 		return;
 
 	timeout_update_next(timeout, tv_now);
@@ -352,8 +401,14 @@ timeout_reset_timeval(struct timeout *timeout, struct timeval *tv_now)
 		 timeout->next_run.tv_sec > tv_now->tv_sec ||
 		 (timeout->next_run.tv_sec == tv_now->tv_sec &&
 		  timeout->next_run.tv_usec > tv_now->tv_usec));
-	priorityq_remove(timeout->ioloop->timeouts, &timeout->item);
-	priorityq_add(timeout->ioloop->timeouts, &timeout->item);
+	if (timing_wheel_item_is_linked(&timeout->wheel_item) &&
+	    timeout->wheel_item.expire == timeout->next_run.tv_sec) {
+		/* still expires within the same second - the priority queue
+		   will get the exact time once the second comes */
+		return;
+	}
+	timeout_unqueue(timeout);
+	timeout_queue(timeout);
 }
 
 void timeout_reset(struct timeout *timeout)
@@ -362,8 +417,8 @@ void timeout_reset(struct timeout *timeout)
 	timeout_reset_timeval(timeout, NULL);
 }
 
-static int timeout_get_wait_time(struct timeout *timeout, struct timeval *tv_r,
-				 struct timeval *tv_now)
+static int timeout_get_wait_time(const struct timeval *next_run,
+				 struct timeval *tv_r, struct timeval *tv_now)
 {
 	int ret;
 
@@ -375,10 +430,10 @@ static int timeout_get_wait_time(struct timeout *timeout, struct timeval *tv_r,
 	tv_r->tv_usec = tv_now->tv_usec;
 
 	i_assert(tv_r->tv_sec > 0);
-	i_assert(timeout->next_run.tv_sec > 0);
+	i_assert(next_run->tv_sec > 0);
 
-	tv_r->tv_sec = timeout->next_run.tv_sec - tv_r->tv_sec;
-	tv_r->tv_usec = timeout->next_run.tv_usec - tv_r->tv_usec;
+	tv_r->tv_sec = next_run->tv_sec - tv_r->tv_sec;
+	tv_r->tv_usec = next_run->tv_usec - tv_r->tv_usec;
 	if (tv_r->tv_usec < 0) {
 		tv_r->tv_sec--;
 		tv_r->tv_usec += 1000000;
@@ -400,18 +455,21 @@ static int timeout_get_wait_time(struct timeout *timeout, struct timeval *tv_r,
 
 int io_loop_get_wait_time(struct ioloop *ioloop, struct timeval *tv_r)
 {
-	struct timeval tv_now;
+	struct timeval tv_now, next_run;
 	struct priorityq_item *item;
 	struct timeout *timeout;
+	time_t wheel_next;
 	int msecs;
 
 	item = priorityq_peek(ioloop->timeouts);
 	timeout = (struct timeout *)item;
+	wheel_next = timing_wheel_get_next_time(ioloop->timeouts_wheel);
 
 	/* we need to see if there are pending IO waiting,
 	   if there is, we set msecs = 0 to ensure they are
 	   processed without delay */
-	if (timeout == NULL && ioloop->io_pending_count == 0) {
+	if (timeout == NULL && wheel_next == 0 &&
+	    ioloop->io_pending_count == 0) {
 		/* no timeouts. use INT_MAX msecs for timeval and
 		   return -1 for poll/epoll infinity. */
 		tv_r->tv_sec = INT_MAX / 1000;
@@ -427,8 +485,17 @@ int io_loop_get_wait_time(struct ioloop *ioloop, struct timeval *tv_r)
 		tv_r->tv_sec = 0;
 		tv_r->tv_usec = 0;
 	} else {
+		/* wake up also when the timing wheel's next second comes,
+		   so its timeouts get moved to the priority queue */
+		if (timeout != NULL)
+			next_run = timeout->next_run;
+		if (wheel_next != 0 &&
+		    (timeout == NULL || wheel_next <= next_run.tv_sec)) {
+			next_run.tv_sec = wheel_next;
+			next_run.tv_usec = 0;
+		}
 		tv_now.tv_sec = 0;
-		msecs = timeout_get_wait_time(timeout, tv_r, &tv_now);
+		msecs = timeout_get_wait_time(&next_run, tv_r, &tv_now);
 	}
 	ioloop->next_max_time = (tv_now.tv_sec + msecs/1000) + 1;
 
@@ -471,16 +538,30 @@ static void io_loop_timeouts_start_new(struct ioloop *ioloop)
 		i_assert(!timeout->one_shot);
 		i_assert(timeout->msecs > 0);
 		timeout_update_next(timeout, &ioloop_timeval);
-		priorityq_add(ioloop->timeouts, &timeout->item);
+		timeout_queue(timeout);
 	}
 	array_clear(&ioloop->timeouts_new);
 }
 
 static void io_loop_timeouts_update(struct ioloop *ioloop, long diff_secs)
 {
+	ARRAY_TYPE(timing_wheel_item) wheel_items;
+	struct timing_wheel_item *const *wheel_itemp;
 	struct priorityq_item *const *items;
 	unsigned int i, count;
 
+	/* the timing wheel can't be shifted in time, so move all of its
+	   timeouts to the priority queue. they'll get back to the wheel when
+	   they're reset. */
+	t_array_init(&wheel_items, timing_wheel_count(ioloop->timeouts_wheel));
+	timing_wheel_pop_all(ioloop->timeouts_wheel, &wheel_items);
+	array_foreach(&wheel_items, wheel_itemp) {
+		struct timeout *to = timeout_from_wheel_item(*wheel_itemp);
+
+		priorityq_add(ioloop->timeouts, &to->item);
+	}
+	timing_wheel_set_time(ioloop->timeouts_wheel, ioloop_timeval.tv_sec);
+
 	count = priorityq_count(ioloop->timeouts);
 	items = priorityq_items(ioloop->timeouts);
 	for (i = 0; i < count; i++) {
@@ -512,6 +593,7 @@ static void ioloop_add_wait_time(struct ioloop *ioloop)
 
 static void io_loop_handle_timeouts_real(struct ioloop *ioloop)
 {
+	struct timing_wheel_item *wheel_item;
 	struct priorityq_item *item;
 	struct timeval tv, tv_call;
 	data_stack_frame_t t_id;
@@ -544,12 +626,21 @@ static void io_loop_handle_timeouts_real(struct ioloop *ioloop)
 	ioloop_time = ioloop_timeval.tv_sec;
 	tv_call = ioloop_timeval;
 
+	/* move the coarse timeouts expiring during this second to the
+	   priority queue */
+	while ((wheel_item = timing_wheel_pop_expired(ioloop->timeouts_wheel,
+						      ioloop_time)) != NULL) {
+		struct timeout *timeout = timeout_from_wheel_item(wheel_item);
+
+		priorityq_add(ioloop->timeouts, &timeout->item);
+	}
+
 	while ((item = priorityq_peek(ioloop->timeouts)) != NULL) {
 		struct timeout *timeout = (struct timeout *)item;
 
 		/* use tv_call to make sure we don't get to infinite loop in
 		   case callbacks update ioloop_timeval. */
-		if (timeout_get_wait_time(timeout, &tv, &tv_call) > 0)
+		if (timeout_get_wait_time(&timeout->next_run, &tv, &tv_call) > 0)
 			break;
 
 		if (timeout->one_shot) {
@@ -687,6 +778,7 @@ struct ioloop *io_loop_create(void)
 
         ioloop = i_new(struct ioloop, 1);
 	ioloop->timeouts = priorityq_init(timeout_cmp, 32);
+	ioloop->timeouts_wheel = timing_wheel_init(ioloop_time);
 	i_array_init(&ioloop->timeouts_new, 8);
 
 	ioloop->time_moved_callback = current_ioloop != NULL ?
@@ -701,6 +793,8 @@ struct ioloop *io_loop_create(void)
 void io_loop_destroy(struct ioloop **_ioloop)
 {
 	struct ioloop *ioloop = *_ioloop;
+	ARRAY_TYPE(timing_wheel_item) wheel_items;
+	struct timing_wheel_item *const *wheel_itemp;
 	struct timeout *const *to_idx;
 	struct priorityq_item *item;
 
@@ -745,6 +839,19 @@ void io_loop_destroy(struct ioloop **_ioloop)
 	}
 	priorityq_deinit(&ioloop->timeouts);
 
+	i_array_init(&wheel_items, 8);
+	timing_wheel_pop_all(ioloop->timeouts_wheel, &wheel_items);
+	array_foreach(&wheel_items, wheel_itemp) {
+		struct timeout *to = timeout_from_wheel_item(*wheel_itemp);
+
+		i_warning("Timeout leak: %p (%s:%u)", (void *)to->callback,
+			  to->source_filename,
+			  to->source_linenum);
+		timeout_free(to);
+	}
+	array_free(&wheel_items);
+	timing_wheel_deinit(&ioloop->timeouts_wheel);
+
 	while (ioloop->wait_timers != NULL) {
 		struct io_wait_timer *timer = ioloop->wait_timers;
 
@@ -6,7 +6,9 @@
 #include "hostpid.h"
 #include "fd-close-on-exec.h"
 #include "ipwd.h"
+#include "mempool-stats.h"
 #include "process-title.h"
+#include "simd-util.h"
 
 #include <fcntl.h>
 #include <unistd.h>
@@ -165,8 +167,11 @@ void lib_init(void)
 		i_fatal("gettimeofday(): %m");
 	rand_set_seed((unsigned int) (tv.tv_sec ^ tv.tv_usec ^ getpid()));
 
+	if (getenv("DEBUG_MEMPOOL_STATS") != NULL)
+		mempool_stats_set_enabled(TRUE);
 	data_stack_init();
 	hostpid_init();
+	simd_features_init();
 	lib_open_non_stdio_dev_null();
 
 	lib_initialized = TRUE;
@@ -186,6 +191,7 @@ void lib_deinit(void)
 	hostpid_deinit();
 	i_close_fd(&dev_null_fd);
 	data_stack_deinit();
+	mempool_stats_deinit();
 	env_deinit();
 	failures_deinit();
 	process_title_deinit();
@@ -4,6 +4,7 @@
 #include "lib.h"
 #include "safe-memset.h"
 #include "mempool.h"
+#include "mempool-stats.h"
 
 
 #ifdef HAVE_GC_GC_H
@@ -25,6 +26,10 @@ struct alloconly_pool {
 	bool disable_warning;
 #endif
 	bool clean_frees;
+
+	/* Memory usage accounting, if enabled */
+	struct mempool_stats_entry *stats;
+	size_t stats_alloc_size;
 };
 
 struct pool_block {
@@ -119,7 +124,28 @@ static void check_sentries(struct pool_block *block)
 }
 #endif
 
-pool_t pool_alloconly_create(const char *name ATTR_UNUSED, size_t size)
+static void pool_alloconly_stats_init(struct alloconly_pool *apool,
+				      const char *name)
+{
+	struct pool_block *block;
+
+	if (strncmp(name, MEMPOOL_GROWING, strlen(MEMPOOL_GROWING)) == 0)
+		name += strlen(MEMPOOL_GROWING);
+	apool->stats = mempool_stats_pool_created(name);
+	for (block = apool->block; block != NULL; block = block->prev)
+		apool->stats_alloc_size += SIZEOF_POOLBLOCK + block->size;
+	mempool_stats_pool_resized(apool->stats, 0, apool->stats_alloc_size);
+}
+
+static void
+pool_alloconly_stats_update(struct alloconly_pool *apool, size_t new_size)
+{
+	mempool_stats_pool_resized(apool->stats, apool->stats_alloc_size,
+				   new_size);
+	apool->stats_alloc_size = new_size;
+}
+
+pool_t pool_alloconly_create(const char *name, size_t size)
 {
 	struct alloconly_pool apool, *new_apool;
 	size_t min_alloc = SIZEOF_POOLBLOCK +
@@ -157,6 +183,9 @@ pool_t pool_alloconly_create(const char *name ATTR_UNUSED, size_t size)
 	/* the first pool allocations must be from the first block */
 	i_assert(new_apool->block->prev == NULL);
 
+	if (unlikely(mempool_stats_enabled))
+		pool_alloconly_stats_init(new_apool, name);
+
 	return &new_apool->pool;
 }
 
@@ -178,6 +207,9 @@ static void pool_alloconly_destroy(struct alloconly_pool *apool)
 	/* destroy all but the last block */
 	pool_alloconly_clear(&apool->pool);
 
+	if (apool->stats != NULL)
+		mempool_stats_pool_destroyed(apool->stats, apool->stats_alloc_size);
+
 	/* destroy the last block */
 	block = apool->block;
 #ifdef DEBUG
@@ -264,6 +296,9 @@ static void block_alloc(struct alloconly_pool *apool, size_t size)
 
 	block->size = size - SIZEOF_POOLBLOCK;
 	block->left = block->size;
+
+	if (apool->stats != NULL)
+		pool_alloconly_stats_update(apool, apool->stats_alloc_size + size);
 }
 
 static void *pool_alloconly_malloc(pool_t pool, size_t size)
@@ -377,6 +412,11 @@ static void pool_alloconly_clear(pool_t pool)
 	while (apool->block->prev != NULL) {
 		block = apool->block;
 		apool->block = block->prev;
+		if (apool->stats != NULL) {
+			pool_alloconly_stats_update(apool,
+				apool->stats_alloc_size -
+				(SIZEOF_POOLBLOCK + block->size));
+		}
 
 #ifdef DEBUG
 		safe_memset(block, CLEAR_CHR, SIZEOF_POOLBLOCK + block->size);
@@ -0,0 +1,377 @@
+/* Copyright (c) 2017 Dovecot authors, see the included COPYING file */
+
+/* @UNSAFE: whole file */
+#include "lib.h"
+#include "safe-memset.h"
+#include "mempool.h"
+
+#ifdef HAVE_GC_GC_H
+#  include <gc/gc.h>
+#elif defined (HAVE_GC_H)
+#  include <gc.h>
+#endif
+
+/* Allocations are rounded up to a multiple of this. Each rounded size has
+   its own size class and free list. */
+#define SLAB_CLASS_GRANULARITY 16
+#define SLAB_CLASS_COUNT 64
+#define SLAB_MAX_OBJECT_SIZE (SLAB_CLASS_COUNT * SLAB_CLASS_GRANULARITY)
+/* Larger allocations are forwarded to malloc() */
+#define SLAB_CLASS_LARGE SLAB_CLASS_COUNT
+
+/* Objects are carved out of slabs of this size. */
+#define SLAB_SIZE (16*1024)
+
+#ifdef DEBUG
+#  define CLEAR_CHR 0xde
+#endif
+
+/* Each object is preceded by a header containing its size class. */
+struct slab_object_header {
+	unsigned int class_idx;
+};
+#define SIZEOF_SLAB_OBJECT_HEADER \
+	MEM_ALIGN(sizeof(struct slab_object_header))
+
+/* Large objects additionally have their own header before the object
+   header, so they can be freed when the pool is destroyed. */
+struct slab_large_header {
+	struct slab_large_header *prev, *next;
+	size_t size;
+};
+#define SIZEOF_SLAB_LARGE_HEADER MEM_ALIGN(sizeof(struct slab_large_header))
+
+struct slab {
+	struct slab *next;
+	/* unsigned char data[]; */
+};
+#define SIZEOF_SLAB MEM_ALIGN(sizeof(struct slab))
+
+struct slab_free_object {
+	struct slab_free_object *next;
+};
+
+struct slab_class {
+	/* freed objects that can be reused */
+	struct slab_free_object *free_list;
+	/* never used objects left in the newest slab */
+	unsigned char *slab_pos, *slab_end;
+};
+
+struct slab_pool {
+	struct pool pool;
+	int refcount;
+	char *name;
+
+	struct slab_class classes[SLAB_CLASS_COUNT];
+	struct slab *slabs;
+	struct slab_large_header *large_objects;
+
+	struct pool_slab_stats stats;
+};
+
+static const char *pool_slab_get_name(pool_t pool);
+static void pool_slab_ref(pool_t pool);
+static void pool_slab_unref(pool_t *pool);
+static void *pool_slab_malloc(pool_t pool, size_t size);
+static void pool_slab_free(pool_t pool, void *mem);
+static void *pool_slab_realloc(pool_t pool, void *mem,
+			       size_t old_size, size_t new_size);
+static void pool_slab_clear(pool_t pool);
+static size_t pool_slab_get_max_easy_alloc_size(pool_t pool);
+
+static const struct pool_vfuncs static_slab_pool_vfuncs = {
+	pool_slab_get_name,
+
+	pool_slab_ref,
+	pool_slab_unref,
+
+	pool_slab_malloc,
+	pool_slab_free,
+
+	pool_slab_realloc,
+
+	pool_slab_clear,
+	pool_slab_get_max_easy_alloc_size
+};
+
+static const struct pool static_slab_pool = {
+	.v = &static_slab_pool_vfuncs,
+
+	.alloconly_pool = FALSE,
+	.datastack_pool = FALSE
+};
+
+static void *slab_sys_malloc(size_t size)
+{
+	void *mem;
+
+#ifndef USE_GC
+	mem = calloc(size, 1);
+#else
+	mem = GC_malloc(size);
+#endif
+	if (unlikely(mem == NULL)) {
+		i_fatal_status(FATAL_OUTOFMEM, "pool_slab_malloc(%"PRIuSIZE_T
+			       "): Out of memory", size);
+	}
+	return mem;
+}
+
+static void slab_sys_free(void *mem ATTR_UNUSED)
+{
+#ifndef USE_GC
+	free(mem);
+#endif
+}
+
+pool_t pool_slab_create(const char *name)
+{
+	struct slab_pool *spool;
+
+	spool = i_new(struct slab_pool, 1);
+	spool->pool = static_slab_pool;
+	spool->refcount = 1;
+	spool->name = i_strdup(name);
+	return &spool->pool;
+}
+
+static const char *pool_slab_get_name(pool_t pool)
+{
+	struct slab_pool *spool = (struct slab_pool *)pool;
+
+	return spool->name;
+}
+
+static void pool_slab_ref(pool_t pool)
+{
+	struct slab_pool *spool = (struct slab_pool *)pool;
+
+	spool->refcount++;
+}
+
+static void pool_slab_unref(pool_t *pool)
+{
+	struct slab_pool *spool = (struct slab_pool *)*pool;
+
+	*pool = NULL;
+	if (--spool->refcount > 0)
+		return;
+
+	pool_slab_clear(&spool->pool);
+	i_free(spool->name);
+	i_free(spool);
+}
+
+static size_t slab_class_object_size(unsigned int class_idx)
+{
+	return (class_idx + 1) * SLAB_CLASS_GRANULARITY;
+}
+
+static void slab_alloc(struct slab_pool *spool, struct slab_class *class,
+		       size_t stride)
+{
+	struct slab *slab;
+
+	slab = slab_sys_malloc(SLAB_SIZE);
+	slab->next = spool->slabs;
+	spool->slabs = slab;
+	spool->stats.alloc_size += SLAB_SIZE;
+
+	/* the rest of the previous slab is wasted */
+	class->slab_pos = (unsigned char *)slab + SIZEOF_SLAB;
+	class->slab_end = class->slab_pos +
+		(SLAB_SIZE - SIZEOF_SLAB) / stride * stride;
+}
+
+static void *pool_slab_malloc_large(struct slab_pool *spool, size_t size)
+{
+	struct slab_large_header *large;
+	struct slab_object_header *hdr;
+	size_t alloc_size;
+
+	alloc_size = SIZEOF_SLAB_LARGE_HEADER + SIZEOF_SLAB_OBJECT_HEADER + size;
+	large = slab_sys_malloc(alloc_size);
+	large->size = size;
+	large->next = spool->large_objects;
+	if (large->next != NULL)
+		large->next->prev = large;
+	spool->large_objects = large;
+
+	hdr = PTR_OFFSET(large, SIZEOF_SLAB_LARGE_HEADER);
+	hdr->class_idx = SLAB_CLASS_LARGE;
+
+	spool->stats.large_alloc_count++;
+	spool->stats.used_size += size;
+	spool->stats.alloc_size += alloc_size;
+	return PTR_OFFSET(hdr, SIZEOF_SLAB_OBJECT_HEADER);
+}
+
+static void *pool_slab_malloc(pool_t pool, size_t size)
+{
+	struct slab_pool *spool = (struct slab_pool *)pool;
+	struct slab_class *class;
+	struct slab_object_header *hdr;
+	unsigned int class_idx;
+	size_t object_size, stride;
+	void *mem;
+
+	if (unlikely(size == 0 || size > SSIZE_T_MAX))
+		i_panic("Trying to allocate %"PRIuSIZE_T" bytes", size);
+
+	spool->stats.alloc_count++;
+	if (size > SLAB_MAX_OBJECT_SIZE)
+		return pool_slab_malloc_large(spool, size);
+
+	class_idx = (size - 1) / SLAB_CLASS_GRANULARITY;
+	class = &spool->classes[class_idx];
+	object_size = slab_class_object_size(class_idx);
+	spool->stats.used_size += object_size;
+
+	if (class->free_list != NULL) {
+		mem = class->free_list;
+		class->free_list = class->free_list->next;
+		memset(mem, 0, object_size);
+		spool->stats.reuse_count++;
+		return mem;
+	}
+
+	stride = SIZEOF_SLAB_OBJECT_HEADER + object_size;
+	if (class->slab_pos == class->slab_end)
+		slab_alloc(spool, class, stride);
+	hdr = (struct slab_object_header *)class->slab_pos;
+	class->slab_pos += stride;
+
+	hdr->class_idx = class_idx;
+	return PTR_OFFSET(hdr, SIZEOF_SLAB_OBJECT_HEADER);
+}
+
+static struct slab_object_header *slab_object_get_header(void *mem)
+{
+	return (struct slab_object_header *)
+		((unsigned char *)mem - SIZEOF_SLAB_OBJECT_HEADER);
+}
+
+static struct slab_large_header *slab_object_get_large_header(void *mem)
+{
+	return (struct slab_large_header *)
+		((unsigned char *)mem - SIZEOF_SLAB_OBJECT_HEADER -
+		 SIZEOF_SLAB_LARGE_HEADER);
+}
+
+static void pool_slab_free(pool_t pool, void *mem)
+{
+	struct slab_pool *spool = (struct slab_pool *)pool;
+	struct slab_object_header *hdr;
+	struct slab_large_header *large;
+	struct slab_free_object *obj = mem;
+	unsigned int class_idx;
+
+	if (mem == NULL)
+		return;
+
+	hdr = slab_object_get_header(mem);
+	class_idx = hdr->class_idx;
+	spool->stats.free_count++;
+	if (class_idx == SLAB_CLASS_LARGE) {
+		large = slab_object_get_large_header(mem);
+		if (large->prev != NULL)
+			large->prev->next = large->next;
+		else
+			spool->large_objects = large->next;
+		if (large->next != NULL)
+			large->next->prev = large->prev;
+		spool->stats.used_size -= large->size;
+		spool->stats.alloc_size -= SIZEOF_SLAB_LARGE_HEADER +
+			SIZEOF_SLAB_OBJECT_HEADER + large->size;
+#ifdef DEBUG
+		safe_memset(mem, CLEAR_CHR, large->size);
+#endif
+		slab_sys_free(large);
+		return;
+	}
+
+	i_assert(class_idx < SLAB_CLASS_COUNT);
+#ifdef DEBUG
+	safe_memset(mem, CLEAR_CHR, slab_class_object_size(class_idx));
+#endif
+	spool->stats.used_size -= slab_class_object_size(class_idx);
+	obj->next = spool->classes[class_idx].free_list;
+	spool->classes[class_idx].free_list = obj;
+}
+
+static size_t slab_object_get_size(void *mem)
+{
+	struct slab_object_header *hdr = slab_object_get_header(mem);
+
+	if (hdr->class_idx == SLAB_CLASS_LARGE)
+		return slab_object_get_large_header(mem)->size;
+	return slab_class_object_size(hdr->class_idx);
+}
+
+static void *pool_slab_realloc(pool_t pool, void *mem,
+			       size_t old_size, size_t new_size)
+{
+	size_t alloc_size;
+	void *new_mem;
+
+	if (unlikely(new_size == 0 || new_size > SSIZE_T_MAX))
+		i_panic("Trying to allocate %"PRIuSIZE_T" bytes", new_size);
+
+	if (mem == NULL)
+		return pool_slab_malloc(pool, new_size);
+
+	alloc_size = slab_object_get_size(mem);
+	i_assert(old_size == (size_t)-1 || old_size <= alloc_size);
+	if (new_size <= alloc_size) {
+		/* fits into the existing object */
+		if (old_size < new_size) {
+			memset((unsigned char *)mem + old_size, 0,
+			       new_size - old_size);
+		}
+		return mem;
+	}
+
+	new_mem = pool_slab_malloc(pool, new_size);
+	memcpy(new_mem, mem, I_MIN(old_size, alloc_size));
+	pool_slab_free(pool, mem);
+	return new_mem;
+}
+
+static void pool_slab_clear(pool_t pool)
+{
+	struct slab_pool *spool = (struct slab_pool *)pool;
+	struct slab *slab;
+	struct slab_large_header *large;
+
+	while (spool->slabs != NULL) {
+		slab = spool->slabs;
+		spool->slabs = slab->next;
+#ifdef DEBUG
+		safe_memset(slab, CLEAR_CHR, SLAB_SIZE);
+#endif
+		slab_sys_free(slab);
+	}
+	while (spool->large_objects != NULL) {
+		large = spool->large_objects;
+		spool->large_objects = large->next;
+		slab_sys_free(large);
+	}
+	memset(spool->classes, 0, sizeof(spool->classes));
+	spool->stats.used_size = 0;
+	spool->stats.alloc_size = 0;
+}
+
+static size_t pool_slab_get_max_easy_alloc_size(pool_t pool ATTR_UNUSED)
+{
+	return 0;
+}
+
+void pool_slab_get_stats(pool_t pool, struct pool_slab_stats *stats_r)
+{
+	struct slab_pool *spool = (struct slab_pool *)pool;
+
+	i_assert(pool->v == &static_slab_pool_vfuncs);
+
+	*stats_r = spool->stats;
+}
@@ -0,0 +1,212 @@
+/* Copyright (c) 2017 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "hash.h"
+#include "str.h"
+#include "mempool-stats.h"
+
+bool mempool_stats_enabled = FALSE;
+
+static HASH_TABLE(char *, struct mempool_stats_entry *) pool_entries;
+static HASH_TABLE(char *, struct mempool_stats_entry *) frame_entries;
+
+void mempool_stats_set_enabled(bool enabled)
+{
+	if (enabled && !hash_table_is_created(pool_entries)) {
+		hash_table_create(&pool_entries, default_pool, 0,
+				  str_hash, strcmp);
+		hash_table_create(&frame_entries, default_pool, 0,
+				  str_hash, strcmp);
+	}
+	mempool_stats_enabled = enabled;
+}
+
+static struct mempool_stats_entry *
+mempool_stats_entry_get(enum mempool_stats_type type, const char *name)
+{
+	struct mempool_stats_entry *entry;
+
+	entry = type == MEMPOOL_STATS_TYPE_ALLOCONLY ?
+		hash_table_lookup(pool_entries, name) :
+		hash_table_lookup(frame_entries, name);
+	if (entry != NULL)
+		return entry;
+
+	entry = i_new(struct mempool_stats_entry, 1);
+	entry->type = type;
+	entry->name = i_strdup(name);
+	if (type == MEMPOOL_STATS_TYPE_ALLOCONLY)
+		hash_table_insert(pool_entries, entry->name, entry);
+	else
+		hash_table_insert(frame_entries, entry->name, entry);
+	return entry;
+}
+
+struct mempool_stats_entry *mempool_stats_pool_created(const char *name)
+{
+	struct mempool_stats_entry *entry;
+
+	i_assert(mempool_stats_enabled);
+
+	entry = mempool_stats_entry_get(MEMPOOL_STATS_TYPE_ALLOCONLY, name);
+	entry->pool_count++;
+	entry->total_count++;
+	return entry;
+}
+
+void mempool_stats_pool_resized(struct mempool_stats_entry *entry,
+				size_t old_pool_size, size_t new_pool_size)
+{
+	/* Pools created while stats were enabled are tracked until they're
+	   destroyed, even if stats were disabled afterwards. Otherwise their
+	   counters would never go back down. The entries exist until
+	   mempool_stats_deinit(). */
+	if (!hash_table_is_created(pool_entries))
+		return;
+
+	i_assert(entry->current_size >= old_pool_size);
+	entry->current_size = entry->current_size - old_pool_size +
+		new_pool_size;
+	if (entry->peak_size < entry->current_size)
+		entry->peak_size = entry->current_size;
+	if (entry->max_single_size < new_pool_size)
+		entry->max_single_size = new_pool_size;
+}
+
+void mempool_stats_pool_destroyed(struct mempool_stats_entry *entry,
+				  size_t pool_size)
+{
+	if (!hash_table_is_created(pool_entries))
+		return;
+
+	mempool_stats_pool_resized(entry, pool_size, 0);
+	i_assert(entry->pool_count > 0);
+	entry->pool_count--;
+}
+
+void mempool_stats_data_stack_frame(const char *marker, size_t peak_size)
+{
+	struct mempool_stats_entry *entry;
+
+	if (peak_size == 0)
+		return;
+	if (marker == NULL)
+		marker = "(unnamed)";
+
+	entry = mempool_stats_entry_get(MEMPOOL_STATS_TYPE_DATA_STACK, marker);
+	entry->total_count++;
+	if (entry->max_single_size < peak_size) {
+		entry->max_single_size = peak_size;
+		entry->peak_size = peak_size;
+	}
+}
+
+static int
+mempool_stats_entry_cmp(struct mempool_stats_entry *const *e1,
+			struct mempool_stats_entry *const *e2)
+{
+	if ((*e1)->peak_size > (*e2)->peak_size)
+		return -1;
+	if ((*e1)->peak_size < (*e2)->peak_size)
+		return 1;
+	return strcmp((*e1)->name, (*e2)->name);
+}
+
+void mempool_stats_get_entries(ARRAY_TYPE(mempool_stats_entry) *entries)
+{
+	struct hash_iterate_context *iter;
+	struct mempool_stats_entry *entry;
+	char *name;
+
+	if (!hash_table_is_created(pool_entries))
+		return;
+
+	iter = hash_table_iterate_init(pool_entries);
+	while (hash_table_iterate(iter, pool_entries, &name, &entry))
+		array_append(entries, &entry, 1);
+	hash_table_iterate_deinit(&iter);
+
+	iter = hash_table_iterate_init(frame_entries);
+	while (hash_table_iterate(iter, frame_entries, &name, &entry))
+		array_append(entries, &entry, 1);
+	hash_table_iterate_deinit(&iter);
+
+	array_sort(entries, mempool_stats_entry_cmp);
+}
+
+void mempool_stats_dump(string_t *dest, unsigned int max_entries)
+{
+	ARRAY_TYPE(mempool_stats_entry) entries;
+	struct mempool_stats_entry *const *entryp;
+	unsigned int count = 0;
+
+	i_array_init(&entries, 64);
+	mempool_stats_get_entries(&entries);
+	array_foreach(&entries, entryp) {
+		const struct mempool_stats_entry *entry = *entryp;
+
+		if (count++ == max_entries)
+			break;
+		switch (entry->type) {
+		case MEMPOOL_STATS_TYPE_ALLOCONLY:
+			str_printfa(dest, "pool %s: count=%u/%llu "
+				    "current=%"PRIuSIZE_T" peak=%"PRIuSIZE_T
+				    " max_single=%"PRIuSIZE_T"\n",
+				    entry->name, entry->pool_count,
+				    (unsigned long long)entry->total_count,
+				    entry->current_size, entry->peak_size,
+				    entry->max_single_size);
+			break;
+		case MEMPOOL_STATS_TYPE_DATA_STACK:
+			str_printfa(dest, "data stack %s: frames=%llu "
+				    "peak=%"PRIuSIZE_T"\n", entry->name,
+				    (unsigned long long)entry->total_count,
+				    entry->peak_size);
+			break;
+		}
+	}
+	array_free(&entries);
+}
+
+void mempool_stats_log(unsigned int max_entries)
+{
+	const char *const *lines;
+	string_t *str;
+
+	T_BEGIN {
+		str = t_str_new(1024);
+		mempool_stats_dump(str, max_entries);
+		lines = t_strsplit(str_c(str), "\n");
+		for (; *lines != NULL; lines++) {
+			if (**lines != '\0')
+				i_info("Memory usage: %s", *lines);
+		}
+	} T_END;
+}
+
+void mempool_stats_deinit(void)
+{
+	struct hash_iterate_context *iter;
+	struct mempool_stats_entry *entry;
+	char *name;
+
+	mempool_stats_enabled = FALSE;
+	if (!hash_table_is_created(pool_entries))
+		return;
+
+	iter = hash_table_iterate_init(pool_entries);
+	while (hash_table_iterate(iter, pool_entries, &name, &entry)) {
+		i_free(entry->name);
+		i_free(entry);
+	}
+	hash_table_iterate_deinit(&iter);
+	iter = hash_table_iterate_init(frame_entries);
+	while (hash_table_iterate(iter, frame_entries, &name, &entry)) {
+		i_free(entry->name);
+		i_free(entry);
+	}
+	hash_table_iterate_deinit(&iter);
+	hash_table_destroy(&pool_entries);
+	hash_table_destroy(&frame_entries);
+}
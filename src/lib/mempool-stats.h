@@ -0,0 +1,61 @@
+#ifndef MEMPOOL_STATS_H
+#define MEMPOOL_STATS_H
+
+#include "array-decl.h"
+
+/* Opt-in accounting of the memory used by named alloconly pools and data
+   stack frames. Pools are grouped by their name and data stack frames by
+   their T_BEGIN/t_push_named() marker. This is enabled by
+   mempool_stats_set_enabled() or by setting DEBUG_MEMPOOL_STATS environment
+   variable before lib_init(). Only the pools created while it's enabled are
+   tracked, but they're tracked until they're destroyed even if stats are
+   disabled in the meantime. */
+
+enum mempool_stats_type {
+	MEMPOOL_STATS_TYPE_ALLOCONLY,
+	MEMPOOL_STATS_TYPE_DATA_STACK
+};
+
+struct mempool_stats_entry {
+	enum mempool_stats_type type;
+	/* Pool name or data stack frame marker */
+	char *name;
+
+	/* Alloconly pools: Number of currently existing pools and the
+	   system memory currently allocated for them. */
+	unsigned int pool_count;
+	size_t current_size;
+	/* Highest current_size so far. For data stack frames this is the
+	   same as max_single_size. */
+	size_t peak_size;
+	/* Highest memory usage of a single pool or data stack frame */
+	size_t max_single_size;
+	/* Number of pools created or data stack frames popped */
+	uint64_t total_count;
+};
+ARRAY_DEFINE_TYPE(mempool_stats_entry, struct mempool_stats_entry *);
+
+extern bool mempool_stats_enabled;
+
+void mempool_stats_set_enabled(bool enabled);
+
+/* Append all the entries to the array, sorted by peak_size (largest
+   first). */
+void mempool_stats_get_entries(ARRAY_TYPE(mempool_stats_entry) *entries);
+/* Append a report of the max_entries largest entries to dest, one line
+   for each entry. */
+void mempool_stats_dump(string_t *dest, unsigned int max_entries);
+/* Log the report with i_info(). */
+void mempool_stats_log(unsigned int max_entries);
+
+/* private: */
+struct mempool_stats_entry *mempool_stats_pool_created(const char *name);
+void mempool_stats_pool_resized(struct mempool_stats_entry *entry,
+				size_t old_pool_size, size_t new_pool_size);
+void mempool_stats_pool_destroyed(struct mempool_stats_entry *entry,
+				  size_t pool_size);
+void mempool_stats_data_stack_frame(const char *marker, size_t peak_size);
+
+void mempool_stats_deinit(void);
+
+#endif
@@ -63,6 +63,14 @@ pool_t pool_alloconly_create(const char *name, size_t size);
    needed. */
 pool_t pool_alloconly_create_clean(const char *name, size_t size);
 
+/* Create a new pool that keeps freed memory in per-size free lists and
+   reuses it for the following allocations of the same size. This is useful
+   for objects that are allocated and freed often, such as connection
+   structs. Small allocations are carved out of larger slabs, which are
+   freed only when the pool is cleared or destroyed. So the pool's memory
+   usage never shrinks below its peak usage until then. */
+pool_t pool_slab_create(const char *name);
+
 /* When allocating memory from returned pool, the data stack frame must be
    the same as it was when calling this function. pool_unref() also checks
    that the stack frame is the same. This should make it quite safe to use. */
@@ -134,6 +142,25 @@ size_t pool_alloconly_get_total_used_size(pool_t pool);
 /* Returns how much system memory has been allocated for this pool. */
 size_t pool_alloconly_get_total_alloc_size(pool_t pool);
 
+struct pool_slab_stats {
+	/* Number of p_malloc() calls */
+	uint64_t alloc_count;
+	/* Number of allocations that reused previously freed memory */
+	uint64_t reuse_count;
+	/* Number of allocations that were too large for slabs */
+	uint64_t large_alloc_count;
+	/* Number of p_free() calls */
+	uint64_t free_count;
+
+	/* Bytes currently allocated, rounded up to the size class */
+	size_t used_size;
+	/* Bytes currently allocated from the system */
+	size_t alloc_size;
+};
+
+/* Returns statistics for a pool created with pool_slab_create(). */
+void pool_slab_get_stats(pool_t pool, struct pool_slab_stats *stats_r);
+
 /* private: */
 void pool_system_free(pool_t pool, void *mem);
 
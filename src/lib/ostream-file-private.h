@@ -18,6 +18,7 @@ struct file_ostream {
 	unsigned char *buffer; /* ring-buffer */
 	size_t buffer_size, optimal_block_size;
 	size_t head, tail; /* first unsent/unused byte */
+	int splice_pipe[2];
 
 	bool full:1; /* if head == tail, is buffer empty or full? */
 	bool file:1;
@@ -25,6 +26,7 @@ struct file_ostream {
 	bool socket_cork_set:1;
 	bool no_socket_cork:1;
 	bool no_sendfile:1;
+	bool no_splice:1;
 	bool autoclose_fd:1;
 };
 
@@ -4,11 +4,14 @@
 
 #include "lib.h"
 #include "ioloop.h"
+#include "read-full.h"
 #include "write-full.h"
 #include "net.h"
+#include "fd-set-nonblock.h"
+#include "fd-close-on-exec.h"
 #include "sendfile-util.h"
 #include "istream.h"
-#include "istream-private.h"
+#include "istream-file-private.h"
 #include "ostream-file-private.h"
 
 #include <unistd.h>
@@ -21,6 +24,9 @@
    128k as optimal size. */
 #define DEFAULT_OPTIMAL_BLOCK_SIZE IO_BLOCK_SIZE
 #define MAX_OPTIMAL_BLOCK_SIZE (128*1024)
+/* maximum number of bytes to move through the splice() pipe at once.
+   This fits into the default Linux pipe buffer. */
+#define MAX_SPLICE_SIZE (64*1024)
 
 #define IS_STREAM_EMPTY(fstream) \
 	((fstream)->head == (fstream)->tail && !(fstream)->full)
@@ -63,6 +69,10 @@ static void o_stream_file_destroy(struct iostream_private *stream)
 {
 	struct file_ostream *fstream = (struct file_ostream *)stream;
 
+	if (fstream->splice_pipe[0] != -1) {
+		i_close_fd(&fstream->splice_pipe[0]);
+		i_close_fd(&fstream->splice_pipe[1]);
+	}
 	i_free(fstream->buffer);
 }
 
@@ -786,6 +796,165 @@ io_stream_sendfile(struct ostream_private *outstream,
 	return TRUE;
 }
 
+#ifdef HAVE_LINUX_SPLICE
+static int
+io_stream_splice_out(struct file_ostream *foutstream, size_t *pipe_used)
+{
+	struct ostream_private *outstream = &foutstream->ostream;
+	ssize_t ret;
+
+	while (*pipe_used > 0) {
+		ret = safe_splice(foutstream->splice_pipe[0],
+				  foutstream->fd, *pipe_used);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return 0;
+			if (errno == EINVAL) {
+				/* splice() not supported for the output fd */
+				foutstream->no_splice = TRUE;
+				return 0;
+			}
+			io_stream_set_error(&outstream->iostream,
+					    "splice() failed: %m");
+			outstream->ostream.stream_errno = errno;
+			stream_closed(foutstream);
+			return -1;
+		}
+		*pipe_used -= ret;
+		foutstream->real_offset += ret;
+		foutstream->buffer_offset += ret;
+		outstream->ostream.offset += ret;
+	}
+	return 1;
+}
+
+static int io_stream_splice_unblock(struct file_ostream *foutstream,
+				    size_t pipe_used)
+{
+	unsigned char *data;
+	size_t max_buffer_size, added;
+	ssize_t ret;
+
+	/* the output can't be written to, but there's still data in the
+	   pipe. it can't be left there, because anything sent later to the
+	   ostream would go through the buffer. move it to the buffer
+	   instead. */
+	data = i_malloc(pipe_used);
+	ret = read_full(foutstream->splice_pipe[0], data, pipe_used);
+	if (ret <= 0) {
+		/* shouldn't happen */
+		io_stream_set_error(&foutstream->ostream.iostream,
+				    "read(splice pipe) failed: %m");
+		foutstream->ostream.ostream.stream_errno = errno;
+		stream_closed(foutstream);
+		i_free(data);
+		return -1;
+	}
+	/* the buffer is empty now, but the data may still be larger than
+	   max_buffer_size. it was already read from the input, so it must be
+	   buffered anyway. */
+	max_buffer_size = foutstream->ostream.max_buffer_size;
+	if (foutstream->ostream.max_buffer_size < pipe_used)
+		foutstream->ostream.max_buffer_size = pipe_used;
+	added = o_stream_add(foutstream, data, pipe_used);
+	foutstream->ostream.max_buffer_size = max_buffer_size;
+	i_assert(added == pipe_used);
+	foutstream->ostream.ostream.offset += pipe_used;
+	i_free(data);
+	return 0;
+}
+
+static bool
+io_stream_splice(struct ostream_private *outstream,
+		 struct istream *instream, int in_fd,
+		 enum ostream_send_istream_result *res_r)
+{
+	struct file_ostream *foutstream = (struct file_ostream *)outstream;
+	struct file_istream *finstream =
+		(struct file_istream *)instream->real_stream;
+	struct const_iovec iov;
+	const unsigned char *data;
+	size_t size, pipe_used;
+	ssize_t ret;
+
+	if (foutstream->splice_pipe[0] == -1) {
+		if (pipe(foutstream->splice_pipe) < 0) {
+			foutstream->splice_pipe[0] = -1;
+			foutstream->splice_pipe[1] = -1;
+			return FALSE;
+		}
+		fd_set_nonblock(foutstream->splice_pipe[0], TRUE);
+		fd_set_nonblock(foutstream->splice_pipe[1], TRUE);
+		fd_close_on_exec(foutstream->splice_pipe[0], TRUE);
+		fd_close_on_exec(foutstream->splice_pipe[1], TRUE);
+	}
+
+	/* send the data already read to the istream's buffer */
+	data = i_stream_get_data(instream, &size);
+	if (size > 0) {
+		iov.iov_base = data;
+		iov.iov_len = size;
+		ret = o_stream_file_sendv(outstream, &iov, 1);
+		if (ret < 0) {
+			*res_r = OSTREAM_SEND_ISTREAM_RESULT_ERROR_OUTPUT;
+			return TRUE;
+		}
+		i_stream_skip(instream, ret);
+		if ((size_t)ret < size) {
+			*res_r = OSTREAM_SEND_ISTREAM_RESULT_WAIT_OUTPUT;
+			return TRUE;
+		}
+	}
+
+	/* flush out any data in buffer */
+	if ((ret = buffer_flush(foutstream)) < 0) {
+		*res_r = OSTREAM_SEND_ISTREAM_RESULT_ERROR_OUTPUT;
+		return TRUE;
+	} else if (ret == 0) {
+		*res_r = OSTREAM_SEND_ISTREAM_RESULT_WAIT_OUTPUT;
+		return TRUE;
+	}
+
+	for (;;) {
+		ret = safe_splice(in_fd, foutstream->splice_pipe[1],
+				  MAX_SPLICE_SIZE);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && errno == EINVAL) {
+			/* splice() not supported for the input fd */
+			return FALSE;
+		}
+		if (ret <= 0) {
+			/* EOF, no more input available or an error. let the
+			   istream handle these. */
+			*res_r = io_stream_copy(&outstream->ostream, instream);
+			return TRUE;
+		}
+		/* skip over the data in the istream. it's a plain fd istream
+		   that isn't seekable and its buffer is empty, so only the
+		   offset needs updating. */
+		i_assert(finstream->skip_left == 0);
+		i_assert(i_stream_get_data_size(instream) == 0);
+		instream->v_offset += ret;
+		pipe_used = ret;
+
+		if ((ret = io_stream_splice_out(foutstream, &pipe_used)) < 0) {
+			*res_r = OSTREAM_SEND_ISTREAM_RESULT_ERROR_OUTPUT;
+			return TRUE;
+		}
+		if (ret == 0) {
+			if (io_stream_splice_unblock(foutstream, pipe_used) < 0)
+				*res_r = OSTREAM_SEND_ISTREAM_RESULT_ERROR_OUTPUT;
+			else
+				*res_r = OSTREAM_SEND_ISTREAM_RESULT_WAIT_OUTPUT;
+			return TRUE;
+		}
+	}
+}
+#endif
+
 static enum ostream_send_istream_result
 io_stream_copy_backwards(struct ostream_private *outstream,
 			 struct istream *instream, uoff_t in_size)
@@ -926,6 +1095,21 @@ o_stream_file_send_istream(struct ostream_private *outstream,
 		foutstream->no_sendfile = TRUE;
 	}
 
+#ifdef HAVE_LINUX_SPLICE
+	/* splice() only directly from non-seekable istream-file fds (sockets,
+	   pipes). other istreams, including ones built on top of istream-file,
+	   may keep their own state that the splicing would bypass. */
+	if (!foutstream->no_splice && in_fd != -1 &&
+	    in_fd != foutstream->fd && !foutstream->file &&
+	    !instream->seekable &&
+	    instream->real_stream->read == i_stream_file_read &&
+	    foutstream->writev == o_stream_file_writev) {
+		if (io_stream_splice(outstream, instream, in_fd, &res))
+			return res;
+		foutstream->no_splice = TRUE;
+	}
+#endif
+
 	same_stream = i_stream_get_fd(instream) == foutstream->fd &&
 		foutstream->fd != -1;
 	if (!same_stream)
@@ -948,6 +1132,7 @@ o_stream_create_file_common(struct file_ostream *fstream,
 	struct ostream *ostream;
 
 	fstream->fd = fd;
+	fstream->splice_pipe[0] = fstream->splice_pipe[1] = -1;
 	fstream->autoclose_fd = autoclose_fd;
 	fstream->optimal_block_size = DEFAULT_OPTIMAL_BLOCK_SIZE;
 
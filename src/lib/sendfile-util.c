@@ -8,6 +8,10 @@
 #ifdef HAVE_LINUX_SENDFILE
 #  undef _FILE_OFFSET_BITS
 #endif
+#ifdef HAVE_LINUX_SPLICE
+#  define _GNU_SOURCE /* for splice() */
+#  include <fcntl.h>
+#endif
 
 #include "lib.h"
 #include "sendfile-util.h"
@@ -141,3 +145,18 @@ ssize_t safe_sendfile(int out_fd ATTR_UNUSED, int in_fd ATTR_UNUSED,
 }
 
 #endif
+
+#ifdef HAVE_LINUX_SPLICE
+ssize_t safe_splice(int in_fd, int out_fd, size_t count)
+{
+	return splice(in_fd, NULL, out_fd, NULL, count,
+		      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+}
+#else
+ssize_t safe_splice(int in_fd ATTR_UNUSED, int out_fd ATTR_UNUSED,
+		    size_t count ATTR_UNUSED)
+{
+	errno = EINVAL;
+	return -1;
+}
+#endif
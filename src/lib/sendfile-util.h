@@ -6,4 +6,9 @@
    large, or there simply is no sendfile()). */
 ssize_t safe_sendfile(int out_fd, int in_fd, uoff_t *offset, size_t count);
 
+/* Move up to count bytes from in_fd to out_fd without blocking using Linux
+   splice(). One of the fds must be a pipe. Returns -1 and errno=EINVAL if
+   it isn't supported for the fds or there is no splice(). */
+ssize_t safe_splice(int in_fd, int out_fd, size_t count);
+
 #endif
@@ -0,0 +1,38 @@
+/* Copyright (c) 2017 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "simd-util.h"
+
+enum simd_features simd_features = 0;
+
+static enum simd_features simd_features_detect(void)
+{
+	enum simd_features features = 0;
+
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		features |= SIMD_FEATURE_SSE2;
+	if (__builtin_cpu_supports("ssse3"))
+		features |= SIMD_FEATURE_SSSE3;
+	if (__builtin_cpu_supports("sse4.2"))
+		features |= SIMD_FEATURE_SSE42;
+	if (__builtin_cpu_supports("avx2"))
+		features |= SIMD_FEATURE_AVX2;
+#if defined(__clang__) || __GNUC__ >= 5
+	if (__builtin_cpu_supports("pclmul"))
+		features |= SIMD_FEATURE_PCLMUL;
+#endif
+#endif
+	return features;
+}
+
+void simd_features_init(void)
+{
+	simd_features = simd_features_detect();
+}
+
+void simd_set_features_mask(enum simd_features mask)
+{
+	simd_features = simd_features_detect() & mask;
+}
@@ -0,0 +1,40 @@
+#ifndef SIMD_UTIL_H
+#define SIMD_UTIL_H
+
+/* x86 SIMD code is compiled using per-function target attributes, so no
+   special compiler flags are needed. The implementation is selected at
+   runtime based on simd_get_features(). */
+#if (defined(__x86_64__) || defined(__i386__)) && \
+	(defined(__clang__) || __GNUC__ > 4 || \
+	 (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#  define HAVE_X86_SIMD
+#  define SIMD_TARGET(name) __attribute__((target(name)))
+#  include <immintrin.h>
+#endif
+
+enum simd_features {
+	SIMD_FEATURE_SSE2	= 0x01,
+	SIMD_FEATURE_SSSE3	= 0x02,
+	SIMD_FEATURE_SSE42	= 0x04,
+	SIMD_FEATURE_AVX2	= 0x08,
+	SIMD_FEATURE_PCLMUL	= 0x10
+};
+
+extern enum simd_features simd_features;
+
+/* Detect the CPU's SIMD features. This is called by lib_init(). */
+void simd_features_init(void);
+
+/* Returns the SIMD instruction sets supported by the CPU. Before lib_init()
+   this returns 0, so only the plain C code is used. */
+static inline enum simd_features simd_get_features(void)
+{
+	return simd_features;
+}
+
+/* Restrict the SIMD instruction sets that are used to the ones in the given
+   mask. 0 disables all SIMD code. This is mainly intended for testing and
+   benchmarking the fallback code. */
+void simd_set_features_mask(enum simd_features mask);
+
+#endif
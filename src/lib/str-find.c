@@ -109,6 +109,7 @@ void str_find_deinit(struct str_find_context **_ctx)
 bool str_find_more(struct str_find_context *ctx,
 		    const unsigned char *data, size_t size)
 {
+	const unsigned char *p;
 	unsigned int key_len = ctx->key_len;
 	unsigned int i, j, a, b;
 	int bad_value;
@@ -141,9 +142,20 @@ bool str_find_more(struct str_find_context *ctx,
 		ctx->match_count = j;
 		j = 0;
 	} else {
-		/* Boyer-Moore searching */
+		/* Boyer-Moore searching. Use memchr() to find the next
+		   position where the key's last character matches. It's
+		   usually much faster than going through the bad character
+		   shifts. */
 		j = 0;
 		while (j + key_len <= size) {
+			p = memchr(data + j + key_len - 1, ctx->key[key_len - 1],
+				   size - (j + key_len - 1));
+			if (p == NULL) {
+				/* no full matches */
+				j = size - key_len + 1;
+				break;
+			}
+			j = p - data - (key_len - 1);
 			i = key_len - 1;
 			while (ctx->key[i] == data[i + j]) {
 				if (i == 0) {
@@ -181,3 +193,251 @@ void str_find_reset(struct str_find_context *ctx)
 {
 	ctx->match_count = 0;
 }
+
+/* Aho-Corasick automaton. The trie is converted into a full DFA, so each
+   input character is handled with a single table lookup. */
+#define STR_FIND_MULTI_ROOT 0
+#define STR_FIND_MULTI_NO_KEY UINT_MAX
+/* Each state uses 1 kB for its transitions. If the keys would need more
+   states than this, search each key separately with str_find instead. */
+#define STR_FIND_MULTI_MAX_STATES 1024
+
+struct str_find_multi_state {
+	/* first key that ends in this state, or STR_FIND_MULTI_NO_KEY */
+	unsigned int key_idx;
+	/* the next state in the failure chain that ends any keys */
+	unsigned int output_link;
+};
+
+struct str_find_multi_context {
+	pool_t pool;
+
+	unsigned int key_count, found_count;
+	/* the next key with the same string as this one */
+	unsigned int *key_next_same;
+	bool *found;
+
+	unsigned int state_count, state;
+	struct str_find_multi_state *states;
+	/* state_count * 256 transitions */
+	unsigned int *next;
+	/* characters that can begin any key */
+	bool start_chars[UCHAR_MAX+1];
+
+	/* if non-NULL, the keys are too long for the DFA and each key is
+	   searched separately */
+	struct str_find_context **key_ctx;
+};
+
+static void str_find_multi_build_dfa(struct str_find_multi_context *ctx)
+{
+	unsigned int *queue, *fail;
+	unsigned int queue_head = 0, queue_tail = 0;
+	unsigned int state, next_state, fail_state, c;
+
+	queue = t_new(unsigned int, ctx->state_count);
+	fail = t_new(unsigned int, ctx->state_count);
+
+	/* breadth-first so that the failure states are always handled
+	   before the states pointing to them */
+	for (c = 0; c <= UCHAR_MAX; c++) {
+		next_state = ctx->next[c];
+		if (next_state != STR_FIND_MULTI_ROOT) {
+			fail[next_state] = STR_FIND_MULTI_ROOT;
+			queue[queue_tail++] = next_state;
+		}
+	}
+	while (queue_head < queue_tail) {
+		state = queue[queue_head++];
+		fail_state = fail[state];
+		if (ctx->states[fail_state].key_idx != STR_FIND_MULTI_NO_KEY)
+			ctx->states[state].output_link = fail_state;
+		else {
+			ctx->states[state].output_link =
+				ctx->states[fail_state].output_link;
+		}
+		for (c = 0; c <= UCHAR_MAX; c++) {
+			next_state = ctx->next[state * (UCHAR_MAX+1) + c];
+			if (next_state == STR_FIND_MULTI_ROOT) {
+				ctx->next[state * (UCHAR_MAX+1) + c] =
+					ctx->next[fail_state * (UCHAR_MAX+1) + c];
+			} else {
+				fail[next_state] =
+					ctx->next[fail_state * (UCHAR_MAX+1) + c];
+				queue[queue_tail++] = next_state;
+			}
+		}
+	}
+}
+
+struct str_find_multi_context *
+str_find_multi_init(pool_t pool, const char *const *keys)
+{
+	struct str_find_multi_context *ctx;
+	unsigned int i, j, state, max_states = 1;
+	unsigned int *next;
+
+	ctx = p_new(pool, struct str_find_multi_context, 1);
+	ctx->pool = pool;
+	ctx->key_count = str_array_length(keys);
+	i_assert(ctx->key_count > 0);
+	for (i = 0; i < ctx->key_count; i++) {
+		i_assert(keys[i][0] != '\0');
+		max_states += strlen(keys[i]);
+	}
+	ctx->found = p_new(pool, bool, ctx->key_count);
+	if (max_states > STR_FIND_MULTI_MAX_STATES) {
+		ctx->key_ctx = p_new(pool, struct str_find_context *,
+				     ctx->key_count);
+		for (i = 0; i < ctx->key_count; i++)
+			ctx->key_ctx[i] = str_find_init(pool, keys[i]);
+		return ctx;
+	}
+	ctx->key_next_same = p_new(pool, unsigned int, ctx->key_count);
+	ctx->states = p_new(pool, struct str_find_multi_state, max_states);
+	ctx->next = p_new(pool, unsigned int,
+			  MALLOC_MULTIPLY(max_states, UCHAR_MAX+1));
+
+	/* build the trie */
+	ctx->state_count = 1;
+	ctx->states[STR_FIND_MULTI_ROOT].key_idx = STR_FIND_MULTI_NO_KEY;
+	for (i = 0; i < ctx->key_count; i++) {
+		const unsigned char *key = (const unsigned char *)keys[i];
+
+		ctx->start_chars[key[0]] = TRUE;
+		state = STR_FIND_MULTI_ROOT;
+		for (j = 0; key[j] != '\0'; j++) {
+			next = &ctx->next[state * (UCHAR_MAX+1) + key[j]];
+			if (*next == STR_FIND_MULTI_ROOT) {
+				*next = ctx->state_count++;
+				ctx->states[*next].key_idx =
+					STR_FIND_MULTI_NO_KEY;
+			}
+			state = *next;
+		}
+		ctx->key_next_same[i] = ctx->states[state].key_idx;
+		ctx->states[state].key_idx = i;
+	}
+	T_BEGIN {
+		str_find_multi_build_dfa(ctx);
+	} T_END;
+	return ctx;
+}
+
+void str_find_multi_deinit(struct str_find_multi_context **_ctx)
+{
+	struct str_find_multi_context *ctx = *_ctx;
+	unsigned int i;
+
+	*_ctx = NULL;
+	if (ctx->key_ctx != NULL) {
+		for (i = 0; i < ctx->key_count; i++)
+			str_find_deinit(&ctx->key_ctx[i]);
+		p_free(ctx->pool, ctx->key_ctx);
+	}
+	p_free(ctx->pool, ctx->next);
+	p_free(ctx->pool, ctx->states);
+	p_free(ctx->pool, ctx->found);
+	p_free(ctx->pool, ctx->key_next_same);
+	p_free(ctx->pool, ctx);
+}
+
+static void
+str_find_multi_found(struct str_find_multi_context *ctx, unsigned int state)
+{
+	unsigned int key_idx;
+
+	for (; state != STR_FIND_MULTI_ROOT;
+	     state = ctx->states[state].output_link) {
+		key_idx = ctx->states[state].key_idx;
+		for (; key_idx != STR_FIND_MULTI_NO_KEY;
+		     key_idx = ctx->key_next_same[key_idx]) {
+			if (!ctx->found[key_idx]) {
+				ctx->found[key_idx] = TRUE;
+				ctx->found_count++;
+			}
+		}
+	}
+}
+
+static bool
+str_find_multi_more_keys(struct str_find_multi_context *ctx,
+			 const unsigned char *data, size_t size)
+{
+	unsigned int i;
+
+	for (i = 0; i < ctx->key_count; i++) {
+		if (!ctx->found[i] &&
+		    str_find_more(ctx->key_ctx[i], data, size)) {
+			ctx->found[i] = TRUE;
+			ctx->found_count++;
+		}
+	}
+	return ctx->found_count == ctx->key_count;
+}
+
+bool str_find_multi_more(struct str_find_multi_context *ctx,
+			 const unsigned char *data, size_t size)
+{
+	const unsigned int *next = ctx->next;
+	unsigned int state = ctx->state;
+	size_t i = 0;
+
+	if (ctx->found_count == ctx->key_count)
+		return TRUE;
+	if (ctx->key_ctx != NULL)
+		return str_find_multi_more_keys(ctx, data, size);
+
+	while (i < size) {
+		if (state == STR_FIND_MULTI_ROOT) {
+			/* skip over characters that can't begin a key */
+			while (!ctx->start_chars[data[i]]) {
+				if (++i == size) {
+					ctx->state = state;
+					return FALSE;
+				}
+			}
+		}
+		state = next[state * (UCHAR_MAX+1) + data[i++]];
+		if (ctx->states[state].key_idx != STR_FIND_MULTI_NO_KEY ||
+		    ctx->states[state].output_link != STR_FIND_MULTI_ROOT) {
+			str_find_multi_found(ctx, state);
+			if (ctx->found_count == ctx->key_count) {
+				ctx->state = state;
+				return TRUE;
+			}
+		}
+	}
+	ctx->state = state;
+	return FALSE;
+}
+
+bool str_find_multi_key_found(struct str_find_multi_context *ctx,
+			      unsigned int key_idx)
+{
+	i_assert(key_idx < ctx->key_count);
+	return ctx->found[key_idx];
+}
+
+unsigned int str_find_multi_get_found_count(struct str_find_multi_context *ctx)
+{
+	return ctx->found_count;
+}
+
+void str_find_multi_reset(struct str_find_multi_context *ctx)
+{
+	unsigned int i;
+
+	ctx->state = STR_FIND_MULTI_ROOT;
+	if (ctx->key_ctx != NULL) {
+		for (i = 0; i < ctx->key_count; i++)
+			str_find_reset(ctx->key_ctx[i]);
+	}
+}
+
+void str_find_multi_clear_found(struct str_find_multi_context *ctx)
+{
+	memset(ctx->found, 0, sizeof(ctx->found[0]) * ctx->key_count);
+	ctx->found_count = 0;
+	str_find_multi_reset(ctx);
+}
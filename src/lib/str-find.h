@@ -2,6 +2,7 @@
 #define STR_FIND_H
 
 struct str_find_context;
+struct str_find_multi_context;
 
 struct str_find_context *str_find_init(pool_t pool, const char *key);
 void str_find_deinit(struct str_find_context **ctx);
@@ -17,4 +18,26 @@ size_t str_find_get_match_end_pos(struct str_find_context *ctx);
    to earlier data. */
 void str_find_reset(struct str_find_context *ctx);
 
+/* Search multiple keys at the same time using a single pass over the data.
+   The keys array is NULL-terminated and it can't contain empty keys. If the
+   keys are too long in total, they're searched one at a time instead to
+   limit the memory usage. */
+struct str_find_multi_context *
+str_find_multi_init(pool_t pool, const char *const *keys);
+void str_find_multi_deinit(struct str_find_multi_context **ctx);
+
+/* Returns TRUE if all the keys have been found. Similarly to str_find_more()
+   the data can be sent in arbitrary blocks. */
+bool str_find_multi_more(struct str_find_multi_context *ctx,
+			 const unsigned char *data, size_t size);
+/* Returns TRUE if the key (index to the keys array given to init) has been
+   found since the last str_find_multi_clear_found(). */
+bool str_find_multi_key_found(struct str_find_multi_context *ctx,
+			      unsigned int key_idx);
+unsigned int str_find_multi_get_found_count(struct str_find_multi_context *ctx);
+/* Reset input data. The keys that were already found stay found. */
+void str_find_multi_reset(struct str_find_multi_context *ctx);
+/* Reset input data and forget about the found keys. */
+void str_find_multi_clear_found(struct str_find_multi_context *ctx);
+
 #endif
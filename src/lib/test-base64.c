@@ -2,6 +2,7 @@
 
 #include "test-lib.h"
 #include "str.h"
+#include "simd-util.h"
 #include "base64.h"
 
 
@@ -101,9 +102,66 @@ static void test_base64_random(void)
 	test_end();
 }
 
+static int
+test_base64_decode_mask(enum simd_features mask, const void *src,
+			size_t src_size, size_t *src_pos_r, buffer_t *dest)
+{
+	int ret;
+
+	simd_set_features_mask(mask);
+	ret = base64_decode(src, src_size, src_pos_r, dest);
+	simd_set_features_mask((enum simd_features)-1);
+	return ret;
+}
+
+static void test_base64_decode_simd(void)
+{
+	static const char b64chars[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	static const char *noise[] = {
+		"\r\n", " ", "\t", "=", "==", "!", "\x80", "A=", "AB=="
+	};
+	static const enum simd_features masks[] = {
+		SIMD_FEATURE_SSE2 | SIMD_FEATURE_SSSE3,
+		(enum simd_features)-1
+	};
+	string_t *input, *expected, *output;
+	size_t expected_pos, output_pos;
+	unsigned int i, j, m, len;
+	int expected_ret, ret;
+
+	test_begin("base64 decode simd");
+	input = t_str_new(512);
+	expected = t_str_new(512);
+	output = t_str_new(512);
+	for (i = 0; i < 5000; i++) {
+		str_truncate(input, 0);
+		len = rand() % 300;
+		for (j = 0; j < len; j++) {
+			if (rand() % 64 == 0)
+				str_append(input, noise[rand() % N_ELEMENTS(noise)]);
+			else
+				str_append_c(input, b64chars[rand() % 64]);
+		}
+		str_truncate(expected, 0);
+		expected_ret = test_base64_decode_mask(0, str_data(input),
+			str_len(input), &expected_pos, expected);
+		for (m = 0; m < N_ELEMENTS(masks); m++) {
+			str_truncate(output, 0);
+			ret = test_base64_decode_mask(masks[m], str_data(input),
+				str_len(input), &output_pos, output);
+			test_assert_idx(ret == expected_ret &&
+					output_pos == expected_pos &&
+					str_equals(output, expected), i);
+		}
+	}
+	test_end();
+}
+
 void test_base64(void)
 {
 	test_base64_encode();
 	test_base64_decode();
 	test_base64_random();
+	test_base64_decode_simd();
 }
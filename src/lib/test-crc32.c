@@ -1,14 +1,58 @@
 /* Copyright (c) 2010-2017 Dovecot authors, see the included COPYING file */
 
 #include "test-lib.h"
+#include "simd-util.h"
 #include "crc32.h"
 
-void test_crc32(void)
+static void test_crc32_known(void)
 {
 	const char str[] = "foo\0bar";
 
 	test_begin("crc32");
 	test_assert(crc32_str(str) == 0x8c736521);
 	test_assert(crc32_data(str, sizeof(str)) == 0x32c9723d);
+	test_assert(crc32_data("123456789", 9) == 0xcbf43926);
+	test_assert(crc32c_data("123456789", 9) == 0xe3069283);
+	test_assert(crc32c_data_more(crc32c_data("1234", 4), "56789", 5) ==
+		    0xe3069283);
 	test_end();
 }
+
+static void test_crc32_simd(void)
+{
+	static const enum simd_features masks[] = {
+		SIMD_FEATURE_SSE42,
+		(enum simd_features)-1
+	};
+	unsigned char buf[1024];
+	uint32_t crc, crc_c, expected, expected_c;
+	unsigned int i, m, start, size;
+
+	test_begin("crc32 simd");
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = rand();
+	for (i = 0; i < 2000; i++) {
+		/* random alignment, size and initial crc */
+		start = rand() % 64;
+		size = rand() % (sizeof(buf) - start);
+		crc = rand();
+
+		simd_set_features_mask(0);
+		expected = crc32_data_more(crc, buf + start, size);
+		expected_c = crc32c_data_more(crc, buf + start, size);
+		for (m = 0; m < N_ELEMENTS(masks); m++) {
+			simd_set_features_mask(masks[m]);
+			crc_c = crc32c_data_more(crc, buf + start, size);
+			test_assert_idx(crc32_data_more(crc, buf + start, size) ==
+					expected && crc_c == expected_c, i);
+		}
+	}
+	simd_set_features_mask((enum simd_features)-1);
+	test_end();
+}
+
+void test_crc32(void)
+{
+	test_crc32_known();
+	test_crc32_simd();
+}
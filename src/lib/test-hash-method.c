@@ -140,6 +140,20 @@ static void test_hash_methods_fips() {
 			"\xe5\x46\x70\xf1",
 			160 / 8
 		},
+		{ "crc32c",
+			"123456789",
+			9,
+			1,
+			"\xe3\x06\x92\x83",
+			32 / 8
+		},
+		{ "crc32c",
+			"\x00",
+			1,
+			32,
+			"\x8a\x91\x36\xaa",
+			32 / 8
+		},
 		{ "sha3-256",
 			"",
 			0,
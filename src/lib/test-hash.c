@@ -4,7 +4,7 @@
 #include "hash.h"
 
 
-static void test_hash_random_pool(pool_t pool)
+static void test_hash_random_pool(pool_t pool, bool open)
 {
 #define KEYMAX 100000
 	HASH_TABLE(void *, void *) hash;
@@ -12,7 +12,10 @@ static void test_hash_random_pool(pool_t pool)
 	unsigned int i, key, keyidx, delidx;
 
 	keys = i_new(unsigned int, KEYMAX); keyidx = 0;
-	hash_table_create_direct(&hash, pool, 0);
+	if (open)
+		hash_table_create_direct_open(&hash, pool, 0);
+	else
+		hash_table_create_direct(&hash, pool, 0);
 	for (i = 0; i < KEYMAX; i++) {
 		key = (rand() % KEYMAX) + 1;
 		if (rand() % 5 > 0) {
@@ -29,19 +32,104 @@ static void test_hash_random_pool(pool_t pool)
 			keyidx--;
 		}
 	}
+	test_assert(hash_table_count(hash) == keyidx);
 	for (i = 0; i < keyidx; i++)
 		hash_table_remove(hash, POINTER_CAST(keys[i]));
+	test_assert(hash_table_count(hash) == 0);
 	hash_table_destroy(&hash);
 	i_free(keys);
 }
 
+static void test_hash_open_iterate(void)
+{
+#define ITER_KEYMAX 1000
+	HASH_TABLE(char *, char *) hash;
+	struct hash_iterate_context *iter;
+	char *keys[ITER_KEYMAX], *key, *value, *orig_key;
+	bool seen[ITER_KEYMAX];
+	unsigned int i, idx, count = 0;
+
+	test_begin("hash open iterate");
+	hash_table_create_open(&hash, default_pool, 0, str_hash, strcmp);
+	for (i = 0; i < ITER_KEYMAX; i++) {
+		keys[i] = i_strdup_printf("key%u", i);
+		hash_table_insert(hash, keys[i], keys[i]);
+	}
+	test_assert(hash_table_count(hash) == ITER_KEYMAX);
+
+	/* update must keep the original key */
+	key = t_strdup_noconst("key5");
+	hash_table_update(hash, key, keys[6]);
+	test_assert(hash_table_lookup_full(hash, key, &orig_key, &value) &&
+		    orig_key == keys[5] && value == keys[6]);
+	hash_table_update(hash, keys[5], keys[5]);
+
+	/* remove the even keys while iterating, some of them before and some
+	   after they're iterated. all the odd keys must be seen exactly once. */
+	memset(seen, 0, sizeof(seen));
+	iter = hash_table_iterate_init(hash);
+	while (hash_table_iterate(iter, hash, &key, &value)) {
+		if (value == NULL) {
+			/* added during iteration */
+			continue;
+		}
+		test_assert(key == value);
+		idx = atoi(key + 3);
+		test_assert(!seen[idx]);
+		seen[idx] = TRUE;
+		if (idx % 4 == 1) {
+			hash_table_remove(hash, keys[idx - 1]);
+			hash_table_remove(hash, keys[idx + 1]);
+		}
+		if (++count == ITER_KEYMAX / 4) {
+			/* growing the table mustn't break iteration either */
+			for (i = 0; i < ITER_KEYMAX; i++) {
+				hash_table_insert(hash,
+					i_strdup_printf("new%u", i), (char *)NULL);
+			}
+		}
+	}
+	hash_table_iterate_deinit(&iter);
+
+	for (i = 0; i < ITER_KEYMAX; i++) {
+		value = hash_table_lookup(hash, keys[i]);
+		test_assert_idx((i % 2 == 0) == (value == NULL), i);
+		test_assert_idx(i % 2 == 0 || seen[i], i);
+	}
+	test_assert(hash_table_count(hash) == ITER_KEYMAX / 2 + ITER_KEYMAX);
+
+	iter = hash_table_iterate_init(hash);
+	while (hash_table_iterate(iter, hash, &key, &value)) {
+		if (value == NULL) {
+			hash_table_remove(hash, key);
+			i_free(key);
+		}
+	}
+	hash_table_iterate_deinit(&iter);
+	test_assert(hash_table_count(hash) == ITER_KEYMAX / 2);
+
+	hash_table_clear(hash, TRUE);
+	test_assert(hash_table_count(hash) == 0);
+	test_assert(hash_table_lookup(hash, keys[1]) == NULL);
+	hash_table_destroy(&hash);
+	for (i = 0; i < ITER_KEYMAX; i++)
+		i_free(keys[i]);
+	test_end();
+}
+
 void test_hash(void)
 {
 	pool_t pool;
 
-	test_hash_random_pool(default_pool);
+	test_begin("hash random");
+	test_hash_random_pool(default_pool, FALSE);
+	test_hash_random_pool(default_pool, TRUE);
 
 	pool = pool_alloconly_create("test hash", 1024);
-	test_hash_random_pool(pool);
+	test_hash_random_pool(pool, FALSE);
+	test_hash_random_pool(pool, TRUE);
 	pool_unref(&pool);
+	test_end();
+
+	test_hash_open_iterate();
 }
@@ -5,6 +5,7 @@
 #include "time-util.h"
 #include "ioloop.h"
 #include "istream.h"
+#include "fd-set-nonblock.h"
 
 #include <unistd.h>
 
@@ -127,6 +128,39 @@ static void test_ioloop_timeout(void)
 	test_end();
 }
 
+struct test_reset_ctx {
+	struct timeout *to, *to_reset;
+};
+
+static void timeout_reset_callback(struct test_reset_ctx *ctx)
+{
+	timeout_reset(ctx->to);
+	timeout_remove(&ctx->to_reset);
+}
+
+static void test_ioloop_timeout_reset(void)
+{
+	struct ioloop *ioloop;
+	struct test_reset_ctx ctx;
+	struct timeval tv_start, tv_callback;
+
+	test_begin("ioloop timeout reset");
+	ioloop = io_loop_create();
+
+	/* the coarse timeout is reset once before it expires */
+	ctx.to = timeout_add(1000, timeout_callback, &tv_callback);
+	ctx.to_reset = timeout_add_short(500, timeout_reset_callback, &ctx);
+	if (gettimeofday(&tv_start, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	io_loop_run(ioloop);
+	test_assert(timeval_diff_msecs(&tv_callback, &tv_start) >= 1400);
+	test_assert(ctx.to_reset == NULL);
+	timeout_remove(&ctx.to);
+	io_loop_destroy(&ioloop);
+
+	test_end();
+}
+
 static void io_callback(void *context ATTR_UNUSED)
 {
 }
@@ -174,6 +208,99 @@ static void test_ioloop_find_fd_conditions(void)
 	test_end();
 }
 
+struct test_ioloop_fd_ctx {
+	int fds[2];
+	struct io *io;
+	unsigned int calls;
+	bool nested;
+};
+
+static void test_ioloop_stop_callback(void *context ATTR_UNUSED)
+{
+	io_loop_stop(current_ioloop);
+}
+
+static void test_ioloop_fd_callback(struct test_ioloop_fd_ctx *ctx)
+{
+	char c;
+
+	/* a stale event gives EAGAIN */
+	if (read(ctx->fds[0], &c, 1) != 1)
+		return;
+	ctx->calls++;
+	if (ctx->nested) {
+		/* the rest of the events are handled by the nested run */
+		io_loop_handler_run(current_ioloop);
+	}
+}
+
+static void test_ioloop_fds_init(struct test_ioloop_fd_ctx *ctx,
+				 unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, ctx[i].fds) < 0)
+			i_fatal("socketpair() failed: %m");
+		fd_set_nonblock(ctx[i].fds[0], TRUE);
+		if (write(ctx[i].fds[1], "x", 1) != 1)
+			i_fatal("write() failed: %m");
+		ctx[i].io = io_add(ctx[i].fds[0], IO_READ,
+				   test_ioloop_fd_callback, &ctx[i]);
+	}
+}
+
+static void test_ioloop_fds_deinit(struct test_ioloop_fd_ctx *ctx,
+				   unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		io_remove(&ctx[i].io);
+		i_close_fd(&ctx[i].fds[0]);
+		i_close_fd(&ctx[i].fds[1]);
+	}
+}
+
+static void test_ioloop_stop_with_pending_fd(void)
+{
+	struct test_ioloop_fd_ctx ctx[2];
+	struct ioloop *ioloop;
+	struct timeout *to;
+
+	test_begin("ioloop stop with pending fd");
+	memset(ctx, 0, sizeof(ctx));
+	ioloop = io_loop_create();
+
+	/* the fd is already readable, so its completion arrives in the same
+	   run where the timeout stops the ioloop */
+	test_ioloop_fds_init(ctx, 1);
+	to = timeout_add_short(0, test_ioloop_stop_callback, (void *)NULL);
+	io_loop_run(ioloop);
+	timeout_remove(&to);
+	test_assert(ctx[0].calls == 0);
+
+	/* the next run must still see the fd as readable */
+	to = timeout_add_short(100, test_ioloop_stop_callback, (void *)NULL);
+	io_loop_run(ioloop);
+	timeout_remove(&to);
+	test_assert(ctx[0].calls == 1);
+	test_ioloop_fds_deinit(ctx, 1);
+
+	/* a nested run from an io callback */
+	memset(ctx, 0, sizeof(ctx));
+	test_ioloop_fds_init(ctx, N_ELEMENTS(ctx));
+	ctx[0].nested = TRUE;
+	to = timeout_add_short(100, test_ioloop_stop_callback, (void *)NULL);
+	io_loop_run(ioloop);
+	timeout_remove(&to);
+	test_assert(ctx[0].calls == 1 && ctx[1].calls == 1);
+	test_ioloop_fds_deinit(ctx, N_ELEMENTS(ctx));
+
+	io_loop_destroy(&ioloop);
+	test_end();
+}
+
 static void io_callback_pending_io(void *context ATTR_UNUSED)
 {
 	io_loop_stop(current_ioloop);
@@ -199,7 +326,9 @@ static void test_ioloop_pending_io(void)
 void test_ioloop(void)
 {
 	test_ioloop_timeout();
+	test_ioloop_timeout_reset();
 	test_ioloop_find_fd_conditions();
 	test_ioloop_pending_io();
+	test_ioloop_stop_with_pending_fd();
 	test_ioloop_fd();
 }
@@ -0,0 +1,109 @@
+/* Copyright (c) 2017 Dovecot authors, see the included COPYING file */
+
+#include "test-lib.h"
+
+static bool mem_has_bytes(const void *mem, size_t size, uint8_t b)
+{
+	const uint8_t *bytes = mem;
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		if (bytes[i] != b)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static void test_mempool_slab_alloc(void)
+{
+#define TEST_SLAB_ALLOC_COUNT 2000
+	struct pool_slab_stats stats;
+	unsigned char *mem[TEST_SLAB_ALLOC_COUNT];
+	size_t sizes[TEST_SLAB_ALLOC_COUNT];
+	unsigned int i, round;
+	pool_t pool;
+
+	test_begin("mempool slab alloc");
+	pool = pool_slab_create("test slab");
+	test_assert(strcmp(pool_get_name(pool), "test slab") == 0);
+	memset(mem, 0, sizeof(mem));
+	for (round = 0; round < 5; round++) {
+		for (i = 0; i < TEST_SLAB_ALLOC_COUNT; i++) {
+			if (mem[i] != NULL && rand() % 2 == 0) {
+				test_assert_idx(mem_has_bytes(mem[i], sizes[i],
+							      i % 256), i);
+				p_free(pool, mem[i]);
+			}
+			if (mem[i] == NULL) {
+				/* mostly small, some large allocations */
+				sizes[i] = rand() % 10 == 0 ?
+					1 + rand() % 5000 : 1 + rand() % 300;
+				mem[i] = p_malloc(pool, sizes[i]);
+				test_assert_idx(mem_has_bytes(mem[i], sizes[i],
+							      0), i);
+				memset(mem[i], i % 256, sizes[i]);
+			}
+		}
+	}
+	for (i = 0; i < TEST_SLAB_ALLOC_COUNT; i++)
+		test_assert_idx(mem_has_bytes(mem[i], sizes[i], i % 256), i);
+
+	pool_slab_get_stats(pool, &stats);
+	test_assert(stats.alloc_count == stats.free_count +
+		    TEST_SLAB_ALLOC_COUNT);
+	test_assert(stats.reuse_count > 0 && stats.large_alloc_count > 0);
+	test_assert(stats.reuse_count + stats.large_alloc_count <=
+		    stats.alloc_count);
+	test_assert(stats.used_size > 0 &&
+		    stats.used_size <= stats.alloc_size);
+
+	for (i = 0; i < TEST_SLAB_ALLOC_COUNT; i++)
+		p_free(pool, mem[i]);
+	pool_slab_get_stats(pool, &stats);
+	test_assert(stats.used_size == 0);
+
+	/* the memory is returned only when the pool is cleared */
+	test_assert(stats.alloc_size > 0);
+	p_clear(pool);
+	pool_slab_get_stats(pool, &stats);
+	test_assert(stats.alloc_size == 0);
+	pool_unref(&pool);
+	test_end();
+}
+
+static void test_mempool_slab_realloc(void)
+{
+	unsigned char *mem, *mem2, *freed_mem;
+	unsigned int i;
+	pool_t pool;
+
+	test_begin("mempool slab realloc");
+	pool = pool_slab_create("test slab");
+	mem = p_malloc(pool, 1);
+	mem[0] = 1;
+	for (i = 2; i <= 3000; i++) {
+		mem = p_realloc(pool, mem, i - 1, i);
+		test_assert_idx(mem[i - 1] == 0, i);
+		mem[i - 1] = i % 256;
+	}
+	for (i = 1; i <= 3000; i++)
+		test_assert_idx(mem[i - 1] == i % 256, i);
+
+	/* shrinking keeps the data */
+	mem = p_realloc(pool, mem, 3000, 10);
+	test_assert(mem[9] == 10);
+
+	/* freed memory is reused for the same size */
+	mem2 = p_malloc(pool, 100);
+	freed_mem = mem2;
+	p_free(pool, mem2);
+	test_assert(p_malloc(pool, 100) == freed_mem);
+	pool_unref(&pool);
+	test_end();
+}
+
+void test_mempool_slab(void)
+{
+	test_mempool_slab_alloc();
+	test_mempool_slab_realloc();
+}
@@ -0,0 +1,169 @@
+/* Copyright (c) 2017 Dovecot authors, see the included COPYING file */
+
+#include "test-lib.h"
+#include "array.h"
+#include "str.h"
+#include "mempool-stats.h"
+
+static const struct mempool_stats_entry *
+test_mempool_stats_find(enum mempool_stats_type type, const char *name)
+{
+	ARRAY_TYPE(mempool_stats_entry) entries;
+	struct mempool_stats_entry *const *entryp;
+
+	t_array_init(&entries, 32);
+	mempool_stats_get_entries(&entries);
+	array_foreach(&entries, entryp) {
+		if ((*entryp)->type == type &&
+		    strcmp((*entryp)->name, name) == 0)
+			return *entryp;
+	}
+	return NULL;
+}
+
+static void test_mempool_stats_alloconly(void)
+{
+	const struct mempool_stats_entry *entry;
+	pool_t pool1, pool2;
+	size_t pool1_size;
+
+	test_begin("mempool stats alloconly");
+	pool1 = pool_alloconly_create(MEMPOOL_GROWING"test stats", 1024);
+	pool2 = pool_alloconly_create("test stats", 1024);
+	entry = test_mempool_stats_find(MEMPOOL_STATS_TYPE_ALLOCONLY,
+					"test stats");
+	test_assert(entry != NULL);
+	if (entry == NULL) {
+		pool_unref(&pool1);
+		pool_unref(&pool2);
+		test_end();
+		return;
+	}
+	test_assert(entry->pool_count == 2 && entry->total_count == 2);
+	test_assert(entry->current_size ==
+		    pool_alloconly_get_total_alloc_size(pool1) +
+		    pool_alloconly_get_total_alloc_size(pool2));
+
+	/* growing the pool is accounted */
+	(void)p_malloc(pool1, 100000);
+	pool1_size = pool_alloconly_get_total_alloc_size(pool1);
+	test_assert(pool1_size > 100000);
+	test_assert(entry->current_size == pool1_size +
+		    pool_alloconly_get_total_alloc_size(pool2));
+	test_assert(entry->max_single_size == pool1_size);
+
+	/* clearing frees the extra blocks, but the peak stays */
+	p_clear(pool1);
+	test_assert(entry->current_size < pool1_size);
+	test_assert(entry->peak_size > pool1_size);
+
+	pool_unref(&pool1);
+	pool_unref(&pool2);
+	test_assert(entry->pool_count == 0 && entry->current_size == 0);
+	test_assert(entry->total_count == 2);
+	test_end();
+}
+
+static void test_mempool_stats_alloconly_disable(void)
+{
+	const struct mempool_stats_entry *entry;
+	pool_t pool;
+
+	test_begin("mempool stats alloconly disable");
+	pool = pool_alloconly_create("test stats disable", 1024);
+	mempool_stats_set_enabled(FALSE);
+	/* the pool is still tracked after stats were disabled */
+	(void)p_malloc(pool, 100000);
+	entry = test_mempool_stats_find(MEMPOOL_STATS_TYPE_ALLOCONLY,
+					"test stats disable");
+	test_assert(entry != NULL &&
+		    entry->current_size ==
+		    pool_alloconly_get_total_alloc_size(pool));
+	pool_unref(&pool);
+	test_assert(entry != NULL &&
+		    entry->pool_count == 0 && entry->current_size == 0);
+
+	/* pools created while disabled aren't tracked */
+	pool = pool_alloconly_create("test stats disabled", 1024);
+	mempool_stats_set_enabled(TRUE);
+	(void)p_malloc(pool, 100000);
+	pool_unref(&pool);
+	test_assert(test_mempool_stats_find(MEMPOOL_STATS_TYPE_ALLOCONLY,
+					    "test stats disabled") == NULL);
+	test_end();
+}
+
+static void test_mempool_stats_data_stack(void)
+{
+	const struct mempool_stats_entry *outer, *inner;
+	data_stack_frame_t frame_id, inner_frame_id;
+
+	test_begin("mempool stats data stack");
+	frame_id = t_push_named("test outer frame");
+	(void)t_malloc0(1000);
+	inner_frame_id = t_push_named("test inner frame %d", 1);
+	(void)t_malloc0(20000);
+	test_assert(t_pop(&inner_frame_id));
+	(void)t_malloc0(2000);
+	test_assert(t_pop(&frame_id));
+
+	inner = test_mempool_stats_find(MEMPOOL_STATS_TYPE_DATA_STACK,
+					"test inner frame 1");
+	outer = test_mempool_stats_find(MEMPOOL_STATS_TYPE_DATA_STACK,
+					"test outer frame");
+	test_assert(inner != NULL && outer != NULL);
+	if (inner != NULL && outer != NULL) {
+		test_assert(inner->total_count == 1 && outer->total_count == 1);
+		test_assert(inner->peak_size >= 20000 &&
+			    inner->peak_size < 21000);
+		/* the outer frame's peak includes the inner frame, but not
+		   the allocation after the inner frame was popped */
+		test_assert(outer->peak_size >= 21000 &&
+			    outer->peak_size < 22000);
+	}
+	test_end();
+}
+
+static void test_mempool_stats_data_stack_enable(void)
+{
+	data_stack_frame_t frame_id;
+
+	test_begin("mempool stats data stack enable");
+	/* frames pushed before enabling aren't accounted for */
+	mempool_stats_set_enabled(FALSE);
+	frame_id = t_push_named("test early frame");
+	(void)t_malloc0(100);
+	mempool_stats_set_enabled(TRUE);
+	(void)t_malloc0(100);
+	test_assert(t_pop(&frame_id));
+	test_assert(test_mempool_stats_find(MEMPOOL_STATS_TYPE_DATA_STACK,
+					    "test early frame") == NULL);
+	test_end();
+}
+
+static void test_mempool_stats_dump(void)
+{
+	string_t *str = t_str_new(256);
+
+	test_begin("mempool stats dump");
+	mempool_stats_dump(str, 1000);
+	test_assert(strstr(str_c(str), "pool test stats: count=0/2 ") != NULL);
+	test_assert(strstr(str_c(str),
+			   "data stack test inner frame 1: frames=1 ") != NULL);
+
+	str_truncate(str, 0);
+	mempool_stats_dump(str, 1);
+	test_assert(strchr(str_c(str), '\n') == str_c(str) + str_len(str) - 1);
+	test_end();
+}
+
+void test_mempool_stats(void)
+{
+	mempool_stats_set_enabled(TRUE);
+	test_mempool_stats_alloconly();
+	test_mempool_stats_alloconly_disable();
+	test_mempool_stats_data_stack();
+	test_mempool_stats_data_stack_enable();
+	test_mempool_stats_dump();
+	mempool_stats_set_enabled(FALSE);
+}
@@ -56,7 +56,7 @@ struct str_find_input {
 	int pos;
 };
 
-void test_str_find(void)
+static void test_str_find_substrings(void)
 {
 	static const char *fail_input[] = {
 		"xabc",
@@ -84,3 +84,179 @@ void test_str_find(void)
 		success = test_str_find_substring(fail_input[i], -1);
 	test_out("str_find()", success);
 }
+
+static void test_str_find_random_text(unsigned char *text, size_t size)
+{
+	size_t i;
+
+	/* small alphabet to get plenty of partial matches */
+	for (i = 0; i < size; i++)
+		text[i] = 'a' + rand() % 4;
+}
+
+static void test_str_find_random(void)
+{
+	unsigned char text[1000];
+	char key[10];
+	struct str_find_context *ctx;
+	unsigned int i, j, key_len;
+	size_t pos, block_size;
+	bool found, expected;
+
+	test_begin("str_find() random");
+	for (i = 0; i < 1000; i++) {
+		test_str_find_random_text(text, sizeof(text));
+		key_len = 1 + rand() % (sizeof(key) - 1);
+		test_str_find_random_text((unsigned char *)key, key_len);
+		key[key_len] = '\0';
+		text[sizeof(text)-1] = '\0';
+		expected = strstr((const char *)text, key) != NULL;
+
+		ctx = str_find_init(default_pool, key);
+		found = FALSE;
+		for (pos = 0; pos < sizeof(text)-1 && !found; pos += block_size) {
+			block_size = I_MIN(1U + rand() % 50,
+					   sizeof(text)-1 - pos);
+			found = str_find_more(ctx, text + pos, block_size);
+		}
+		test_assert_idx(found == expected, i);
+		if (found) {
+			j = pos - block_size +
+				str_find_get_match_end_pos(ctx) - key_len;
+			test_assert_idx(memcmp(text + j, key, key_len) == 0 &&
+				strstr((const char *)text, key) ==
+				(const char *)text + j, i);
+		}
+		str_find_deinit(&ctx);
+	}
+	test_end();
+}
+
+static void test_str_find_multi(void)
+{
+	const char *keys[] = { "he", "she", "his", "hers", "she", NULL };
+	static const unsigned char text[] = "ushers";
+	struct str_find_multi_context *ctx;
+
+	test_begin("str_find_multi()");
+	ctx = str_find_multi_init(default_pool, keys);
+	test_assert(!str_find_multi_more(ctx, text, sizeof(text)-1));
+	test_assert(str_find_multi_get_found_count(ctx) == 4);
+	test_assert(str_find_multi_key_found(ctx, 0));
+	test_assert(str_find_multi_key_found(ctx, 1));
+	test_assert(!str_find_multi_key_found(ctx, 2));
+	test_assert(str_find_multi_key_found(ctx, 3));
+	test_assert(str_find_multi_key_found(ctx, 4));
+
+	/* matches continue across blocks, unless reset */
+	test_assert(!str_find_multi_more(ctx, (const unsigned char *)"h", 1));
+	test_assert(str_find_multi_more(ctx, (const unsigned char *)"is", 2));
+	str_find_multi_clear_found(ctx);
+	test_assert(!str_find_multi_more(ctx, (const unsigned char *)"h", 1));
+	str_find_multi_reset(ctx);
+	test_assert(!str_find_multi_more(ctx, (const unsigned char *)"is", 2));
+	test_assert(str_find_multi_get_found_count(ctx) == 0);
+	str_find_multi_deinit(&ctx);
+	test_end();
+}
+
+static void test_str_find_multi_random(void)
+{
+	unsigned char text[1000];
+	const char *keys[6];
+	struct str_find_multi_context *ctx;
+	unsigned int i, j, key_count, key_len;
+	size_t pos, block_size;
+	char *key;
+
+	test_begin("str_find_multi() random");
+	for (i = 0; i < 1000; i++) {
+		test_str_find_random_text(text, sizeof(text));
+		text[sizeof(text)-1] = '\0';
+		key_count = 1 + rand() % (N_ELEMENTS(keys) - 1);
+		for (j = 0; j < key_count; j++) {
+			key_len = 1 + rand() % 8;
+			key = t_malloc0(key_len + 1);
+			test_str_find_random_text((unsigned char *)key,
+						  key_len);
+			keys[j] = key;
+		}
+		keys[j] = NULL;
+
+		ctx = str_find_multi_init(default_pool, keys);
+		for (pos = 0; pos < sizeof(text)-1; pos += block_size) {
+			block_size = I_MIN(1U + rand() % 50,
+					   sizeof(text)-1 - pos);
+			if (str_find_multi_more(ctx, text + pos, block_size))
+				break;
+		}
+		for (j = 0; j < key_count; j++) {
+			test_assert_idx(str_find_multi_key_found(ctx, j) ==
+				(strstr((const char *)text, keys[j]) != NULL), i);
+		}
+		str_find_multi_deinit(&ctx);
+	}
+	test_end();
+}
+
+static void test_str_find_multi_long_keys(void)
+{
+	unsigned char text[2000];
+	const char *keys[6];
+	struct str_find_multi_context *ctx;
+	unsigned int i, j;
+	size_t pos, block_size;
+	char *key;
+
+	test_begin("str_find_multi() long keys");
+	for (i = 0; i < 100; i++) {
+		test_str_find_random_text(text, sizeof(text));
+		text[sizeof(text)-1] = '\0';
+		/* too long in total for the DFA. some of the keys are taken
+		   from the text, so they are found. */
+		for (j = 0; j < N_ELEMENTS(keys) - 1; j++) {
+			key = t_malloc0(300 + 1);
+			if (j % 2 == 0) {
+				test_str_find_random_text(
+					(unsigned char *)key, 300);
+			} else {
+				memcpy(key, text +
+				       rand() % (sizeof(text) - 300), 300);
+			}
+			keys[j] = key;
+		}
+		keys[j] = NULL;
+
+		ctx = str_find_multi_init(default_pool, keys);
+		for (pos = 0; pos < sizeof(text)-1; pos += block_size) {
+			block_size = I_MIN(1U + rand() % 500,
+					   sizeof(text)-1 - pos);
+			if (str_find_multi_more(ctx, text + pos, block_size))
+				break;
+		}
+		for (j = 0; keys[j] != NULL; j++) {
+			test_assert_idx(str_find_multi_key_found(ctx, j) ==
+				(strstr((const char *)text, keys[j]) != NULL), i);
+		}
+
+		/* matches don't continue across a reset */
+		str_find_multi_clear_found(ctx);
+		test_assert_idx(!str_find_multi_more(ctx, text, 1000), i);
+		str_find_multi_reset(ctx);
+		test_assert_idx(!str_find_multi_more(ctx, text + 1000, 1), i);
+		pos = strstr((const char *)text, keys[1]) - (const char *)text;
+		test_assert_idx(str_find_multi_key_found(ctx, 1) ==
+				(pos + 300 <= 1000), i);
+		str_find_multi_deinit(&ctx);
+	}
+	test_end();
+}
+
+void test_str_find(void)
+{
+	test_str_find_substrings();
+	test_str_find_random();
+	test_str_find_multi();
+	test_str_find_multi_random();
+	test_str_find_multi_long_keys();
+}
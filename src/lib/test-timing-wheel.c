@@ -0,0 +1,206 @@
+/* Copyright (c) 2017 Dovecot authors, see the included COPYING file */
+
+#include "test-lib.h"
+#include "array.h"
+#include "timing-wheel.h"
+
+#define TEST_WHEEL_START_TIME 1000000
+
+struct test_wheel_item {
+	struct timing_wheel_item item;
+	bool removed;
+	bool expired;
+};
+
+static void test_timing_wheel_fixed(void)
+{
+	static const time_t deltas[] = {
+		1, 2, 255, 256, 257, 511, 512, 16383, 16384, 16385,
+		1048575, 1048576, 1048577, 67108863, 67108864, 200000000
+	};
+	struct test_wheel_item items[N_ELEMENTS(deltas)];
+	struct timing_wheel_item *item;
+	struct timing_wheel *wheel;
+	time_t now = TEST_WHEEL_START_TIME, prev_now, next_time;
+	unsigned int i, count = 0;
+
+	test_begin("timing wheel fixed");
+	wheel = timing_wheel_init(now);
+	for (i = 0; i < N_ELEMENTS(deltas); i++) {
+		timing_wheel_item_init(&items[i].item);
+		timing_wheel_add(wheel, &items[i].item, now + deltas[i]);
+	}
+	test_assert(timing_wheel_count(wheel) == N_ELEMENTS(deltas));
+
+	/* each item must be returned exactly at its expire time */
+	while (timing_wheel_count(wheel) > 0) {
+		next_time = timing_wheel_get_next_time(wheel);
+		test_assert(next_time > now);
+		prev_now = now;
+		now = next_time;
+		while ((item = timing_wheel_pop_expired(wheel, now)) != NULL) {
+			test_assert(item->expire > prev_now &&
+				    item->expire <= now);
+			test_assert(item->expire == now);
+			test_assert(item == &items[count].item);
+			count++;
+		}
+	}
+	test_assert(count == N_ELEMENTS(deltas));
+	test_assert(timing_wheel_get_time(wheel) == now);
+	timing_wheel_deinit(&wheel);
+	test_end();
+}
+
+static void test_timing_wheel_random(void)
+{
+#define TEST_WHEEL_ITEM_COUNT 2000
+	struct test_wheel_item *items, *titem;
+	struct timing_wheel_item *item;
+	struct timing_wheel *wheel;
+	time_t now = TEST_WHEEL_START_TIME, prev_now;
+	unsigned int i, idx, left = TEST_WHEEL_ITEM_COUNT;
+
+	test_begin("timing wheel random");
+	items = i_new(struct test_wheel_item, TEST_WHEEL_ITEM_COUNT);
+	wheel = timing_wheel_init(now);
+	for (i = 0; i < TEST_WHEEL_ITEM_COUNT; i++) {
+		timing_wheel_item_init(&items[i].item);
+		timing_wheel_add(wheel, &items[i].item,
+				 now + 1 + rand() % (rand() % 2 == 0 ? 300 : 50000));
+	}
+
+	while (left > 0) {
+		/* remove and re-add some items while the time advances */
+		for (i = 0; i < 5; i++) {
+			idx = rand() % TEST_WHEEL_ITEM_COUNT;
+			titem = &items[idx];
+			if (titem->removed || titem->expired)
+				continue;
+			timing_wheel_remove(wheel, &titem->item);
+			test_assert(!timing_wheel_item_is_linked(&titem->item));
+			if (rand() % 2 == 0) {
+				titem->removed = TRUE;
+				left--;
+			} else {
+				timing_wheel_add(wheel, &titem->item,
+						 now + 1 + rand() % 1000);
+			}
+		}
+
+		prev_now = now;
+		now += 1 + rand() % 200;
+		while ((item = timing_wheel_pop_expired(wheel, now)) != NULL) {
+			titem = (struct test_wheel_item *)item;
+			test_assert(!titem->removed && !titem->expired);
+			test_assert(item->expire > prev_now &&
+				    item->expire <= now);
+			titem->expired = TRUE;
+			left--;
+		}
+		test_assert(timing_wheel_count(wheel) == left);
+	}
+	for (i = 0; i < TEST_WHEEL_ITEM_COUNT; i++)
+		test_assert_idx(items[i].removed != items[i].expired, i);
+	timing_wheel_deinit(&wheel);
+	i_free(items);
+	test_end();
+}
+
+static void test_timing_wheel_mixed_levels(void)
+{
+	struct test_wheel_item items[2], *titem;
+	struct timing_wheel_item *item;
+	struct timing_wheel *wheel;
+	time_t now = TEST_WHEEL_START_TIME, next_time;
+	unsigned int i, count = 0;
+
+	test_begin("timing wheel mixed levels");
+	wheel = timing_wheel_init(now);
+	/* the first item goes to level 1, the second one to level 0 but it
+	   expires after the first one is cascaded */
+	timing_wheel_item_init(&items[0].item);
+	timing_wheel_add(wheel, &items[0].item, now + 300);
+	test_assert(timing_wheel_pop_expired(wheel, now + 100) == NULL);
+	now += 100;
+	timing_wheel_item_init(&items[1].item);
+	timing_wheel_add(wheel, &items[1].item, now + 250);
+
+	while (timing_wheel_count(wheel) > 0) {
+		next_time = timing_wheel_get_next_time(wheel);
+		test_assert(next_time > now);
+		now = next_time;
+		while ((item = timing_wheel_pop_expired(wheel, now)) != NULL) {
+			test_assert(item->expire == now);
+			test_assert(item == &items[count].item);
+			count++;
+		}
+	}
+	test_assert(count == N_ELEMENTS(items));
+	timing_wheel_deinit(&wheel);
+
+	/* stepping only to the returned next times must return all the
+	   items exactly at their expire times */
+	titem = i_new(struct test_wheel_item, TEST_WHEEL_ITEM_COUNT);
+	now = TEST_WHEEL_START_TIME;
+	wheel = timing_wheel_init(now);
+	for (i = 0; i < TEST_WHEEL_ITEM_COUNT; i++) {
+		timing_wheel_item_init(&titem[i].item);
+		timing_wheel_add(wheel, &titem[i].item,
+				 now + 1 + rand() % (rand() % 2 == 0 ? 300 : 20000));
+		if (i % 10 == 0 && timing_wheel_count(wheel) > 0) {
+			now = timing_wheel_get_next_time(wheel);
+			while ((item = timing_wheel_pop_expired(wheel, now)) != NULL)
+				test_assert(item->expire == now);
+		}
+	}
+	while (timing_wheel_count(wheel) > 0) {
+		now = timing_wheel_get_next_time(wheel);
+		while ((item = timing_wheel_pop_expired(wheel, now)) != NULL)
+			test_assert(item->expire == now);
+	}
+	timing_wheel_deinit(&wheel);
+	i_free(titem);
+	test_end();
+}
+
+static void test_timing_wheel_pop_all(void)
+{
+	struct test_wheel_item items[100];
+	ARRAY_TYPE(timing_wheel_item) popped;
+	struct timing_wheel *wheel;
+	unsigned int i;
+
+	test_begin("timing wheel pop all");
+	wheel = timing_wheel_init(TEST_WHEEL_START_TIME);
+	for (i = 0; i < N_ELEMENTS(items); i++) {
+		timing_wheel_item_init(&items[i].item);
+		timing_wheel_add(wheel, &items[i].item,
+				 TEST_WHEEL_START_TIME + 1 + i * i * 100);
+	}
+	t_array_init(&popped, N_ELEMENTS(items));
+	timing_wheel_pop_all(wheel, &popped);
+	test_assert(array_count(&popped) == N_ELEMENTS(items));
+	test_assert(timing_wheel_count(wheel) == 0);
+	test_assert(timing_wheel_get_next_time(wheel) == 0);
+	for (i = 0; i < N_ELEMENTS(items); i++)
+		test_assert_idx(!timing_wheel_item_is_linked(&items[i].item), i);
+
+	/* the time can be moved backwards for an empty wheel */
+	timing_wheel_set_time(wheel, TEST_WHEEL_START_TIME - 100);
+	timing_wheel_add(wheel, &items[0].item, TEST_WHEEL_START_TIME - 99);
+	test_assert(timing_wheel_get_next_time(wheel) ==
+		    TEST_WHEEL_START_TIME - 99);
+	test_assert(timing_wheel_pop_expired(wheel, TEST_WHEEL_START_TIME) ==
+		    &items[0].item);
+	timing_wheel_deinit(&wheel);
+	test_end();
+}
+
+void test_timing_wheel(void)
+{
+	test_timing_wheel_fixed();
+	test_timing_wheel_random();
+	test_timing_wheel_mixed_levels();
+	test_timing_wheel_pop_all();
+}
@@ -3,6 +3,7 @@
 #include "test-lib.h"
 #include "str.h"
 #include "buffer.h"
+#include "simd-util.h"
 #include "unichar.h"
 
 static void test_unichar_uni_utf8_strlen(void)
@@ -36,6 +37,152 @@ static void test_unichar_uni_utf8_partial_strlen_n(void)
 	test_end();
 }
 
+static void test_unichar_fuzz_input(buffer_t *input)
+{
+	static const char *const chars[] = {
+		"\xc3\xa4", "\xc3\xbc", "\xe2\x82\xac", "\xf0\x9f\x98\x80",
+		"\xea\xb0\x80", "\xef\xac\x81", "\xc3", "\xe2\x82", "\x80",
+		"\xff", "\xc0\xaf", "\xed\xa0\x80", "\xf8\x80\x95\x81\xa1"
+	};
+	unsigned int i, j, count, len;
+	unsigned char c;
+
+	buffer_set_used_size(input, 0);
+	count = rand() % 10;
+	for (i = 0; i < count; i++) {
+		switch (rand() % 3) {
+		case 0:
+			/* ASCII run of varying length, so that all the block
+			   sizes and their tails get tested */
+			len = rand() % 100;
+			for (j = 0; j < len; j++) {
+				c = 0x20 + rand() % 0x5f;
+				buffer_append_c(input, c);
+			}
+			break;
+		case 1:
+			j = rand() % N_ELEMENTS(chars);
+			buffer_append(input, chars[j], strlen(chars[j]));
+			break;
+		case 2:
+			c = rand() % 256;
+			buffer_append_c(input, c);
+			break;
+		}
+	}
+}
+
+static bool test_utf8_ref_is_valid(const unsigned char *input, size_t size)
+{
+	unichar_t chr;
+	int len;
+
+	while (size > 0) {
+		len = uni_utf8_get_char_n(input, size, &chr);
+		if (len <= 0)
+			return FALSE;
+		input += len; size -= len;
+	}
+	return TRUE;
+}
+
+static void test_utf8_ref_add_replacement(buffer_t *output)
+{
+	if (output->used >= UTF8_REPLACEMENT_CHAR_LEN &&
+	    memcmp(CONST_PTR_OFFSET(output->data,
+				    output->used - UTF8_REPLACEMENT_CHAR_LEN),
+		   utf8_replacement_char, UTF8_REPLACEMENT_CHAR_LEN) == 0)
+		return;
+	buffer_append(output, utf8_replacement_char, UTF8_REPLACEMENT_CHAR_LEN);
+}
+
+static void
+test_utf8_ref_get_valid_data(const unsigned char *input, size_t size,
+			     buffer_t *output)
+{
+	unichar_t chr;
+	int len;
+
+	while (size > 0) {
+		len = uni_utf8_get_char_n(input, size, &chr);
+		if (len <= 0) {
+			test_utf8_ref_add_replacement(output);
+			input++; size--;
+		} else {
+			buffer_append(output, input, len);
+			input += len; size -= len;
+		}
+	}
+}
+
+static void
+test_utf8_ref_decomposed_titlecase(const unsigned char *input, size_t size,
+				   buffer_t *output)
+{
+	unichar_t chr;
+	int len;
+
+	while (size > 0) {
+		len = uni_utf8_get_char_n(input, size, &chr);
+		if (len <= 0) {
+			test_utf8_ref_add_replacement(output);
+			input++; size--;
+		} else if (chr < 0x80) {
+			uni_ucs4_to_utf8_c(uni_ucs4_to_titlecase(chr), output);
+			input++; size--;
+		} else {
+			/* a single non-ASCII character goes through the
+			   scalar code */
+			(void)uni_utf8_to_decomposed_titlecase(input, len,
+							       output);
+			input += len; size -= len;
+		}
+	}
+}
+
+static void test_unichar_fuzz(const char *name, enum simd_features mask)
+{
+	buffer_t *input, *output, *expected;
+	unsigned int i;
+	bool valid;
+
+	simd_set_features_mask(mask);
+	test_begin(name);
+	input = buffer_create_dynamic(default_pool, 1024);
+	output = buffer_create_dynamic(default_pool, 1024);
+	expected = buffer_create_dynamic(default_pool, 1024);
+	for (i = 0; i < 20000; i++) {
+		test_unichar_fuzz_input(input);
+
+		valid = test_utf8_ref_is_valid(input->data, input->used);
+		test_assert_idx(uni_utf8_data_is_valid(input->data,
+						       input->used) == valid, i);
+
+		buffer_set_used_size(output, 0);
+		buffer_set_used_size(expected, 0);
+		test_assert_idx(uni_utf8_get_valid_data(input->data,
+				input->used, output) == valid, i);
+		if (!valid) {
+			test_utf8_ref_get_valid_data(input->data, input->used,
+						     expected);
+			test_assert_idx(buffer_cmp(output, expected), i);
+		}
+
+		buffer_set_used_size(output, 0);
+		buffer_set_used_size(expected, 0);
+		test_assert_idx(uni_utf8_to_decomposed_titlecase(input->data,
+				input->used, output) == (valid ? 0 : -1), i);
+		test_utf8_ref_decomposed_titlecase(input->data, input->used,
+						   expected);
+		test_assert_idx(buffer_cmp(output, expected), i);
+	}
+	buffer_free(&input);
+	buffer_free(&output);
+	buffer_free(&expected);
+	test_end();
+	simd_set_features_mask((enum simd_features)-1);
+}
+
 void test_unichar(void)
 {
 	static const char overlong_utf8[] = "\xf8\x80\x95\x81\xa1";
@@ -92,4 +239,7 @@ void test_unichar(void)
 
 	test_unichar_uni_utf8_strlen();
 	test_unichar_uni_utf8_partial_strlen_n();
+	test_unichar_fuzz("unichar fuzz", (enum simd_features)-1);
+	test_unichar_fuzz("unichar fuzz sse2", SIMD_FEATURE_SSE2);
+	test_unichar_fuzz("unichar fuzz without simd", 0);
 }
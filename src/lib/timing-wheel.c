@@ -0,0 +1,249 @@
+/* Copyright (c) 2017 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "timing-wheel.h"
+
+/* Level 0 has a slot for each second. Each slot in level n covers all the
+   slots of level n-1. */
+#define TIMING_WHEEL_L0_BITS 8
+#define TIMING_WHEEL_LN_BITS 6
+#define TIMING_WHEEL_LEVELS 4
+
+#define TIMING_WHEEL_L0_SIZE (1U << TIMING_WHEEL_L0_BITS)
+#define TIMING_WHEEL_LN_SIZE (1U << TIMING_WHEEL_LN_BITS)
+#define TIMING_WHEEL_SLOT_COUNT \
+	(TIMING_WHEEL_L0_SIZE + (TIMING_WHEEL_LEVELS-1) * TIMING_WHEEL_LN_SIZE)
+/* Items further away than this (~2 years) are placed at the maximum
+   distance. They're cascaded back there until they get close enough. */
+#define TIMING_WHEEL_MAX_DELTA \
+	((1ULL << (TIMING_WHEEL_L0_BITS + \
+		   (TIMING_WHEEL_LEVELS-1) * TIMING_WHEEL_LN_BITS)) - 1)
+
+struct timing_wheel {
+	/* All items expiring before this have already been returned */
+	time_t now;
+	unsigned int count, l0_count;
+
+	struct timing_wheel_item *slots[TIMING_WHEEL_SLOT_COUNT];
+};
+
+struct timing_wheel *timing_wheel_init(time_t now)
+{
+	struct timing_wheel *wheel;
+
+	wheel = i_new(struct timing_wheel, 1);
+	wheel->now = now;
+	return wheel;
+}
+
+void timing_wheel_deinit(struct timing_wheel **_wheel)
+{
+	struct timing_wheel *wheel = *_wheel;
+
+	*_wheel = NULL;
+	i_assert(wheel->count == 0);
+	i_free(wheel);
+}
+
+void timing_wheel_item_init(struct timing_wheel_item *item)
+{
+	i_zero(item);
+	item->slot = UINT_MAX;
+}
+
+time_t timing_wheel_get_time(const struct timing_wheel *wheel)
+{
+	return wheel->now;
+}
+
+unsigned int timing_wheel_count(const struct timing_wheel *wheel)
+{
+	return wheel->count;
+}
+
+static unsigned int
+timing_wheel_get_slot(const struct timing_wheel *wheel, time_t expire)
+{
+	unsigned long long delta;
+	unsigned int level, shift;
+
+	i_assert(expire >= wheel->now);
+
+	delta = expire - wheel->now;
+	if (delta < TIMING_WHEEL_L0_SIZE)
+		return expire & (TIMING_WHEEL_L0_SIZE-1);
+
+	if (delta > TIMING_WHEEL_MAX_DELTA) {
+		delta = TIMING_WHEEL_MAX_DELTA;
+		expire = wheel->now + delta;
+	}
+	level = 1; shift = TIMING_WHEEL_L0_BITS;
+	while (delta >= (1ULL << (shift + TIMING_WHEEL_LN_BITS))) {
+		level++;
+		shift += TIMING_WHEEL_LN_BITS;
+	}
+	i_assert(level < TIMING_WHEEL_LEVELS);
+	return TIMING_WHEEL_L0_SIZE + (level-1) * TIMING_WHEEL_LN_SIZE +
+		((expire >> shift) & (TIMING_WHEEL_LN_SIZE-1));
+}
+
+static void
+timing_wheel_link(struct timing_wheel *wheel, struct timing_wheel_item *item)
+{
+	unsigned int slot = timing_wheel_get_slot(wheel, item->expire);
+
+	item->slot = slot;
+	item->prev = NULL;
+	item->next = wheel->slots[slot];
+	if (item->next != NULL)
+		item->next->prev = item;
+	wheel->slots[slot] = item;
+	if (slot < TIMING_WHEEL_L0_SIZE)
+		wheel->l0_count++;
+}
+
+static void
+timing_wheel_unlink(struct timing_wheel *wheel, struct timing_wheel_item *item)
+{
+	if (item->prev != NULL)
+		item->prev->next = item->next;
+	else
+		wheel->slots[item->slot] = item->next;
+	if (item->next != NULL)
+		item->next->prev = item->prev;
+	if (item->slot < TIMING_WHEEL_L0_SIZE)
+		wheel->l0_count--;
+	item->slot = UINT_MAX;
+	item->prev = item->next = NULL;
+}
+
+void timing_wheel_add(struct timing_wheel *wheel,
+		      struct timing_wheel_item *item, time_t expire)
+{
+	i_assert(!timing_wheel_item_is_linked(item));
+	i_assert(expire > wheel->now);
+
+	item->expire = expire;
+	timing_wheel_link(wheel, item);
+	wheel->count++;
+}
+
+void timing_wheel_remove(struct timing_wheel *wheel,
+			 struct timing_wheel_item *item)
+{
+	i_assert(timing_wheel_item_is_linked(item));
+	i_assert(wheel->count > 0);
+
+	timing_wheel_unlink(wheel, item);
+	wheel->count--;
+}
+
+static void timing_wheel_cascade(struct timing_wheel *wheel)
+{
+	struct timing_wheel_item *item, *next;
+	unsigned int level, shift, slot;
+
+	/* when a level's slot has been fully passed, redistribute the next
+	   slot of the higher level */
+	shift = TIMING_WHEEL_L0_BITS;
+	for (level = 1; level < TIMING_WHEEL_LEVELS; level++) {
+		if ((wheel->now & ((1ULL << shift) - 1)) != 0)
+			break;
+		slot = TIMING_WHEEL_L0_SIZE + (level-1) * TIMING_WHEEL_LN_SIZE +
+			((wheel->now >> shift) & (TIMING_WHEEL_LN_SIZE-1));
+		item = wheel->slots[slot];
+		wheel->slots[slot] = NULL;
+		for (; item != NULL; item = next) {
+			next = item->next;
+			timing_wheel_link(wheel, item);
+		}
+		shift += TIMING_WHEEL_LN_BITS;
+	}
+}
+
+struct timing_wheel_item *
+timing_wheel_pop_expired(struct timing_wheel *wheel, time_t now)
+{
+	struct timing_wheel_item *item;
+	time_t next;
+
+	for (;;) {
+		if (wheel->count == 0) {
+			if (now > wheel->now)
+				wheel->now = now;
+			return NULL;
+		}
+		/* the current second's slot contains only items that expire
+		   at this second */
+		item = wheel->slots[wheel->now & (TIMING_WHEEL_L0_SIZE-1)];
+		if (item != NULL) {
+			i_assert(item->expire == wheel->now);
+			timing_wheel_remove(wheel, item);
+			return item;
+		}
+		if (wheel->now >= now)
+			return NULL;
+		if (wheel->l0_count > 0)
+			wheel->now++;
+		else {
+			/* level 0 is empty - skip directly to the next
+			   cascade */
+			next = ((wheel->now >> TIMING_WHEEL_L0_BITS) + 1) <<
+				TIMING_WHEEL_L0_BITS;
+			if (next > now) {
+				wheel->now = now;
+				return NULL;
+			}
+			wheel->now = next;
+		}
+		timing_wheel_cascade(wheel);
+	}
+}
+
+time_t timing_wheel_get_next_time(const struct timing_wheel *wheel)
+{
+	time_t next_cascade;
+	unsigned int i;
+
+	if (wheel->count == 0)
+		return 0;
+
+	/* the higher levels are cascaded at level 0 boundaries, which may
+	   be earlier than the items already in level 0 */
+	next_cascade = ((wheel->now >> TIMING_WHEEL_L0_BITS) + 1) <<
+		TIMING_WHEEL_L0_BITS;
+	if (wheel->l0_count > 0) {
+		for (i = 0; i < TIMING_WHEEL_L0_SIZE; i++) {
+			if (wheel->slots[(wheel->now + i) &
+					 (TIMING_WHEEL_L0_SIZE-1)] != NULL)
+				break;
+		}
+		i_assert(i < TIMING_WHEEL_L0_SIZE);
+		if (wheel->count == wheel->l0_count ||
+		    wheel->now + (time_t)i < next_cascade)
+			return wheel->now + i;
+	}
+	return next_cascade;
+}
+
+void timing_wheel_pop_all(struct timing_wheel *wheel,
+			  ARRAY_TYPE(timing_wheel_item) *items)
+{
+	struct timing_wheel_item *item;
+	unsigned int i;
+
+	for (i = 0; i < TIMING_WHEEL_SLOT_COUNT && wheel->count > 0; i++) {
+		while ((item = wheel->slots[i]) != NULL) {
+			timing_wheel_remove(wheel, item);
+			array_append(items, &item, 1);
+		}
+	}
+	i_assert(wheel->count == 0);
+}
+
+void timing_wheel_set_time(struct timing_wheel *wheel, time_t now)
+{
+	i_assert(wheel->count == 0);
+	wheel->now = now;
+}
@@ -0,0 +1,63 @@
+#ifndef TIMING_WHEEL_H
+#define TIMING_WHEEL_H
+
+#include "array-decl.h"
+
+/* Hierarchical timing wheel with one second granularity. Adding and removing
+   items is O(1), which makes it a good fit for coarse timeouts that get reset
+   all the time. Items that are far in the future are kept in higher levels
+   of the wheel and cascaded to the lower levels as the time advances. */
+
+struct timing_wheel_item {
+	/* Expiration time. Set by timing_wheel_add(). */
+	time_t expire;
+	/* Internal state, UINT_MAX when the item isn't in a wheel. */
+	unsigned int slot;
+	struct timing_wheel_item *prev, *next;
+	/* [your own data] */
+};
+ARRAY_DEFINE_TYPE(timing_wheel_item, struct timing_wheel_item *);
+
+/* Create a new wheel with the given current time. */
+struct timing_wheel *timing_wheel_init(time_t now);
+void timing_wheel_deinit(struct timing_wheel **wheel);
+
+/* Initialize an item that isn't in any wheel. */
+void timing_wheel_item_init(struct timing_wheel_item *item);
+/* Returns TRUE if the item is in a wheel. */
+static inline bool timing_wheel_item_is_linked(const struct timing_wheel_item *item)
+{
+	return item->slot != UINT_MAX;
+}
+
+/* Return the wheel's current time. */
+time_t timing_wheel_get_time(const struct timing_wheel *wheel) ATTR_PURE;
+/* Return number of items in the wheel. */
+unsigned int timing_wheel_count(const struct timing_wheel *wheel) ATTR_PURE;
+
+/* Add an item that expires at the given time. The item must not already be
+   in a wheel and the expire time must be later than the wheel's current
+   time. */
+void timing_wheel_add(struct timing_wheel *wheel,
+		      struct timing_wheel_item *item, time_t expire);
+/* Remove the item from the wheel. */
+void timing_wheel_remove(struct timing_wheel *wheel,
+			 struct timing_wheel_item *item);
+
+/* Advance the wheel's time up to now, and remove and return the next item
+   that has expired. Returns NULL when there are no more expired items. */
+struct timing_wheel_item *
+timing_wheel_pop_expired(struct timing_wheel *wheel, time_t now);
+/* Returns the time when timing_wheel_pop_expired() needs to be called next,
+   or 0 if the wheel is empty. This may be earlier than the next expiration,
+   because items need to be cascaded from the higher levels. */
+time_t timing_wheel_get_next_time(const struct timing_wheel *wheel);
+
+/* Remove all items from the wheel and append them to the array. */
+void timing_wheel_pop_all(struct timing_wheel *wheel,
+			  ARRAY_TYPE(timing_wheel_item) *items);
+/* Set the current time of an empty wheel. This can be used after the system
+   time has moved. */
+void timing_wheel_set_time(struct timing_wheel *wheel, time_t now);
+
+#endif
@@ -3,6 +3,7 @@
 #include "lib.h"
 #include "array.h"
 #include "bsearch-insert-pos.h"
+#include "simd-util.h"
 #include "unichar.h"
 
 #include "unicodemap.c"
@@ -20,6 +21,76 @@ static const uint8_t utf8_non1_bytes[256 - 192 - 2] = {
 
 const uint8_t *const uni_utf8_non1_bytes = utf8_non1_bytes;
 
+static size_t uni_utf8_ascii_len_scalar(const unsigned char *input, size_t size)
+{
+	const uint64_t high_bits = 0x8080808080808080ULL;
+	uint64_t word;
+	size_t i = 0;
+
+	for (; i + sizeof(word) <= size; i += sizeof(word)) {
+		memcpy(&word, input + i, sizeof(word));
+		if ((word & high_bits) != 0)
+			break;
+	}
+	while (i < size && input[i] < 0x80)
+		i++;
+	return i;
+}
+
+#ifdef HAVE_X86_SIMD
+static size_t SIMD_TARGET("sse2")
+uni_utf8_ascii_len_sse2(const unsigned char *input, size_t size)
+{
+	__m128i block;
+	unsigned int mask;
+	size_t i = 0;
+
+	for (; i + 16 <= size; i += 16) {
+		block = _mm_loadu_si128((const void *)(input + i));
+		mask = _mm_movemask_epi8(block);
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+	while (i < size && input[i] < 0x80)
+		i++;
+	return i;
+}
+
+static size_t SIMD_TARGET("avx2")
+uni_utf8_ascii_len_avx2(const unsigned char *input, size_t size)
+{
+	__m256i block;
+	unsigned int mask;
+	size_t i = 0;
+
+	for (; i + 32 <= size; i += 32) {
+		block = _mm256_loadu_si256((const void *)(input + i));
+		mask = _mm256_movemask_epi8(block);
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+	if (i + 16 <= size)
+		return i + uni_utf8_ascii_len_sse2(input + i, size - i);
+	while (i < size && input[i] < 0x80)
+		i++;
+	return i;
+}
+#endif
+
+/* Returns the number of bytes in the beginning of input that are ASCII. */
+static size_t uni_utf8_ascii_len(const unsigned char *input, size_t size)
+{
+#ifdef HAVE_X86_SIMD
+	enum simd_features features = simd_get_features();
+
+	if ((features & SIMD_FEATURE_AVX2) != 0)
+		return uni_utf8_ascii_len_avx2(input, size);
+	if ((features & SIMD_FEATURE_SSE2) != 0)
+		return uni_utf8_ascii_len_sse2(input, size);
+#endif
+	return uni_utf8_ascii_len_scalar(input, size);
+}
+
 unsigned int uni_strlen(const unichar_t *str)
 {
 	unsigned int len = 0;
@@ -327,9 +398,23 @@ int uni_utf8_to_decomposed_titlecase(const void *_input, size_t size,
 {
 	const unsigned char *input = _input;
 	unichar_t chr;
+	unsigned char *dest;
+	size_t i, len;
 	int ret = 0;
 
 	while (size > 0) {
+		if (*input < 0x80) {
+			/* ASCII characters have no decompositions, so only
+			   the titlecasing is needed */
+			len = uni_utf8_ascii_len(input, size);
+			dest = buffer_append_space_unsafe(output, len);
+			for (i = 0; i < len; i++)
+				dest[i] = titlecase8_map[input[i]];
+			input += len;
+			size -= len;
+			continue;
+		}
+
 		int bytes = uni_utf8_get_char_n(input, size, &chr);
 		if (bytes <= 0) {
 			/* invalid input. try the next byte. */
@@ -367,7 +452,7 @@ static int uni_utf8_find_invalid_pos(const unsigned char *input, size_t size,
 	/* find the first invalid utf8 sequence */
 	for (i = 0; i < size;) {
 		if (input[i] < 0x80)
-			i++;
+			i += uni_utf8_ascii_len(input + i, size - i);
 		else {
 			len = is_valid_utf8_seq(input + i, size-i);
 			if (unlikely(len == 0)) {
@@ -394,7 +479,9 @@ bool uni_utf8_get_valid_data(const unsigned char *input, size_t size,
 	output_add_replacement_char(buf);
 	while (i < size) {
 		if (input[i] < 0x80) {
-			buffer_append_c(buf, input[i++]);
+			len = uni_utf8_ascii_len(input + i, size - i);
+			buffer_append(buf, input + i, len);
+			i += len;
 			continue;
 		}
 
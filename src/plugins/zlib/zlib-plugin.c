@@ -46,6 +46,8 @@ struct zlib_user {
 
 	const struct compression_handler *save_handler;
 	unsigned int save_level;
+
+	const struct compression_handler *index_save_handler;
 };
 
 const char *zlib_plugin_version = DOVECOT_ABI_VERSION;
@@ -293,6 +295,7 @@ static int zlib_mailbox_open_input(struct mailbox *box)
 static int zlib_mailbox_open(struct mailbox *box)
 {
 	union mailbox_module_context *zbox = ZLIB_CONTEXT(box);
+	struct zlib_user *zuser = ZLIB_USER_CONTEXT(box->storage->user);
 
 	if (box->input == NULL &&
 	    (box->storage->class_flags &
@@ -301,7 +304,14 @@ static int zlib_mailbox_open(struct mailbox *box)
 			return -1;
 	}
 
-	return zbox->super.open(box);
+	if (zbox->super.open(box) < 0)
+		return -1;
+	if (zuser->index_save_handler != NULL && box->index != NULL) {
+		mail_index_set_compression(box->index,
+					   zuser->index_save_handler->name,
+					   zuser->save_level);
+	}
+	return 0;
 }
 
 static void zlib_mailbox_close(struct mailbox *box)
@@ -360,6 +370,16 @@ static void zlib_mail_user_created(struct mail_user *user)
 			zuser->save_handler = NULL;
 		}
 	}
+	name = mail_user_plugin_getenv(user, "zlib_index_save");
+	if (name != NULL && *name != '\0') {
+		zuser->index_save_handler = compression_lookup_handler(name);
+		if (zuser->index_save_handler == NULL)
+			i_error("zlib_index_save: Unknown handler: %s", name);
+		else if (zuser->index_save_handler->create_ostream == NULL) {
+			i_error("zlib_index_save: Support not compiled in for handler: %s", name);
+			zuser->index_save_handler = NULL;
+		}
+	}
 	name = mail_user_plugin_getenv(user, "zlib_save_level");
 	if (name != NULL) {
 		if (str_to_uint(name, &zuser->save_level) < 0 ||
@@ -373,6 +393,31 @@ static void zlib_mail_user_created(struct mail_user *user)
 	MODULE_CONTEXT_SET(user, zlib_user_module, zuser);
 }
 
+static struct istream *zlib_index_create_istream(struct istream *input)
+{
+	const struct compression_handler *handler;
+
+	handler = compression_detect_handler(input);
+	if (handler == NULL || handler->create_istream == NULL)
+		return NULL;
+	return handler->create_istream(input, TRUE);
+}
+
+static struct ostream *
+zlib_index_create_ostream(struct ostream *output, const char *name, int level)
+{
+	const struct compression_handler *handler;
+
+	handler = compression_lookup_handler(name);
+	i_assert(handler != NULL && handler->create_ostream != NULL);
+	return handler->create_ostream(output, level);
+}
+
+static const struct mail_index_compression zlib_index_compression = {
+	.create_istream = zlib_index_create_istream,
+	.create_ostream = zlib_index_create_ostream
+};
+
 static struct mail_storage_hooks zlib_mail_storage_hooks = {
 	.mail_user_created = zlib_mail_user_created,
 	.mailbox_allocated = zlib_mailbox_allocated,
@@ -382,9 +427,11 @@ static struct mail_storage_hooks zlib_mail_storage_hooks = {
 void zlib_plugin_init(struct module *module)
 {
 	mail_storage_hooks_add(module, &zlib_mail_storage_hooks);
+	mail_index_register_compression(&zlib_index_compression);
 }
 
 void zlib_plugin_deinit(void)
 {
+	mail_index_unregister_compression(&zlib_index_compression);
 	mail_storage_hooks_remove(&zlib_mail_storage_hooks);
 }
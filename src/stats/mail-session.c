@@ -325,8 +325,8 @@ void mail_sessions_init(void)
 {
 	session_id_warn_hide_until =
 		ioloop_time + SESSION_ID_WARN_HIDE_SECS;
-	hash_table_create(&mail_sessions_hash, default_pool, 0,
-			  str_hash, strcmp);
+	hash_table_create_open(&mail_sessions_hash, default_pool, 0,
+			       str_hash, strcmp);
 	services = str_table_init();
 }
 
@@ -166,7 +166,8 @@ void mail_users_free_memory(void)
 
 void mail_users_init(void)
 {
-	hash_table_create(&mail_users_hash, default_pool, 0, str_hash, strcmp);
+	hash_table_create_open(&mail_users_hash, default_pool, 0,
+			       str_hash, strcmp);
 }
 
 void mail_users_deinit(void)